@@ -0,0 +1,178 @@
+#include "coeff_file.h"
+#include "sparse_gp.h"
+#include "test_structure.h"
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+// Write text and values in the given format, and check that they are read
+// back exactly.
+static void check_round_trip(bool binary) {
+  std::string file_name = binary ? "coeff_binary.txt" : "coeff_ascii.txt";
+  std::vector<double> values{1.5, -2.25e-300, 0, 3.0e200, -1.0 / 3, 7};
+  Eigen::MatrixXd matrix = Eigen::MatrixXd::Random(3, 7);
+
+  CoeffFileWriter writer(file_name, binary);
+  writer.text << "DATE: today CONTRIBUTOR: test\n";
+  writer.text << "2 NormalizedDotProduct\n";
+  writer.write_values(values.data(), values.size());
+  writer.text << "3\n";
+  writer.write_values(matrix);
+  writer.close();
+
+  CoeffFileReader reader(fopen(file_name.c_str(), "r"));
+  EXPECT_EQ(reader.binary(), binary);
+
+  char line[1024];
+  ASSERT_NE(reader.gets(line, 1024), nullptr);
+  EXPECT_STREQ(line, "DATE: today CONTRIBUTOR: test\n");
+  ASSERT_NE(reader.gets(line, 1024), nullptr);
+  EXPECT_STREQ(line, "2 NormalizedDotProduct\n");
+
+  std::vector<double> values_read(values.size());
+  reader.grab(values.size(), values_read.data());
+  for (int i = 0; i < values.size(); i++)
+    EXPECT_EQ(values[i], values_read[i]);
+
+  ASSERT_NE(reader.gets(line, 1024), nullptr);
+  EXPECT_STREQ(line, "3\n");
+
+  // The matrix is read row by row.
+  std::vector<double> matrix_read(matrix.size());
+  reader.grab(matrix.size(), matrix_read.data());
+  for (int i = 0; i < matrix.rows(); i++)
+    for (int j = 0; j < matrix.cols(); j++)
+      EXPECT_EQ(matrix(i, j), matrix_read[i * matrix.cols() + j]);
+
+  EXPECT_EQ(reader.gets(line, 1024), nullptr);
+  EXPECT_THROW(reader.grab(1, values_read.data()), std::runtime_error);
+}
+
+TEST(CoeffFileTest, AsciiRoundTrip) { check_round_trip(false); }
+
+TEST(CoeffFileTest, BinaryRoundTrip) { check_round_trip(true); }
+
+TEST(CoeffFileTest, ShortFirstLine) {
+  // Lines shorter than the magic survive the format detection.
+  std::ofstream file("coeff_short.txt");
+  file << "a\n\n1 2\n3.5\n";
+  file.close();
+
+  CoeffFileReader reader(fopen("coeff_short.txt", "r"));
+  EXPECT_FALSE(reader.binary());
+  char line[1024];
+  reader.gets(line, 1024);
+  EXPECT_STREQ(line, "a\n");
+  reader.gets(line, 1024);
+  EXPECT_STREQ(line, "\n");
+  double values[3];
+  reader.grab(3, values);
+  EXPECT_EQ(values[0], 1);
+  EXPECT_EQ(values[1], 2);
+  EXPECT_EQ(values[2], 3.5);
+}
+
+TEST(CoeffFileTest, Corruption) {
+  std::vector<double> values{1, 2, 3, 4};
+  {
+    CoeffFileWriter writer("coeff_corrupt.txt", true);
+    writer.text << "header\n";
+    writer.write_values(values.data(), values.size());
+  }
+
+  // Flip a bit of the last value.
+  std::fstream file("coeff_corrupt.txt",
+                    std::ios::in | std::ios::out | std::ios::binary);
+  file.seekg(0, std::ios::end);
+  long size = file.tellg();
+  file.seekg(size - 9);
+  char byte;
+  file.read(&byte, 1);
+  byte ^= 1;
+  file.seekp(size - 9);
+  file.write(&byte, 1);
+  file.close();
+
+  std::string message;
+  CoeffFileReader reader(fopen("coeff_corrupt.txt", "r"),
+                         [&](const std::string &m) { message = m; });
+  char line[1024];
+  reader.gets(line, 1024);
+  EXPECT_STREQ(line, "header\n");
+  double values_read[4];
+  EXPECT_THROW(reader.grab(4, values_read), std::runtime_error);
+  EXPECT_NE(message.find("Checksum"), std::string::npos);
+
+  // A truncated file is detected before its values are read.
+  {
+    std::ofstream truncated("coeff_truncated.txt", std::ios::binary);
+    std::ifstream full("coeff_corrupt.txt", std::ios::binary);
+    std::vector<char> bytes(size - 16);
+    full.read(bytes.data(), bytes.size());
+    truncated.write(bytes.data(), bytes.size());
+  }
+  CoeffFileReader truncated_reader(fopen("coeff_truncated.txt", "r"));
+  truncated_reader.gets(line, 1024);
+  EXPECT_THROW(truncated_reader.grab(4, values_read), std::runtime_error);
+}
+
+TEST_F(StructureTest, BinaryMapping) {
+  // The binary mapping file holds the same coefficients as the ASCII one.
+  SparseGP sparse_gp({&kernel_norm}, 0.1, 0.2, 0.3);
+  test_struc.energy = Eigen::VectorXd::Random(1);
+  test_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  sparse_gp.add_training_structure(test_struc);
+  sparse_gp.add_all_environments(test_struc);
+  sparse_gp.update_matrices_QR();
+
+  sparse_gp.write_mapping_coefficients("beta.txt", "test", 0);
+  sparse_gp.write_mapping_coefficients("beta_binary.txt", "test", 0, true);
+
+  CoeffFileReader ascii(fopen("beta.txt", "r"));
+  CoeffFileReader binary(fopen("beta_binary.txt", "r"));
+  EXPECT_FALSE(ascii.binary());
+  EXPECT_TRUE(binary.binary());
+
+  // Compare the lines after the date.
+  char ascii_line[1024], binary_line[1024];
+  ascii.gets(ascii_line, 1024);
+  binary.gets(binary_line, 1024);
+  int beta_size = 0, n_species_read = 0, n_max, l_max;
+  for (int i = 0; i < 4; i++) {
+    ascii.gets(ascii_line, 1024);
+    binary.gets(binary_line, 1024);
+    EXPECT_STREQ(ascii_line, binary_line);
+    if (i == 2)
+      sscanf(ascii_line, "%i %i %i %i", &n_species_read, &n_max, &l_max,
+             &beta_size);
+  }
+  EXPECT_EQ(n_species_read, n_species);
+
+  int n_values = n_species * n_species + n_species * beta_size;
+  std::vector<double> ascii_values(n_values), binary_values(n_values);
+  ascii.grab(n_values, ascii_values.data());
+  binary.grab(n_values, binary_values.data());
+  for (int i = 0; i < n_values; i++)
+    EXPECT_EQ(ascii_values[i], binary_values[i]);
+}
+
+TEST(CoeffFileTest, WriteErrors) {
+  for (bool binary : {false, true}) {
+    EXPECT_THROW(CoeffFileWriter("missing_directory/coeff.txt", binary),
+                 std::runtime_error);
+
+    // Writes to a full device fail at the latest when the file is closed.
+    if (!std::ifstream("/dev/full"))
+      continue;
+    std::vector<double> values(10000, 1.0);
+    EXPECT_THROW(
+        {
+          CoeffFileWriter writer("/dev/full", binary);
+          writer.write_values(values.data(), values.size());
+          writer.close();
+        },
+        std::runtime_error);
+  }
+}
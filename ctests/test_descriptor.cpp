@@ -1,3 +1,5 @@
+#include "b2.h"
+#include "b2_norm.h"
 #include "b3.h"
 #include "descriptor.h"
 #include "test_structure.h"
@@ -5,6 +7,7 @@
 #include <Eigen/Dense>
 #include <cmath>
 #include <list>
+#include <random>
 #include <iostream>
 
 //// Test different types B1, B2, B3 to match with Bk
@@ -280,3 +283,107 @@ TYPED_TEST(DescTest, RotationTest) {
 //     }
 //   }
 // }
+
+TEST(SingleBondTest, StaticDispatch) {
+  // Compare the specialized single bond engine with the std::function path.
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<double> dist(0, 1);
+  int n_atoms = 8;
+  Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * 4.0;
+  Eigen::MatrixXd positions(n_atoms, 3);
+  std::vector<int> species;
+  for (int i = 0; i < n_atoms; i++) {
+    for (int k = 0; k < 3; k++)
+      positions(i, k) = 4.0 * dist(gen);
+    species.push_back(i % 2);
+  }
+
+  std::vector<std::string> radials{"chebyshev", "positive_chebyshev",
+                                   "bessel"};
+  std::vector<std::string> cutoffs{"quadratic", "cosine"};
+  std::vector<double> radial_hyps{0, 3.5};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{2, 4, 3};
+
+  for (const std::string &radial : radials) {
+    for (const std::string &cutoff : cutoffs) {
+      B2 fast(radial, cutoff, radial_hyps, cutoff_hyps, descriptor_settings);
+      B2 slow = fast;
+      EXPECT_TRUE(fast.single_bond_pointer != nullptr);
+      slow.single_bond_pointer = nullptr;
+
+      Structure struc1(cell, species, positions, 3.5, {&fast});
+      Structure struc2(cell, species, positions, 3.5, {&slow});
+
+      for (int s = 0; s < struc1.descriptors[0].n_types; s++) {
+        EXPECT_EQ(struc1.descriptors[0].descriptors[s],
+                  struc2.descriptors[0].descriptors[s]);
+        EXPECT_EQ(struc1.descriptors[0].descriptor_force_dervs[s],
+                  struc2.descriptors[0].descriptor_force_dervs[s]);
+      }
+    }
+  }
+}
+
+static void expect_matrices_near(const Eigen::MatrixXd &A,
+                                 const Eigen::MatrixXd &B, double tol) {
+  ASSERT_EQ(A.rows(), B.rows());
+  ASSERT_EQ(A.cols(), B.cols());
+  for (int i = 0; i < A.rows(); i++) {
+    for (int j = 0; j < A.cols(); j++) {
+      EXPECT_NEAR(A(i, j), B(i, j), tol * (1 + std::abs(B(i, j))));
+    }
+  }
+}
+
+TEST(B2Test, GemmContraction) {
+  // Compare the matrix product contraction of the B2 descriptor with the
+  // reference loops.
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<double> dist(0, 1);
+  int n_atoms = 10;
+  Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * 5.0;
+  Eigen::MatrixXd positions(n_atoms, 3);
+  std::vector<int> species;
+  for (int i = 0; i < n_atoms; i++) {
+    for (int k = 0; k < 3; k++)
+      positions(i, k) = 5.0 * dist(gen);
+    species.push_back(i % 3);
+  }
+
+  std::vector<double> radial_hyps{0, 4.0};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{3, 4, 4};
+
+  B2 gemm("chebyshev", "quadratic", radial_hyps, cutoff_hyps,
+          descriptor_settings);
+  B2 loops = gemm;
+  loops.b2_gemm = false;
+  B2_Norm gemm_norm("chebyshev", "quadratic", radial_hyps, cutoff_hyps,
+                    descriptor_settings);
+  B2_Norm loops_norm = gemm_norm;
+  loops_norm.b2_gemm = false;
+
+  Structure struc1(cell, species, positions, 4.0, {&gemm, &gemm_norm});
+  Structure struc2(cell, species, positions, 4.0, {&loops, &loops_norm});
+
+  double tol = 1e-12;
+  for (int d = 0; d < 2; d++) {
+    DescriptorValues &desc1 = struc1.descriptors[d];
+    DescriptorValues &desc2 = struc2.descriptors[d];
+    for (int s = 0; s < desc1.n_types; s++) {
+      expect_matrices_near(desc1.descriptors[s], desc2.descriptors[s], tol);
+      expect_matrices_near(desc1.descriptor_force_dervs[s],
+                           desc2.descriptor_force_dervs[s], tol);
+      expect_matrices_near(desc1.descriptor_norms[s], desc2.descriptor_norms[s],
+                           tol);
+      expect_matrices_near(desc1.descriptor_force_dots[s],
+                           desc2.descriptor_force_dots[s], tol);
+    }
+  }
+  // The flag is saved, and JSON without it loads the GEMM path.
+  nlohmann::json j = loops;
+  EXPECT_FALSE(j.get<B2>().b2_gemm);
+  j.erase("b2_gemm");
+  EXPECT_TRUE(j.get<B2>().b2_gemm);
+}
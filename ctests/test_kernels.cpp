@@ -1,5 +1,6 @@
 #include "test_structure.h"
 #include <list>
+#include <random>
 
 // Test different kernel types with different descriptor types
 template <typename T>
@@ -784,3 +785,101 @@ TYPED_TEST(KernelTest, StressStressKernel) {
     }
   }
 }
+
+TEST(KernelDiagonalTest, EnvsSelfDiagonal) {
+  // Compare the self-kernel diagonal of each kernel with the diagonal of the
+  // full environment kernel matrix.
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<double> dist(0, 1);
+  int n_atoms = 12, n_types = 3;
+  Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * 6.0;
+  Eigen::MatrixXd positions(n_atoms, 3);
+  std::vector<int> species;
+  for (int i = 0; i < n_atoms; i++) {
+    species.push_back(i % n_types);
+    for (int k = 0; k < 3; k++)
+      positions(i, k) = 6.0 * dist(gen);
+  }
+  // Isolate the last atom, so that its environment is empty.
+  cell(2, 2) = 20.0;
+  positions.row(n_atoms - 1) << 3.0, 3.0, 13.0;
+
+  std::vector<double> radial_hyps{0, 3.0};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{n_types, 3, 2};
+  B2 b2("chebyshev", "quadratic", radial_hyps, cutoff_hyps,
+        descriptor_settings);
+  Structure struc(cell, species, positions, 3.0, {&b2});
+  ClusterDescriptor envs(struc.descriptors[0]);
+
+  Eigen::MatrixXd icm_coeffs(n_types, n_types);
+  icm_coeffs << 1.0, 0.5, 0.2, 0.5, 2.0, 0.3, 0.2, 0.3, 0.7;
+  NormalizedDotProduct normalized(1.5, 2);
+  DotProduct dot(1.5, 3);
+  NormalizedDotProduct_ICM icm(1.5, 2, icm_coeffs);
+  SquaredExponential squared_exponential(1.5, 2.0);
+  std::vector<Kernel *> kernels{&normalized, &dot, &icm,
+                                &squared_exponential};
+
+  for (Kernel *kernel : kernels) {
+    Eigen::VectorXd diag =
+        kernel->envs_self_diagonal(envs, kernel->kernel_hyperparameters);
+    Eigen::VectorXd expected =
+        kernel->envs_envs(envs, envs, kernel->kernel_hyperparameters)
+            .diagonal();
+    ASSERT_EQ(diag.size(), expected.size());
+    for (int i = 0; i < diag.size(); i++)
+      EXPECT_NEAR(diag(i), expected(i), 1e-10 * std::abs(expected(i)) + 1e-12)
+          << kernel->kernel_name;
+  }
+}
+
+TEST(KernelContractionTest, EnvsStrucContracted) {
+  // Compare the alpha-contracted predictions with the kernel matrix.
+  std::mt19937 gen(4);
+  std::uniform_real_distribution<double> dist(0, 1);
+  int n_atoms = 10, n_types = 2;
+  Eigen::MatrixXd cell(3, 3);
+  cell << 5.0, 0.0, 0.0, 0.4, 5.0, 0.0, -0.3, 0.2, 5.5;
+  Eigen::MatrixXd positions(n_atoms, 3), sparse_positions(n_atoms, 3);
+  std::vector<int> species;
+  for (int i = 0; i < n_atoms; i++) {
+    species.push_back(i % n_types);
+    for (int k = 0; k < 3; k++) {
+      positions(i, k) = 5.0 * dist(gen);
+      sparse_positions(i, k) = 5.0 * dist(gen);
+    }
+  }
+
+  std::vector<double> radial_hyps{0, 3.5};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{n_types, 3, 2};
+  B2 b2("chebyshev", "quadratic", radial_hyps, cutoff_hyps,
+        descriptor_settings);
+  Structure struc(cell, species, positions, 3.5, {&b2});
+  Structure sparse_struc(cell, species, sparse_positions, 3.5, {&b2});
+  ClusterDescriptor envs(sparse_struc.descriptors[0]);
+  Eigen::VectorXd alpha(envs.n_clusters);
+  for (int i = 0; i < envs.n_clusters; i++)
+    alpha(i) = dist(gen) - 0.5;
+
+  NormalizedDotProduct normalized_1(1.5, 1), normalized_2(1.5, 2);
+  DotProduct dot_1(1.5, 1), dot_2(1.5, 2);
+  SquaredExponential squared_exponential(1.5, 2.0);
+  std::vector<Kernel *> kernels{&normalized_1, &normalized_2, &dot_1, &dot_2,
+                                &squared_exponential};
+
+  for (Kernel *kernel : kernels) {
+    Eigen::VectorXd efs = kernel->envs_struc_contracted(
+        envs, struc.descriptors[0], alpha, kernel->kernel_hyperparameters);
+    Eigen::VectorXd expected =
+        kernel->envs_struc(envs, struc.descriptors[0],
+                           kernel->kernel_hyperparameters)
+            .transpose() *
+        alpha;
+    ASSERT_EQ(efs.size(), expected.size());
+    double tol = 1e-10 * expected.cwiseAbs().maxCoeff();
+    for (int i = 0; i < efs.size(); i++)
+      EXPECT_NEAR(efs(i), expected(i), tol) << kernel->kernel_name;
+  }
+}
@@ -0,0 +1,236 @@
+#include "cutoffs.h"
+#include "lammps_descriptor.h"
+#include "radial.h"
+#include "gtest/gtest.h"
+#include <random>
+
+// Mapped B2 potential evaluated on a synthetic cluster with full neighbor
+// lists, as LAMMPS would pass them to pair_style flare.
+class LammpsDescriptorTest : public ::testing::Test {
+public:
+  int n_atoms = 12, n_species = 2, N = 3, lmax = 2, power = 2;
+  std::vector<double> positions;
+  std::vector<double *> x;
+  std::vector<int> type;
+  std::vector<std::vector<int>> neighbor_lists;
+  Eigen::MatrixXd cutoff_matrix;
+  std::vector<double> radial_hyps{0, 4.5}, cutoff_hyps;
+  std::vector<Eigen::MatrixXd> beta_matrices;
+  LammpsSingleBond::Function single_bond_function;
+
+  LammpsDescriptorTest() {
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> dist(0, 5);
+    positions.resize(3 * n_atoms);
+    for (int i = 0; i < 3 * n_atoms; i++)
+      positions[i] = dist(gen);
+    for (int i = 0; i < n_atoms; i++) {
+      x.push_back(&positions[3 * i]);
+      type.push_back(1 + i % n_species);
+    }
+
+    neighbor_lists.resize(n_atoms);
+    for (int i = 0; i < n_atoms; i++)
+      for (int j = 0; j < n_atoms; j++)
+        if (j != i)
+          neighbor_lists[i].push_back(j);
+
+    cutoff_matrix = Eigen::MatrixXd(n_species, n_species);
+    cutoff_matrix << 4.0, 3.5, 3.5, 4.5;
+
+    int n_radial = n_species * N;
+    int n_descriptors = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+    for (int s = 0; s < n_species; s++) {
+      Eigen::MatrixXd A = Eigen::MatrixXd::Random(n_descriptors, n_descriptors);
+      beta_matrices.push_back(A + A.transpose());
+    }
+
+    single_bond_function = set_lammps_single_bond("chebyshev", "quadratic");
+  }
+
+  bool compute_atom(int i, LammpsSingleBond::Function function, double &evdwl,
+                    Eigen::MatrixXd &partial_forces,
+                    ShortNeighborList &neighbors) {
+    neighbors.build(x.data(), type.data(), i, neighbor_lists[i].size(),
+                    neighbor_lists[i].data(), cutoff_matrix);
+    return b2_energy_and_forces(
+        neighbors, function, chebyshev, quadratic_cutoff, power, n_species, N,
+        lmax, radial_hyps, cutoff_hyps, beta_matrices[type[i] - 1], true,
+        evdwl, partial_forces);
+  }
+
+  // Total energy and forces, with the partial forces added as in
+  // PairFLARE::tally_atom.
+  double energy_and_forces(Eigen::MatrixXd &forces) {
+    double energy = 0, evdwl;
+    Eigen::MatrixXd partial_forces;
+    ShortNeighborList neighbors;
+    forces = Eigen::MatrixXd::Zero(n_atoms, 3);
+    for (int i = 0; i < n_atoms; i++) {
+      if (!compute_atom(i, single_bond_function, evdwl, partial_forces,
+                        neighbors))
+        continue;
+      energy += evdwl;
+      for (int k = 0; k < neighbors.size(); k++) {
+        forces.row(i) += partial_forces.row(k);
+        forces.row(neighbors.index[k]) -= partial_forces.row(k);
+      }
+    }
+    return energy;
+  }
+};
+
+TEST_F(LammpsDescriptorTest, ForcesMatchEnergy) {
+  Eigen::MatrixXd forces, unused;
+  energy_and_forces(forces);
+  EXPECT_GT(forces.cwiseAbs().maxCoeff(), 0);
+
+  double delta = 1e-5;
+  for (int i = 0; i < n_atoms; i++) {
+    for (int k = 0; k < 3; k++) {
+      positions[3 * i + k] += delta;
+      double energy_plus = energy_and_forces(unused);
+      positions[3 * i + k] -= 2 * delta;
+      double energy_minus = energy_and_forces(unused);
+      positions[3 * i + k] += delta;
+
+      double finite_difference = -(energy_plus - energy_minus) / (2 * delta);
+      EXPECT_NEAR(forces(i, k), finite_difference,
+                  1e-6 * std::max(1.0, std::abs(finite_difference)));
+    }
+  }
+}
+
+TEST_F(LammpsDescriptorTest, ThreadedAtoms) {
+  // Atoms computed concurrently give exactly the serial results, and the
+  // generic single bond function agrees with the specialized one.
+  std::vector<double> energies(n_atoms), threaded_energies(n_atoms);
+  std::vector<Eigen::MatrixXd> forces(n_atoms), threaded_forces(n_atoms);
+  std::vector<ShortNeighborList> neighbors(n_atoms),
+      threaded_neighbors(n_atoms);
+  std::vector<int> found(n_atoms), threaded_found(n_atoms);
+
+  for (int i = 0; i < n_atoms; i++)
+    found[i] = compute_atom(i, single_bond_function, energies[i], forces[i],
+                            neighbors[i]);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < n_atoms; i++)
+    threaded_found[i] =
+        compute_atom(i, single_bond_function, threaded_energies[i],
+                     threaded_forces[i], threaded_neighbors[i]);
+
+  for (int i = 0; i < n_atoms; i++) {
+    ASSERT_EQ(found[i], threaded_found[i]);
+    if (!found[i])
+      continue;
+    EXPECT_EQ(energies[i], threaded_energies[i]);
+    EXPECT_EQ(neighbors[i].index, threaded_neighbors[i].index);
+    EXPECT_EQ(forces[i], threaded_forces[i]);
+
+    double evdwl;
+    Eigen::MatrixXd generic_forces;
+    ShortNeighborList generic_neighbors;
+    compute_atom(i, nullptr, evdwl, generic_forces, generic_neighbors);
+    EXPECT_NEAR(evdwl, energies[i], 1e-10 * std::abs(energies[i]));
+    EXPECT_LE((generic_forces - forces[i]).cwiseAbs().maxCoeff(),
+              1e-10 * forces[i].cwiseAbs().maxCoeff());
+  }
+}
+
+TEST_F(LammpsDescriptorTest, BatchedAtoms) {
+  // The batched evaluation, with the beta products grouped by species,
+  // agrees with the per-atom one for any order of ilist and thread count,
+  // and leaves the Eigen thread count of the process unchanged.
+  int eigen_threads = Eigen::nbThreads();
+  std::vector<int> ilist, numneigh;
+  std::vector<int *> firstneigh;
+  for (int i = n_atoms - 1; i >= 0; i -= 2)
+    ilist.push_back(i);
+  for (int i = 0; i < n_atoms; i += 2)
+    ilist.push_back(i);
+  for (int i = 0; i < n_atoms; i++) {
+    numneigh.push_back(neighbor_lists[i].size());
+    firstneigh.push_back(neighbor_lists[i].data());
+  }
+
+  for (int p = 1; p <= 2; p++) {
+    power = p;
+    for (int n_threads = 1; n_threads <= 3; n_threads += 2) {
+      B2Batch batch;
+      b2_energies_and_forces(
+          x.data(), type.data(), ilist.data(), n_atoms, numneigh.data(),
+          firstneigh.data(), cutoff_matrix, single_bond_function, chebyshev,
+          quadratic_cutoff, power, n_species, N, lmax, radial_hyps,
+          cutoff_hyps, beta_matrices, {}, {}, true, n_threads, batch);
+      EXPECT_EQ(Eigen::nbThreads(), eigen_threads);
+
+      for (int a = 0; a < n_atoms; a++) {
+        double evdwl;
+        Eigen::MatrixXd partial_forces;
+        ShortNeighborList neighbors;
+        bool found = compute_atom(ilist[a], single_bond_function, evdwl,
+                                  partial_forces, neighbors);
+        ASSERT_EQ(found, batch.nonempty[a] != 0);
+        if (!found)
+          continue;
+        EXPECT_EQ(neighbors.index, batch.neighbors[a].index);
+        EXPECT_NEAR(batch.energies[a], evdwl, 1e-10 * std::abs(evdwl));
+        EXPECT_LE((batch.partial_forces[a] - partial_forces).cwiseAbs().maxCoeff(),
+                  1e-10 * partial_forces.cwiseAbs().maxCoeff());
+      }
+    }
+  }
+}
+
+TEST_F(LammpsDescriptorTest, CompressedBeta) {
+  // Beta matrices given by their eigendecompositions give the energies and
+  // forces of the dense matrices, and a truncated decomposition gives the
+  // energies of the truncated matrices.
+  std::vector<int> ilist, numneigh;
+  std::vector<int *> firstneigh;
+  for (int i = 0; i < n_atoms; i++) {
+    ilist.push_back(i);
+    numneigh.push_back(neighbor_lists[i].size());
+    firstneigh.push_back(neighbor_lists[i].data());
+  }
+
+  int n_descriptors = beta_matrices[0].rows();
+  for (int rank : {n_descriptors, n_descriptors / 3}) {
+    std::vector<Eigen::MatrixXd> eigenvectors, truncated_matrices;
+    std::vector<Eigen::VectorXd> eigenvalues;
+    for (int s = 0; s < n_species; s++) {
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(beta_matrices[s]);
+      Eigen::MatrixXd V = solver.eigenvectors().rightCols(rank);
+      Eigen::VectorXd lambda = solver.eigenvalues().tail(rank);
+      eigenvectors.push_back(V);
+      eigenvalues.push_back(lambda);
+      truncated_matrices.push_back(V * lambda.asDiagonal() * V.transpose());
+    }
+
+    B2Batch dense, compressed;
+    b2_energies_and_forces(
+        x.data(), type.data(), ilist.data(), n_atoms, numneigh.data(),
+        firstneigh.data(), cutoff_matrix, single_bond_function, chebyshev,
+        quadratic_cutoff, power, n_species, N, lmax, radial_hyps, cutoff_hyps,
+        truncated_matrices, {}, {}, true, 1, dense);
+    b2_energies_and_forces(
+        x.data(), type.data(), ilist.data(), n_atoms, numneigh.data(),
+        firstneigh.data(), cutoff_matrix, single_bond_function, chebyshev,
+        quadratic_cutoff, power, n_species, N, lmax, radial_hyps, cutoff_hyps,
+        {}, eigenvectors, eigenvalues, true, 2, compressed);
+
+    for (int a = 0; a < n_atoms; a++) {
+      ASSERT_EQ(dense.nonempty[a], compressed.nonempty[a]);
+      if (!dense.nonempty[a])
+        continue;
+      EXPECT_NEAR(compressed.energies[a], dense.energies[a],
+                  1e-10 * std::abs(dense.energies[a]));
+      EXPECT_LE(
+          (compressed.partial_forces[a] - dense.partial_forces[a])
+              .cwiseAbs()
+              .maxCoeff(),
+          1e-10 * dense.partial_forces[a].cwiseAbs().maxCoeff());
+    }
+  }
+}
@@ -1,8 +1,11 @@
 #include "sparse_gp.h"
 #include "test_structure.h"
+#include <cstdio> // Remove
+#include <fstream>
 #include <thread>
 #include <chrono>
 #include <numeric> // Iota
+#include <random>
 
 // TEST(TestPar, TestPar){
 //   std::cout << omp_get_max_threads() << std::endl;
@@ -75,13 +78,13 @@ TEST_F(StructureTest, SparseTest) {
   sparse_gp.add_all_environments(test_struc);
   sparse_gp.add_all_environments(test_struc_2);
 
-  EXPECT_EQ(sparse_gp.Sigma.rows(), 0);
-  EXPECT_EQ(sparse_gp.Kuu_inverse.rows(), 0);
+  EXPECT_EQ(sparse_gp.Sigma().rows(), 0);
+  EXPECT_EQ(sparse_gp.Kuu_inverse().rows(), 0);
 
   sparse_gp.update_matrices_QR();
-  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.Sigma.rows());
+  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.Sigma().rows());
   EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters,
-            sparse_gp.Kuu_inverse.rows());
+            sparse_gp.Kuu_inverse().rows());
 
   sparse_gp.predict_DTC(test_struc);
   std::vector<Eigen::VectorXd> cluster_variances =
@@ -141,9 +144,9 @@ TEST_F(StructureTest, TestAdd){
   sparse_gp.add_random_environments(test_struc, envs);
 
   sparse_gp.update_matrices_QR();
-  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.Sigma.rows());
+  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.Sigma().rows());
   EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters,
-            sparse_gp.Kuu_inverse.rows());
+            sparse_gp.Kuu_inverse().rows());
 }
 
 TEST_F(StructureTest, LikeGrad) {
@@ -168,8 +171,8 @@ TEST_F(StructureTest, LikeGrad) {
 
   // TODO: add another test structure
 
-  EXPECT_EQ(sparse_gp.Sigma.rows(), 0);
-  EXPECT_EQ(sparse_gp.Kuu_inverse.rows(), 0);
+  EXPECT_EQ(sparse_gp.Sigma().rows(), 0);
+  EXPECT_EQ(sparse_gp.Kuu_inverse().rows(), 0);
 
   sparse_gp.update_matrices_QR();
 
@@ -247,8 +250,8 @@ TEST_F(StructureTest, LikeGradStable) {
   sparse_gp.add_training_structure(test_struc_2, {0, 1, 3, 5}, 0.64, 0.55, 0.45);
   sparse_gp.add_specific_environments(test_struc_2, {2, 3, 4}); 
 
-  EXPECT_EQ(sparse_gp.Sigma.rows(), 0);
-  EXPECT_EQ(sparse_gp.Kuu_inverse.rows(), 0);
+  EXPECT_EQ(sparse_gp.Sigma().rows(), 0);
+  EXPECT_EQ(sparse_gp.Kuu_inverse().rows(), 0);
 
   sparse_gp.update_matrices_QR();
 
@@ -275,7 +278,9 @@ TEST_F(StructureTest, LikeGradStable) {
 
   int n_hyps = hyps.size();
   Eigen::VectorXd hyps_up, hyps_down;
-  double pert = 1e-6, like_up, like_down, fin_diff;
+  // The likelihood is of order 1e4, so smaller steps are dominated by
+  // rounding.
+  double pert = 1e-4, like_up, like_down, fin_diff;
 
   for (int i = 0; i < n_hyps; i++) {
     hyps_up = hyps;
@@ -407,3 +412,586 @@ TEST_F(StructureTest, AddOrder) {
     }
   }
 }
+
+TEST_F(SparseGPTest, PredictMeanFast) {
+  // Compare the back-propagated mean predictions with predict_mean, with and
+  // without the stored descriptor force derivatives.
+  init(7, 5.0, 4.0, {2, 4, 3});
+  cell << 5.0, 0.0, 0.0, 0.5, 5.5, 0.0, 0.3, -0.4, 6.0;
+  B2_Norm b2_norm("chebyshev", "quadratic", radial_hyps, cutoff_hyps,
+                  descriptor_settings);
+
+  NormalizedDotProduct normalized_kernel(2.0, 2);
+  DotProduct dot_kernel(1.5, 2);
+  std::vector<Kernel *> kernels{&normalized_kernel, &dot_kernel};
+  std::vector<Descriptor *> calculators{&b2, &b2_norm};
+  std::vector<Structure> strucs = make_structures(2, 12, calculators);
+  Structure &train_struc = strucs[0], &test_struc = strucs[1];
+
+  SparseGP sparse_gp(kernels, 0.1, 0.1, 0.1);
+  sparse_gp.add_training_structure(train_struc);
+  sparse_gp.add_all_environments(train_struc);
+  sparse_gp.update_matrices_QR();
+
+  Structure fast_struc(cell, test_struc.species, test_struc.positions, cutoff,
+                       calculators, "brute_force", 0, true);
+  EXPECT_EQ(fast_struc.descriptors[0].descriptor_force_dervs[0].rows(), 0);
+
+  sparse_gp.predict_mean(test_struc);
+  Eigen::VectorXd mean_efs = test_struc.mean_efs;
+  sparse_gp.predict_mean_fast(test_struc);
+  sparse_gp.predict_mean_fast(fast_struc);
+
+  double tol = 1e-10 * mean_efs.cwiseAbs().maxCoeff();
+  for (int i = 0; i < mean_efs.size(); i++) {
+    EXPECT_NEAR(test_struc.mean_efs(i), mean_efs(i), tol);
+    EXPECT_NEAR(fast_struc.mean_efs(i), mean_efs(i), tol);
+  }
+
+  // The other predictions and training need the force derivatives.
+  EXPECT_THROW(sparse_gp.predict_mean(fast_struc), std::invalid_argument);
+  EXPECT_THROW(sparse_gp.predict_SOR(fast_struc), std::invalid_argument);
+  EXPECT_THROW(sparse_gp.predict_DTC(fast_struc), std::invalid_argument);
+  EXPECT_THROW(sparse_gp.add_training_structure(fast_struc),
+               std::invalid_argument);
+}
+
+TEST_F(SparseGPTest, DiagonalVariances) {
+  // Compare the column-wise variance reductions, with and without blocking,
+  // with the diagonals of the full predictive covariance matrices.
+  init(11, 5.0, 4.0);
+  NormalizedDotProduct kernel(2.0, 2);
+  std::vector<Kernel *> kernels{&kernel};
+  std::vector<Structure> strucs = make_structures(2, 10, {&b2});
+  Structure &train_struc = strucs[0], &test_struc = strucs[1];
+
+  SparseGP sparse_gp(kernels, 0.1, 0.1, 0.1);
+  sparse_gp.add_training_structure(train_struc);
+  sparse_gp.add_all_environments(train_struc);
+  sparse_gp.update_matrices_QR();
+
+  Eigen::MatrixXd kernel_mat = kernel.envs_struc(
+      sparse_gp.sparse_descriptors[0], test_struc.descriptors[0],
+      kernel.kernel_hyperparameters);
+  Eigen::MatrixXd V_SOR =
+      kernel_mat.transpose() * sparse_gp.Sigma() * kernel_mat;
+  Eigen::MatrixXd Q_self =
+      kernel_mat.transpose() * sparse_gp.Kuu_inverse() * kernel_mat;
+  Eigen::VectorXd K_self = kernel.self_kernel_struc(
+      test_struc.descriptors[0], kernel.kernel_hyperparameters);
+  Eigen::VectorXd DTC = K_self - Q_self.diagonal() + V_SOR.diagonal();
+
+  for (int block_size : {0, 7}) {
+    sparse_gp.predict_SOR(test_struc, block_size);
+    for (int i = 0; i < V_SOR.rows(); i++)
+      EXPECT_NEAR(test_struc.variance_efs(i), V_SOR(i, i),
+                  1e-8 * std::abs(V_SOR(i, i)) + 1e-12);
+
+    sparse_gp.predict_DTC(test_struc, block_size);
+    for (int i = 0; i < DTC.size(); i++)
+      EXPECT_NEAR(test_struc.variance_efs(i), DTC(i),
+                  1e-8 * K_self(i) + 1e-12);
+  }
+}
+
+TEST_F(SparseGPTest, IncrementalQR) {
+  // Add labels and sparse points in several steps, extending the stored
+  // factorization, and compare with a factorization from scratch.
+  init(5, 5.0, 4.0);
+  NormalizedDotProduct normalized_kernel(2.0, 2);
+  DotProduct dot_kernel(1.5, 2);
+  std::vector<Kernel *> kernels{&normalized_kernel, &dot_kernel};
+  std::vector<Structure> strucs = make_structures(3, 10, {&b2, &b2});
+
+  SparseGP sparse_gp(kernels, 0.1, 0.1, 0.1);
+  sparse_gp.add_training_structure(strucs[0]);
+  sparse_gp.add_specific_environments(strucs[0], {0, 1, 2, 3});
+  sparse_gp.update_matrices_QR();
+
+  // New sparse points of both types are inserted inside the stacked order.
+  sparse_gp.add_training_structure(strucs[1]);
+  sparse_gp.add_specific_environments(strucs[1], {4, 5, 6});
+  EXPECT_TRUE(sparse_gp.update_matrices_incremental());
+
+  // New labels only.
+  sparse_gp.add_training_structure(strucs[2], {1, 7});
+  EXPECT_TRUE(sparse_gp.update_matrices_incremental());
+
+  SparseGP full_gp = sparse_gp;
+  full_gp.compute_matrices_QR();
+
+  double tol = 1e-8;
+  expect_close(sparse_gp.alpha, full_gp.alpha, tol);
+  expect_close(sparse_gp.Sigma(), full_gp.Sigma(), tol);
+  expect_close(sparse_gp.Kuu_inverse(), full_gp.Kuu_inverse(), tol);
+  expect_close(sparse_gp.R_inv_diag.cwiseAbs(), full_gp.R_inv_diag.cwiseAbs(),
+               tol);
+  expect_close(sparse_gp.L_diag.cwiseAbs(), full_gp.L_diag.cwiseAbs(), tol);
+
+  // Changing the hyperparameters requires a new factorization.
+  sparse_gp.hyperparameters(0) *= 2;
+  EXPECT_FALSE(sparse_gp.update_matrices_incremental());
+}
+
+TEST_F(SparseGPTest, GrowableKernelMatrices) {
+  // Kuu and Kuf are grown in place. Compare them with matrices computed
+  // from scratch after interleaving new labels and new sparse points.
+  init(7, 5.0, 4.0);
+  NormalizedDotProduct normalized_kernel(2.0, 2);
+  DotProduct dot_kernel(1.5, 2);
+  std::vector<Kernel *> kernels{&normalized_kernel, &dot_kernel};
+  std::vector<Structure> strucs = make_structures(4, 8, {&b2, &b2});
+
+  SparseGP sparse_gp(kernels, 0.1, 0.1, 0.1);
+  sparse_gp.add_training_structure(strucs[0]);
+  sparse_gp.add_specific_environments(strucs[0], {0, 3});
+  sparse_gp.add_training_structure(strucs[1], {2, 5});
+  sparse_gp.add_specific_environments(strucs[1], {1, 2, 6});
+  sparse_gp.add_training_structure(strucs[2]);
+  sparse_gp.add_all_environments(strucs[3]);
+  sparse_gp.add_training_structure(strucs[3]);
+
+  double tol = 1e-10;
+  for (int i = 0; i < kernels.size(); i++) {
+    const ClusterDescriptor &sparse = sparse_gp.sparse_descriptors[i];
+    expect_close(sparse_gp.Kuu_kernels[i],
+                 kernels[i]->envs_envs(sparse, sparse,
+                                       kernels[i]->kernel_hyperparameters),
+                 tol);
+
+    // The last structure contributes all of its labels.
+    Eigen::MatrixXd envs_struc = kernels[i]->envs_struc(
+        sparse, strucs[3].descriptors[i], kernels[i]->kernel_hyperparameters);
+    expect_close(sparse_gp.Kuf_kernels[i].rightCols(envs_struc.cols()),
+                 envs_struc, tol);
+  }
+
+  // The stacked matrices match the blocks of the kernel matrices.
+  SparseGP stacked_gp = sparse_gp;
+  stacked_gp.stack_Kuu();
+  stacked_gp.stack_Kuf();
+  expect_close(sparse_gp.Kuu, stacked_gp.Kuu, tol);
+  expect_close(sparse_gp.Kuf, stacked_gp.Kuf, tol);
+}
+
+TEST_F(SparseGPTest, BatchTrainingStructures) {
+  // Adding structures and sparse environments in batches gives the same
+  // model as adding them one at a time.
+  init(11, 5.0, 4.0);
+  NormalizedDotProduct normalized_kernel(2.0, 2);
+  DotProduct dot_kernel(1.5, 2);
+  std::vector<Kernel *> kernels{&normalized_kernel, &dot_kernel};
+  std::vector<Structure> strucs = make_structures(4, 8, {&b2, &b2});
+  strucs[2].stresses = Eigen::VectorXd();
+
+  std::vector<std::vector<int>> atom_indices{{-1}, {2, 5}, {-1}, {0, 1, 7}};
+  std::vector<double> rel_e{1.0, 0.4, 0.7, 1.2}, rel_f{0.5, 1.0, 0.3, 0.8},
+      rel_s{0.9, 0.6, 1.0, 0.2};
+  std::vector<std::vector<int>> sparse_atoms{{0, 3}, {}, {1, 2, 6}, {4}};
+
+  SparseGP sequential_gp(kernels, 0.1, 0.2, 0.3);
+  for (int n = 0; n < strucs.size(); n++) {
+    sequential_gp.add_training_structure(strucs[n], atom_indices[n], rel_e[n],
+                                         rel_f[n], rel_s[n]);
+  }
+  for (int n = 0; n < strucs.size(); n++) {
+    if (sparse_atoms[n].size() != 0)
+      sequential_gp.add_specific_environments(strucs[n], sparse_atoms[n]);
+  }
+
+  SparseGP batch_gp(kernels, 0.1, 0.2, 0.3);
+  batch_gp.add_training_structures({strucs[0], strucs[1]},
+                                   {atom_indices[0], atom_indices[1]},
+                                   {rel_e[0], rel_e[1]}, {rel_f[0], rel_f[1]},
+                                   {rel_s[0], rel_s[1]});
+  batch_gp.add_training_structures({strucs[2], strucs[3]},
+                                   {atom_indices[2], atom_indices[3]},
+                                   {rel_e[2], rel_e[3]}, {rel_f[2], rel_f[3]},
+                                   {rel_s[2], rel_s[3]});
+  batch_gp.add_specific_environments(strucs, sparse_atoms);
+
+  EXPECT_EQ(batch_gp.n_strucs, sequential_gp.n_strucs);
+  EXPECT_EQ(batch_gp.n_labels, sequential_gp.n_labels);
+  EXPECT_EQ(batch_gp.n_force_labels, sequential_gp.n_force_labels);
+  EXPECT_EQ(batch_gp.n_stress_labels, sequential_gp.n_stress_labels);
+  EXPECT_EQ(batch_gp.n_sparse, sequential_gp.n_sparse);
+  EXPECT_EQ(batch_gp.training_atom_indices,
+            sequential_gp.training_atom_indices);
+  double tol = 1e-12;
+  expect_close(batch_gp.label_count, sequential_gp.label_count, tol);
+  expect_close(batch_gp.y, sequential_gp.y, tol);
+  expect_close(batch_gp.noise_vector, sequential_gp.noise_vector, tol);
+  expect_close(batch_gp.f_noise_one, sequential_gp.f_noise_one, tol);
+  expect_close(batch_gp.inv_s_noise_one, sequential_gp.inv_s_noise_one, tol);
+  expect_close(batch_gp.Kuu, sequential_gp.Kuu, tol);
+  expect_close(batch_gp.Kuf, sequential_gp.Kuf, tol);
+
+  // A list of the wrong length is rejected.
+  EXPECT_THROW(batch_gp.add_training_structures(strucs, {{-1}}),
+               std::invalid_argument);
+}
+
+TEST_F(SparseGPTest, Likelihood) {
+  // The likelihood from the Woodbury identity matches the one from the QR
+  // factors and the dense expression.
+  init(5, 4.0, 3.5);
+  NormalizedDotProduct kernel(1.5, 2);
+  SparseGP sparse_gp({&kernel}, 0.2, 0.3, 0.4);
+  for (const Structure &struc : make_structures(2, 6, {&b2})) {
+    sparse_gp.add_training_structure(struc);
+    sparse_gp.add_specific_environments(struc, {0, 2, 5});
+  }
+  sparse_gp.update_matrices_QR();
+
+  sparse_gp.compute_likelihood();
+  double like = sparse_gp.log_marginal_likelihood;
+  sparse_gp.compute_likelihood_stable();
+  double like_stable = sparse_gp.log_marginal_likelihood;
+
+  int n_labels = sparse_gp.n_labels;
+  Eigen::MatrixXd Kuu = sparse_gp.Kuu;
+  Kuu.diagonal().array() += sparse_gp.Kuu_jitter;
+  Eigen::MatrixXd Kuf = sparse_gp.Kuf;
+  Eigen::MatrixXd Q = Kuf.transpose() * Kuu.inverse() * Kuf;
+  Q.diagonal() += sparse_gp.noise_vector.cwiseInverse();
+  Eigen::PartialPivLU<Eigen::MatrixXd> lu(Q);
+  double log_det = lu.matrixLU().diagonal().array().abs().log().sum();
+  double like_dense = -(log_det + sparse_gp.y.dot(lu.solve(sparse_gp.y)) +
+                        n_labels * log(2 * M_PI)) / 2;
+
+  EXPECT_NEAR(like, like_dense, 1e-8 * abs(like_dense));
+  EXPECT_NEAR(like_stable, like_dense, 1e-8 * abs(like_dense));
+}
+
+// Memory check of the likelihood and its gradients with 200000 labels, where
+// an n_labels x n_labels matrix would need 320 GB. It takes several seconds,
+// so it is disabled by default. Run it with --gtest_also_run_disabled_tests.
+TEST_F(SparseGPTest, DISABLED_LikelihoodMemory) {
+  init(5, 10.8, 1.5, {1, 2, 0});
+  neighbor_method = "cell_list";
+  NormalizedDotProduct kernel(1.5, 2);
+  SparseGP sparse_gp({&kernel}, 0.2, 0.3, 0.4);
+  std::vector<Structure> strucs = make_structures(100, 667, {&b2});
+  for (int n = 0; n < strucs.size(); n++) {
+    sparse_gp.add_training_structure(strucs[n]);
+    if (n < 5)
+      sparse_gp.add_specific_environments(strucs[n], {0, 1});
+  }
+  sparse_gp.update_matrices_QR();
+  ASSERT_GE(sparse_gp.n_labels, 200000);
+
+  sparse_gp.compute_likelihood();
+  double like = sparse_gp.log_marginal_likelihood;
+  sparse_gp.compute_likelihood_stable();
+  EXPECT_NEAR(like, sparse_gp.log_marginal_likelihood, 1e-6 * abs(like));
+
+  Eigen::VectorXd hyps = sparse_gp.hyperparameters;
+  double like_stable = sparse_gp.compute_likelihood_gradient_stable();
+  Eigen::VectorXd grad_stable = sparse_gp.likelihood_gradient;
+  like = sparse_gp.compute_likelihood_gradient(hyps);
+  Eigen::VectorXd grad = sparse_gp.likelihood_gradient;
+  EXPECT_NEAR(like, like_stable, 1e-6 * abs(like));
+  ASSERT_EQ(grad.size(), 4);
+  for (int i = 0; i < grad.size(); i++)
+    EXPECT_NEAR(grad(i), grad_stable(i), 1e-6 * grad.cwiseAbs().maxCoeff());
+}
+
+TEST_F(SparseGPTest, KernelBases) {
+  // Kuu and Kuf rebuilt from the kernel bases match the kernels evaluated
+  // from the descriptors.
+  init(11, 4.0, 3.5);
+  Eigen::MatrixXd icm_coeffs(2, 2);
+  icm_coeffs << 1.0, 0.4, 0.4, 0.8;
+  NormalizedDotProduct_ICM icm_kernel(1.5, 2, icm_coeffs);
+  SquaredExponential sq_exp_kernel(1.2, 0.8);
+  NormalizedDotProduct normalized_kernel(2.0, 2);
+  std::vector<Kernel *> kernels{&icm_kernel, &sq_exp_kernel,
+                                &normalized_kernel};
+  std::vector<Structure> strucs = make_structures(2, 6, {&b2, &b2, &b2});
+
+  SparseGP sparse_gp(kernels, 0.1, 0.2, 0.3);
+  sparse_gp.add_training_structure(strucs[0], {0, 3, 4});
+  sparse_gp.add_all_environments(strucs[0]);
+  sparse_gp.add_training_structure(strucs[1]);
+  sparse_gp.add_specific_environments(strucs[1], {1, 2, 5});
+  sparse_gp.update_matrices_QR();
+
+  sparse_gp.update_kernel_bases();
+  EXPECT_EQ(sparse_gp.Kuu_bases[0].size(), 3);
+  EXPECT_EQ(sparse_gp.Kuf_bases[0].size(), 3);
+  EXPECT_EQ(sparse_gp.Kuu_bases[1].size(), 2);
+  EXPECT_EQ(sparse_gp.Kuf_bases[1].size(), 0);
+  EXPECT_EQ(sparse_gp.Kuu_bases[2].size(), 0);
+  EXPECT_EQ(sparse_gp.Kuf_bases[2].size(), 0);
+
+  Eigen::VectorXd hyps(10);
+  hyps << 1.1, 0.7, 0.3, 0.6, 1.2, 0.9, 1.7, 0.15, 0.2, 0.25;
+  sparse_gp.set_hyperparameters(hyps);
+
+  double tol = 1e-10;
+  int hyp_index = 0;
+  for (int i = 0; i < kernels.size(); i++) {
+    const ClusterDescriptor &sparse = sparse_gp.sparse_descriptors[i];
+    int n_hyps = kernels[i]->kernel_hyperparameters.size();
+    Eigen::VectorXd kernel_hyps = hyps.segment(hyp_index, n_hyps);
+    hyp_index += n_hyps;
+
+    std::vector<Eigen::MatrixXd> Kuu_grad =
+        kernels[i]->envs_envs_grad(sparse, sparse, kernel_hyps);
+    std::vector<Eigen::MatrixXd> base_grad =
+        sparse_gp.compute_Kuu_grad(i, kernel_hyps);
+    ASSERT_EQ(base_grad.size(), Kuu_grad.size());
+    for (int j = 0; j < Kuu_grad.size(); j++)
+      expect_close(base_grad[j], Kuu_grad[j], tol);
+    expect_close(sparse_gp.Kuu_kernels[i], Kuu_grad[0], tol);
+
+    // The second structure contributes all of its labels.
+    std::vector<Eigen::MatrixXd> struc_grad = kernels[i]->envs_struc_grad(
+        sparse, strucs[1].descriptors[i], kernel_hyps);
+    std::vector<Eigen::MatrixXd> Kuf_grad =
+        sparse_gp.compute_Kuf_grad(i, kernel_hyps);
+    ASSERT_EQ(Kuf_grad.size(), struc_grad.size());
+    int n_struc_labels = struc_grad[0].cols();
+    for (int j = 0; j < struc_grad.size(); j++)
+      expect_close(Kuf_grad[j].rightCols(n_struc_labels), struc_grad[j], tol);
+    expect_close(sparse_gp.Kuf_kernels[i].rightCols(n_struc_labels),
+                 struc_grad[0], tol);
+  }
+}
+
+TEST_F(SparseGPTest, OptimizeHyperparameters) {
+  // The native optimizer increases the likelihood, respects the bounds and
+  // leaves the model factorized at the optimum.
+  init(5, 4.0, 3.5);
+  NormalizedDotProduct normalized_kernel(1.5, 2);
+  SquaredExponential sq_exp_kernel(1.0, 1.0);
+  std::vector<std::vector<Kernel *>> kernel_sets{{&normalized_kernel},
+                                                 {&sq_exp_kernel}};
+  std::vector<Structure> strucs = make_structures(3, 5, {&b2});
+
+  for (std::string method : {"L-BFGS-B", "L-BFGS-B-log"}) {
+    for (std::vector<Kernel *> kernels : kernel_sets) {
+      SparseGP sparse_gp(kernels, 0.5, 0.5, 0.5);
+      for (int n = 0; n < strucs.size(); n++) {
+        sparse_gp.add_training_structure(strucs[n]);
+        sparse_gp.add_specific_environments(strucs[n], {0, 3});
+      }
+      sparse_gp.update_matrices_QR();
+      Eigen::VectorXd initial_hyps = sparse_gp.hyperparameters;
+      sparse_gp.compute_likelihood_gradient_stable();
+      double initial_likelihood = sparse_gp.log_marginal_likelihood;
+
+      int n_hyps = initial_hyps.size();
+      Eigen::MatrixXd bounds(n_hyps, 2);
+      bounds.col(0) = Eigen::VectorXd::Constant(n_hyps, 1e-3);
+      bounds.col(1) = Eigen::VectorXd::Constant(n_hyps, 5.0);
+      double likelihood =
+          sparse_gp.optimize_hyperparameters(method, 20, bounds);
+
+      EXPECT_GT(likelihood, initial_likelihood);
+      Eigen::VectorXd hyps = sparse_gp.hyperparameters;
+      for (int i = 0; i < n_hyps; i++) {
+        EXPECT_GE(hyps(i), 1e-3);
+        EXPECT_LE(hyps(i), 5.0);
+      }
+
+      // The stored solution and likelihood match a fresh factorization.
+      Eigen::VectorXd alpha = sparse_gp.alpha;
+      Eigen::VectorXd gradient = sparse_gp.likelihood_gradient;
+      sparse_gp.set_hyperparameters(hyps);
+      double check = sparse_gp.compute_likelihood_gradient_stable();
+      EXPECT_NEAR(likelihood, check, 1e-8 * std::abs(check));
+      for (int i = 0; i < alpha.size(); i++)
+        EXPECT_NEAR(alpha(i), sparse_gp.alpha(i),
+                    1e-8 * sparse_gp.alpha.cwiseAbs().maxCoeff());
+      for (int i = 0; i < n_hyps; i++)
+        EXPECT_NEAR(gradient(i), sparse_gp.likelihood_gradient(i),
+                    1e-6 * sparse_gp.likelihood_gradient.cwiseAbs().maxCoeff());
+    }
+  }
+
+  SparseGP sparse_gp(kernel_sets[0], 0.5, 0.5, 0.5);
+  sparse_gp.add_training_structure(strucs[0]);
+  sparse_gp.add_all_environments(strucs[0]);
+  sparse_gp.update_matrices_QR();
+  EXPECT_THROW(sparse_gp.optimize_hyperparameters("BFGS"),
+               std::invalid_argument);
+  EXPECT_THROW(sparse_gp.optimize_hyperparameters(
+                   "L-BFGS-B", 10, Eigen::MatrixXd::Zero(2, 2)),
+               std::invalid_argument);
+}
+
+TEST_F(SparseGPTest, FactorsJson) {
+  // The triangular factors are serialized in place of the inverses, and
+  // files without them are refactorized when loaded.
+  init(3, 4.0, 3.5);
+  NormalizedDotProduct kernel(2.0, 2);
+  std::vector<Kernel *> kernels{&kernel};
+  std::vector<Structure> strucs = make_structures(2, 6, {&b2});
+  Structure &train_struc = strucs[0], &test_struc = strucs[1];
+
+  SparseGP sparse_gp(kernels, 0.1, 0.2, 0.3);
+  sparse_gp.add_training_structure(train_struc);
+  sparse_gp.add_all_environments(train_struc);
+  sparse_gp.update_matrices_QR();
+
+  sparse_gp.predict_DTC(test_struc);
+  Eigen::VectorXd mean = test_struc.mean_efs;
+  Eigen::VectorXd variance = test_struc.variance_efs;
+
+  std::string file_name = "sgp_factors.json";
+  SparseGP::to_json(file_name, sparse_gp);
+  std::ifstream in_file(file_name);
+  nlohmann::json j;
+  in_file >> j;
+  in_file.close();
+  EXPECT_TRUE(j.contains("R_factor"));
+  EXPECT_FALSE(j.contains("Sigma"));
+
+  // Write the same model without the factors.
+  j.erase("R_factor");
+  j.erase("L_factor");
+  std::string old_file_name = "sgp_factors_old.json";
+  std::ofstream out_file(old_file_name);
+  out_file << j;
+  out_file.close();
+
+  for (std::string name : {file_name, old_file_name}) {
+    SparseGP loaded = SparseGP::from_json(name);
+    loaded.predict_DTC(test_struc);
+    for (int i = 0; i < mean.size(); i++) {
+      EXPECT_NEAR(test_struc.mean_efs(i), mean(i),
+                  1e-8 * mean.cwiseAbs().maxCoeff());
+      EXPECT_NEAR(test_struc.variance_efs(i), variance(i),
+                  1e-8 * variance.cwiseAbs().maxCoeff());
+    }
+    std::remove(name.c_str());
+  }
+}
+
+TEST_F(SparseGPTest, BlockGradients) {
+  // The likelihood gradients, assembled from per-kernel row blocks, agree
+  // between the two likelihood implementations for kernels with different
+  // numbers of hyperparameters.
+  init(17, 4.0, 3.5);
+  Eigen::MatrixXd icm_coeffs(2, 2);
+  icm_coeffs << 1.0, 0.3, 0.3, 0.7;
+  NormalizedDotProduct_ICM icm_kernel(1.2, 2, icm_coeffs);
+  SquaredExponential sq_exp_kernel(0.9, 1.1);
+  NormalizedDotProduct normalized_kernel(1.5, 2);
+  std::vector<Kernel *> kernels{&icm_kernel, &sq_exp_kernel,
+                                &normalized_kernel};
+
+  SparseGP sparse_gp(kernels, 0.2, 0.3, 0.4);
+  for (const Structure &struc : make_structures(2, 6, {&b2, &b2, &b2})) {
+    sparse_gp.add_training_structure(struc);
+    sparse_gp.add_specific_environments(struc, {0, 2, 5});
+  }
+  sparse_gp.update_matrices_QR();
+
+  Eigen::VectorXd hyps = sparse_gp.hyperparameters;
+  double like_stable = sparse_gp.compute_likelihood_gradient_stable();
+  Eigen::VectorXd grad_stable = sparse_gp.likelihood_gradient;
+  double like = sparse_gp.compute_likelihood_gradient(hyps);
+  Eigen::VectorXd grad = sparse_gp.likelihood_gradient;
+
+  EXPECT_NEAR(like, like_stable, 1e-8 * std::abs(like));
+  ASSERT_EQ(grad.size(), 10);
+  double tol = 1e-6 * grad.cwiseAbs().maxCoeff();
+  for (int i = 0; i < grad.size(); i++)
+    EXPECT_NEAR(grad(i), grad_stable(i), tol);
+}
+
+TEST_F(SparseGPTest, CompressedMapping) {
+  // The eigendecomposition written at zero tolerance reproduces the beta
+  // matrices, and truncation at a tolerance bounds the local energy errors.
+  init(23, 5.0, 4.0);
+  NormalizedDotProduct normalized_kernel(2.0, 2);
+  SparseGP sparse_gp({&normalized_kernel}, 0.1, 0.2, 0.3);
+  for (Structure &struc : make_structures(3, 8, {&b2})) {
+    struc.stresses = Eigen::VectorXd();
+    sparse_gp.add_training_structure(struc);
+    sparse_gp.add_all_environments(struc);
+  }
+  sparse_gp.update_matrices_QR();
+
+  int n_descriptors = sparse_gp.sparse_descriptors[0].n_descriptors;
+  int n_species = 2;
+
+  // Read the rank and coefficients of a compressed file.
+  auto read_coefficients = [&](int &rank) {
+    std::ifstream coeff_file("beta_compressed.txt");
+    std::string line, kernel_name;
+    std::getline(coeff_file, line);
+    int power;
+    coeff_file >> power >> kernel_name >> rank;
+    EXPECT_EQ(power, 2);
+    EXPECT_EQ(kernel_name, "NormalizedDotProduct");
+    for (int i = 0; i < 5; i++)
+      std::getline(coeff_file, line);
+    std::vector<double> coeffs;
+    double val;
+    while (coeff_file >> val)
+      coeffs.push_back(val);
+    return coeffs;
+  };
+
+  MappingCompression full = sparse_gp.write_compressed_mapping_coefficients(
+      "beta_compressed.txt", "test", 0, 0);
+  int rank;
+  std::vector<double> coeffs = read_coefficients(rank);
+  EXPECT_EQ(full.rank, rank);
+  ASSERT_EQ(coeffs.size(), n_species * rank * (n_descriptors + 1));
+  EXPECT_LT(full.energy_max, 1e-10);
+  EXPECT_LT(full.force_max, 1e-10);
+
+  Eigen::MatrixXd mapping_coeffs =
+      normalized_kernel.compute_mapping_coefficients(sparse_gp, 0);
+  std::vector<double> max_eigenvalues;
+  for (int s = 0; s < n_species; s++) {
+    const double *block = &coeffs[s * rank * (n_descriptors + 1)];
+    Eigen::MatrixXd beta = Eigen::MatrixXd::Zero(n_descriptors, n_descriptors);
+    for (int k = 0; k < rank; k++) {
+      Eigen::Map<const Eigen::VectorXd> v(block + rank + k * n_descriptors,
+                                          n_descriptors);
+      beta += block[k] * v * v.transpose();
+    }
+    max_eigenvalues.push_back(std::abs(block[0]));
+
+    int beta_count = 0;
+    double tol = 1e-8 * std::abs(block[0]);
+    for (int i = 0; i < n_descriptors; i++) {
+      for (int j = i; j < n_descriptors; j++) {
+        double factor = i == j ? 1 : 2;
+        EXPECT_NEAR(factor * beta(i, j), mapping_coeffs(s, beta_count), tol);
+        beta_count++;
+      }
+    }
+  }
+
+  double tolerance =
+      0.01 * *std::min_element(max_eigenvalues.begin(), max_eigenvalues.end());
+  MappingCompression truncated =
+      sparse_gp.write_compressed_mapping_coefficients("beta_compressed.txt",
+                                                      "test", 0, tolerance);
+  coeffs = read_coefficients(rank);
+  EXPECT_EQ(truncated.rank, rank);
+  EXPECT_GE(rank, 1);
+  EXPECT_LT(rank, full.rank);
+  ASSERT_EQ(coeffs.size(), n_species * rank * (n_descriptors + 1));
+  EXPECT_LE(truncated.energy_max, tolerance);
+  EXPECT_LE(truncated.energy_rmse, truncated.energy_max);
+  EXPECT_GT(truncated.force_max, 0);
+  EXPECT_LE(truncated.force_rmse, truncated.force_max);
+  std::remove("beta_compressed.txt");
+
+  // Only power 2 dot product kernels can be compressed.
+  NormalizedDotProduct power_one_kernel(2.0, 1);
+  SparseGP power_one_gp({&power_one_kernel}, 0.1, 0.2, 0.3);
+  power_one_gp.add_training_structure(sparse_gp.training_structures[0]);
+  power_one_gp.add_all_environments(sparse_gp.training_structures[0]);
+  power_one_gp.update_matrices_QR();
+  EXPECT_THROW(power_one_gp.write_compressed_mapping_coefficients(
+                   "beta_compressed.txt", "test", 0, 0),
+               std::invalid_argument);
+}
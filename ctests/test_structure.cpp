@@ -1,4 +1,7 @@
 #include "test_structure.h"
+#include <algorithm>
+#include <random>
+#include <sys/resource.h>
 
 TEST_F(StructureTest, TestWrapped) {
   // Check that the wrapped coordinates are equivalent to Cartesian coordinates
@@ -35,3 +38,236 @@ TEST_F(StructureTest, TestEnvironments) {
   ClusterDescriptor envs;
   envs.add_all_clusters(struc_desc);
 }
+
+TEST_F(StructureTest, ComputeStructures) {
+  // Structures built concurrently match structures built one at a time.
+  std::vector<Structure> strucs = Structure::compute_structures(
+      {cell, cell_2, cell_3}, {species, species_2, species_3},
+      {positions, positions_2, positions_3}, cutoff, dc, 2);
+  std::vector<Structure *> expected{&test_struc, &test_struc_2, &test_struc_3};
+
+  ASSERT_EQ(strucs.size(), 3);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(strucs[i].neighbor_count, expected[i]->neighbor_count);
+    EXPECT_EQ(strucs[i].structure_indices, expected[i]->structure_indices);
+    for (int s = 0; s < n_species; s++) {
+      Eigen::MatrixXd desc1 = strucs[i].descriptors[0].descriptors[s];
+      Eigen::MatrixXd desc2 = expected[i]->descriptors[0].descriptors[s];
+      ASSERT_EQ(desc1.rows(), desc2.rows());
+      if (desc1.size() > 0)
+        EXPECT_LE((desc1 - desc2).cwiseAbs().maxCoeff(), 1e-12);
+    }
+  }
+
+  // The neighbor search and skin are forwarded to every frame.
+  std::vector<Structure> cell_list_strucs = Structure::compute_structures(
+      {cell, cell_2}, {species, species_2}, {positions, positions_2}, cutoff,
+      dc, 2, false, "cell_list", 0.5);
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(cell_list_strucs[i].neighbor_method, "cell_list");
+    EXPECT_EQ(cell_list_strucs[i].skin, 0.5);
+    EXPECT_EQ(cell_list_strucs[i].neighbor_count,
+              expected[i]->neighbor_count);
+  }
+
+  EXPECT_THROW(Structure::compute_structures({cell}, {}, {positions}, cutoff,
+                                             dc),
+               std::invalid_argument);
+}
+
+// Neighbor list tests draw from their own random number generator so that
+// they leave the global random state used by the other tests untouched.
+class NeighborTest : public ::testing::Test {
+public:
+  int n_atoms = 10;
+  int n_species = 3;
+  double cell_size = 10;
+  double cutoff = cell_size / 2;
+  Eigen::MatrixXd cell, positions;
+  std::vector<int> species;
+  B2_Norm ps_norm;
+  std::vector<Descriptor *> dc;
+  std::mt19937 generator;
+
+  NeighborTest() {
+    cell = Eigen::MatrixXd::Identity(3, 3) * cell_size;
+    positions = random_positions(n_atoms, cell_size / 2);
+    std::uniform_int_distribution<int> species_distribution(0, n_species - 1);
+    for (int i = 0; i < n_atoms; i++) {
+      species.push_back(species_distribution(generator));
+    }
+
+    std::vector<double> radial_hyps{0, cutoff}, cutoff_hyps;
+    std::vector<int> descriptor_settings{n_species, 3, 3};
+    ps_norm = B2_Norm("chebyshev", "cosine", radial_hyps, cutoff_hyps,
+                      descriptor_settings);
+    dc.push_back(&ps_norm);
+  }
+
+  // Random coordinates drawn uniformly from [-scale, scale].
+  Eigen::MatrixXd random_positions(int n, double scale) {
+    std::uniform_real_distribution<double> distribution(-scale, scale);
+    Eigen::MatrixXd random(n, 3);
+    for (int i = 0; i < n; i++) {
+      for (int k = 0; k < 3; k++) {
+        random(i, k) = distribution(generator);
+      }
+    }
+    return random;
+  }
+};
+
+// Check that two structures have the same neighbor lists and descriptors.
+// Neighbors may be stored in a different order, so sorted (index, x, y, z)
+// tuples are compared.
+static void expect_same_neighbors(const Structure &struc1,
+                                  const Structure &struc2) {
+  EXPECT_EQ(struc1.n_neighbors, struc2.n_neighbors);
+
+  for (int i = 0; i < struc1.noa; i++) {
+    EXPECT_EQ(struc1.neighbor_count(i), struc2.neighbor_count(i));
+    EXPECT_EQ(struc1.cumulative_neighbor_count(i + 1),
+              struc2.cumulative_neighbor_count(i + 1));
+
+    std::vector<std::vector<double>> neigh1, neigh2;
+    for (int j = 0; j < struc1.neighbor_count(i); j++) {
+      int n1 = struc1.cumulative_neighbor_count(i) + j;
+      neigh1.push_back({(double)struc1.structure_indices(n1),
+                        struc1.relative_positions(n1, 1),
+                        struc1.relative_positions(n1, 2),
+                        struc1.relative_positions(n1, 3)});
+    }
+    for (int j = 0; j < struc2.neighbor_count(i); j++) {
+      int n2 = struc2.cumulative_neighbor_count(i) + j;
+      neigh2.push_back({(double)struc2.structure_indices(n2),
+                        struc2.relative_positions(n2, 1),
+                        struc2.relative_positions(n2, 2),
+                        struc2.relative_positions(n2, 3)});
+      EXPECT_EQ(struc2.neighbor_species(n2),
+                struc2.species[struc2.structure_indices(n2)]);
+    }
+    std::sort(neigh1.begin(), neigh1.end());
+    std::sort(neigh2.begin(), neigh2.end());
+    for (int j = 0; j < std::min(neigh1.size(), neigh2.size()); j++) {
+      for (int k = 0; k < 4; k++) {
+        EXPECT_NEAR(neigh1[j][k], neigh2[j][k], 1e-10);
+      }
+    }
+  }
+
+  // Descriptors should agree up to summation order.
+  Eigen::MatrixXd desc1 = struc1.descriptors[0].descriptors[0];
+  Eigen::MatrixXd desc2 = struc2.descriptors[0].descriptors[0];
+  EXPECT_LE((desc1 - desc2).cwiseAbs().maxCoeff(), 1e-10);
+}
+
+TEST_F(NeighborTest, CellListNeighbors) {
+  // Check that the cell list reproduces the brute force neighbor lists, both
+  // in a large cell and in a small triclinic cell that requires several
+  // periodic images.
+  Eigen::MatrixXd small_cell(3, 3);
+  small_cell << 3.0, 0.0, 0.0, 1.2, 2.8, 0.0, 0.5, -0.7, 3.3;
+  Eigen::MatrixXd small_positions = random_positions(n_atoms, 2);
+
+  expect_same_neighbors(
+      Structure(cell, species, positions, cutoff, dc, "brute_force"),
+      Structure(cell, species, positions, cutoff, dc, "cell_list"));
+  expect_same_neighbors(
+      Structure(small_cell, species, small_positions, cutoff, dc,
+                "brute_force"),
+      Structure(small_cell, species, small_positions, cutoff, dc,
+                "cell_list"));
+}
+
+TEST_F(NeighborTest, UpdatePositions) {
+  // Moving the atoms of a structure with a Verlet list should give the same
+  // neighbors and descriptors as building the structure from scratch.
+  double skin = 1.0;
+  std::vector<std::string> methods{"brute_force", "cell_list"};
+  for (int m = 0; m < methods.size(); m++) {
+    Structure struc(cell, species, positions, cutoff, dc, methods[m], skin);
+    expect_same_neighbors(Structure(cell, species, positions, cutoff, dc),
+                          struc);
+
+    // Small displacements reuse the Verlet list.
+    Eigen::MatrixXd small_step =
+        positions + random_positions(n_atoms, skin / 4);
+    struc.update_positions(small_step);
+    EXPECT_EQ(struc.verlet_positions, positions);
+    expect_same_neighbors(Structure(cell, species, small_step, cutoff, dc),
+                          struc);
+
+    // Large displacements trigger a rebuild.
+    Eigen::MatrixXd large_step = small_step;
+    large_step.row(0) += Eigen::RowVector3d(skin, 0, 0);
+    struc.update_positions(large_step);
+    EXPECT_EQ(struc.verlet_positions, large_step);
+    expect_same_neighbors(Structure(cell, species, large_step, cutoff, dc),
+                          struc);
+  }
+}
+
+// Peak resident set size of the process in MB.
+static double peak_memory_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024. * 1024.);
+#else
+  return usage.ru_maxrss / 1024.;
+#endif
+}
+
+TEST_F(NeighborTest, NeighborMemory) {
+  // A dilute structure with many atoms. Scratch memory proportional to
+  // noa * noa * sweep_no candidate pairs would take several GB here, while
+  // the neighbor lists themselves take well under 1 MB.
+  int n_big = 1500;
+  double big_cell_size = 60;
+  Eigen::MatrixXd big_cell = Eigen::MatrixXd::Identity(3, 3) * big_cell_size;
+  Eigen::MatrixXd big_positions = random_positions(n_big, big_cell_size / 2);
+  std::vector<int> big_species(n_big, 0);
+  std::vector<Descriptor *> no_descriptors;
+
+  std::vector<std::string> methods{"brute_force", "cell_list"};
+  for (int m = 0; m < methods.size(); m++) {
+    double memory_before = peak_memory_mb();
+    Structure struc(big_cell, big_species, big_positions, cutoff,
+                    no_descriptors, methods[m]);
+    double memory_after = peak_memory_mb();
+
+    EXPECT_EQ(struc.sweep, 1);
+    EXPECT_EQ(struc.relative_positions.rows(), struc.n_neighbors);
+    EXPECT_EQ(struc.structure_indices.size(), struc.n_neighbors);
+    EXPECT_LE(memory_after - memory_before, 64);
+  }
+}
+
+TEST_F(NeighborTest, JsonSettings) {
+  // The neighbor settings survive a JSON round trip, and structures saved
+  // without them load with the defaults.
+  std::vector<double> radial_hyps{0, cutoff}, cutoff_hyps;
+  std::vector<int> descriptor_settings{n_species, 3, 3};
+  B2 b2("chebyshev", "cosine", radial_hyps, cutoff_hyps,
+        descriptor_settings);
+  Structure struc(cell, species, positions, cutoff, {&b2}, "cell_list", 0.5,
+                  true);
+  nlohmann::json j = struc;
+  Structure loaded = j;
+  EXPECT_EQ(loaded.neighbor_method, "cell_list");
+  EXPECT_EQ(loaded.skin, 0.5);
+  EXPECT_TRUE(loaded.prediction_only);
+  EXPECT_EQ(loaded.neighbor_count, struc.neighbor_count);
+
+  for (std::string key : {"neighbor_method", "skin", "prediction_only"})
+    j.erase(key);
+  Structure legacy = j;
+  EXPECT_EQ(legacy.neighbor_method, "brute_force");
+  EXPECT_EQ(legacy.skin, 0);
+  EXPECT_FALSE(legacy.prediction_only);
+  EXPECT_EQ(legacy.positions, struc.positions);
+  for (Descriptor *descriptor : loaded.descriptor_calculators)
+    delete descriptor;
+  for (Descriptor *descriptor : legacy.descriptor_calculators)
+    delete descriptor;
+}
@@ -17,6 +17,7 @@
 #include <chrono>
 #include <cmath>
 #include <iostream>
+#include <random>
 #include <stdlib.h>
 
 class StructureTest : public ::testing::Test {
@@ -96,3 +97,77 @@ public:
     kernel_3 = SquaredExponential(sigma, ls);
   }
 };
+
+/** Check that two matrices agree elementwise to a tolerance relative to the
+ * largest entry of B.
+ */
+inline void expect_close(const Eigen::MatrixXd &A, const Eigen::MatrixXd &B,
+                         double rel_tol) {
+  ASSERT_EQ(A.rows(), B.rows());
+  ASSERT_EQ(A.cols(), B.cols());
+  double tol = rel_tol * B.cwiseAbs().maxCoeff();
+  for (int i = 0; i < A.rows(); i++)
+    for (int j = 0; j < A.cols(); j++)
+      EXPECT_NEAR(A(i, j), B(i, j), tol);
+}
+
+/** Random labelled structures with a B2 descriptor for the sparse GP tests.
+ * The structures are drawn from a generator seeded by each test, which
+ * leaves rand() to the other tests.
+ */
+class SparseGPTest : public ::testing::Test {
+public:
+  std::mt19937 gen;
+  std::uniform_real_distribution<double> dist{0, 1};
+  Eigen::MatrixXd cell;
+  double cell_size, cutoff;
+  std::string neighbor_method = "brute_force";
+  std::vector<double> radial_hyps, cutoff_hyps;
+  std::vector<int> descriptor_settings;
+  B2 b2;
+
+  /** Seed the generator, make a cubic cell and build the B2 descriptor. The
+   * settings are {n_species, n_max, l_max}.
+   */
+  void init(int seed, double cell_size, double cutoff,
+            std::vector<int> settings = {2, 3, 2}) {
+    gen.seed(seed);
+    this->cell_size = cell_size;
+    this->cutoff = cutoff;
+    cell = Eigen::MatrixXd::Identity(3, 3) * cell_size;
+    radial_hyps = {0, cutoff};
+    descriptor_settings = settings;
+    b2 = B2("chebyshev", "quadratic", radial_hyps, cutoff_hyps,
+            descriptor_settings);
+  }
+
+  /** Structures of n_atoms atoms at random positions in the cell, with the
+   * species alternating. Each has a random energy, forces and stresses.
+   */
+  std::vector<Structure>
+  make_structures(int n_strucs, int n_atoms,
+                  std::vector<Descriptor *> calculators) {
+    std::vector<int> species;
+    for (int i = 0; i < n_atoms; i++)
+      species.push_back(i % descriptor_settings[0]);
+
+    std::vector<Structure> strucs;
+    for (int n = 0; n < n_strucs; n++) {
+      Eigen::MatrixXd positions(n_atoms, 3);
+      for (int i = 0; i < n_atoms; i++)
+        for (int k = 0; k < 3; k++)
+          positions(i, k) = cell_size * dist(gen);
+      Structure struc(cell, species, positions, cutoff, calculators,
+                      neighbor_method);
+      struc.energy = Eigen::VectorXd::Constant(1, dist(gen));
+      struc.forces = Eigen::VectorXd(3 * n_atoms);
+      for (int i = 0; i < 3 * n_atoms; i++)
+        struc.forces(i) = dist(gen);
+      struc.stresses = Eigen::VectorXd(6);
+      for (int i = 0; i < 6; i++)
+        struc.stresses(i) = dist(gen);
+      strucs.push_back(struc);
+    }
+    return strucs;
+  }
+};
@@ -274,3 +274,32 @@ TEST_F(YGradTest, AdditionTest) {
     count += m_no;
   }
 }
+
+TEST_F(YGradTest, BatchTest) {
+  // Check that the batched spherical harmonics match the scalar ones. The
+  // number of vectors isn't a multiple of the SIMD width, so that the partial
+  // pack is tested.
+  int n = 11;
+  Eigen::VectorXd xs(n), ys(n), zs(n);
+  for (int i = 0; i < n; i++) {
+    xs(i) = x + 0.37 * i;
+    ys(i) = y - 1.21 * i;
+    zs(i) = z * cos(i);
+  }
+
+  Eigen::MatrixXd Y, Yx, Yy, Yz;
+  get_Y_batch(Y, Yx, Yy, Yz, xs, ys, zs, l);
+  EXPECT_EQ(Y.rows(), n);
+  EXPECT_EQ(Y.cols(), sz);
+
+  double tol = 1e-12;
+  for (int i = 0; i < n; i++) {
+    get_Y(Y1, Y2, Y3, Y4, xs(i), ys(i), zs(i), l);
+    for (int m = 0; m < sz; m++) {
+      EXPECT_NEAR(Y(i, m), Y1[m], tol * (1 + abs(Y1[m])));
+      EXPECT_NEAR(Yx(i, m), Y2[m], tol * (1 + abs(Y2[m])));
+      EXPECT_NEAR(Yy(i, m), Y3[m], tol * (1 + abs(Y3[m])));
+      EXPECT_NEAR(Yz(i, m), Y4[m], tol * (1 + abs(Y4[m])));
+    }
+  }
+}
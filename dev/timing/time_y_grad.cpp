@@ -0,0 +1,67 @@
+#include <chrono>
+#include <iostream>
+#include <cmath>
+#include <vector>
+
+#include "simd.h"
+#include "y_grad.h"
+
+using namespace std;
+
+// Compares the scalar and batched spherical harmonics for a neighbor list of
+// typical size.
+int main(){
+    int n_neighbors = 64;
+    int lmax = 6;
+    int number_of_harmonics = (lmax + 1) * (lmax + 1);
+    int reps = 20000;
+
+    // Choose arbitrary neighbor positions.
+    vector<double> x(n_neighbors), y(n_neighbors), z(n_neighbors);
+    for (int i = 0; i < n_neighbors; i++) {
+        x[i] = 2.19 + sin(i);
+        y[i] = 1.23 - cos(2 * i);
+        z[i] = -0.24 + 0.1 * i;
+    }
+
+    // Time the scalar path, one neighbor at a time.
+    vector<double> h = vector<double>(number_of_harmonics, 0);
+    vector<double> hx = vector<double>(number_of_harmonics, 0);
+    vector<double> hy = vector<double>(number_of_harmonics, 0);
+    vector<double> hz = vector<double>(number_of_harmonics, 0);
+    double check = 0;
+
+    auto t1 = chrono::high_resolution_clock::now();
+    for (int n = 0; n < reps; n++){
+        for (int i = 0; i < n_neighbors; i++){
+            get_Y(h, hx, hy, hz, x[i], y[i], z[i], lmax);
+            check += h[number_of_harmonics - 1];
+        }
+    }
+    auto t2 = chrono::high_resolution_clock::now();
+    double scalar_time =
+        (double) chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+
+    // Time the batched path.
+    int batch_size = number_of_harmonics * n_neighbors;
+    vector<double> Y(batch_size), Yx(batch_size), Yy(batch_size),
+        Yz(batch_size);
+
+    t1 = chrono::high_resolution_clock::now();
+    for (int n = 0; n < reps; n++){
+        get_Y_batch(Y.data(), Yx.data(), Yy.data(), Yz.data(), x.data(),
+                    y.data(), z.data(), n_neighbors, n_neighbors, lmax);
+        check -= Y[batch_size - 1];
+    }
+    t2 = chrono::high_resolution_clock::now();
+    double batch_time =
+        (double) chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+
+    cout << "SIMD width: " << SimdDouble::width << endl;
+    cout << "scalar get_Y took " << scalar_time / reps
+         << " microseconds per neighbor list" << endl;
+    cout << "batched get_Y took " << batch_time / reps
+         << " microseconds per neighbor list" << endl;
+    cout << "speedup: " << scalar_time / batch_time << endl;
+    cout << "(checksum " << check << ")" << endl;
+}
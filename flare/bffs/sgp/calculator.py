@@ -17,13 +17,24 @@ class SGP_Calculator(Calculator):
 
     implemented_properties = ["energy", "forces", "stress", "stds"]
 
-    def __init__(self, sgp_model, use_mapping=False):
+    def __init__(
+        self, sgp_model, use_mapping=False, skin=0.0, neighbor_method="brute_force"
+    ):
         super().__init__()
         self.gp_model = sgp_model
         self.results = {}
         self.use_mapping = use_mapping
         self.mgp_model = None
 
+        # If the skin is positive, the structure of the previous call is
+        # kept and its Verlet neighbor list is reused when only the positions
+        # have changed.
+        self.skin = skin
+        self._structure = None
+
+        # Neighbor search of the structures, "brute_force" or "cell_list".
+        self.neighbor_method = neighbor_method
+
     # TODO: Figure out why this is called twice per MD step.
     def calculate(self, atoms=None, properties=None, system_changes=all_changes):
         """
@@ -44,16 +55,47 @@ class SGP_Calculator(Calculator):
             coded_species.append(self.gp_model.species_map[spec])
 
         # Create structure descriptor.
-        structure_descriptor = Structure(
-            atoms.cell,
-            coded_species,
-            atoms.positions,
-            self.gp_model.cutoff,
-            self.gp_model.descriptor_calculators,
-        )
+        if self.skin > 0:
+            structure_descriptor = self.get_structure(atoms, coded_species)
+        else:
+            structure_descriptor = Structure(
+                atoms.cell,
+                coded_species,
+                atoms.positions,
+                self.gp_model.cutoff,
+                self.gp_model.descriptor_calculators,
+                self.neighbor_method,
+            )
 
         self.predict_on_structure(structure_descriptor)
 
+    def get_structure(self, atoms, coded_species):
+        """
+        Return a structure descriptor for the atoms, updating the positions
+        of the previous structure if the cell and species are unchanged.
+        """
+
+        struc = self._structure
+        if (
+            struc is not None
+            and struc.species == coded_species
+            and np.array_equal(struc.cell, np.array(atoms.cell))
+        ):
+            struc.update_positions(atoms.positions)
+        else:
+            struc = Structure(
+                atoms.cell,
+                coded_species,
+                atoms.positions,
+                self.gp_model.cutoff,
+                self.gp_model.descriptor_calculators,
+                self.neighbor_method,
+                self.skin,
+            )
+            self._structure = struc
+
+        return struc
+
     def predict_on_structure(self, structure_descriptor):
         # Predict on structure.
         if self.gp_model.variance_type == "SOR":
@@ -138,6 +180,7 @@ class SGP_Calculator(Calculator):
         out_dict["class"] = self.__class__.__name__
         out_dict["gp_model"] = self.gp_model.as_dict()
         out_dict.pop("atoms")
+        out_dict.pop("_structure", None)
 
         if "get_spin_polarized" in out_dict:
             out_dict.pop("get_spin_polarized")
@@ -147,7 +190,12 @@ class SGP_Calculator(Calculator):
     @staticmethod
     def from_dict(dct):
         sgp, _ = SGP_Wrapper.from_dict(dct["gp_model"])
-        calc = SGP_Calculator(sgp, use_mapping=dct["use_mapping"])
+        calc = SGP_Calculator(
+            sgp,
+            use_mapping=dct["use_mapping"],
+            skin=dct.get("skin", 0.0),
+            neighbor_method=dct.get("neighbor_method", "brute_force"),
+        )
         calc.results = dct["results"]
         return calc
 
@@ -162,28 +210,44 @@ class SGP_Calculator(Calculator):
         with open(name, "r") as f:
             gp_dict = json.loads(f.readline())
         sgp, kernels = SGP_Wrapper.from_dict(gp_dict["gp_model"])
-        calc = SGP_Calculator(sgp, use_mapping=gp_dict["use_mapping"])
+        calc = SGP_Calculator(
+            sgp,
+            use_mapping=gp_dict["use_mapping"],
+            skin=gp_dict.get("skin", 0.0),
+            neighbor_method=gp_dict.get("neighbor_method", "brute_force"),
+        )
 
         return calc, kernels
 
     def build_map(
-        self, filename="lmp.flare", contributor="user", map_uncertainty=False
+        self,
+        filename="lmp.flare",
+        contributor="user",
+        map_uncertainty=False,
+        compression_tolerance=None,
+        binary=False,
     ):
-        # write potential file for lammps
-        self.gp_model.sparse_gp.write_mapping_coefficients(filename, contributor, 0)
+        # write potential file for lammps, keeping the compression errors
+        compression = self.gp_model.write_mapping_coefficients(
+            filename, contributor, 0, compression_tolerance, binary
+        )
 
         # write uncertainty file(s)
         if map_uncertainty:
             self.gp_model.write_varmap_coefficients(
-                f"map_unc_{filename}", contributor, 0
+                f"map_unc_{filename}", contributor, 0, binary
             )
         else:
             # write L_inv and sparse descriptors for variance in lammps
-            self.gp_model.sparse_gp.write_L_inverse(f"L_inv_{filename}", contributor)
+            self.gp_model.sparse_gp.write_L_inverse(
+                f"L_inv_{filename}", contributor, binary
+            )
             self.gp_model.sparse_gp.write_sparse_descriptors(
-                f"sparse_desc_{filename}", contributor
+                f"sparse_desc_{filename}", contributor, binary
             )
 
+        return compression
+
 
 def sort_variances(structure_descriptor, variances):
     # Check that the variance length matches the number of atoms.
@@ -1,7 +1,7 @@
 import json
 from time import time
 import numpy as np
-from scipy.optimize import minimize
+from scipy.optimize import minimize, OptimizeResult
 from typing import List
 import warnings
 from ase import Atoms
@@ -9,7 +9,14 @@ from flare.atoms import FLARE_Atoms
 from flare.utils import NumpyEncoder
 
 try:
-    from ._C_flare import SparseGP, Structure, NormalizedDotProduct, B2, DotProduct
+    from ._C_flare import (
+        SparseGP,
+        Structure,
+        NormalizedDotProduct,
+        B2,
+        DotProduct,
+        compute_structures,
+    )
 except Exception as e:
     warnings.warn(f"Cannot import _C_flare: {e.__class__.__name__}: {e}")
 
@@ -151,6 +158,7 @@ class SGP_Wrapper:
             "cutoff_hyps": b2_calc.cutoff_hyps,
             "descriptor_settings": b2_calc.descriptor_settings,
             "cutoffs": b2_calc.cutoffs,
+            "b2_gemm": b2_calc.b2_gemm,
         }
         out_dict["descriptor_calculators"] = [b2_dict]
 
@@ -243,6 +251,7 @@ class SGP_Wrapper:
             b2_dict["descriptor_settings"],
             b2_dict["cutoffs"],
         )
+        calc.b2_gemm = b2_dict.get("b2_gemm", True)
 
         # change the keys of single_atom_energies and species_map to int
         if in_dict["single_atom_energies"] is not None:
@@ -270,30 +279,36 @@ class SGP_Wrapper:
         )
         gp.sparse_gp.Kuu_jitter = in_dict["Kuu_jitter"]
 
-        # update db
+        # update db, adding all training structures in one batch
         training_data = in_dict["training_structures"]
+        strucs, custom_ranges, energies, atom_indices = [], [], [], []
+        rel_e_noise, rel_f_noise, rel_s_noise = [], [], []
         for s in range(len(training_data)):
-            custom_range = in_dict["sparse_indice"][0][s]
+            custom_ranges.append(in_dict["sparse_indice"][0][s])
             train_struc = FLARE_Atoms.from_dict(training_data[s])
+            strucs.append(train_struc)
             if "atom_indices" in in_dict:
-                atom_indices = in_dict["atom_indices"][s]
+                atom_indices.append(in_dict["atom_indices"][s])
             else:
-                atom_indices = [-1]
+                atom_indices.append([-1])
 
             if len(train_struc.energy) > 0:
-                energy = train_struc.energy[0]
+                energies.append(train_struc.energy[0])
             else:
-                energy = None
+                energies.append(None)
 
             rel_efs_noise = train_struc.info.get("rel_efs_noise", [1, 1, 1])
-            rel_e_noise, rel_f_noise, rel_s_noise = rel_efs_noise
+            rel_e_noise.append(rel_efs_noise[0])
+            rel_f_noise.append(rel_efs_noise[1])
+            rel_s_noise.append(rel_efs_noise[2])
 
+        if strucs:
             gp.update_db(
-                train_struc,
-                train_struc.forces,
-                custom_range=custom_range,
-                energy=energy,
-                stress=train_struc.stress,
+                strucs,
+                [struc.forces for struc in strucs],
+                custom_range=custom_ranges,
+                energy=energies,
+                stress=[struc.stress for struc in strucs],
                 mode="specific",
                 sgp=None,
                 update_qr=False,
@@ -327,53 +342,147 @@ class SGP_Wrapper:
         rel_f_noise: float = 1,
         rel_s_noise: float = 1,
     ):
+        """Add a structure, or a list of structures, to the training set.
 
-        # Convert coded species to 0, 1, 2, etc.
-        if isinstance(structure, (Atoms, FLARE_Atoms)):
-            coded_species = []
-            for spec in structure.numbers:
-                coded_species.append(self.species_map[spec])
-        elif isinstance(structure, Structure):
-            coded_species = structure.species
+        For a list of structures, forces, custom_range, energy, stress,
+        atom_indices and the relative noises are given per structure. Left
+        at their defaults, they apply to every structure. The structures are
+        added to the sparse GP in one batch, and in mode="specific" the
+        sparse environments are added in one batch as well.
+        """
+
+        if isinstance(structure, (list, tuple)):
+            n_strucs = len(structure)
+            structures = list(structure)
+
+            def per_structure(value, item_is_scalar):
+                # A value given once applies to every structure.
+                if value is None or np.isscalar(value):
+                    return [value] * n_strucs
+                if not item_is_scalar and (
+                    len(value) == 0 or np.isscalar(value[0])
+                ):
+                    return [value] * n_strucs
+                return list(value)
+
+            forces = per_structure(forces, False)
+            custom_range = per_structure(custom_range, False)
+            energy = per_structure(energy, True)
+            stress = per_structure(stress, False)
+            atom_indices = per_structure(atom_indices, False)
+            rel_e_noise = per_structure(rel_e_noise, True)
+            rel_f_noise = per_structure(rel_f_noise, True)
+            rel_s_noise = per_structure(rel_s_noise, True)
         else:
-            raise Exception
-
-        # Convert flare structure to structure descriptor.
-        structure_descriptor = Structure(
-            structure.cell,
-            coded_species,
-            structure.positions,
-            self.cutoff,
-            self.descriptor_calculators,
+            structures = [structure]
+            forces = [forces]
+            custom_range = [custom_range]
+            energy = [energy]
+            stress = [stress]
+            atom_indices = [atom_indices]
+            rel_e_noise = [rel_e_noise]
+            rel_f_noise = [rel_f_noise]
+            rel_s_noise = [rel_s_noise]
+
+        structure_descriptors = self.get_structure_descriptors(
+            structures, forces, energy, stress
         )
 
-        # Add labels to structure descriptor.
-        if (energy is not None) and (self.energy_training):
-            # Sum up single atom energies.
-            single_atom_sum = 0
-            if self.single_atom_energies is not None:
-                for spec in coded_species:
-                    single_atom_sum += self.single_atom_energies[spec]
+        # Update the sparse GP.
+        if sgp is None:
+            sgp = self.sparse_gp
+            self.atom_indices += atom_indices
+
+        if mode == "specific":
+            sgp.add_training_structures(
+                structure_descriptors,
+                atom_indices,
+                rel_e_noise,
+                rel_f_noise,
+                rel_s_noise,
+            )
+
+            if any(len(r) == 0 for r in custom_range):
+                warnings.warn(
+                    "The mode='specific' but no custom_range is given, will not add sparse envs"
+                )
+            added = [s for s in range(len(structures)) if len(custom_range[s]) > 0]
+            if added:
+                sgp.add_specific_environments(
+                    [structure_descriptors[s] for s in added],
+                    [custom_range[s] for s in added],
+                )
+        else:
+            # The other modes choose environments given the current sparse
+            # set, so each structure is added in turn.
+            for s in range(len(structures)):
+                sgp.add_training_structure(
+                    structure_descriptors[s],
+                    atom_indices[s],
+                    rel_e_noise[s],
+                    rel_f_noise[s],
+                    rel_s_noise[s],
+                )
+                self.add_environments(
+                    sgp, structure_descriptors[s], custom_range[s], mode
+                )
 
-            # Correct the energy label and assign to structure.
-            corrected_energy = energy - single_atom_sum
-            structure_descriptor.energy = np.array([[corrected_energy]])
+        for noise in zip(rel_e_noise, rel_f_noise, rel_s_noise):
+            self.rel_efs_noise.append(list(noise))
 
-        if (forces is not None) and (self.force_training):
-            structure_descriptor.forces = forces.reshape(-1)
+        if update_qr:
+            sgp.update_matrices_QR()
 
-        if (stress is not None) and (self.stress_training):
-            structure_descriptor.stresses = stress
+    def get_structure_descriptors(self, structures, forces, energy, stress):
+        """Compute the descriptors of a list of structures, in parallel and
+        without the GIL, and attach their labels."""
 
-        # Update the sparse GP.
-        if sgp is None:
-            sgp = self.sparse_gp
-            self.atom_indices.append(atom_indices)
+        # Convert coded species to 0, 1, 2, etc.
+        frames = []
+        for structure in structures:
+            if isinstance(structure, (Atoms, FLARE_Atoms)):
+                coded_species = []
+                for spec in structure.numbers:
+                    coded_species.append(self.species_map[spec])
+            elif isinstance(structure, Structure):
+                coded_species = structure.species
+            else:
+                raise Exception
+            frames.append(
+                (np.array(structure.cell), coded_species, structure.positions)
+            )
 
-        sgp.add_training_structure(
-            structure_descriptor, atom_indices, rel_e_noise, rel_f_noise, rel_s_noise
+        # Convert flare structures to structure descriptors.
+        structure_descriptors = compute_structures(
+            frames, self.cutoff, self.descriptor_calculators
         )
-        self.rel_efs_noise.append([rel_e_noise, rel_f_noise, rel_s_noise])
+
+        # Add labels to structure descriptors.
+        for s, structure_descriptor in enumerate(structure_descriptors):
+            coded_species = frames[s][1]
+            if (energy[s] is not None) and (self.energy_training):
+                # Sum up single atom energies.
+                single_atom_sum = 0
+                if self.single_atom_energies is not None:
+                    for spec in coded_species:
+                        single_atom_sum += self.single_atom_energies[spec]
+
+                # Correct the energy label and assign to structure.
+                corrected_energy = energy[s] - single_atom_sum
+                structure_descriptor.energy = np.array([[corrected_energy]])
+
+            if (forces[s] is not None) and (self.force_training):
+                structure_descriptor.forces = forces[s].reshape(-1)
+
+            if (stress[s] is not None) and (self.stress_training):
+                structure_descriptor.stresses = stress[s]
+
+        return structure_descriptors
+
+    @staticmethod
+    def add_environments(sgp, structure_descriptor, custom_range, mode):
+        """Add the sparse environments of one structure in the given mode."""
+
         if mode == "all":
             if not custom_range:
                 sgp.add_all_environments(structure_descriptor)
@@ -387,13 +496,6 @@ class SGP_Wrapper:
                 raise Exception(
                     "The custom_range should be set as [n_added] if mode='uncertain'"
                 )
-        elif mode == "specific":
-            if len(custom_range) == 0:
-                warnings.warn(
-                    "The mode='specific' but no custom_range is given, will not add sparse envs"
-                )
-            else:
-                sgp.add_specific_environments(structure_descriptor, custom_range)
         elif mode == "random":
             if len(custom_range) == 1:  # custom_range gives n_added
                 n_added = custom_range
@@ -405,9 +507,6 @@ class SGP_Wrapper:
         else:
             raise NotImplementedError
 
-        if update_qr:
-            sgp.update_matrices_QR()
-
     def set_L_alpha(self):
         # Taken care of in the update_db method.
         pass
@@ -420,10 +519,35 @@ class SGP_Wrapper:
             bounds=self.bounds,
         )
 
-    def write_mapping_coefficients(self, filename, contributor, kernel_idx):
-        self.sparse_gp.write_mapping_coefficients(filename, contributor, kernel_idx)
+    def write_mapping_coefficients(
+        self,
+        filename,
+        contributor,
+        kernel_idx,
+        compression_tolerance=None,
+        binary=False,
+    ):
+        """Write the mapping coefficients for pair_style flare. With a
+        compression_tolerance, the power 2 beta matrices are stored as their
+        eigenpairs of magnitude above the tolerance, and a MappingCompression
+        with the rank and the energy (per atom) and force errors this induces
+        on the training set is returned. With binary=True the file is written in the binary
+        format, which LAMMPS maps into memory instead of parsing."""
+
+        if compression_tolerance is None:
+            self.sparse_gp.write_mapping_coefficients(
+                filename, contributor, kernel_idx, binary
+            )
+            return None
 
-    def write_varmap_coefficients(self, filename, contributor, kernel_idx):
+        compression = self.sparse_gp.write_compressed_mapping_coefficients(
+            filename, contributor, kernel_idx, compression_tolerance, binary
+        )
+        return compression
+
+    def write_varmap_coefficients(
+        self, filename, contributor, kernel_idx, binary=False
+    ):
         old_kernels = self.sparse_gp.kernels
         assert (len(old_kernels) == 1) and (
             kernel_idx == 0
@@ -488,7 +612,9 @@ class SGP_Wrapper:
         new_kernels = self.sgp_var.kernels
         print("Map with current sgp_var")
 
-        self.sgp_var.write_varmap_coefficients(filename, contributor, kernel_idx)
+        self.sgp_var.write_varmap_coefficients(
+            filename, contributor, kernel_idx, binary
+        )
 
         return new_kernels
 
@@ -634,6 +760,32 @@ def optimize_hyperparameters(
 ):
     """Optimize the hyperparameters of a sparse GP model."""
 
+    # The native optimizers run in C++ without Python callbacks.
+    if method in ("native-L-BFGS-B", "native-L-BFGS-B-log"):
+        if bounds is None:
+            bounds_array = np.zeros((0, 2))
+        else:
+            bounds_array = np.array(
+                [
+                    [-np.inf if lo is None else lo, np.inf if hi is None else hi]
+                    for lo, hi in bounds
+                ],
+                dtype=float,
+            )
+
+        likelihood = sparse_gp.optimize_hyperparameters(
+            method=method[len("native-") :],
+            max_iterations=max_iterations,
+            bounds=bounds_array,
+            gradient_tolerance=gradient_tolerance,
+        )
+
+        return OptimizeResult(
+            x=sparse_gp.hyperparameters,
+            fun=-likelihood,
+            jac=-sparse_gp.likelihood_gradient,
+        )
+
     initial_guess = sparse_gp.hyperparameters
     precompute = True
     for kern in sparse_gp.kernels:
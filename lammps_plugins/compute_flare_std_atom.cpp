@@ -13,10 +13,12 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <omp.h>
 
 // flare++ modules
+#include "coeff_file.h"
 #include "cutoffs.h"
 #include "lammps_descriptor.h"
 #include "radial.h"
@@ -90,6 +92,25 @@ void ComputeFlareStdAtom::init_list(int /*id*/, NeighList *ptr)
 }
 
 
+/* ----------------------------------------------------------------------
+   squared norm of L * k, with the lower triangular L packed row by row and
+   the entries of k before index first equal to zero
+------------------------------------------------------------------------- */
+
+static double packed_lower_squared_norm(const Eigen::VectorXd &L,
+                                        const Eigen::VectorXd &k, int first) {
+  int n = k.size();
+  double norm = 0;
+  for (int j = first; j < n; j++) {
+    const double *row = L.data() + (long)j * (j + 1) / 2;
+    double val = 0;
+    for (int m = first; m <= j; m++)
+      val += row[m] * k(m);
+    norm += val * val;
+  }
+  return norm;
+}
+
 /* ---------------------------------------------------------------------- */
 
 void ComputeFlareStdAtom::compute_peratom() {
@@ -118,54 +139,38 @@ void ComputeFlareStdAtom::compute_peratom() {
 
 #pragma omp parallel
 {
-  double delx, dely, delz, xtmp, ytmp, ztmp, rsq;
-  int *ilist, *jlist, *numneigh, **firstneigh;
+  int *ilist, *numneigh, **firstneigh;
 
   int inum = list->inum;
   ilist = list->ilist;
   numneigh = list->numneigh;
   firstneigh = list->firstneigh;
 
-  int beta_init, beta_counter;
-  double B2_norm_squared, B2_val_1, B2_val_2;
+  double B2_norm_squared;
 
-  Eigen::VectorXd single_bond_vals, B2_vals, B2_env_dot, beta_p, partial_forces, u;
-  Eigen::MatrixXd single_bond_env_dervs, B2_env_dervs;
+  Eigen::VectorXd single_bond_vals, B2_vals, u;
+  Eigen::MatrixXd single_bond_env_dervs;
+  ShortNeighborList neighbors;
   double empty_thresh = 1e-8;
 
   #pragma omp for
   for (int ii = 0; ii < inum; ii++) {
     int i = ilist[ii];
-    int itype = type[i];
-    int jnum = numneigh[i];
-    xtmp = x[i][0];
-    ytmp = x[i][1];
-    ztmp = x[i][2];
-    jlist = firstneigh[i];
-
-    // Count the atoms inside the cutoff.
-    int n_inner = 0;
-    for (int jj = 0; jj < jnum; jj++) {
-      int j = jlist[jj];
-      int s = type[j] - 1;
-      double cutoff_val = cutoff_matrix(itype-1, s);
-
-      delx = x[j][0] - xtmp;
-      dely = x[j][1] - ytmp;
-      delz = x[j][2] - ztmp;
-      rsq = delx * delx + dely * dely + delz * delz;
-      if (rsq < (cutoff_val * cutoff_val)) {
-        n_inner++;
-      }
 
-    }
+    // Collect the atoms inside the cutoff.
+    neighbors.build(x, type, i, numneigh[i], firstneigh[i], cutoff_matrix);
 
     // Compute covariant descriptors.
-    single_bond_multiple_cutoffs(x, type, jnum, n_inner, i, xtmp, ytmp, ztmp,
-                                 jlist, basis_function, cutoff_function,
-                                 n_species, n_max, l_max, radial_hyps,
-                                 cutoff_hyps, single_bond_vals,
-                                 single_bond_env_dervs, cutoff_matrix);
+    if (single_bond_function != nullptr) {
+      single_bond_function(neighbors, n_species, n_max, l_max, radial_hyps,
+                           cutoff_hyps, single_bond_vals,
+                           single_bond_env_dervs);
+    } else {
+      single_bond_multiple_cutoffs(neighbors, basis_function, cutoff_function,
+                                   n_species, n_max, l_max, radial_hyps,
+                                   cutoff_hyps, single_bond_vals,
+                                   single_bond_env_dervs);
+    }
 
     // Compute invariant descriptors.
     B2_descriptor(B2_vals, B2_norm_squared,
@@ -182,16 +187,17 @@ void ComputeFlareStdAtom::compute_peratom() {
     if (use_map) {
       int power = 2;
       compute_energy_and_u(B2_vals, B2_norm_squared, single_bond_vals, power,
-              n_species, n_max, l_max, beta_matrices[itype - 1], u, &variance, normalized);
+              n_species, n_max, l_max, beta_matrices[type[i] - 1], u, &variance, normalized);
       variance /= sig2;
     } else {
       Eigen::VectorXd kernel_vec = Eigen::VectorXd::Zero(n_clusters);
       double K_self;
       double B2_norm = pow(B2_norm_squared, 0.5);
       Eigen::VectorXd normed_B2 = B2_vals / B2_norm;
-      int cum_types = 0;
+      int cum_types = 0, type_start = 0;
       for (int s = 0; s < n_types; s++) {
         if (type[i] - 1 == s) {
+          type_start = cum_types;
           if (normalized) {
             kernel_vec.segment(cum_types, n_clusters_by_type[s]) = (normed_sparse_descriptors[s] * normed_B2).array().pow(power);
             K_self = 1.0;
@@ -203,8 +209,8 @@ void ComputeFlareStdAtom::compute_peratom() {
         }
         cum_types += n_clusters_by_type[s];
       }
-      Eigen::VectorXd L_inv_kv = L_inv_blocks[0] * kernel_vec;
-      double Q_self = sig2 * L_inv_kv.transpose() * L_inv_kv;
+      double Q_self = sig2 * packed_lower_squared_norm(L_inv_blocks[0],
+                                                       kernel_vec, type_start);
 
       variance = K_self - Q_self;
     }
@@ -319,14 +325,15 @@ void ComputeFlareStdAtom::coeff(int narg, char **arg) {
    read potential values from a DYNAMO single element funcfl file
 ------------------------------------------------------------------------- */
 
-void ComputeFlareStdAtom::parse_cutoff_matrix(int n_species, FILE *fptr){
+void ComputeFlareStdAtom::parse_cutoff_matrix(int n_species,
+                                              CoeffFileReader *reader){
   int me = comm->me;
 
   // Parse the cutoffs.
   int n_cutoffs = n_species * n_species;
   memory->create(cutoffs, n_cutoffs, "compute:cutoffs");
   if (me == 0)
-    grab(fptr, n_cutoffs, cutoffs);
+    reader->grab(n_cutoffs, cutoffs);
   MPI_Bcast(cutoffs, n_cutoffs, MPI_DOUBLE, 0, world);
 
   // Create cutsq array (used in pair.cpp)
@@ -354,6 +361,7 @@ void ComputeFlareStdAtom::read_file(char *filename) {
   char line[MAXLINE], radial_string[MAXLINE], cutoff_string[MAXLINE], kernel_string[MAXLINE];
   int radial_string_length, cutoff_string_length, kernel_string_length;
   FILE *fptr;
+  std::unique_ptr<CoeffFileReader> reader;
 
   // Check that the potential file can be opened.
   if (me == 0) {
@@ -363,19 +371,22 @@ void ComputeFlareStdAtom::read_file(char *filename) {
       snprintf(str, 128, "Cannot open variance file %s", filename);
       error->one(FLERR, str);
     }
+    reader.reset(new CoeffFileReader(fptr, [this](const std::string &message) {
+      error->one(FLERR, message.c_str());
+    }));
   }
 
   if (me == 0) {
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
 
-    fgets(line, MAXLINE, fptr); // hyperparameters
+    reader->gets(line, MAXLINE); // hyperparameters
     sscanf(line, "%i", &n_hyps);
   }
 
   MPI_Bcast(&n_hyps, 1, MPI_INT, 0, world);
   hyperparameters = Eigen::VectorXd::Zero(n_hyps);
   if (me == 0) {
-    fgets(line, MAXLINE, fptr); // hyperparameters
+    reader->gets(line, MAXLINE); // hyperparameters
     double sig, en, fn, sn;
     sscanf(line, "%lg %lg %lg %lg", &sig, &en, &fn, &sn);
     hyperparameters(0) = sig;
@@ -383,16 +394,16 @@ void ComputeFlareStdAtom::read_file(char *filename) {
     hyperparameters(2) = fn;
     hyperparameters(3) = sn;
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", kernel_string); // kernel name
     kernel_string_length = strlen(kernel_string);
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", radial_string); // Radial basis set
     radial_string_length = strlen(radial_string);
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%i %i %i %i", &n_species, &n_max, &l_max, &beta_size);
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", cutoff_string); // Cutoff function
     cutoff_string_length = strlen(cutoff_string);
   }
@@ -411,7 +422,7 @@ void ComputeFlareStdAtom::read_file(char *filename) {
   MPI_Bcast(kernel_string, kernel_string_length + 1, MPI_CHAR, 0, world);
 
   // Parse the cutoffs and fill in the cutoff matrix
-  parse_cutoff_matrix(n_species, fptr);
+  parse_cutoff_matrix(n_species, reader.get());
 
   // Set number of descriptors.
   int n_radial = n_max * n_species;
@@ -434,6 +445,9 @@ void ComputeFlareStdAtom::read_file(char *filename) {
   else if (!strcmp(cutoff_string, "cosine"))
     cutoff_function = cos_cutoff;
 
+  // Select the single bond engine specialized on the basis and cutoff.
+  single_bond_function = set_lammps_single_bond(radial_string, cutoff_string);
+
   // Set the kernel
   if (!strcmp(kernel_string, "NormalizedDotProduct")) {
     normalized = true;
@@ -447,7 +461,7 @@ void ComputeFlareStdAtom::read_file(char *filename) {
 
   if (me == 0)
   //  grab(fptr, beta_size * n_species * n_species, beta);
-    grab(fptr, beta_size * n_species, beta);
+    reader->grab(beta_size * n_species, beta);
   //MPI_Bcast(beta, beta_size * n_species * n_species, MPI_DOUBLE, 0, world);
   MPI_Bcast(beta, beta_size * n_species, MPI_DOUBLE, 0, world);
 
@@ -478,6 +492,7 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
   char line[MAXLINE], radial_string[MAXLINE], cutoff_string[MAXLINE], kernel_string[MAXLINE];
   int radial_string_length, cutoff_string_length, kernel_string_length;
   FILE *fptr;
+  std::unique_ptr<CoeffFileReader> reader;
 
   // Check that the potential file can be opened.
   if (me == 0) {
@@ -487,17 +502,20 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
       snprintf(str, 128, "Cannot open variance file %s", filename);
       error->one(FLERR, str);
     }
+    reader.reset(new CoeffFileReader(fptr, [this](const std::string &message) {
+      error->one(FLERR, message.c_str());
+    }));
   }
 
   int tmp, nwords;
   if (me == 0) {
-    fgets(line, MAXLINE, fptr); // skip the first line
+    reader->gets(line, MAXLINE); // skip the first line
 
-    fgets(line, MAXLINE, fptr); // power
+    reader->gets(line, MAXLINE); // power
     sscanf(line, "%i %s", &power, kernel_string);
     kernel_string_length = strlen(kernel_string);
 
-    fgets(line, MAXLINE, fptr); // hyperparameters
+    reader->gets(line, MAXLINE); // hyperparameters
     sscanf(line, "%i", &n_hyps);
   }
   MPI_Bcast(&power, 1, MPI_INT, 0, world);
@@ -505,7 +523,7 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
 
   hyperparameters = Eigen::VectorXd::Zero(n_hyps);
   if (me == 0) {
-    fgets(line, MAXLINE, fptr); // hyperparameters
+    reader->gets(line, MAXLINE); // hyperparameters
     double sig, en, fn, sn;
     sscanf(line, "%lg %lg %lg %lg", &sig, &en, &fn, &sn);
     hyperparameters(0) = sig;
@@ -513,14 +531,14 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
     hyperparameters(2) = fn;
     hyperparameters(3) = sn;
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", radial_string); // Radial basis set
     radial_string_length = strlen(radial_string);
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%i %i %i %i", &n_species, &n_max, &l_max, &n_kernels);
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", cutoff_string); // Cutoff function
     cutoff_string_length = strlen(cutoff_string);
   }
@@ -539,11 +557,11 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
   MPI_Bcast(kernel_string, kernel_string_length + 1, MPI_CHAR, 0, world);
 
   // Parse the cutoffs and fill in the cutoff matrix
-  parse_cutoff_matrix(n_species, fptr);
+  parse_cutoff_matrix(n_species, reader.get());
 
   // Parse number of sparse envs
   if (me == 0) {
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%i", &n_clusters);
   }
   MPI_Bcast(&n_clusters, 1, MPI_INT, 0, world);
@@ -569,6 +587,9 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
   else if (!strcmp(cutoff_string, "cosine"))
     cutoff_function = cos_cutoff;
 
+  // Select the single bond engine specialized on the basis and cutoff.
+  single_bond_function = set_lammps_single_bond(radial_string, cutoff_string);
+
   // Set the kernel
   if (!strcmp(kernel_string, "NormalizedDotProduct")) {
     normalized = true;
@@ -579,20 +600,12 @@ void ComputeFlareStdAtom::read_L_inverse(char *filename) {
   // Parse the beta vectors.
   memory->create(beta, Linv_size, "compute:L_inv");
   if (me == 0)
-    grab(fptr, Linv_size, beta);
+    reader->grab(Linv_size, beta);
   MPI_Bcast(beta, Linv_size, MPI_DOUBLE, 0, world);
 
-  // Fill in the beta matrix.
+  // Keep the lower triangle packed.
   for (int i = 0; i < n_kernels; i++) {
-    int count = 0;
-    Eigen::MatrixXd Linv = Eigen::MatrixXd::Zero(n_clusters, n_clusters);
-    for (int j = 0; j < n_clusters; j++) {
-      for (int k = 0; k <= j; k++) {
-        Linv(j, k) = beta[count];
-        count++;
-      }
-    }
-    L_inv_blocks.push_back(Linv);
+    L_inv_blocks.push_back(Eigen::Map<Eigen::VectorXd>(beta, Linv_size));
   }
   memory->destroy(beta);
 }
@@ -602,6 +615,7 @@ void ComputeFlareStdAtom::read_sparse_descriptors(char *filename) {
   char line[MAXLINE], radial_string[MAXLINE], cutoff_string[MAXLINE];
   int radial_string_length, cutoff_string_length;
   FILE *fptr;
+  std::unique_ptr<CoeffFileReader> reader;
 
   // Check that the potential file can be opened.
   if (me == 0) {
@@ -611,13 +625,16 @@ void ComputeFlareStdAtom::read_sparse_descriptors(char *filename) {
       snprintf(str, 128, "Cannot open variance file %s", filename);
       error->one(FLERR, str);
     }
+    reader.reset(new CoeffFileReader(fptr, [this](const std::string &message) {
+      error->one(FLERR, message.c_str());
+    }));
   }
 
   int kernel_ind = 0;
   if (me == 0) {
-    fgets(line, MAXLINE, fptr); // skip the first line
+    reader->gets(line, MAXLINE); // skip the first line
 
-    fgets(line, MAXLINE, fptr); // hyperparameters
+    reader->gets(line, MAXLINE); // hyperparameters
     int n_kern = 0;
     sscanf(line, "%i", &n_kern);
     if (n_kern != n_kernels) {
@@ -627,7 +644,7 @@ void ComputeFlareStdAtom::read_sparse_descriptors(char *filename) {
 
   for (int i = 0; i < n_kernels; i++) {
     if (me == 0) {
-      fgets(line, MAXLINE, fptr);
+      reader->gets(line, MAXLINE);
       int n_clst = 0;
       sscanf(line, "%i %i %i", &kernel_ind, &n_clst, &n_types);
       if (n_clst != n_clusters) {
@@ -640,7 +657,7 @@ void ComputeFlareStdAtom::read_sparse_descriptors(char *filename) {
     for (int s = 0; s < n_types; s++) {
       int n_clst_by_type;
       if (me == 0) {
-        fgets(line, MAXLINE, fptr);
+        reader->gets(line, MAXLINE);
         sscanf(line, "%i", &n_clst_by_type);
       }
       MPI_Bcast(&n_clst_by_type, 1, MPI_INT, 0, world);
@@ -653,7 +670,7 @@ void ComputeFlareStdAtom::read_sparse_descriptors(char *filename) {
       // Parse the beta vectors.
       memory->create(beta, sparse_desc_size, "compute:sparse_desc");
       if (me == 0)
-        grab(fptr, sparse_desc_size, beta);
+        reader->grab(sparse_desc_size, beta);
       MPI_Bcast(beta, sparse_desc_size, MPI_DOUBLE, 0, world);
 
       // Fill in the beta matrix.
@@ -671,24 +688,3 @@ void ComputeFlareStdAtom::read_sparse_descriptors(char *filename) {
   }
 
 }
-
-
-/* ----------------------------------------------------------------------
-   grab n values from file fp and put them in list
-   values can be several to a line
-   only called by proc 0
-------------------------------------------------------------------------- */
-
-void ComputeFlareStdAtom::grab(FILE *fptr, int n, double *list) {
-  char *ptr;
-  char line[MAXLINE];
-
-  int i = 0;
-  while (i < n) {
-    fgets(line, MAXLINE, fptr);
-    ptr = strtok(line, " \t\n\r\f");
-    list[i++] = atof(ptr);
-    while ((ptr = strtok(NULL, " \t\n\r\f")))
-      list[i++] = atof(ptr);
-  }
-}
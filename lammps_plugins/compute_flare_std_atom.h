@@ -11,7 +11,9 @@ ComputeStyle(flare/std/atom, ComputeFlareStdAtom)
 #ifndef LMP_COMPUTE_FLARE_STD_ATOM_H
 #define LMP_COMPUTE_FLARE_STD_ATOM_H
 
+#include "coeff_file.h"
 #include "compute.h"
+#include "lammps_descriptor.h"
 #include <Eigen/Dense>
 #include <cstdio>
 #include <vector>
@@ -44,6 +46,7 @@ protected:
   std::function<void(std::vector<double> &, double, double,
                      std::vector<double>)>
       cutoff_function;
+  LammpsSingleBond::Function single_bond_function = nullptr;
 
   std::vector<double> radial_hyps, cutoff_hyps;
 
@@ -54,7 +57,9 @@ protected:
   std::vector<Eigen::MatrixXd> beta_matrices;
 
   Eigen::VectorXd hyperparameters;
-  std::vector<Eigen::MatrixXd> L_inv_blocks, normed_sparse_descriptors;
+  // Lower triangular L_inv blocks, packed row by row as in the file.
+  std::vector<Eigen::VectorXd> L_inv_blocks;
+  std::vector<Eigen::MatrixXd> normed_sparse_descriptors;
   int n_hyps, n_clusters, n_kernels, n_types;
   bool use_map = false, normalized;
   int power = 2;
@@ -62,10 +67,9 @@ protected:
 
   virtual void allocate();
   virtual void read_file(char *);
-  void parse_cutoff_matrix(int n_species, FILE *fptr);
+  void parse_cutoff_matrix(int n_species, CoeffFileReader *reader);
   void read_L_inverse(char *);
   void read_sparse_descriptors(char *);
-  void grab(FILE *, int, double *);
 
   virtual void coeff(int, char **);
 
@@ -24,7 +24,7 @@ do
     ln -s $(pwd)/$f $src/$f
 done
 
-for f in cutoffs radial y_grad
+for f in coeff_file cutoffs radial y_grad
 do
     for ex in cpp h
     do
@@ -32,8 +32,14 @@ do
     done
 done
 
+for f in simd single_bond
+do
+    ln -s $(pwd)/../src/flare_pp/$f.h $src/$f.h
+done
+
 echo '
 target_sources(lammps PRIVATE
+    ${LAMMPS_SOURCE_DIR}/coeff_file.cpp
     ${LAMMPS_SOURCE_DIR}/cutoffs.cpp
     ${LAMMPS_SOURCE_DIR}/lammps_descriptor.cpp
     ${LAMMPS_SOURCE_DIR}/radial.cpp
@@ -185,11 +185,13 @@ void PairFLAREKokkos<DeviceType>::compute(int eflag_in, int vflag_in)
     // Goal: First batch needs to be biggest to avoid extra allocs.
     {
       double beta_mem = n_species * n_descriptors * n_descriptors * 8;
+      if (beta_rank > 0) beta_mem = 2 * n_species * beta_rank * n_descriptors * 8;
       double neigh_mem = 1.0*n_atoms * max_neighs * 4;
       double lmp_atom_mem = ignum * (18 * 8 + 4 * 4); // 2xf, v, x, virial, tag, type, mask, image
       double mem_per_atom = 8 * (
           2*n_bond // single_bond, u
           + 3*n_descriptors // B2, betaB2, w
+          + beta_rank // projections
           + 2 // evdwls, B2_norm2s
           + 0.5 // numneigh_short
           + max_neighs * (
@@ -231,6 +233,10 @@ void PairFLAREKokkos<DeviceType>::compute(int eflag_in, int vflag_in)
         B2 = View2D(Kokkos::ViewAllocateWithoutInitializing("FLARE: B2"), batch_size, n_descriptors);
         beta_B2 = View2D();
         beta_B2 = View2D(Kokkos::ViewAllocateWithoutInitializing("FLARE: beta*B2"), batch_size, n_descriptors);
+        if (beta_rank > 0){
+          projections = View2D();
+          projections = View2D(Kokkos::ViewAllocateWithoutInitializing("FLARE: projections"), batch_size, beta_rank);
+        }
         B2_norm2s = View1D(); evdwls = View1D(); w = View2D();
         B2_norm2s = View1D(Kokkos::ViewAllocateWithoutInitializing("FLARE: B2_norm2s"), batch_size);
         evdwls = View1D(Kokkos::ViewAllocateWithoutInitializing("FLARE: evdwls"), batch_size);
@@ -299,7 +305,12 @@ void PairFLAREKokkos<DeviceType>::compute(int eflag_in, int vflag_in)
         );
 
         // compute beta*B2
-        if(n_species>0){
+        if(beta_rank > 0){
+          // beta = V^T diag(lambda) V, applied as two rank-r products
+          KokkosBlas::gemm("N", "T", 1.0, B2, Kokkos::subview(beta_vecs, curr_type, Kokkos::ALL(), Kokkos::ALL()), 0.0, projections);
+          KokkosBlas::gemm("N", "N", 1.0, projections, Kokkos::subview(beta_scaled_vecs, curr_type, Kokkos::ALL(), Kokkos::ALL()), 0.0, beta_B2);
+        }
+        else if(n_species>0){
           KokkosBlas::gemm("N", "T", 1.0, B2, Kokkos::subview(beta, curr_type, Kokkos::ALL(), Kokkos::ALL()), 0.0, beta_B2);
         }
         else{
@@ -732,17 +743,37 @@ void PairFLAREKokkos<DeviceType>::coeff(int narg, char **arg)
   n_bond = n_radial * n_harmonics;
   n_descriptors = (n_radial * (n_radial + 1) / 2) * (l_max + 1);
 
-  beta = Kokkos::View<F_FLOAT***, Kokkos::LayoutRight, typename DeviceType::memory_space>("beta", n_species, n_descriptors, n_descriptors);
-  auto beta_h = Kokkos::create_mirror_view(beta);
-  for(int s = 0; s < n_species; s++){
-    for(int i = 0; i < n_descriptors; i++){
-      for(int j = 0; j < n_descriptors; j++){
-        beta_h(s,i,j) = beta_matrices[s](i,j);
+  if(beta_rank > 0){
+    beta_vecs = View3D("beta_vecs", n_species, beta_rank, n_descriptors);
+    beta_scaled_vecs = View3D("beta_scaled_vecs", n_species, beta_rank, n_descriptors);
+    auto vecs_h = Kokkos::create_mirror_view(beta_vecs);
+    auto scaled_vecs_h = Kokkos::create_mirror_view(beta_scaled_vecs);
+    for(int s = 0; s < n_species; s++){
+      for(int k = 0; k < beta_rank; k++){
+        for(int i = 0; i < n_descriptors; i++){
+          vecs_h(s,k,i) = beta_eigenvectors[s](i,k);
+          scaled_vecs_h(s,k,i) = beta_eigenvalues[s](k)*beta_eigenvectors[s](i,k);
+        }
+      }
+    }
+    Kokkos::deep_copy(beta_vecs, vecs_h);
+    Kokkos::deep_copy(beta_scaled_vecs, scaled_vecs_h);
+    beta_eigenvectors.clear();
+    beta_eigenvalues.clear();
+  }
+  else{
+    beta = Kokkos::View<F_FLOAT***, Kokkos::LayoutRight, typename DeviceType::memory_space>("beta", n_species, n_descriptors, n_descriptors);
+    auto beta_h = Kokkos::create_mirror_view(beta);
+    for(int s = 0; s < n_species; s++){
+      for(int i = 0; i < n_descriptors; i++){
+        for(int j = 0; j < n_descriptors; j++){
+          beta_h(s,i,j) = beta_matrices[s](i,j);
+        }
       }
     }
+    Kokkos::deep_copy(beta, beta_h);
+    beta_matrices.clear();
   }
-  Kokkos::deep_copy(beta, beta_h);
-  beta_matrices.clear();
 
   cutoff_matrix_k = View2D("cutoff_matrix", n_species, n_species);
   auto cutoff_matrix_h = Kokkos::create_mirror_view(cutoff_matrix_k);
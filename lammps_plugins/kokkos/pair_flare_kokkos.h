@@ -132,8 +132,9 @@ class PairFLAREKokkos : public PairFLARE {
   int need_dup;
 
   View1D B2_norm2s, evdwls;
-  View2D B2, beta_B2, w, cutoff_matrix_k;
+  View2D B2, beta_B2, w, cutoff_matrix_k, projections;
   View3D beta, single_bond, u, partial_forces;
+  View3D beta_vecs, beta_scaled_vecs; // v_k and lambda_k v_k, if compressed
   gYView4D g, Y;
   gYView4DRA g_ra, Y_ra;
   View5D single_bond_grad;
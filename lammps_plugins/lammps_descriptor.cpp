@@ -1,109 +1,120 @@
 #include "lammps_descriptor.h"
 #include "radial.h"
+#include "single_bond.h"
 #include "y_grad.h"
 #include <cmath>
 #include <iostream>
 
-void single_bond_multiple_cutoffs(
-    double **x, int *type, int jnum, int n_inner, int i, double xtmp,
-    double ytmp, double ztmp, int *jlist,
-    std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
-        basis_function,
-    std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
-        cutoff_function,
-    int n_species, int N, int lmax,
-    const std::vector<double> &radial_hyps,
-    const std::vector<double> &cutoff_hyps, Eigen::VectorXd &single_bond_vals,
-    Eigen::MatrixXd &single_bond_env_dervs,
-    const Eigen::MatrixXd &cutoff_matrix) {
-
-  // Initialize basis vectors and spherical harmonics.
-  std::vector<double> g = std::vector<double>(N, 0);
-  std::vector<double> gx = std::vector<double>(N, 0);
-  std::vector<double> gy = std::vector<double>(N, 0);
-  std::vector<double> gz = std::vector<double>(N, 0);
+void ShortNeighborList::build(double **x, int *type, int i, int jnum,
+                              int *jlist,
+                              const Eigen::MatrixXd &cutoff_matrix) {
+  delx.clear();
+  dely.clear();
+  delz.clear();
+  r.clear();
+  rcut.clear();
+  species.clear();
+  index.clear();
 
-  int n_harmonics = (lmax + 1) * (lmax + 1);
-  std::vector<double> h = std::vector<double>(n_harmonics, 0);
-  std::vector<double> hx = std::vector<double>(n_harmonics, 0);
-  std::vector<double> hy = std::vector<double>(n_harmonics, 0);
-  std::vector<double> hz = std::vector<double>(n_harmonics, 0);
-
-  // Prepare LAMMPS variables.
   int central_species = type[i] - 1;
-  double delx, dely, delz, rsq, r, bond, bond_x, bond_y, bond_z, g_val, gx_val,
-      gy_val, gz_val, h_val;
-  int j, s, descriptor_counter;
+  double xtmp = x[i][0];
+  double ytmp = x[i][1];
+  double ztmp = x[i][2];
 
-  // Initialize vectors.
-  int n_radial = n_species * N;
-  int n_bond = n_radial * n_harmonics;
-  single_bond_vals = Eigen::VectorXd::Zero(n_bond);
-  single_bond_env_dervs = Eigen::MatrixXd::Zero(n_inner * 3, n_bond);
-
-  // Initialize radial hyperparameters.
-  std::vector<double> new_radial_hyps = radial_hyps;
-
-  // Loop over neighbors.
-  int n_count = 0;
   for (int jj = 0; jj < jnum; jj++) {
-    j = jlist[jj];
-
-    delx = x[j][0] - xtmp;
-    dely = x[j][1] - ytmp;
-    delz = x[j][2] - ztmp;
-    rsq = delx * delx + dely * dely + delz * delz;
-    r = sqrt(rsq);
+    int j = jlist[jj];
+    double dx = x[j][0] - xtmp;
+    double dy = x[j][1] - ytmp;
+    double dz = x[j][2] - ztmp;
+    double rsq = dx * dx + dy * dy + dz * dz;
 
     // Retrieve the cutoff.
     int s = type[j] - 1;
     double cutoff = cutoff_matrix(central_species, s);
-    double cutforcesq = cutoff * cutoff;
 
-    if (rsq < cutforcesq) { // minus a small value to prevent numerial error
-      // Reset endpoint of the radial basis set.
-      new_radial_hyps[1] = cutoff;
+    if (rsq < cutoff * cutoff) {
+      delx.push_back(dx);
+      dely.push_back(dy);
+      delz.push_back(dz);
+      r.push_back(sqrt(rsq));
+      rcut.push_back(cutoff);
+      species.push_back(s);
+      index.push_back(j);
+    }
+  }
+}
 
-      calculate_radial(g, gx, gy, gz, basis_function, cutoff_function, delx,
-                       dely, delz, r, cutoff, N, new_radial_hyps, cutoff_hyps);
-      get_Y(h, hx, hy, hz, delx, dely, delz, lmax);
+// Single bond values with species-dependent cutoffs. Radial and Cutoff are
+// either std::function objects or the StaticRadial/StaticCutoff wrappers of
+// the single bond engine.
+template <typename Radial, typename Cutoff>
+static void single_bond_multiple_cutoffs_engine(
+    const ShortNeighborList &neighbors, const Radial &basis_function,
+    const Cutoff &cutoff_function, int n_species, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, Eigen::VectorXd &single_bond_vals,
+    Eigen::MatrixXd &single_bond_env_dervs) {
 
-      // Store the products and their derivatives.
-      descriptor_counter = s * N * n_harmonics;
+  // Per-thread buffers for the bonds, basis functions and spherical
+  // harmonics.
+  SingleBondScratch &scratch = single_bond_scratch(N);
+  scratch.bond_x = neighbors.delx;
+  scratch.bond_y = neighbors.dely;
+  scratch.bond_z = neighbors.delz;
+  scratch.bond_r = neighbors.r;
+  scratch.bond_rcut = neighbors.rcut;
+  scratch.bond_species = neighbors.species;
 
-      for (int radial_counter = 0; radial_counter < N; radial_counter++) {
-        // Retrieve radial values.
-        g_val = g[radial_counter];
-        gx_val = gx[radial_counter];
-        gy_val = gy[radial_counter];
-        gz_val = gz[radial_counter];
+  // Initialize vectors.
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  int n_radial = n_species * N;
+  int n_bond = n_radial * n_harmonics;
+  single_bond_vals = Eigen::VectorXd::Zero(n_bond);
+  single_bond_env_dervs = Eigen::MatrixXd::Zero(neighbors.size() * 3, n_bond);
 
-        for (int angular_counter = 0; angular_counter < n_harmonics;
-             angular_counter++) {
+  // Initialize radial hyperparameters.
+  std::vector<double> new_radial_hyps = radial_hyps;
 
-          h_val = h[angular_counter];
-          bond = g_val * h_val;
+  add_single_bonds(single_bond_vals, single_bond_env_dervs, 0, scratch,
+                   basis_function, cutoff_function, N, lmax, new_radial_hyps,
+                   cutoff_hyps);
+}
 
-          // Calculate derivatives with the product rule.
-          bond_x = gx_val * h_val + g_val * hx[angular_counter];
-          bond_y = gy_val * h_val + g_val * hy[angular_counter];
-          bond_z = gz_val * h_val + g_val * hz[angular_counter];
+template <RadialFunction radial, CutoffFunction cutoff>
+void LammpsSingleBond::compute(const ShortNeighborList &neighbors,
+                               int n_species, int N, int lmax,
+                               const std::vector<double> &radial_hyps,
+                               const std::vector<double> &cutoff_hyps,
+                               Eigen::VectorXd &single_bond_vals,
+                               Eigen::MatrixXd &single_bond_env_dervs) {
+
+  single_bond_multiple_cutoffs_engine(
+      neighbors, StaticRadial<radial>(), StaticCutoff<cutoff>(), n_species, N,
+      lmax, radial_hyps, cutoff_hyps, single_bond_vals, single_bond_env_dervs);
+}
 
-          // Update single bond basis arrays.
-          single_bond_vals(descriptor_counter) += bond;
+LammpsSingleBond::Function
+set_lammps_single_bond(const std::string &radial_basis,
+                       const std::string &cutoff_function) {
+  return set_single_bond<LammpsSingleBond>(radial_basis, cutoff_function);
+}
 
-          single_bond_env_dervs(n_count * 3, descriptor_counter) += bond_x;
-          single_bond_env_dervs(n_count * 3 + 1, descriptor_counter) += bond_y;
-          single_bond_env_dervs(n_count * 3 + 2, descriptor_counter) += bond_z;
+void single_bond_multiple_cutoffs(
+    const ShortNeighborList &neighbors,
+    std::function<void(std::vector<double> &, std::vector<double> &, double,
+                       int, std::vector<double>)>
+        basis_function,
+    std::function<void(std::vector<double> &, double, double,
+                       std::vector<double>)>
+        cutoff_function,
+    int n_species, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, Eigen::VectorXd &single_bond_vals,
+    Eigen::MatrixXd &single_bond_env_dervs) {
 
-          descriptor_counter++;
-        }
-      }
-      n_count++;
-    }
-  }
+  single_bond_multiple_cutoffs_engine(
+      neighbors, basis_function, cutoff_function, n_species, N, lmax,
+      radial_hyps, cutoff_hyps, single_bond_vals, single_bond_env_dervs);
 }
 
 void single_bond(
@@ -247,40 +258,15 @@ void B2_descriptor(Eigen::VectorXd &B2_vals,
   norm_squared = B2_vals.dot(B2_vals);
 }
 
-void compute_energy_and_u(Eigen::VectorXd &B2_vals, 
-                   double &norm_squared,
-                   const Eigen::VectorXd &single_bond_vals,
-                   int power, int n_species,
-                   int N, int lmax, const Eigen::MatrixXd &beta_matrix, 
-                   Eigen::VectorXd &u, double *evdwl, bool normalized) {
+// Compute u(n1, l, m), where f_ik = u * dA/dr_ik, from w = dE/dB2.
+static void compute_u(const Eigen::VectorXd &w,
+                      const Eigen::VectorXd &single_bond_vals, int n_species,
+                      int N, int lmax, Eigen::VectorXd &u) {
 
   int n1_l, n2_l, counter, n1_count, n2_count;
   int n_radial = n_species * N;
   int n_harmonics = (lmax + 1) * (lmax + 1);
 
-  Eigen::VectorXd w;
-  if (normalized) {
-    if (power == 1) {
-      double B2_norm = pow(norm_squared, 0.5);
-      *evdwl = B2_vals.dot(beta_matrix.col(0)) / B2_norm;
-      w = beta_matrix.col(0) / B2_norm - *evdwl * B2_vals / norm_squared;
-    } else if (power == 2) { 
-      Eigen::VectorXd beta_p = beta_matrix * B2_vals;
-      *evdwl = B2_vals.dot(beta_p) / norm_squared;
-      w = 2 * (beta_p - *evdwl * B2_vals) / norm_squared;
-    }
-  } else {
-    if (power == 1) {
-      w = beta_matrix.col(0);
-      *evdwl = B2_vals.dot(w);
-    } else if (power == 2) { 
-      Eigen::VectorXd beta_p = beta_matrix * B2_vals;
-      *evdwl = B2_vals.dot(beta_p);
-      w = 2 * beta_p;
-    }
-  }
-
-  // Compute u(n1, l, m), where f_ik = u * dA/dr_ik
   u = Eigen::VectorXd::Zero(single_bond_vals.size());
   double factor;
   for (int n1 = n_radial - 1; n1 >= 0; n1--) {
@@ -313,3 +299,249 @@ void compute_energy_and_u(Eigen::VectorXd &B2_vals,
   }
   u *= 2;
 }
+
+void compute_energy_and_u(Eigen::VectorXd &B2_vals, 
+                   double &norm_squared,
+                   const Eigen::VectorXd &single_bond_vals,
+                   int power, int n_species,
+                   int N, int lmax, const Eigen::MatrixXd &beta_matrix, 
+                   Eigen::VectorXd &u, double *evdwl, bool normalized) {
+
+  if (power == 2) {
+    Eigen::VectorXd beta_p = beta_matrix * B2_vals;
+    compute_energy_and_u_pow2(B2_vals, norm_squared, single_bond_vals, beta_p,
+                              n_species, N, lmax, u, evdwl, normalized);
+    return;
+  }
+
+  Eigen::VectorXd w;
+  if (normalized) {
+    if (power == 1) {
+      double B2_norm = pow(norm_squared, 0.5);
+      *evdwl = B2_vals.dot(beta_matrix.col(0)) / B2_norm;
+      w = beta_matrix.col(0) / B2_norm - *evdwl * B2_vals / norm_squared;
+    }
+  } else {
+    if (power == 1) {
+      w = beta_matrix.col(0);
+      *evdwl = B2_vals.dot(w);
+    }
+  }
+
+  compute_u(w, single_bond_vals, n_species, N, lmax, u);
+}
+
+void compute_energy_and_u_pow2(const Eigen::VectorXd &B2_vals,
+                               double norm_squared,
+                               const Eigen::VectorXd &single_bond_vals,
+                               const Eigen::VectorXd &beta_p, int n_species,
+                               int N, int lmax, Eigen::VectorXd &u,
+                               double *evdwl, bool normalized) {
+
+  Eigen::VectorXd w;
+  if (normalized) {
+    *evdwl = B2_vals.dot(beta_p) / norm_squared;
+    w = 2 * (beta_p - *evdwl * B2_vals) / norm_squared;
+  } else {
+    *evdwl = B2_vals.dot(beta_p);
+    w = 2 * beta_p;
+  }
+
+  compute_u(w, single_bond_vals, n_species, N, lmax, u);
+}
+
+// Covariant descriptors of a short neighbor list, with the specialized single
+// bond engine if there is one.
+static void compute_single_bond(
+    const ShortNeighborList &neighbors,
+    LammpsSingleBond::Function single_bond_function,
+    const std::function<void(std::vector<double> &, std::vector<double> &,
+                             double, int, std::vector<double>)>
+        &basis_function,
+    const std::function<void(std::vector<double> &, double, double,
+                             std::vector<double>)> &cutoff_function,
+    int n_species, int N, int lmax, const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, Eigen::VectorXd &single_bond_vals,
+    Eigen::MatrixXd &single_bond_env_dervs) {
+
+  if (single_bond_function != nullptr) {
+    single_bond_function(neighbors, n_species, N, lmax, radial_hyps,
+                         cutoff_hyps, single_bond_vals, single_bond_env_dervs);
+  } else {
+    single_bond_multiple_cutoffs(neighbors, basis_function, cutoff_function,
+                                 n_species, N, lmax, radial_hyps, cutoff_hyps,
+                                 single_bond_vals, single_bond_env_dervs);
+  }
+}
+
+// Compute partial forces f_ij = u * dA/dr_ij.
+static void compute_partial_forces(const Eigen::MatrixXd &single_bond_env_dervs,
+                                   const Eigen::VectorXd &u,
+                                   Eigen::MatrixXd &partial_forces) {
+  int n_inner = single_bond_env_dervs.rows() / 3;
+  partial_forces.resize(n_inner, 3);
+  for (int k = 0; k < n_inner; k++) {
+    partial_forces(k, 0) = single_bond_env_dervs.row(k * 3).dot(u);
+    partial_forces(k, 1) = single_bond_env_dervs.row(k * 3 + 1).dot(u);
+    partial_forces(k, 2) = single_bond_env_dervs.row(k * 3 + 2).dot(u);
+  }
+}
+
+bool b2_energy_and_forces(
+    const ShortNeighborList &neighbors,
+    LammpsSingleBond::Function single_bond_function,
+    std::function<void(std::vector<double> &, std::vector<double> &, double,
+                       int, std::vector<double>)>
+        basis_function,
+    std::function<void(std::vector<double> &, double, double,
+                       std::vector<double>)>
+        cutoff_function,
+    int power, int n_species, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, const Eigen::MatrixXd &beta_matrix,
+    bool normalized, double &evdwl, Eigen::MatrixXd &partial_forces) {
+
+  double empty_thresh = 1e-8;
+
+  // Compute covariant descriptors.
+  Eigen::VectorXd single_bond_vals, B2_vals, u;
+  Eigen::MatrixXd single_bond_env_dervs;
+  compute_single_bond(neighbors, single_bond_function, basis_function,
+                      cutoff_function, n_species, N, lmax, radial_hyps,
+                      cutoff_hyps, single_bond_vals, single_bond_env_dervs);
+
+  // Compute invariant descriptors.
+  double B2_norm_squared;
+  B2_descriptor(B2_vals, B2_norm_squared, single_bond_vals, n_species, N,
+                lmax);
+
+  // Skip empty environments.
+  if (B2_norm_squared < empty_thresh)
+    return false;
+
+  compute_energy_and_u(B2_vals, B2_norm_squared, single_bond_vals, power,
+                       n_species, N, lmax, beta_matrix, u, &evdwl,
+                       normalized);
+  compute_partial_forces(single_bond_env_dervs, u, partial_forces);
+
+  return true;
+}
+
+void b2_energies_and_forces(
+    double **x, int *type, int *ilist, int n_atoms, int *numneigh,
+    int **firstneigh, const Eigen::MatrixXd &cutoff_matrix,
+    LammpsSingleBond::Function single_bond_function,
+    std::function<void(std::vector<double> &, std::vector<double> &, double,
+                       int, std::vector<double>)>
+        basis_function,
+    std::function<void(std::vector<double> &, double, double,
+                       std::vector<double>)>
+        cutoff_function,
+    int power, int n_species, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps,
+    const std::vector<Eigen::MatrixXd> &beta_matrices,
+    const std::vector<Eigen::MatrixXd> &beta_eigenvectors,
+    const std::vector<Eigen::VectorXd> &beta_eigenvalues, bool normalized,
+    int n_threads, B2Batch &batch) {
+
+  double empty_thresh = 1e-8;
+  int n_radial = n_species * N;
+  int n_descriptors = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+  if (n_threads < 1)
+    n_threads = 1;
+
+  if (batch.neighbors.size() < n_atoms) {
+    batch.neighbors.resize(n_atoms);
+    batch.single_bond_vals.resize(n_atoms);
+    batch.single_bond_env_dervs.resize(n_atoms);
+    batch.partial_forces.resize(n_atoms);
+    batch.norm_squared.resize(n_atoms);
+    batch.energies.resize(n_atoms);
+    batch.column.resize(n_atoms);
+    batch.nonempty.resize(n_atoms);
+  }
+
+  // Give the atoms of each species a contiguous block of columns, in ilist
+  // order.
+  bool compressed = !beta_eigenvalues.empty();
+  int n_types = compressed ? beta_eigenvalues.size() : beta_matrices.size();
+  std::vector<int> species_start(n_types + 1, 0);
+  for (int a = 0; a < n_atoms; a++)
+    species_start[type[ilist[a]]]++;
+  for (int s = 0; s < n_types; s++)
+    species_start[s + 1] += species_start[s];
+  std::vector<int> next_column(species_start.begin(), species_start.end() - 1);
+  for (int a = 0; a < n_atoms; a++)
+    batch.column[a] = next_column[type[ilist[a]] - 1]++;
+
+  // Compute the descriptors of every atom.
+  batch.B2_vals.resize(n_descriptors, n_atoms);
+#pragma omp parallel for schedule(dynamic, 16) num_threads(n_threads)
+  for (int a = 0; a < n_atoms; a++) {
+    int i = ilist[a];
+    batch.neighbors[a].build(x, type, i, numneigh[i], firstneigh[i],
+                             cutoff_matrix);
+    compute_single_bond(batch.neighbors[a], single_bond_function,
+                        basis_function, cutoff_function, n_species, N, lmax,
+                        radial_hyps, cutoff_hyps, batch.single_bond_vals[a],
+                        batch.single_bond_env_dervs[a]);
+
+    Eigen::VectorXd B2_vals;
+    B2_descriptor(B2_vals, batch.norm_squared[a], batch.single_bond_vals[a],
+                  n_species, N, lmax);
+    batch.B2_vals.col(batch.column[a]) = B2_vals;
+    batch.nonempty[a] = batch.norm_squared[a] >= empty_thresh;
+  }
+
+  // One matrix product per species, or two for compressed coefficients.
+  // Eigen threads the products itself, so its thread count is set to that
+  // of the caller for the products and restored afterwards.
+  if (power == 2) {
+    batch.beta_p.resize(n_descriptors, n_atoms);
+    int eigen_threads = Eigen::nbThreads();
+    Eigen::setNbThreads(n_threads);
+    for (int s = 0; s < n_types; s++) {
+      int start = species_start[s];
+      int count = species_start[s + 1] - start;
+      if (count == 0)
+        continue;
+      if (compressed) {
+        const Eigen::MatrixXd &V = beta_eigenvectors[s];
+        batch.projections.noalias() =
+            V.transpose() * batch.B2_vals.middleCols(start, count);
+        batch.projections =
+            beta_eigenvalues[s].asDiagonal() * batch.projections;
+        batch.beta_p.middleCols(start, count).noalias() =
+            V * batch.projections;
+      } else {
+        batch.beta_p.middleCols(start, count).noalias() =
+            beta_matrices[s] * batch.B2_vals.middleCols(start, count);
+      }
+    }
+    Eigen::setNbThreads(eigen_threads);
+  }
+
+  // Finish the energies and partial forces.
+#pragma omp parallel for schedule(dynamic, 16) num_threads(n_threads)
+  for (int a = 0; a < n_atoms; a++) {
+    if (!batch.nonempty[a])
+      continue;
+
+    int c = batch.column[a];
+    Eigen::VectorXd B2_vals = batch.B2_vals.col(c), u;
+    if (power == 2) {
+      compute_energy_and_u_pow2(B2_vals, batch.norm_squared[a],
+                                batch.single_bond_vals[a], batch.beta_p.col(c),
+                                n_species, N, lmax, u, &batch.energies[a],
+                                normalized);
+    } else {
+      compute_energy_and_u(B2_vals, batch.norm_squared[a],
+                           batch.single_bond_vals[a], power, n_species, N,
+                           lmax, beta_matrices[type[ilist[a]] - 1], u,
+                           &batch.energies[a], normalized);
+    }
+    compute_partial_forces(batch.single_bond_env_dervs[a], u,
+                           batch.partial_forces[a]);
+  }
+}
@@ -1,10 +1,53 @@
 #ifndef LAMMPS_DESCRIPTOR_H
 #define LAMMPS_DESCRIPTOR_H
 
+#include "single_bond.h"
 #include <Eigen/Dense>
 #include <functional>
+#include <string>
 #include <vector>
 
+/**
+ * Neighbors of one atom inside the species-dependent cutoffs, packed with
+ * the displacement x_j - x_i, distance, cutoff, species and atom index of
+ * each. The list is built once per atom from the LAMMPS neighbor list and
+ * shared by the descriptor, energy and force stages, so distances are
+ * computed once and later stages visit only the neighbors inside the
+ * cutoff. Clearing keeps the capacity, so a reused list stops allocating.
+ */
+struct ShortNeighborList {
+  std::vector<double> delx, dely, delz, r, rcut;
+  std::vector<int> species, index;
+
+  int size() const { return index.size(); }
+  void build(double **x, int *type, int i, int jnum, int *jlist,
+             const Eigen::MatrixXd &cutoff_matrix);
+};
+
+/**
+ * Single bond engine for short neighbor lists, specialized on the radial
+ * basis and cutoff function. Equivalent to single_bond_multiple_cutoffs.
+ */
+struct LammpsSingleBond {
+  typedef void (*Function)(const ShortNeighborList &neighbors, int n_species,
+                           int N, int lmax,
+                           const std::vector<double> &radial_hyps,
+                           const std::vector<double> &cutoff_hyps,
+                           Eigen::VectorXd &single_bond_vals,
+                           Eigen::MatrixXd &single_bond_env_dervs);
+
+  template <RadialFunction radial, CutoffFunction cutoff>
+  static void compute(const ShortNeighborList &neighbors, int n_species, int N,
+                      int lmax, const std::vector<double> &radial_hyps,
+                      const std::vector<double> &cutoff_hyps,
+                      Eigen::VectorXd &single_bond_vals,
+                      Eigen::MatrixXd &single_bond_env_dervs);
+};
+
+// Returns nullptr if the radial basis or cutoff function is not recognized.
+LammpsSingleBond::Function
+set_lammps_single_bond(const std::string &radial_basis,
+                       const std::string &cutoff_function);
 
 void single_bond(
     double **x, int *type, int jnum, int n_inner, int i, double xtmp,
@@ -21,8 +64,7 @@ void single_bond(
     Eigen::MatrixXd &single_bond_env_dervs);
 
 void single_bond_multiple_cutoffs(
-    double **x, int *type, int jnum, int n_inner, int i, double xtmp,
-    double ytmp, double ztmp, int *jlist,
+    const ShortNeighborList &neighbors,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
                        int, std::vector<double>)>
         basis_function,
@@ -32,8 +74,7 @@ void single_bond_multiple_cutoffs(
     int n_species, int N, int lmax,
     const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, Eigen::VectorXd &single_bond_vals,
-    Eigen::MatrixXd &single_bond_env_dervs,
-    const Eigen::MatrixXd &cutoff_matrix);
+    Eigen::MatrixXd &single_bond_env_dervs);
 
 void B2_descriptor(Eigen::VectorXd &B2_vals,
                    double &norm_squared,
@@ -48,4 +89,81 @@ void compute_energy_and_u(Eigen::VectorXd &B2_vals,
                    int N, int lmax, const Eigen::MatrixXd &beta_matrix, 
                    Eigen::VectorXd &u, double *evdwl, bool normalized);
 
+// Power 2 case of compute_energy_and_u, given beta_p = beta_matrix * B2_vals.
+void compute_energy_and_u_pow2(const Eigen::VectorXd &B2_vals,
+                               double norm_squared,
+                               const Eigen::VectorXd &single_bond_vals,
+                               const Eigen::VectorXd &beta_p, int n_species,
+                               int N, int lmax, Eigen::VectorXd &u,
+                               double *evdwl, bool normalized);
+
+/**
+ * Local energy of an atom under a mapped B2 potential, and the partial forces
+ * f_ij = u * dA/dr_ij on its neighbors inside the cutoff. Row k of
+ * partial_forces belongs to neighbor k of the short neighbor list; the force
+ * is added to the central atom and subtracted from the neighbor. beta_matrix
+ * is the matrix of the central species. No LAMMPS state is touched, so atoms
+ * can be processed concurrently. Returns false if the environment is empty,
+ * in which case the atom contributes nothing.
+ */
+bool b2_energy_and_forces(
+    const ShortNeighborList &neighbors,
+    LammpsSingleBond::Function single_bond_function,
+    std::function<void(std::vector<double> &, std::vector<double> &, double,
+                       int, std::vector<double>)>
+        basis_function,
+    std::function<void(std::vector<double> &, double, double,
+                       std::vector<double>)>
+        cutoff_function,
+    int power, int n_species, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, const Eigen::MatrixXd &beta_matrix,
+    bool normalized, double &evdwl, Eigen::MatrixXd &partial_forces);
+
+/**
+ * Per-atom buffers of b2_energies_and_forces, reused between calls. Entry a
+ * of each vector belongs to atom a of the batch; the descriptor matrices
+ * hold one column per atom, grouped by species.
+ */
+struct B2Batch {
+  std::vector<ShortNeighborList> neighbors;
+  std::vector<Eigen::VectorXd> single_bond_vals;
+  std::vector<Eigen::MatrixXd> single_bond_env_dervs, partial_forces;
+  std::vector<double> norm_squared, energies;
+  std::vector<int> column, nonempty; // not vector<bool>, which packs bits
+  Eigen::MatrixXd B2_vals, beta_p, projections;
+};
+
+/**
+ * b2_energy_and_forces for the atoms ilist[0], ..., ilist[n_atoms - 1],
+ * with beta_matrices[s] the matrix of species s. The descriptors of all
+ * atoms are computed first, so that for power 2 the products
+ * beta_matrix * B2 are evaluated as one matrix-matrix product per species
+ * rather than one matrix-vector product per atom. If beta_eigenvalues is not
+ * empty, the matrix of species s is instead
+ * beta_eigenvectors[s] * diag(beta_eigenvalues[s]) * beta_eigenvectors[s]^T,
+ * applied as two products of the rank of the eigenvectors. The energy,
+ * partial forces
+ * and short neighbor list of atom a are left in batch.energies[a],
+ * batch.partial_forces[a] and batch.neighbors[a], and batch.nonempty[a] is
+ * zero if its environment is empty. Uses n_threads OpenMP threads.
+ */
+void b2_energies_and_forces(
+    double **x, int *type, int *ilist, int n_atoms, int *numneigh,
+    int **firstneigh, const Eigen::MatrixXd &cutoff_matrix,
+    LammpsSingleBond::Function single_bond_function,
+    std::function<void(std::vector<double> &, std::vector<double> &, double,
+                       int, std::vector<double>)>
+        basis_function,
+    std::function<void(std::vector<double> &, double, double,
+                       std::vector<double>)>
+        cutoff_function,
+    int power, int n_species, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps,
+    const std::vector<Eigen::MatrixXd> &beta_matrices,
+    const std::vector<Eigen::MatrixXd> &beta_eigenvectors,
+    const std::vector<Eigen::VectorXd> &beta_eigenvalues, bool normalized,
+    int n_threads, B2Batch &batch);
+
 #endif
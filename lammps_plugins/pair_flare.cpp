@@ -8,15 +8,18 @@
 #include "neigh_request.h"
 #include "neighbor.h"
 #include <Eigen/Dense>
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <sys/time.h>
 
 // flare++ modules
+#include "coeff_file.h"
 #include "cutoffs.h"
 #include "lammps_descriptor.h"
 #include "radial.h"
@@ -25,6 +28,7 @@
 using namespace LAMMPS_NS;
 
 #define MAXLINE 1024
+#define ATOMS_PER_BATCH 128
 
 typedef unsigned long long timestamp_t;
 
@@ -66,121 +70,78 @@ PairFLARE::~PairFLARE() {
 /* ---------------------------------------------------------------------- */
 
 void PairFLARE::compute(int eflag, int vflag) {
-  int i, j, ii, jj, inum, jnum, itype, jtype, n_inner, n_count;
-  double evdwl, delx, dely, delz, xtmp, ytmp, ztmp, rsq;
-  double *coeff;
-  int *ilist, *jlist, *numneigh, **firstneigh;
+  compute_batches(eflag, vflag, 1);
+}
 
-  evdwl = 0.0;
+/* ----------------------------------------------------------------------
+   The descriptors of a batch of local atoms are computed together, so that
+   for power 2 the beta matrix multiplies all descriptors of a species at
+   once. The results are then added to the force, energy and virial arrays
+   in ilist order.
+------------------------------------------------------------------------- */
+
+void PairFLARE::compute_batches(int eflag, int vflag, int n_threads) {
   ev_init(eflag, vflag);
 
-  double **x = atom->x;
+  int inum = list->inum;
+  int *ilist = list->ilist;
+  int batch_size = ATOMS_PER_BATCH * n_threads;
+
+  for (int start = 0; start < inum; start += batch_size) {
+    int n_atoms = std::min(batch_size, inum - start);
+    b2_energies_and_forces(
+        atom->x, atom->type, ilist + start, n_atoms, list->numneigh,
+        list->firstneigh, cutoff_matrix, single_bond_function, basis_function,
+        cutoff_function, power, n_species, n_max, l_max, radial_hyps,
+        cutoff_hyps, beta_matrices, beta_eigenvectors, beta_eigenvalues,
+        normalized, n_threads, batch);
+
+    for (int a = 0; a < n_atoms; a++) {
+      if (batch.nonempty[a])
+        tally_atom(ilist[start + a], batch.energies[a],
+                   batch.partial_forces[a], batch.neighbors[a], eflag, vflag);
+    }
+  }
+
+  if (vflag_fdotr)
+    virial_fdotr_compute();
+}
+
+/* ----------------------------------------------------------------------
+   add the energy and partial forces of atom i to the force, energy and
+   virial arrays
+------------------------------------------------------------------------- */
+
+void PairFLARE::tally_atom(int i, double evdwl,
+                           const Eigen::MatrixXd &partial_forces,
+                           const ShortNeighborList &neighbors, int eflag,
+                           int vflag) {
   double **f = atom->f;
-  int *type = atom->type;
   int nlocal = atom->nlocal;
-  int nall = nlocal + atom->nghost;
   int newton_pair = force->newton_pair;
 
-  inum = list->inum;
-  ilist = list->ilist;
-  numneigh = list->numneigh;
-  firstneigh = list->firstneigh;
-
-  int beta_init, beta_counter;
-  double B2_norm_squared, B2_val_1, B2_val_2;
-  Eigen::VectorXd single_bond_vals, B2_vals, B2_env_dot, u;
-  Eigen::MatrixXd single_bond_env_dervs, B2_env_dervs;
-  double empty_thresh = 1e-8;
-
-  for (ii = 0; ii < inum; ii++) {
-    i = list->ilist[ii];
-    itype = type[i];
-    jnum = numneigh[i];
-    xtmp = x[i][0];
-    ytmp = x[i][1];
-    ztmp = x[i][2];
-    jlist = firstneigh[i];
-
-    // Count the atoms inside the cutoff.
-    n_inner = 0;
-    for (int jj = 0; jj < jnum; jj++) {
-      j = jlist[jj];
-      int s = type[j] - 1;
-      double cutoff_val = cutoff_matrix(itype-1, s);
-
-      delx = x[j][0] - xtmp;
-      dely = x[j][1] - ytmp;
-      delz = x[j][2] - ztmp;
-      rsq = delx * delx + dely * dely + delz * delz;
-      if (rsq < (cutoff_val * cutoff_val))
-        n_inner++;
-    }
-
-    // Compute covariant descriptors.
-    double secs;
-    single_bond_multiple_cutoffs(x, type, jnum, n_inner, i, xtmp, ytmp, ztmp,
-                                 jlist, basis_function, cutoff_function,
-                                 n_species, n_max, l_max, radial_hyps,
-                                 cutoff_hyps, single_bond_vals,
-                                 single_bond_env_dervs, cutoff_matrix);
-
-    // Compute invariant descriptors.
-    B2_descriptor(B2_vals, B2_norm_squared,
-                  single_bond_vals, n_species, n_max, l_max);
-
-    compute_energy_and_u(B2_vals, B2_norm_squared, single_bond_vals, power,
-           n_species, n_max, l_max, beta_matrices[itype - 1], u, &evdwl, normalized);
-
-    // Continue if the environment is empty.
-    if (B2_norm_squared < empty_thresh)
-      continue;
-
-    // Update energy, force and stress arrays.
-    n_count = 0;
-    double fxsum = 0, fysum = 0, fzsum = 0;
-    for (int jj = 0; jj < jnum; jj++) {
-      j = jlist[jj];
-      int s = type[j] - 1;
-      double cutoff_val = cutoff_matrix(itype-1, s);
-      delx = xtmp - x[j][0];
-      dely = ytmp - x[j][1];
-      delz = ztmp - x[j][2];
-      rsq = delx * delx + dely * dely + delz * delz;
-
-      if (rsq < (cutoff_val * cutoff_val)) {
-        // Compute partial force f_ij = u * dA/dr_ij
-        double fx = single_bond_env_dervs.row(n_count * 3).dot(u);
-        double fy = single_bond_env_dervs.row(n_count * 3 + 1).dot(u);
-        double fz = single_bond_env_dervs.row(n_count * 3 + 2).dot(u);
-        // Compute local energy and partial forces.
-
-        f[i][0] += fx;
-        f[i][1] += fy;
-        f[i][2] += fz;
-        f[j][0] -= fx;
-        f[j][1] -= fy;
-        f[j][2] -= fz;
-        fxsum += fx;
-        fysum += fy;
-        fzsum += fz;
-        //printf("i = %d, j = %d, f = %g %g %g\n", i, j, fx, fy, fz);
-
-        if (vflag) {
-          ev_tally_xyz(i, j, nlocal, newton_pair, 0.0, 0.0, fx, fy, fz, delx,
-                       dely, delz);
-        }
-        n_count++;
-      }
+  for (int k = 0; k < neighbors.size(); k++) {
+    int j = neighbors.index[k];
+    double fx = partial_forces(k, 0);
+    double fy = partial_forces(k, 1);
+    double fz = partial_forces(k, 2);
+
+    f[i][0] += fx;
+    f[i][1] += fy;
+    f[i][2] += fz;
+    f[j][0] -= fx;
+    f[j][1] -= fy;
+    f[j][2] -= fz;
+
+    if (vflag) {
+      ev_tally_xyz(i, j, nlocal, newton_pair, 0.0, 0.0, fx, fy, fz,
+                   -neighbors.delx[k], -neighbors.dely[k], -neighbors.delz[k]);
     }
-      //printf("i = %d, Fsum = %g %g %g\n", i, fxsum, fysum, fzsum);
-
-    // Compute local energy.
-    if (eflag)
-      ev_tally_full(i, 2.0 * evdwl, 0.0, 0.0, 0.0, 0.0, 0.0);
   }
 
-  if (vflag_fdotr)
-    virial_fdotr_compute();
+  // Compute local energy.
+  if (eflag)
+    ev_tally_full(i, 2.0 * evdwl, 0.0, 0.0, 0.0, 0.0, 0.0);
 }
 
 /* ----------------------------------------------------------------------
@@ -260,6 +221,7 @@ void PairFLARE::read_file(char *filename) {
   char line[MAXLINE], radial_string[MAXLINE], cutoff_string[MAXLINE], kernel_string[MAXLINE];
   int radial_string_length, cutoff_string_length, kernel_string_length;
   FILE *fptr;
+  std::unique_ptr<CoeffFileReader> reader;
 
   // Check that the potential file can be opened.
   if (me == 0) {
@@ -269,29 +231,35 @@ void PairFLARE::read_file(char *filename) {
       snprintf(str, 128, "Cannot open potential file %s", filename);
       error->one(FLERR, str);
     }
+    reader.reset(new CoeffFileReader(fptr, [this](const std::string &message) {
+      error->one(FLERR, message.c_str());
+    }));
   }
 
   int tmp, nwords;
   if (me == 0) {
-    fgets(line, MAXLINE, fptr); // Date and contributor
+    reader->gets(line, MAXLINE); // Date and contributor
 
-    fgets(line, MAXLINE, fptr); // Power, use integer instead of double for simplicity
-    sscanf(line, "%i %s", &power, &kernel_string);
+    reader->gets(line, MAXLINE); // Power, use integer instead of double for simplicity
+    // A third number is the rank of compressed power 2 coefficients.
+    beta_rank = 0;
+    sscanf(line, "%i %s %i", &power, &kernel_string, &beta_rank);
     kernel_string_length = strlen(kernel_string);
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", radial_string); // Radial basis set
     radial_string_length = strlen(radial_string);
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%i %i %i %i", &n_species, &n_max, &l_max, &beta_size);
 
-    fgets(line, MAXLINE, fptr);
+    reader->gets(line, MAXLINE);
     sscanf(line, "%s", cutoff_string); // Cutoff function
     cutoff_string_length = strlen(cutoff_string);
   }
 
   MPI_Bcast(&power, 1, MPI_INT, 0, world);
+  MPI_Bcast(&beta_rank, 1, MPI_INT, 0, world);
   MPI_Bcast(&n_species, 1, MPI_INT, 0, world);
   MPI_Bcast(&n_max, 1, MPI_INT, 0, world);
   MPI_Bcast(&l_max, 1, MPI_INT, 0, world);
@@ -308,7 +276,7 @@ void PairFLARE::read_file(char *filename) {
   int n_cutoffs = n_species * n_species;
   memory->create(cutoffs, n_cutoffs, "pair:cutoffs");
   if (me == 0)
-    grab(fptr, n_cutoffs, cutoffs);
+    reader->grab(n_cutoffs, cutoffs);
   MPI_Bcast(cutoffs, n_cutoffs, MPI_DOUBLE, 0, world);
 
   // Create cutsq array (used in pair.cpp)
@@ -337,11 +305,17 @@ void PairFLARE::read_file(char *filename) {
   int beta_check;
   if (power == 1) {
     beta_check = n_descriptors;
+  } else if (power == 2 && beta_rank > 0) {
+    if (beta_rank > n_descriptors)
+      error->all(FLERR, "Beta rank exceeds the number of descriptors.");
+    beta_check = beta_rank * (n_descriptors + 1);
   } else if (power == 2) {
     beta_check = n_descriptors * (n_descriptors + 1) / 2;
   } else {
     error->all(FLERR, "Power should be 1 or 2.");
   }
+  if (power == 1 && beta_rank > 0)
+    error->all(FLERR, "Compressed coefficients require power 2.");
   if (beta_check != beta_size)
     error->all(FLERR, "Beta size doesn't match the number of descriptors.");
 
@@ -357,6 +331,9 @@ void PairFLARE::read_file(char *filename) {
   else if (!strcmp(cutoff_string, "cosine"))
     cutoff_function = cos_cutoff;
 
+  // Select the single bond engine specialized on the basis and cutoff.
+  single_bond_function = set_lammps_single_bond(radial_string, cutoff_string);
+
   // Set the kernel
   if (strcmp(kernel_string, "NormalizedDotProduct") == 0) {
     normalized = true;
@@ -371,7 +348,7 @@ void PairFLARE::read_file(char *filename) {
   // Parse the beta vectors.
   memory->create(beta, beta_size * n_species, "pair:beta");
   if (me == 0)
-    grab(fptr, beta_size * n_species, beta);
+    reader->grab(beta_size * n_species, beta);
   MPI_Bcast(beta, beta_size * n_species, MPI_DOUBLE, 0, world);
 
   // Fill in the beta matrix.
@@ -389,6 +366,24 @@ void PairFLARE::read_file(char *filename) {
       }
       beta_matrices.push_back(beta_matrix);
     }
+  } else if (beta_rank > 0) {
+    // Each species stores its eigenvalues followed by its eigenvectors.
+    for (int k = 0; k < n_species; k++) {
+      Eigen::VectorXd eigenvalues(beta_rank);
+      Eigen::MatrixXd eigenvectors(n_descriptors, beta_rank);
+      for (int r = 0; r < beta_rank; r++) {
+        eigenvalues(r) = beta[beta_count];
+        beta_count++;
+      }
+      for (int r = 0; r < beta_rank; r++) {
+        for (int i = 0; i < n_descriptors; i++) {
+          eigenvectors(i, r) = beta[beta_count];
+          beta_count++;
+        }
+      }
+      beta_eigenvalues.push_back(eigenvalues);
+      beta_eigenvectors.push_back(eigenvectors);
+    }
   } else if (power == 2) {
     for (int k = 0; k < n_species; k++) {
       beta_matrix = Eigen::MatrixXd::Zero(n_descriptors, n_descriptors);
@@ -408,23 +403,3 @@ void PairFLARE::read_file(char *filename) {
     }
   }
 }
-
-/* ----------------------------------------------------------------------
-   grab n values from file fp and put them in list
-   values can be several to a line
-   only called by proc 0
-------------------------------------------------------------------------- */
-
-void PairFLARE::grab(FILE *fptr, int n, double *list) {
-  char *ptr;
-  char line[MAXLINE];
-
-  int i = 0;
-  while (i < n) {
-    fgets(line, MAXLINE, fptr);
-    ptr = strtok(line, " \t\n\r\f");
-    list[i++] = atof(ptr);
-    while ((ptr = strtok(NULL, " \t\n\r\f")))
-      list[i++] = atof(ptr);
-  }
-}
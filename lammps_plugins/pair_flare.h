@@ -10,6 +10,7 @@ PairStyle(flare, PairFLARE)
 #ifndef LMP_PAIR_FLARE_H
 #define LMP_PAIR_FLARE_H
 
+#include "lammps_descriptor.h"
 #include "pair.h"
 #include <Eigen/Dense>
 #include <cstdio>
@@ -37,6 +38,7 @@ protected:
   std::function<void(std::vector<double> &, double, double,
                      std::vector<double>)>
       cutoff_function;
+  LammpsSingleBond::Function single_bond_function = nullptr;
 
   std::vector<double> radial_hyps, cutoff_hyps;
 
@@ -45,9 +47,23 @@ protected:
   Eigen::MatrixXd beta_matrix, cutoff_matrix;
   std::vector<Eigen::MatrixXd> beta_matrices;
 
+  // Compressed power 2 coefficients, beta = V diag(lambda) V^T with
+  // beta_rank columns in V. Empty for uncompressed files.
+  int beta_rank = 0;
+  std::vector<Eigen::MatrixXd> beta_eigenvectors;
+  std::vector<Eigen::VectorXd> beta_eigenvalues;
+
   virtual void allocate();
   virtual void read_file(char *);
-  void grab(FILE *, int, double *);
+
+  // Per-atom buffers of the batched descriptor and energy evaluation.
+  B2Batch batch;
+
+  // Energies and forces of the local atoms, evaluated in batches of
+  // ATOMS_PER_BATCH atoms per thread.
+  void compute_batches(int eflag, int vflag, int n_threads);
+  void tally_atom(int i, double evdwl, const Eigen::MatrixXd &partial_forces,
+                  const ShortNeighborList &neighbors, int eflag, int vflag);
 };
 
 } // namespace LAMMPS_NS
@@ -0,0 +1,20 @@
+#include "pair_flare_omp.h"
+#include "comm.h"
+
+using namespace LAMMPS_NS;
+
+/* ---------------------------------------------------------------------- */
+
+PairFLAREOMP::PairFLAREOMP(LAMMPS *lmp) : PairFLARE(lmp) {}
+
+/* ----------------------------------------------------------------------
+   Each batch of atoms is split over the threads, and the matrix products
+   of the batch are threaded by Eigen. Every atom writes only its own slot,
+   and the results are added to the force, energy and virial arrays
+   afterwards in ilist order, so the only difference from pair_style flare
+   is the rounding of the larger matrix products.
+------------------------------------------------------------------------- */
+
+void PairFLAREOMP::compute(int eflag, int vflag) {
+  compute_batches(eflag, vflag, comm->nthreads);
+}
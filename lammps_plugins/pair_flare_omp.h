@@ -0,0 +1,25 @@
+// OpenMP-threaded version of pair_style flare
+
+#ifdef PAIR_CLASS
+
+PairStyle(flare/omp, PairFLAREOMP)
+
+#else
+
+#ifndef LMP_PAIR_FLARE_OMP_H
+#define LMP_PAIR_FLARE_OMP_H
+
+#include "pair_flare.h"
+
+namespace LAMMPS_NS {
+
+class PairFLAREOMP : public PairFLARE {
+public:
+  PairFLAREOMP(class LAMMPS *);
+  virtual void compute(int, int);
+};
+
+} // namespace LAMMPS_NS
+
+#endif
+#endif
@@ -24,14 +24,29 @@
 
 namespace py = pybind11;
 
+static std::vector<GrowableMatrix::ConstView>
+growable_views(const std::vector<GrowableMatrix> &matrices) {
+  std::vector<GrowableMatrix::ConstView> views;
+  for (int i = 0; i < matrices.size(); i++)
+    views.push_back(matrices[i].view());
+  return views;
+}
+
 PYBIND11_MODULE(_C_flare, m) {
   // Structure
   py::class_<Structure>(m, "Structure")
       .def(py::init<const Eigen::MatrixXd &, const std::vector<int> &,
                     const Eigen::MatrixXd &>())
+      // Neighbor lists and descriptors are computed without the GIL.
       .def(py::init<const Eigen::MatrixXd &, const std::vector<int> &,
                     const Eigen::MatrixXd &, double,
-                    std::vector<Descriptor *>>())
+                    std::vector<Descriptor *>, const std::string &, double,
+                    bool>(),
+           py::arg("cell"), py::arg("species"), py::arg("positions"),
+           py::arg("cutoff"), py::arg("descriptor_calculators"),
+           py::arg("neighbor_method") = "brute_force", py::arg("skin") = 0.0,
+           py::arg("prediction_only") = false,
+           py::call_guard<py::gil_scoped_release>())
       .def_readwrite("noa", &Structure::noa)
       .def_readwrite("cell", &Structure::cell)
       .def_readwrite("species", &Structure::species)
@@ -39,6 +54,9 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readwrite("cell_transpose", &Structure::cell_transpose)
       .def_readwrite("wrapped_positions", &Structure::wrapped_positions)
       .def_readwrite("volume", &Structure::volume)
+      .def_readonly("neighbor_method", &Structure::neighbor_method)
+      .def_readonly("skin", &Structure::skin)
+      .def_readonly("prediction_only", &Structure::prediction_only)
       .def_readwrite("energy", &Structure::energy)
       .def_readwrite("forces", &Structure::forces)
       .def_readwrite("stresses", &Structure::stresses)
@@ -48,11 +66,40 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readwrite("descriptors", &Structure::descriptors)
       .def_readwrite("descriptor_calculators",
                     &Structure::descriptor_calculators)
-      .def("compute_descriptors", &Structure::compute_descriptors)
+      .def("compute_descriptors", &Structure::compute_descriptors,
+           py::call_guard<py::gil_scoped_release>())
+      .def("update_positions", &Structure::update_positions,
+           py::call_guard<py::gil_scoped_release>())
       .def("wrap_positions", &Structure::wrap_positions)
       .def_static("to_json", &Structure::to_json)
       .def_static("from_json", &Structure::from_json);
 
+  // Build the structures of many (cell, species, positions) frames in
+  // parallel.
+  m.def(
+      "compute_structures",
+      [](const std::vector<std::tuple<Eigen::MatrixXd, std::vector<int>,
+                                      Eigen::MatrixXd>> &frames,
+         double cutoff, std::vector<Descriptor *> descriptor_calculators,
+         int n_threads, bool prediction_only,
+         const std::string &neighbor_method, double skin) {
+        std::vector<Eigen::MatrixXd> cells, positions;
+        std::vector<std::vector<int>> species;
+        for (const auto &frame : frames) {
+          cells.push_back(std::get<0>(frame));
+          species.push_back(std::get<1>(frame));
+          positions.push_back(std::get<2>(frame));
+        }
+        return Structure::compute_structures(cells, species, positions,
+                                             cutoff, descriptor_calculators,
+                                             n_threads, prediction_only,
+                                             neighbor_method, skin);
+      },
+      py::arg("frames"), py::arg("cutoff"), py::arg("descriptors"),
+      py::arg("n_threads") = 0, py::arg("prediction_only") = false,
+      py::arg("neighbor_method") = "brute_force", py::arg("skin") = 0.0,
+      py::call_guard<py::gil_scoped_release>());
+
   // Descriptor values
   py::class_<DescriptorValues>(m, "DescriptorValues")
       .def(py::init<>())
@@ -119,7 +166,8 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readonly("radial_hyps", &B2::radial_hyps)
       .def_readonly("cutoff_hyps", &B2::cutoff_hyps)
       .def_readonly("cutoffs", &B2::cutoffs)
-      .def_readonly("descriptor_settings", &B2::descriptor_settings);
+      .def_readonly("descriptor_settings", &B2::descriptor_settings)
+      .def_readwrite("b2_gemm", &B2::b2_gemm);
 
   py::class_<B2_Simple, Descriptor>(m, "B2_Simple")
       .def(py::init<const std::string &, const std::string &,
@@ -147,6 +195,7 @@ PYBIND11_MODULE(_C_flare, m) {
                     &NormalizedDotProduct::kernel_hyperparameters)
       .def("envs_envs", &NormalizedDotProduct::envs_envs)
       .def("envs_struc", &NormalizedDotProduct::envs_struc)
+      .def("envs_struc_contracted", &NormalizedDotProduct::envs_struc_contracted)
       .def("struc_struc", &NormalizedDotProduct::struc_struc);
 
   py::class_<DotProduct, Kernel>(m, "DotProduct")
@@ -157,6 +206,7 @@ PYBIND11_MODULE(_C_flare, m) {
                     &DotProduct::kernel_hyperparameters)
       .def("envs_envs", &DotProduct::envs_envs)
       .def("envs_struc", &DotProduct::envs_struc)
+      .def("envs_struc_contracted", &DotProduct::envs_struc_contracted)
       .def("struc_struc", &DotProduct::struc_struc);
 
   py::class_<NormalizedDotProduct_ICM, Kernel>(m, "NormalizedDotProduct_ICM")
@@ -166,41 +216,112 @@ PYBIND11_MODULE(_C_flare, m) {
       .def(py::init<double, double>());
 
   // Sparse GP DTC
+  py::class_<MappingCompression>(m, "MappingCompression")
+      .def_readonly("rank", &MappingCompression::rank)
+      .def_readonly("energy_rmse", &MappingCompression::energy_rmse)
+      .def_readonly("energy_max", &MappingCompression::energy_max)
+      .def_readonly("force_rmse", &MappingCompression::force_rmse)
+      .def_readonly("force_max", &MappingCompression::force_max);
+
   py::class_<SparseGP>(m, "SparseGP")
       .def(py::init<>())
       .def(py::init<std::vector<Kernel *>, double, double, double>())
-      .def("set_hyperparameters", &SparseGP::set_hyperparameters)
-      .def("predict_mean", &SparseGP::predict_mean)
-      .def("predict_SOR", &SparseGP::predict_SOR)
-      .def("predict_DTC", &SparseGP::predict_DTC)
+      // Training and prediction run entirely in C++, so the GIL is released.
+      .def("set_hyperparameters", &SparseGP::set_hyperparameters,
+           py::call_guard<py::gil_scoped_release>())
+      .def("predict_mean", &SparseGP::predict_mean,
+           py::call_guard<py::gil_scoped_release>())
+      .def("predict_mean_fast", &SparseGP::predict_mean_fast,
+           py::call_guard<py::gil_scoped_release>())
+      .def("predict_SOR", &SparseGP::predict_SOR, py::arg("structure"),
+           py::arg("block_size") = 0,
+           py::call_guard<py::gil_scoped_release>())
+      .def("predict_DTC", &SparseGP::predict_DTC, py::arg("structure"),
+           py::arg("block_size") = 0,
+           py::call_guard<py::gil_scoped_release>())
       .def("predict_local_uncertainties",
-           &SparseGP::predict_local_uncertainties)
-      .def("add_all_environments", &SparseGP::add_all_environments)
-      .def("add_specific_environments", &SparseGP::add_specific_environments)
-      .def("add_random_environments", &SparseGP::add_random_environments)
+           &SparseGP::predict_local_uncertainties,
+           py::call_guard<py::gil_scoped_release>())
+      .def("add_all_environments", &SparseGP::add_all_environments,
+           py::call_guard<py::gil_scoped_release>())
+      .def("add_specific_environments",
+           static_cast<void (SparseGP::*)(const Structure &,
+                                          const std::vector<int>)>(
+               &SparseGP::add_specific_environments),
+           py::call_guard<py::gil_scoped_release>())
+      .def("add_specific_environments",
+           static_cast<void (SparseGP::*)(
+               const std::vector<Structure> &,
+               const std::vector<std::vector<int>> &)>(
+               &SparseGP::add_specific_environments),
+           py::arg("structures"), py::arg("atoms"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("add_random_environments", &SparseGP::add_random_environments,
+           py::call_guard<py::gil_scoped_release>())
       .def("add_uncertain_environments",
-           &SparseGP::add_uncertain_environments)
+           &SparseGP::add_uncertain_environments,
+           py::call_guard<py::gil_scoped_release>())
       .def("add_training_structure", &SparseGP::add_training_structure,
                        py::arg("structure"),
                        py::arg("atom_indices") = - Eigen::VectorXi::Ones(1),
                        py::arg("rel_e_noise") = 1.0,
                        py::arg("rel_f_noise") = 1.0,
-                       py::arg("rel_s_noise") = 1.0)
-      .def("update_matrices_QR", &SparseGP::update_matrices_QR)
-      .def("compute_likelihood", &SparseGP::compute_likelihood)
-      .def("compute_likelihood_stable", &SparseGP::compute_likelihood_stable)
+                       py::arg("rel_s_noise") = 1.0,
+                       py::call_guard<py::gil_scoped_release>())
+      .def("add_training_structures", &SparseGP::add_training_structures,
+           py::arg("structures"),
+           py::arg("atom_indices") = std::vector<std::vector<int>>(),
+           py::arg("rel_e_noise") = std::vector<double>(),
+           py::arg("rel_f_noise") = std::vector<double>(),
+           py::arg("rel_s_noise") = std::vector<double>(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("update_matrices_QR", &SparseGP::update_matrices_QR,
+           py::call_guard<py::gil_scoped_release>())
+      .def("compute_matrices_QR", &SparseGP::compute_matrices_QR,
+           py::call_guard<py::gil_scoped_release>())
+      .def("update_matrices_incremental",
+           &SparseGP::update_matrices_incremental,
+           py::call_guard<py::gil_scoped_release>())
+      .def("compute_likelihood", &SparseGP::compute_likelihood,
+           py::call_guard<py::gil_scoped_release>())
+      .def("compute_likelihood_stable", &SparseGP::compute_likelihood_stable,
+           py::call_guard<py::gil_scoped_release>())
       .def("compute_likelihood_gradient",
-           &SparseGP::compute_likelihood_gradient)
+           &SparseGP::compute_likelihood_gradient,
+           py::call_guard<py::gil_scoped_release>())
       .def("compute_likelihood_gradient_stable",
-           &SparseGP::compute_likelihood_gradient_stable)
-      .def("precompute_KnK", &SparseGP::precompute_KnK)
-      .def("write_mapping_coefficients", &SparseGP::write_mapping_coefficients)
+           &SparseGP::compute_likelihood_gradient_stable,
+           py::call_guard<py::gil_scoped_release>())
+      .def("precompute_KnK", &SparseGP::precompute_KnK,
+           py::call_guard<py::gil_scoped_release>())
+      .def("optimize_hyperparameters", &SparseGP::optimize_hyperparameters,
+           py::arg("method") = "L-BFGS-B", py::arg("max_iterations") = 10,
+           py::arg("bounds") = Eigen::MatrixXd(),
+           py::arg("gradient_tolerance") = 1e-4,
+           py::call_guard<py::gil_scoped_release>())
+      .def("write_mapping_coefficients", &SparseGP::write_mapping_coefficients,
+           py::arg("file_name"), py::arg("contributor"),
+           py::arg("kernel_index"), py::arg("binary") = false)
+      .def("write_compressed_mapping_coefficients",
+           &SparseGP::write_compressed_mapping_coefficients,
+           py::arg("file_name"), py::arg("contributor"),
+           py::arg("kernel_index"), py::arg("tolerance"),
+           py::arg("binary") = false,
+           py::call_guard<py::gil_scoped_release>())
       .def_readonly("varmap_coeffs", &SparseGP::varmap_coeffs) // for debugging and unit test
       .def("compute_cluster_uncertainties", &SparseGP::compute_cluster_uncertainties) // for debugging and unit test
-      .def("write_varmap_coefficients", &SparseGP::write_varmap_coefficients)
-      .def("write_sparse_descriptors", &SparseGP::write_sparse_descriptors)
-      .def("write_L_inverse", &SparseGP::write_L_inverse)
+      .def("write_varmap_coefficients", &SparseGP::write_varmap_coefficients,
+           py::arg("file_name"), py::arg("contributor"),
+           py::arg("kernel_index"), py::arg("binary") = false)
+      .def("write_sparse_descriptors", &SparseGP::write_sparse_descriptors,
+           py::arg("file_name"), py::arg("contributor"),
+           py::arg("binary") = false)
+      .def("write_L_inverse", &SparseGP::write_L_inverse,
+           py::arg("file_name"), py::arg("contributor"),
+           py::arg("binary") = false)
       .def_readwrite("Kuu_jitter", &SparseGP::Kuu_jitter)
+      .def_readwrite("refactorization_tolerance",
+                     &SparseGP::refactorization_tolerance)
       .def_readonly("complexity_penalty", &SparseGP::complexity_penalty)
       .def_readonly("data_fit", &SparseGP::data_fit)
       .def_readonly("constant_term", &SparseGP::constant_term)
@@ -219,16 +340,30 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readonly("energy_noise", &SparseGP::energy_noise)
       .def_readonly("stress_noise", &SparseGP::stress_noise)
       .def_readonly("noise_vector", &SparseGP::noise_vector)
-      .def_readonly("Kuu", &SparseGP::Kuu)
-      .def_readonly("Kuu_kernels", &SparseGP::Kuu_kernels)
-      .def_readonly("Kuf", &SparseGP::Kuf)
-      .def_readonly("Kuf_kernels", &SparseGP::Kuf_kernels)
+      // Kuu and Kuf are returned as read-only views of the stored matrices.
+      .def_property_readonly(
+          "Kuu", [](const SparseGP &gp) { return gp.Kuu.view(); },
+          py::return_value_policy::reference_internal)
+      .def_property_readonly(
+          "Kuu_kernels",
+          [](const SparseGP &gp) { return growable_views(gp.Kuu_kernels); },
+          py::return_value_policy::reference_internal)
+      .def_property_readonly(
+          "Kuf", [](const SparseGP &gp) { return gp.Kuf.view(); },
+          py::return_value_policy::reference_internal)
+      .def_property_readonly(
+          "Kuf_kernels",
+          [](const SparseGP &gp) { return growable_views(gp.Kuf_kernels); },
+          py::return_value_policy::reference_internal)
       .def_readwrite("Kuf_e_noise_Kfu", &SparseGP::Kuf_e_noise_Kfu)
       .def_readwrite("Kuf_f_noise_Kfu", &SparseGP::Kuf_f_noise_Kfu)
       .def_readwrite("Kuf_s_noise_Kfu", &SparseGP::Kuf_s_noise_Kfu)
       .def_readonly("alpha", &SparseGP::alpha)
-      .def_readonly("Kuu_inverse", &SparseGP::Kuu_inverse)
-      .def_readonly("Sigma", &SparseGP::Sigma)
+      // The inverses are formed from the stored factors when first read.
+      .def_property_readonly("Kuu_inverse", &SparseGP::Kuu_inverse,
+                             py::return_value_policy::copy)
+      .def_property_readonly("Sigma", &SparseGP::Sigma,
+                             py::return_value_policy::copy)
       .def_readonly("n_sparse", &SparseGP::n_sparse)
       .def_readonly("n_labels", &SparseGP::n_labels)
       .def_readonly("y", &SparseGP::y)
@@ -0,0 +1,194 @@
+#ifndef GROWABLE_MATRIX_H
+#define GROWABLE_MATRIX_H
+
+#include "json.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <new>
+#include <nlohmann/json.hpp>
+#include <vector>
+
+/**
+ * Dense column-major matrix that grows by appending columns and by inserting
+ * rows and columns, as the Kuu and Kuf matrices of the sparse GP do when
+ * training structures and sparse points are added. Storage is reserved
+ * geometrically in both dimensions, so that appending does not copy the
+ * existing entries, and inserting moves them in place.
+ *
+ * The matrix is an Eigen::Map of its own storage, so it can be used in
+ * Eigen expressions like an Eigen::MatrixXd. Assigning an expression
+ * replaces the contents and releases any reserved storage.
+ */
+class GrowableMatrix
+    : public Eigen::Map<Eigen::MatrixXd, 0, Eigen::OuterStride<>> {
+public:
+  typedef Eigen::Map<Eigen::MatrixXd, 0, Eigen::OuterStride<>> Base;
+  typedef Eigen::Map<const Eigen::MatrixXd, 0, Eigen::OuterStride<>>
+      ConstView;
+
+  // Storage grows by at least this factor when it is reallocated.
+  static constexpr double growth_factor = 1.5;
+
+  GrowableMatrix() : Base(nullptr, 0, 0, Eigen::OuterStride<>(1)) {}
+
+  GrowableMatrix(const GrowableMatrix &other)
+      : Base(nullptr, 0, 0, Eigen::OuterStride<>(1)) {
+    *this = other;
+  }
+
+  GrowableMatrix(GrowableMatrix &&other) noexcept
+      : Base(nullptr, 0, 0, Eigen::OuterStride<>(1)) {
+    storage.swap(other.storage);
+    remap(other.rows(), other.cols());
+    other.remap(0, 0);
+  }
+
+  template <typename Derived>
+  GrowableMatrix(const Eigen::MatrixBase<Derived> &other)
+      : Base(nullptr, 0, 0, Eigen::OuterStride<>(1)) {
+    *this = other;
+  }
+
+  GrowableMatrix &operator=(const GrowableMatrix &other) {
+    if (this != &other)
+      assign(other);
+    return *this;
+  }
+
+  GrowableMatrix &operator=(GrowableMatrix &&other) noexcept {
+    if (this != &other) {
+      storage.swap(other.storage);
+      remap(other.rows(), other.cols());
+      other.remap(0, 0);
+    }
+    return *this;
+  }
+
+  template <typename Derived>
+  GrowableMatrix &operator=(const Eigen::MatrixBase<Derived> &other) {
+    assign(other);
+    return *this;
+  }
+
+  /** Read-only view of the entries, without the reserved storage. */
+  ConstView view() const {
+    return ConstView(data(), rows(), cols(),
+                     Eigen::OuterStride<>(outerStride()));
+  }
+
+  int capacity_rows() const { return storage.rows(); }
+  int capacity_cols() const { return storage.cols(); }
+
+  /** Reserve storage for at least n_rows x n_cols entries. */
+  void reserve(int n_rows, int n_cols) {
+    if (n_rows <= storage.rows() && n_cols <= storage.cols())
+      return;
+
+    int new_rows = storage.rows(), new_cols = storage.cols();
+    if (n_rows > new_rows)
+      new_rows = std::max(n_rows, (int)(growth_factor * new_rows));
+    if (n_cols > new_cols)
+      new_cols = std::max(n_cols, (int)(growth_factor * new_cols));
+
+    Eigen::MatrixXd new_storage(new_rows, new_cols);
+    new_storage.topLeftCorner(rows(), cols()) = *this;
+    int n_rows_old = rows(), n_cols_old = cols();
+    storage.swap(new_storage);
+    remap(n_rows_old, n_cols_old);
+  }
+
+  /** Resize, keeping the existing entries. New entries are zero. */
+  void conservativeResize(int n_rows, int n_cols) {
+    int n_rows_old = rows(), n_cols_old = cols();
+    reserve(n_rows, n_cols);
+    remap(n_rows, n_cols);
+    if (n_rows > n_rows_old)
+      bottomLeftCorner(n_rows - n_rows_old, std::min(n_cols, n_cols_old))
+          .setZero();
+    if (n_cols > n_cols_old)
+      rightCols(n_cols - n_cols_old).setZero();
+  }
+
+  /**
+   * Insert zero rows, so that they end up at the given positions of the
+   * grown matrix. The positions must be sorted in increasing order. The
+   * existing rows keep their order.
+   */
+  void insert_rows(const std::vector<int> &positions) {
+    int n_new = positions.size();
+    if (n_new == 0)
+      return;
+    int n_rows_old = rows(), n_rows = n_rows_old + n_new, n_cols = cols();
+    reserve(n_rows, n_cols);
+    remap(n_rows, n_cols);
+
+    // Moving from the bottom up never overwrites a row that is still to be
+    // moved.
+#pragma omp parallel for
+    for (int j = 0; j < n_cols; j++) {
+      double *column = data() + (long)j * outerStride();
+      int old_row = n_rows_old - 1, p = n_new - 1;
+      for (int row = n_rows - 1; row >= 0; row--) {
+        if (p >= 0 && positions[p] == row) {
+          column[row] = 0;
+          p--;
+        } else {
+          column[row] = column[old_row--];
+        }
+      }
+    }
+  }
+
+  /** Insert zero columns at the given sorted positions, as insert_rows. */
+  void insert_cols(const std::vector<int> &positions) {
+    int n_new = positions.size();
+    if (n_new == 0)
+      return;
+    int n_cols_old = cols(), n_cols = n_cols_old + n_new, n_rows = rows();
+    reserve(n_rows, n_cols);
+    remap(n_rows, n_cols);
+
+    int old_col = n_cols_old - 1, p = n_new - 1;
+    for (int j = n_cols - 1; j >= 0; j--) {
+      if (p >= 0 && positions[p] == j) {
+        col(j).setZero();
+        p--;
+      } else {
+        if (j != old_col)
+          col(j) = col(old_col);
+        old_col--;
+      }
+    }
+  }
+
+private:
+  Eigen::MatrixXd storage;
+
+  void remap(int n_rows, int n_cols) {
+    new (static_cast<Base *>(this))
+        Base(storage.data(), n_rows, n_cols,
+             Eigen::OuterStride<>(std::max<Eigen::Index>(storage.rows(), 1)));
+  }
+
+  // Evaluate first, since the expression may refer to this matrix.
+  template <typename Derived>
+  void assign(const Eigen::MatrixBase<Derived> &other) {
+    Eigen::MatrixXd result = other;
+    storage.swap(result);
+    remap(storage.rows(), storage.cols());
+  }
+};
+
+namespace nlohmann {
+  template <> struct adl_serializer<GrowableMatrix> {
+    static void to_json(json &j, const GrowableMatrix &matrix) {
+      j = Eigen::MatrixXd(matrix.view());
+    }
+
+    static void from_json(const json &j, GrowableMatrix &matrix) {
+      matrix = j.get<Eigen::MatrixXd>();
+    }
+  };
+}
+
+#endif
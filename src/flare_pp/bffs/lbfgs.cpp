@@ -0,0 +1,124 @@
+#include "lbfgs.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+static Eigen::VectorXd project(const Eigen::VectorXd &x,
+                               const Eigen::VectorXd &lower,
+                               const Eigen::VectorXd &upper) {
+  return x.cwiseMax(lower).cwiseMin(upper);
+}
+
+LBFGSResult lbfgs_minimize(
+    const std::function<double(const Eigen::VectorXd &, Eigen::VectorXd &)>
+        &fun,
+    const Eigen::VectorXd &x0, const Eigen::VectorXd &lower,
+    const Eigen::VectorXd &upper, int max_iterations,
+    double gradient_tolerance, double value_tolerance, int memory) {
+
+  // Armijo constant and maximum number of step halvings of the line search.
+  const double c1 = 1e-4;
+  const int max_backtracks = 30;
+
+  int n = x0.size();
+  LBFGSResult result;
+  result.x = project(x0, lower, upper);
+  result.value = fun(result.x, result.gradient);
+  result.evaluations = 1;
+
+  // Curvature pairs s = x_new - x and y = g_new - g, oldest first.
+  std::deque<Eigen::VectorXd> s_history, y_history;
+  std::deque<double> rho_history;
+
+  Eigen::VectorXd x_new, g_new;
+  while (result.iterations < max_iterations) {
+    const Eigen::VectorXd &x = result.x;
+    const Eigen::VectorXd &g = result.gradient;
+
+    Eigen::VectorXd projected_gradient = project(x - g, lower, upper) - x;
+    if (projected_gradient.lpNorm<Eigen::Infinity>() <= gradient_tolerance) {
+      result.converged = true;
+      break;
+    }
+
+    // Freeze variables that the gradient pushes against their bounds.
+    Eigen::VectorXd free = Eigen::VectorXd::Ones(n);
+    for (int i = 0; i < n; i++) {
+      if ((x(i) <= lower(i) && g(i) > 0) || (x(i) >= upper(i) && g(i) < 0))
+        free(i) = 0;
+    }
+
+    // Two-loop recursion for the quasi-Newton direction.
+    int m = s_history.size();
+    std::vector<double> a(m);
+    Eigen::VectorXd d = g.cwiseProduct(free);
+    for (int k = m - 1; k >= 0; k--) {
+      a[k] = rho_history[k] * s_history[k].dot(d);
+      d -= a[k] * y_history[k];
+    }
+    if (m > 0)
+      d *= 1 / (rho_history[m - 1] * y_history[m - 1].squaredNorm());
+    for (int k = 0; k < m; k++) {
+      double b = rho_history[k] * y_history[k].dot(d);
+      d += (a[k] - b) * s_history[k];
+    }
+    d = -d.cwiseProduct(free);
+
+    // Fall back to steepest descent if the direction is not a descent
+    // direction, which can happen when variables are frozen.
+    if (!(g.dot(d) < 0)) {
+      s_history.clear();
+      y_history.clear();
+      rho_history.clear();
+      m = 0;
+      d = -g.cwiseProduct(free);
+    }
+
+    // Without curvature information the first step has unit length.
+    double step = m == 0 ? std::min(1., 1. / d.norm()) : 1.;
+    double value_new;
+    bool accepted = false;
+    for (int k = 0; k < max_backtracks; k++) {
+      x_new = project(x + step * d, lower, upper);
+      value_new = fun(x_new, g_new);
+      result.evaluations++;
+      if (std::isfinite(value_new) &&
+          value_new <= result.value + c1 * g.dot(x_new - x)) {
+        accepted = true;
+        break;
+      }
+      step /= 2;
+    }
+    if (!accepted)
+      break;
+
+    Eigen::VectorXd s = x_new - x, y = g_new - g;
+    double sy = s.dot(y);
+    if (sy > 1e-10 * y.squaredNorm()) {
+      s_history.push_back(s);
+      y_history.push_back(y);
+      rho_history.push_back(1 / sy);
+      if ((int)s_history.size() > memory) {
+        s_history.pop_front();
+        y_history.pop_front();
+        rho_history.pop_front();
+      }
+    }
+
+    double value_old = result.value;
+    result.x = x_new;
+    result.gradient = g_new;
+    result.value = value_new;
+    result.iterations++;
+
+    if (value_old - value_new <=
+        value_tolerance *
+            std::max(std::max(std::abs(value_old), std::abs(value_new)), 1.)) {
+      result.converged = true;
+      break;
+    }
+  }
+
+  return result;
+}
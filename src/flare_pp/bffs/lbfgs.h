@@ -0,0 +1,32 @@
+#ifndef LBFGS_H
+#define LBFGS_H
+
+#include <Eigen/Dense>
+#include <functional>
+
+struct LBFGSResult {
+  Eigen::VectorXd x, gradient;
+  double value;
+  int iterations = 0, evaluations = 0;
+  bool converged = false;
+};
+
+/**
+ * Minimize fun inside the box lower <= x <= upper with a projected
+ * limited-memory BFGS method. fun returns the value at x and writes the
+ * gradient to its second argument. Variables held at a bound by the
+ * gradient are frozen for the step, and steps are chosen by a projected
+ * backtracking (Armijo) line search. The iteration stops when the
+ * projected gradient is below gradient_tolerance, when the relative
+ * decrease of the value is below value_tolerance, after max_iterations
+ * iterations, or when the line search fails. Infinite bounds are allowed.
+ */
+LBFGSResult lbfgs_minimize(
+    const std::function<double(const Eigen::VectorXd &, Eigen::VectorXd &)>
+        &fun,
+    const Eigen::VectorXd &x0, const Eigen::VectorXd &lower,
+    const Eigen::VectorXd &upper, int max_iterations,
+    double gradient_tolerance, double value_tolerance = 2.2e-9,
+    int memory = 10);
+
+#endif
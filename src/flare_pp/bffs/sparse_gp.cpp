@@ -1,14 +1,116 @@
 #include "sparse_gp.h"
+#include "lbfgs.h"
 #include <algorithm> // Random shuffle
 #include <chrono>
 #include <fstream> // File operations
 #include <iomanip> // setprecision
 #include <iostream>
+#include <limits>
 #include <numeric> // Iota
+#include <random>
 #include <assert.h> 
 
 #define MAXLINE 1024
 
+// Squared norms of the columns of T^-1 K for a triangular view T. The
+// columns of K are processed in blocks of block_size, so that the solution
+// never holds more than block_size columns. A block size of zero processes
+// all columns at once.
+template <typename Factor>
+static Eigen::VectorXd squared_column_norms(const Factor &T,
+                                            const Eigen::MatrixXd &K,
+                                            int block_size) {
+  int n_cols = K.cols();
+  if (block_size <= 0 || block_size > n_cols)
+    block_size = n_cols;
+
+  Eigen::VectorXd norms(n_cols);
+  Eigen::MatrixXd product;
+  for (int start = 0; start < n_cols; start += block_size) {
+    int size = std::min(block_size, n_cols - start);
+    product = K.middleCols(start, size);
+    T.solveInPlace(product);
+    norms.segment(start, size) = product.colwise().squaredNorm().transpose();
+  }
+
+  return norms;
+}
+
+// Replace the upper triangular factor R by the factor of
+// R^T R + sign * x x^T, with sign = 1 (update) or -1 (downdate), by a
+// sequence of Givens rotations of the rows of R. Returns false if a
+// downdate would make the factor singular.
+template <typename Factor>
+static bool rank_one_update(Factor &&R, Eigen::VectorXd x, double sign) {
+  int n = R.rows();
+  for (int k = 0; k < n; k++) {
+    double rkk = R(k, k);
+    double r2 = rkk * rkk + sign * x(k) * x(k);
+    if (!(r2 > 0))
+      return false;
+    double r = sqrt(r2);
+    double c = r / rkk, s = x(k) / rkk;
+    R(k, k) = r;
+    for (int j = k + 1; j < n; j++) {
+      R(k, j) = (R(k, j) + sign * s * x(j)) / c;
+      x(j) = c * x(j) - s * R(k, j);
+    }
+  }
+  return true;
+}
+
+// Insert a row and column at index q of the matrix R^T R, where v holds the
+// new column without its diagonal entry d. The rows above q gain one entry,
+// the new row is computed by forward substitution, and the trailing block
+// is downdated. Returns false if the bordered matrix is not positive
+// definite to working precision.
+static bool insert_factor_column(SparseGP::FactorMatrix &R, int q,
+                                 const Eigen::VectorXd &v, double d) {
+  int m = R.rows();
+  int m2 = m - q;
+
+  Eigen::VectorXd s = R.topLeftCorner(q, q)
+                          .triangularView<Eigen::Upper>()
+                          .transpose()
+                          .solve(v.head(q));
+  double t2 = d - s.squaredNorm();
+  if (!(t2 > 0))
+    return false;
+  double t = sqrt(t2);
+  Eigen::VectorXd x =
+      (v.tail(m2) - R.topRightCorner(q, m2).transpose() * s) / t;
+
+  SparseGP::FactorMatrix R_new = SparseGP::FactorMatrix::Zero(m + 1, m + 1);
+  R_new.topLeftCorner(q, q) = R.topLeftCorner(q, q);
+  R_new.block(0, q, q, 1) = s;
+  R_new.topRightCorner(q, m2) = R.topRightCorner(q, m2);
+  R_new(q, q) = t;
+  R_new.block(q, q + 1, 1, m2) = x.transpose();
+  R_new.bottomRightCorner(m2, m2) = R.bottomRightCorner(m2, m2);
+  if (!rank_one_update(R_new.bottomRightCorner(m2, m2), x, -1))
+    return false;
+
+  R.swap(R_new);
+  return true;
+}
+
+// Sparse points are stacked by type, and added points are appended to the
+// end of their type. Given the type counts of the existing and the added
+// points, append the stacked positions of each, starting at offset. The
+// added counts have one entry per type.
+static void insertion_positions(const std::vector<int> &counts,
+                                const std::vector<int> &added_counts,
+                                int offset, std::vector<int> &old_positions,
+                                std::vector<int> &new_positions) {
+  int position = offset;
+  for (int s = 0; s < added_counts.size(); s++) {
+    for (int j = 0; j < counts[s]; j++)
+      old_positions.push_back(position++);
+    for (int j = 0; j < added_counts[s]; j++)
+      new_positions.push_back(position++);
+  }
+}
+
 SparseGP ::SparseGP() {}
 
 SparseGP ::SparseGP(std::vector<Kernel *> kernels, double energy_noise,
@@ -107,22 +209,21 @@ SparseGP ::compute_cluster_uncertainties(const Structure &structure) {
   std::vector<Eigen::MatrixXd> sparse_kernels;
   int sparse_count = 0;
   for (int i = 0; i < n_kernels; i++) {
-    K_self.push_back(
-        (kernels[i]->envs_envs(cluster_descriptors[i], cluster_descriptors[i],
-                               kernels[i]->kernel_hyperparameters))
-            .diagonal());
+    K_self.push_back(kernels[i]->envs_self_diagonal(
+        cluster_descriptors[i], kernels[i]->kernel_hyperparameters));
 
     sparse_kernels.push_back(
         kernels[i]->envs_envs(cluster_descriptors[i], sparse_descriptors[i],
                               kernels[i]->kernel_hyperparameters));
 
+    // Kuu is block diagonal, and so is its Cholesky factor.
     int n_clusters = sparse_descriptors[i].n_clusters;
-    Eigen::MatrixXd L_inverse_block =
-        L_inv.block(sparse_count, sparse_count, n_clusters, n_clusters);
+    Eigen::MatrixXd Q1 =
+        L_factor.block(sparse_count, sparse_count, n_clusters, n_clusters)
+            .triangularView<Eigen::Lower>()
+            .solve(sparse_kernels[i].transpose());
     sparse_count += n_clusters;
-
-    Eigen::MatrixXd Q1 = L_inverse_block * sparse_kernels[i].transpose();
-    Q_self.push_back((Q1.transpose() * Q1).diagonal());
+    Q_self.push_back(Q1.colwise().squaredNorm().transpose());
 
     variances.push_back(K_self[i] - Q_self[i]); // it is sorted by clusters, not the original atomic order 
     // TODO: If the environment is empty, the assigned uncertainty should be
@@ -132,6 +233,27 @@ SparseGP ::compute_cluster_uncertainties(const Structure &structure) {
   return variances;
 }
 
+// Indices of the clusters, by type, whose central atom is in the given list.
+static std::vector<std::vector<int>>
+specific_cluster_indices(const DescriptorValues &descriptor,
+                         const std::vector<int> &atoms) {
+  std::vector<std::vector<int>> indices;
+  for (int j = 0; j < descriptor.n_types; j++) {
+    int n_clusters = descriptor.n_clusters_by_type[j];
+    std::vector<int> type_indices;
+    for (int k = 0; k < n_clusters; k++) {
+      int atom_index_1 = descriptor.atom_indices[j](k);
+      for (size_t l = 0; l < atoms.size(); l++) {
+        if (atom_index_1 == atoms[l]) {
+          type_indices.push_back(k);
+        }
+      }
+    }
+    indices.push_back(type_indices);
+  }
+  return indices;
+}
+
 void SparseGP ::add_specific_environments(const Structure &structure,
                                           const std::vector<int> atoms) {
 
@@ -141,24 +263,8 @@ void SparseGP ::add_specific_environments(const Structure &structure,
   std::vector<std::vector<std::vector<int>>> indices_1;
   for (int i = 0; i < n_kernels; i++){
     sparse_indices[i].push_back(atoms); // for each kernel the added atoms are the same
-
-    int n_types = structure.descriptors[i].n_types;
-    std::vector<std::vector<int>> indices_2;
-    for (int j = 0; j < n_types; j++){
-      int n_clusters = structure.descriptors[i].n_clusters_by_type[j];
-      std::vector<int> indices_3;
-      for (int k = 0; k < n_clusters; k++){
-        int atom_index_1 = structure.descriptors[i].atom_indices[j](k);
-        for (int l = 0; l < atoms.size(); l++){
-          int atom_index_2 = atoms[l];
-          if (atom_index_1 == atom_index_2){
-            indices_3.push_back(k);
-          }
-        }
-      }
-      indices_2.push_back(indices_3);
-    }
-    indices_1.push_back(indices_2);
+    indices_1.push_back(
+        specific_cluster_indices(structure.descriptors[i], atoms));
   }
 
   // Create cluster descriptors.
@@ -172,8 +278,6 @@ void SparseGP ::add_specific_environments(const Structure &structure,
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   for (int i = 0; i < n_kernels; i++) {
@@ -182,6 +286,46 @@ void SparseGP ::add_specific_environments(const Structure &structure,
   }
 }
 
+void SparseGP ::add_specific_environments(
+    const std::vector<Structure> &structures,
+    const std::vector<std::vector<int>> &atoms) {
+
+  if (atoms.size() != structures.size())
+    throw std::invalid_argument(
+        "One list of atoms is needed for each structure.");
+  if (structures.size() == 0)
+    return;
+
+  initialize_sparse_descriptors(structures[0]);
+
+  // Gather the new clusters of all structures into one cluster descriptor
+  // per kernel, in the order in which they are stored below.
+  int n_added = structures.size();
+  std::vector<std::vector<std::vector<std::vector<int>>>> indices(n_added);
+  std::vector<ClusterDescriptor> cluster_descriptors(n_kernels);
+  for (int n = 0; n < n_added; n++) {
+    for (int i = 0; i < n_kernels; i++) {
+      indices[n].push_back(
+          specific_cluster_indices(structures[n].descriptors[i], atoms[n]));
+      cluster_descriptors[i].add_clusters_by_type(
+          structures[n].descriptors[i], indices[n][i]);
+    }
+  }
+
+  // Update Kuu and Kuf.
+  update_Kuu(cluster_descriptors);
+  update_Kuf(cluster_descriptors);
+
+  // Store sparse environments.
+  for (int n = 0; n < n_added; n++) {
+    for (int i = 0; i < n_kernels; i++) {
+      sparse_indices[i].push_back(atoms[n]);
+      sparse_descriptors[i].add_clusters_by_type(structures[n].descriptors[i],
+                                                 indices[n][i]);
+    }
+  }
+}
+
 void SparseGP ::add_uncertain_environments(const Structure &structure,
                                            const std::vector<int> &n_added) {
 
@@ -214,8 +358,6 @@ void SparseGP ::add_uncertain_environments(const Structure &structure,
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   for (int i = 0; i < n_kernels; i++) {
@@ -275,8 +417,6 @@ void SparseGP ::add_random_environments(const Structure &structure,
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   for (int i = 0; i < n_kernels; i++) {
@@ -316,8 +456,6 @@ void SparseGP ::add_all_environments(const Structure &structure) {
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   std::vector<int> added_indices;
@@ -333,7 +471,10 @@ void SparseGP ::add_all_environments(const Structure &structure) {
 void SparseGP ::update_Kuu(
     const std::vector<ClusterDescriptor> &cluster_descriptors) {
 
-  // Update Kuu matrices.
+  // Update Kuu matrices. The existing entries are moved in place to make
+  // room for the new sparse points.
+  std::vector<int> stacked_positions;
+  int offset = 0;
   for (int i = 0; i < n_kernels; i++) {
     Eigen::MatrixXd prev_block =
         kernels[i]->envs_envs(sparse_descriptors[i], cluster_descriptors[i],
@@ -344,72 +485,71 @@ void SparseGP ::update_Kuu(
 
     int n_sparse = sparse_descriptors[i].n_clusters;
     int n_envs = cluster_descriptors[i].n_clusters;
-    int n_types = cluster_descriptors[i].n_types;
-
-    Eigen::MatrixXd kern_mat =
-        Eigen::MatrixXd::Zero(n_sparse + n_envs, n_sparse + n_envs);
-
-    int n1 = 0; // Sparse descriptor counter 1
-    int n2 = 0; // Cluster descriptor counter 1
 
     // TODO: Generalize to allow comparisons across types.
-    for (int j = 0; j < n_types; j++) {
-      int n3 = 0; // Sparse descriptor counter 2
-      int n4 = 0; // Cluster descriptor counter 2
-      int n5 = sparse_descriptors[i].n_clusters_by_type[j];
-      int n6 = cluster_descriptors[i].n_clusters_by_type[j];
-
-      for (int k = 0; k < n_types; k++){
-        int n7 = sparse_descriptors[i].n_clusters_by_type[k];
-        int n8 = cluster_descriptors[i].n_clusters_by_type[k];
-
-        Eigen::MatrixXd prev_vals_1 = prev_block.block(n1, n4, n5, n8);
-        Eigen::MatrixXd prev_vals_2 = prev_block.block(n3, n2, n7, n6);
-        Eigen::MatrixXd self_vals = self_block.block(n2, n4, n6, n8);
-
-        kern_mat.block(n1 + n2, n3 + n4, n5, n7) =
-          Kuu_kernels[i].block(n1, n3, n5, n7);
-        kern_mat.block(n1 + n2, n3 + n4 + n7, n5, n8) =
-          prev_vals_1;
-        kern_mat.block(n1 + n2 + n5, n3 + n4, n6, n7) =
-          prev_vals_2.transpose();
-        kern_mat.block(n1 + n2 + n5, n3 + n4 + n7, n6, n8) =
-          self_vals;
-
-        n3 += n7;
-        n4 += n8;
+    std::vector<int> old_positions, new_positions;
+    insertion_positions(sparse_descriptors[i].n_clusters_by_type,
+                        cluster_descriptors[i].n_clusters_by_type, 0,
+                        old_positions, new_positions);
+
+    GrowableMatrix &kern_mat = Kuu_kernels[i];
+    kern_mat.insert_rows(new_positions);
+    kern_mat.insert_cols(new_positions);
+    for (int a = 0; a < n_envs; a++) {
+      int p = new_positions[a];
+      for (int b = 0; b < n_sparse; b++) {
+        int q = old_positions[b];
+        kern_mat(p, q) = kern_mat(q, p) = prev_block(b, a);
+      }
+      for (int b = 0; b < n_envs; b++) {
+        kern_mat(p, new_positions[b]) = self_block(a, b);
       }
-      n1 += n5;
-      n2 += n6;
     }
-    Kuu_kernels[i] = kern_mat;
+
+    for (int a = 0; a < n_envs; a++)
+      stacked_positions.push_back(offset + new_positions[a]);
+    offset += kern_mat.rows();
 
     // Update sparse count.
     this->n_sparse += n_envs;
+  }
+
+  // Update the stacked Kuu.
+  Kuu.insert_rows(stacked_positions);
+  Kuu.insert_cols(stacked_positions);
+  offset = 0;
+  int count = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    int size = Kuu_kernels[i].rows();
+    int n_envs = cluster_descriptors[i].n_clusters;
+    for (int a = 0; a < n_envs; a++) {
+      int p = stacked_positions[count + a];
+      Kuu.block(p, offset, 1, size) = Kuu_kernels[i].row(p - offset);
+      Kuu.block(offset, p, size, 1) = Kuu_kernels[i].col(p - offset);
     }
+    count += n_envs;
+    offset += size;
   }
+}
 
 void SparseGP ::update_Kuf(
     const std::vector<ClusterDescriptor> &cluster_descriptors) {
 
   // Compute kernels between new sparse environments and training structures.
+  // The existing rows are moved in place to make room for the new ones.
+  std::vector<int> stacked_positions;
+  int offset = 0;
   for (int i = 0; i < n_kernels; i++) {
-    int n_sparse = sparse_descriptors[i].n_clusters;
-    int n_envs = cluster_descriptors[i].n_clusters;
     int n_types = cluster_descriptors[i].n_types;
 
-    // Precompute indices.
-    Eigen::ArrayXi inds = Eigen::ArrayXi::Zero(n_types + 1);
-    int counter = 0;
-    for (int j = 0; j < n_types; j++) {
-      int t1 = sparse_descriptors[i].n_clusters_by_type[j];
-      int t2 = cluster_descriptors[i].n_clusters_by_type[j];
-      counter += t1 + t2;
-      inds(j + 1) = counter;
-    }
+    std::vector<int> old_positions, new_positions;
+    insertion_positions(sparse_descriptors[i].n_clusters_by_type,
+                        cluster_descriptors[i].n_clusters_by_type, 0,
+                        old_positions, new_positions);
 
-    Eigen::MatrixXd kern_mat =
-        Eigen::MatrixXd::Zero(n_sparse + n_envs, n_labels);
+    GrowableMatrix &kern_mat = Kuf_kernels[i];
+    kern_mat.conservativeResize(kern_mat.rows(), n_labels);
+    kern_mat.insert_rows(new_positions);
 
 #pragma omp parallel for
     for (int j = 0; j < n_strucs; j++) {
@@ -418,18 +558,16 @@ void SparseGP ::update_Kuf(
           cluster_descriptors[i], training_structures[j].descriptors[i],
           kernels[i]->kernel_hyperparameters);
 
-      int n1 = 0; // Sparse descriptor count
       int n2 = 0; // Cluster descriptor count
       for (int k = 0; k < n_types; k++) {
         int current_count = 0;
-        int u_ind = inds(k);
-        int n3 = sparse_descriptors[i].n_clusters_by_type[k];
         int n4 = cluster_descriptors[i].n_clusters_by_type[k];
+        if (n4 == 0)
+          continue;
+        int u_ind = new_positions[n2];
 
         if (training_structures[j].energy.size() != 0) {
-          kern_mat.block(u_ind, label_count(j), n3, 1) =
-              Kuf_kernels[i].block(n1, label_count(j), n3, 1);
-          kern_mat.block(u_ind + n3, label_count(j), n4, 1) =
+          kern_mat.block(u_ind, label_count(j), n4, 1) =
               envs_struc_kernels.block(n2, 0, n4, 1);
 
           current_count += 1;
@@ -438,138 +576,228 @@ void SparseGP ::update_Kuf(
         if (training_structures[j].forces.size() != 0) {
           std::vector<int> atom_indices = training_atom_indices[j];
           for (int a = 0; a < atom_indices.size(); a++) {  // Allow adding a subset of force labels
-            kern_mat.block(u_ind, label_count(j) + current_count, n3, 3) =
-                Kuf_kernels[i].block(n1, label_count(j) + current_count, n3, 3);
-            kern_mat.block(u_ind + n3, label_count(j) + current_count, n4, 3) =
+            kern_mat.block(u_ind, label_count(j) + current_count, n4, 3) =
                 envs_struc_kernels.block(n2, 1 + atom_indices[a] * 3, n4, 3);
             current_count += 3;
           }
         }
 
         if (training_structures[j].stresses.size() != 0) {
-          kern_mat.block(u_ind, label_count(j) + current_count, n3, 6) =
-              Kuf_kernels[i].block(n1, label_count(j) + current_count, n3, 6);
-          kern_mat.block(u_ind + n3, label_count(j) + current_count, n4, 6) =
+          kern_mat.block(u_ind, label_count(j) + current_count, n4, 6) =
               envs_struc_kernels.block(n2, 1 + n_atoms * 3, n4, 6);
         }
 
-        n1 += n3;
         n2 += n4;
       }
     }
-    Kuf_kernels[i] = kern_mat;
+
+    for (int a = 0; a < new_positions.size(); a++)
+      stacked_positions.push_back(offset + new_positions[a]);
+    offset += kern_mat.rows();
+  }
+
+  // Update the stacked Kuf.
+  Kuf.conservativeResize(Kuf.rows(), n_labels);
+  Kuf.insert_rows(stacked_positions);
+  offset = 0;
+  int count = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    int n_envs = cluster_descriptors[i].n_clusters;
+    for (int a = 0; a < n_envs; a++) {
+      int p = stacked_positions[count + a];
+      Kuf.row(p) = Kuf_kernels[i].row(p - offset);
+    }
+    count += n_envs;
+    offset += Kuf_kernels[i].rows();
   }
 }
 
+// Structures built with prediction_only have no descriptor force
+// derivatives, which the kernel matrices need.
+static void check_force_derivatives(const Structure &structure,
+                                    const std::string &caller) {
+  if (structure.prediction_only)
+    throw std::invalid_argument(
+        caller + " needs descriptor force derivatives, but the structure "
+                 "was built with prediction_only. Use predict_mean_fast, or "
+                 "build the structure without prediction_only.");
+}
+
 void SparseGP ::add_training_structure(const Structure &structure,
                                        const std::vector<int> atom_indices, 
                                        double rel_e_noise,
                                        double rel_f_noise,
                                        double rel_s_noise) {
-  // Allow adding a subset of force labels
-  initialize_sparse_descriptors(structure);
+  add_training_structures({structure}, {atom_indices}, {rel_e_noise},
+                          {rel_f_noise}, {rel_s_noise});
+}
 
-  int n_atoms = structure.noa;
-  int n_energy = structure.energy.size();
-  int n_force = 0;
-  std::vector<int> atoms;
-  if (atom_indices[0] == -1) { // add all atoms
-    n_force = structure.forces.size();
-    for (int i = 0; i < n_atoms; i++) {
-      atoms.push_back(i);
+void SparseGP ::add_training_structures(
+    const std::vector<Structure> &structures,
+    const std::vector<std::vector<int>> &atom_indices,
+    const std::vector<double> &rel_e_noise,
+    const std::vector<double> &rel_f_noise,
+    const std::vector<double> &rel_s_noise) {
+
+  int n_added = structures.size();
+  for (int size : {atom_indices.size(), rel_e_noise.size(),
+                   rel_f_noise.size(), rel_s_noise.size()}) {
+    if (size != 0 && size != n_added)
+      throw std::invalid_argument(
+          "Atom indices and relative noises must be empty or given for "
+          "each structure.");
+  }
+  if (n_added == 0)
+    return;
+  for (const Structure &structure : structures)
+    check_force_derivatives(structure, "add_training_structure");
+
+  initialize_sparse_descriptors(structures[0]);
+
+  // Allow adding a subset of force labels. Find the force atoms and the
+  // first label of each structure.
+  std::vector<std::vector<int>> atoms(n_added);
+  std::vector<int> label_start(n_added + 1, n_labels);
+  for (int n = 0; n < n_added; n++) {
+    const Structure &structure = structures[n];
+    int n_force = 0;
+    if (atom_indices.size() == 0 ||
+        (atom_indices[n].size() != 0 && atom_indices[n][0] == -1)) {
+      // add all atoms
+      n_force = structure.forces.size();
+      for (int i = 0; i < structure.noa; i++) {
+        atoms[n].push_back(i);
+      }
+    } else {
+      atoms[n] = atom_indices[n];
+      n_force = atoms[n].size() * 3;
     }
-  } else {
-    atoms = atom_indices;
-    n_force = atoms.size() * 3;
-  }
-  training_atom_indices.push_back(atoms);
-  int n_stress = structure.stresses.size();
-  int n_struc_labels = n_energy + n_force + n_stress;
-
-  // Update labels.
-  label_count.conservativeResize(training_structures.size() + 2);
-  label_count(training_structures.size() + 1) = n_labels + n_struc_labels;
-  y.conservativeResize(n_labels + n_struc_labels);
-  y.segment(n_labels, n_energy) = structure.energy;
-  y.segment(n_labels + n_energy + n_force, n_stress) = structure.stresses;
-  for (int a = 0; a < atoms.size(); a++) {
-    y.segment(n_labels + n_energy + a * 3, 3) = structure.forces.segment(atoms[a] * 3, 3);
-  }
-
-  // Update noise.
-  noise_vector.conservativeResize(n_labels + n_struc_labels);
-  noise_vector.segment(n_labels, n_energy) =
-      Eigen::VectorXd::Constant(n_energy, 1 / (energy_noise * energy_noise * rel_e_noise * rel_e_noise));
-  noise_vector.segment(n_labels + n_energy, n_force) =
-      Eigen::VectorXd::Constant(n_force, 1 / (force_noise * force_noise * rel_f_noise * rel_f_noise));
-  noise_vector.segment(n_labels + n_energy + n_force, n_stress) =
-      Eigen::VectorXd::Constant(n_stress, 1 / (stress_noise * stress_noise * rel_s_noise * rel_s_noise));
-
-  // Save "1" vector for energy, force and stress noise, for likelihood gradient calculation
-  e_noise_one.conservativeResize(n_labels + n_struc_labels);
-  f_noise_one.conservativeResize(n_labels + n_struc_labels);
-  s_noise_one.conservativeResize(n_labels + n_struc_labels);
-
-  e_noise_one.segment(n_labels, n_struc_labels) = Eigen::VectorXd::Zero(n_struc_labels);
-  f_noise_one.segment(n_labels, n_struc_labels) = Eigen::VectorXd::Zero(n_struc_labels);
-  s_noise_one.segment(n_labels, n_struc_labels) = Eigen::VectorXd::Zero(n_struc_labels);
-
-  e_noise_one.segment(n_labels, n_energy) =
-      Eigen::VectorXd::Constant(n_energy, 1 / (rel_e_noise * rel_e_noise));
-  f_noise_one.segment(n_labels + n_energy, n_force) =
-      Eigen::VectorXd::Constant(n_force, 1 / (rel_f_noise * rel_f_noise));
-  s_noise_one.segment(n_labels + n_energy + n_force, n_stress) =
-      Eigen::VectorXd::Constant(n_stress, 1 / (rel_s_noise * rel_s_noise));
-
-  inv_e_noise_one.conservativeResize(n_labels + n_struc_labels);
-  inv_f_noise_one.conservativeResize(n_labels + n_struc_labels);
-  inv_s_noise_one.conservativeResize(n_labels + n_struc_labels);
-
-  inv_e_noise_one.segment(n_labels, n_struc_labels) = Eigen::VectorXd::Zero(n_struc_labels);
-  inv_f_noise_one.segment(n_labels, n_struc_labels) = Eigen::VectorXd::Zero(n_struc_labels);
-  inv_s_noise_one.segment(n_labels, n_struc_labels) = Eigen::VectorXd::Zero(n_struc_labels);
-
-  inv_e_noise_one.segment(n_labels, n_energy) =
-      Eigen::VectorXd::Constant(n_energy, rel_e_noise * rel_e_noise);
-  inv_f_noise_one.segment(n_labels + n_energy, n_force) =
-      Eigen::VectorXd::Constant(n_force, rel_f_noise * rel_f_noise);
-  inv_s_noise_one.segment(n_labels + n_energy + n_force, n_stress) =
-      Eigen::VectorXd::Constant(n_stress, rel_s_noise * rel_s_noise);
+    label_start[n + 1] = label_start[n] + structure.energy.size() + n_force +
+                         structure.stresses.size();
+  }
+  int n_total = label_start[n_added];
+  int n_new = n_total - n_labels;
+
+  // Update labels and noise. Every array is resized once.
+  label_count.conservativeResize(n_strucs + n_added + 1);
+  y.conservativeResize(n_total);
+  noise_vector.conservativeResize(n_total);
+
+  // "1" vectors for energy, force and stress noise, for likelihood gradient
+  // calculation
+  for (Eigen::VectorXd *noise_one :
+       {&e_noise_one, &f_noise_one, &s_noise_one, &inv_e_noise_one,
+        &inv_f_noise_one, &inv_s_noise_one}) {
+    noise_one->conservativeResize(n_total);
+    noise_one->tail(n_new).setZero();
+  }
 
-  // Update Kuf kernels.
-  Eigen::MatrixXd envs_struc_kernels;
-  for (int i = 0; i < n_kernels; i++) {
-    int n_sparse = sparse_descriptors[i].n_clusters;
+  for (int n = 0; n < n_added; n++) {
+    const Structure &structure = structures[n];
+    double e_rel = rel_e_noise.size() == 0 ? 1 : rel_e_noise[n];
+    double f_rel = rel_f_noise.size() == 0 ? 1 : rel_f_noise[n];
+    double s_rel = rel_s_noise.size() == 0 ? 1 : rel_s_noise[n];
+
+    int start = label_start[n];
+    int n_energy = structure.energy.size();
+    int n_stress = structure.stresses.size();
+    int n_force = label_start[n + 1] - start - n_energy - n_stress;
+    label_count(n_strucs + n + 1) = label_start[n + 1];
+
+    y.segment(start, n_energy) = structure.energy;
+    y.segment(start + n_energy + n_force, n_stress) = structure.stresses;
+    if (structure.forces.size() != 0) {
+      for (size_t a = 0; a < atoms[n].size(); a++) {
+        y.segment(start + n_energy + a * 3, 3) =
+            structure.forces.segment(atoms[n][a] * 3, 3);
+      }
+    }
 
-    envs_struc_kernels = // contain all atoms
-        kernels[i]->envs_struc(sparse_descriptors[i], structure.descriptors[i],
-                               kernels[i]->kernel_hyperparameters);
+    noise_vector.segment(start, n_energy) = Eigen::VectorXd::Constant(
+        n_energy, 1 / (energy_noise * energy_noise * e_rel * e_rel));
+    noise_vector.segment(start + n_energy, n_force) = Eigen::VectorXd::Constant(
+        n_force, 1 / (force_noise * force_noise * f_rel * f_rel));
+    noise_vector.segment(start + n_energy + n_force, n_stress) =
+        Eigen::VectorXd::Constant(
+            n_stress, 1 / (stress_noise * stress_noise * s_rel * s_rel));
+
+    e_noise_one.segment(start, n_energy).setConstant(1 / (e_rel * e_rel));
+    f_noise_one.segment(start + n_energy, n_force)
+        .setConstant(1 / (f_rel * f_rel));
+    s_noise_one.segment(start + n_energy + n_force, n_stress)
+        .setConstant(1 / (s_rel * s_rel));
+
+    inv_e_noise_one.segment(start, n_energy).setConstant(e_rel * e_rel);
+    inv_f_noise_one.segment(start + n_energy, n_force).setConstant(f_rel * f_rel);
+    inv_s_noise_one.segment(start + n_energy + n_force, n_stress)
+        .setConstant(s_rel * s_rel);
+  }
 
-    Kuf_kernels[i].conservativeResize(n_sparse, n_labels + n_struc_labels);
-    Kuf_kernels[i].block(0, n_labels, n_sparse, n_energy) =
-        envs_struc_kernels.block(0, 0, n_sparse, n_energy);
-    Kuf_kernels[i].block(0, n_labels + n_energy + n_force, n_sparse, n_stress) =
-        envs_struc_kernels.block(0, 1 + n_atoms * 3, n_sparse, n_stress);
+  // Update Kuf kernels. Columns are appended to reserved storage, which is
+  // sized before the structures are evaluated in parallel. A single
+  // structure is evaluated outside a parallel region, so that the parallel
+  // loops of envs_struc are not nested and keep all threads.
+  for (int i = 0; i < n_kernels; i++)
+    Kuf_kernels[i].conservativeResize(sparse_descriptors[i].n_clusters,
+                                      n_total);
+
+#pragma omp parallel for if(n_added > 1)
+  for (int n = 0; n < n_added; n++) {
+    const Structure &structure = structures[n];
+    int n_atoms = structure.noa;
+    int start = label_start[n];
+    int n_energy = structure.energy.size();
+    int n_stress = structure.stresses.size();
+    int n_force = label_start[n + 1] - start - n_energy - n_stress;
 
-    // Only add forces from `atoms`
-    for (int a = 0; a < atoms.size(); a++) {
-      Kuf_kernels[i].block(0, n_labels + n_energy + a * 3, n_sparse, 3) =
-          envs_struc_kernels.block(0, 1 + atoms[a] * 3, n_sparse, 3); // if n_energy=0, we can not use n_energy but 1
+    for (int i = 0; i < n_kernels; i++) {
+      int n_sparse = sparse_descriptors[i].n_clusters;
+      Eigen::MatrixXd envs_struc_kernels = // contain all atoms
+          kernels[i]->envs_struc(sparse_descriptors[i],
+                                 structure.descriptors[i],
+                                 kernels[i]->kernel_hyperparameters);
+
+      GrowableMatrix &kern_mat = Kuf_kernels[i];
+      kern_mat.block(0, start, n_sparse, n_energy) =
+          envs_struc_kernels.block(0, 0, n_sparse, n_energy);
+      kern_mat.block(0, start + n_energy + n_force, n_sparse, n_stress) =
+          envs_struc_kernels.block(0, 1 + n_atoms * 3, n_sparse, n_stress);
+
+      // Only add forces from `atoms`
+      if (structure.forces.size() != 0) {
+        for (size_t a = 0; a < atoms[n].size(); a++) {
+          kern_mat.block(0, start + n_energy + a * 3, n_sparse, 3) =
+              envs_struc_kernels.block(0, 1 + atoms[n][a] * 3, n_sparse, 3);
+        }
+      }
     }
   }
 
-  // Update label count.
-  n_energy_labels += n_energy;
-  n_force_labels += n_force;
-  n_stress_labels += n_stress;
-  n_labels += n_struc_labels;
-
-  // Store training structure.
-  training_structures.push_back(structure);
-  n_strucs += 1;
+  Kuf.conservativeResize(n_sparse, n_total);
+  int count = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    int n_sparse = sparse_descriptors[i].n_clusters;
+    Kuf.block(count, n_labels, n_sparse, n_new) =
+        Kuf_kernels[i].rightCols(n_new);
+    count += n_sparse;
+  }
 
-  // Update Kuf.
-  stack_Kuf();
+  // Update label count.
+  for (int n = 0; n < n_added; n++) {
+    int n_energy = structures[n].energy.size();
+    int n_stress = structures[n].stresses.size();
+    n_energy_labels += n_energy;
+    n_stress_labels += n_stress;
+    n_force_labels += label_start[n + 1] - label_start[n] - n_energy - n_stress;
+  }
+  n_labels = n_total;
+
+  // Store training structures.
+  training_structures.insert(training_structures.end(), structures.begin(),
+                             structures.end());
+  training_atom_indices.insert(training_atom_indices.end(), atoms.begin(),
+                               atoms.end());
+  n_strucs += n_added;
 }
 
 void SparseGP ::stack_Kuu() {
@@ -595,18 +823,19 @@ void SparseGP ::stack_Kuf() {
 }
 
 void SparseGP ::update_matrices_QR() {
+  if (!update_matrices_incremental())
+    compute_matrices_QR();
+}
+
+void SparseGP ::compute_matrices_QR() {
   // Store square root of noise vector.
   Eigen::VectorXd noise_vector_sqrt = sqrt(noise_vector.array());
 
   // Cholesky decompose Kuu.
   Eigen::LLT<Eigen::MatrixXd> chol(
       Kuu + Kuu_jitter * Eigen::MatrixXd::Identity(Kuu.rows(), Kuu.cols()));
-
-  // Get the inverse of Kuu from Cholesky decomposition.
-  Eigen::MatrixXd Kuu_eye = Eigen::MatrixXd::Identity(Kuu.rows(), Kuu.cols());
-  L_inv = chol.matrixL().solve(Kuu_eye);
-  L_diag = L_inv.diagonal();
-  Kuu_inverse = L_inv.transpose() * L_inv;
+  L_factor = chol.matrixL();
+  L_diag = L_factor.diagonal().cwiseInverse();
 
   // Form A matrix.
   Eigen::MatrixXd A =
@@ -621,34 +850,232 @@ void SparseGP ::update_matrices_QR() {
 
   // QR decompose A.
   Eigen::HouseholderQR<Eigen::MatrixXd> qr(A);
-  Eigen::VectorXd Q_b = qr.householderQ().transpose() * b;
-  R_inv = qr.matrixQR().block(0, 0, Kuu.cols(), Kuu.cols())
-                       .triangularView<Eigen::Upper>()
-                       .solve(Kuu_eye);
-  R_inv_diag = R_inv.diagonal();
-  alpha = R_inv * Q_b;
-  Sigma = R_inv * R_inv.transpose();
+  Eigen::VectorXd Q_b =
+      (qr.householderQ().transpose() * b).head(Kuu.cols());
+
+  // Store the factor with a positive diagonal, which leaves R^T R unchanged
+  // and flips the signs of the corresponding entries of Q^T b.
+  R_factor = qr.matrixQR().block(0, 0, Kuu.cols(), Kuu.cols())
+                 .triangularView<Eigen::Upper>();
+  for (int i = 0; i < R_factor.rows(); i++) {
+    if (R_factor(i, i) < 0) {
+      R_factor.row(i) *= -1;
+      Q_b(i) *= -1;
+    }
+  }
+  R_inv_diag = R_factor.diagonal().cwiseInverse();
+  alpha = R_factor.triangularView<Eigen::Upper>().solve(Q_b);
+  clear_inverses();
+  factored_labels = n_labels;
+  factored_jitter = Kuu_jitter;
+  factored_hyperparameters = hyperparameters;
+  factored_clusters_by_type.clear();
+  for (int i = 0; i < n_kernels; i++) {
+    factored_clusters_by_type.push_back(
+        sparse_descriptors[i].n_clusters_by_type);
+  }
+}
+
+bool SparseGP ::update_matrices_incremental() {
+  if (R_factor.rows() == 0 || factored_labels > n_labels ||
+      factored_jitter != Kuu_jitter ||
+      factored_hyperparameters.size() != hyperparameters.size() ||
+      factored_hyperparameters != hyperparameters ||
+      factored_clusters_by_type.size() != n_kernels)
+    return false;
+
+  // Find the stacked positions of the factored and the new sparse points.
+  std::vector<int> old_positions, new_positions;
+  int position = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    const std::vector<int> &current = sparse_descriptors[i].n_clusters_by_type;
+    const std::vector<int> &factored = factored_clusters_by_type[i];
+    if (factored.size() != current.size())
+      return false;
+    std::vector<int> added(current.size());
+    for (int s = 0; s < current.size(); s++) {
+      if (factored[s] > current[s])
+        return false;
+      added[s] = current[s] - factored[s];
+    }
+    insertion_positions(factored, added, position, old_positions,
+                        new_positions);
+    position += sparse_descriptors[i].n_clusters;
+  }
+  if (position != n_sparse || old_positions.size() != R_factor.rows())
+    return false;
+
+  int n_old_labels = factored_labels;
+  int n_new_sparse = new_positions.size();
+  if (n_new_sparse == 0 && n_old_labels == n_labels)
+    return true;
+  bool extended = true;
+
+  // The factor also represents the current solution, and is restored if it
+  // cannot be extended.
+  FactorMatrix old_factor = R_factor;
+
+  // Border the factor with the new sparse points, using the factored labels
+  // only. The new columns of Kuu + jitter + Kuf Lambda Kfu are computed
+  // together.
+  if (n_new_sparse > 0) {
+    Eigen::MatrixXd weighted_rows(n_new_sparse, n_old_labels);
+    for (int j = 0; j < n_new_sparse; j++) {
+      weighted_rows.row(j) =
+          Kuf.row(new_positions[j]).head(n_old_labels).cwiseProduct(
+              noise_vector.head(n_old_labels).transpose());
+    }
+    Eigen::MatrixXd new_columns =
+        Kuf.leftCols(n_old_labels) * weighted_rows.transpose();
+
+    std::vector<int> members = old_positions;
+    for (int j = 0; j < n_new_sparse && extended; j++) {
+      int p = new_positions[j];
+      new_columns.col(j) += Kuu.col(p);
+      new_columns(p, j) += Kuu_jitter;
+
+      int q = std::lower_bound(members.begin(), members.end(), p) -
+              members.begin();
+      Eigen::VectorXd v(members.size());
+      for (int k = 0; k < members.size(); k++)
+        v(k) = new_columns(members[k], j);
+      extended = insert_factor_column(R_factor, q, v, new_columns(p, j));
+      members.insert(members.begin() + q, p);
+    }
+  }
+
+  // Rotate in the new labels.
+  for (int l = n_old_labels; l < n_labels && extended; l++) {
+    extended = rank_one_update(R_factor, sqrt(noise_vector(l)) * Kuf.col(l), 1);
+  }
+
+  // Check the factor against the system it represents on a fixed random
+  // vector, to catch the loss of accuracy of the downdates.
+  if (extended) {
+    std::mt19937 gen(0);
+    std::normal_distribution<double> dist(0, 1);
+    Eigen::VectorXd probe(n_sparse);
+    for (int i = 0; i < n_sparse; i++)
+      probe(i) = dist(gen);
+    Eigen::VectorXd system_probe =
+        Kuu * probe + Kuu_jitter * probe +
+        Kuf * noise_vector.cwiseProduct(Kuf.transpose() * probe);
+    Eigen::VectorXd factor_probe =
+        R_factor.transpose() *
+        (R_factor.triangularView<Eigen::Upper>() * probe);
+    extended = (factor_probe - system_probe).norm() <=
+               refactorization_tolerance * system_probe.norm();
+  }
+
+  if (!extended) {
+    R_factor = old_factor;
+    return false;
+  }
+
+  // Kuu only changes when sparse points are added.
+  if (n_new_sparse > 0) {
+    Eigen::LLT<Eigen::MatrixXd> chol(
+        Kuu + Kuu_jitter * Eigen::MatrixXd::Identity(n_sparse, n_sparse));
+    L_factor = chol.matrixL();
+    L_diag = L_factor.diagonal().cwiseInverse();
+  }
+
+  // Q^T b is the solution of R^T Q_b = Kuf Lambda y.
+  Eigen::VectorXd Q_b = R_factor.transpose().triangularView<Eigen::Lower>()
+                            .solve(Kuf * noise_vector.cwiseProduct(y));
+  R_inv_diag = R_factor.diagonal().cwiseInverse();
+  alpha = R_factor.triangularView<Eigen::Upper>().solve(Q_b);
+  clear_inverses();
+
+  factored_labels = n_labels;
+  for (int i = 0; i < n_kernels; i++) {
+    factored_clusters_by_type[i] = sparse_descriptors[i].n_clusters_by_type;
+  }
+  return true;
+}
+
+const Eigen::MatrixXd &SparseGP ::L_inv() const {
+  if (L_inv_cache.rows() != L_factor.rows()) {
+    L_inv_cache = L_factor.triangularView<Eigen::Lower>().solve(
+        Eigen::MatrixXd::Identity(L_factor.rows(), L_factor.cols()));
+  }
+  return L_inv_cache;
+}
+
+const Eigen::MatrixXd &SparseGP ::R_inv() const {
+  if (R_inv_cache.rows() != R_factor.rows()) {
+    R_inv_cache = R_factor.triangularView<Eigen::Upper>().solve(
+        Eigen::MatrixXd::Identity(R_factor.rows(), R_factor.cols()));
+  }
+  return R_inv_cache;
+}
+
+const Eigen::MatrixXd &SparseGP ::Kuu_inverse() const {
+  if (Kuu_inverse_cache.rows() != L_factor.rows()) {
+    const Eigen::MatrixXd &L_inverse = L_inv();
+    Kuu_inverse_cache.noalias() = L_inverse.transpose() * L_inverse;
+  }
+  return Kuu_inverse_cache;
+}
+
+const Eigen::MatrixXd &SparseGP ::Sigma() const {
+  if (Sigma_cache.rows() != R_factor.rows()) {
+    const Eigen::MatrixXd &R_inverse = R_inv();
+    Sigma_cache.noalias() = R_inverse * R_inverse.transpose();
+  }
+  return Sigma_cache;
+}
+
+void SparseGP ::clear_inverses() {
+  Sigma_cache.resize(0, 0);
+  Kuu_inverse_cache.resize(0, 0);
+  R_inv_cache.resize(0, 0);
+  L_inv_cache.resize(0, 0);
 }
 
 void SparseGP ::predict_mean(Structure &test_structure) {
+  check_force_derivatives(test_structure, "predict_mean");
 
   int n_atoms = test_structure.noa;
   int n_out = 1 + 3 * n_atoms + 6;
 
-  Eigen::MatrixXd kernel_mat = Eigen::MatrixXd::Zero(n_sparse, n_out);
+  Eigen::VectorXd mean_efs = Eigen::VectorXd::Zero(n_out);
   int count = 0;
   for (int i = 0; i < Kuu_kernels.size(); i++) {
     int size = Kuu_kernels[i].rows();
-    kernel_mat.block(count, 0, size, n_out) = kernels[i]->envs_struc(
+    mean_efs += kernels[i]->envs_struc_contracted(
         sparse_descriptors[i], test_structure.descriptors[i],
-        kernels[i]->kernel_hyperparameters);
+        alpha.segment(count, size), kernels[i]->kernel_hyperparameters);
     count += size;
   }
 
-  test_structure.mean_efs = kernel_mat.transpose() * alpha;
+  test_structure.mean_efs = mean_efs;
 }
 
-void SparseGP ::predict_SOR(Structure &test_structure) {
+void SparseGP ::predict_mean_fast(Structure &test_structure) {
+
+  int n_atoms = test_structure.noa;
+  int n_out = 1 + 3 * n_atoms + 6;
+
+  Eigen::VectorXd mean_efs = Eigen::VectorXd::Zero(n_out);
+  std::vector<Eigen::MatrixXd> gradients;
+  int count = 0;
+  for (int i = 0; i < Kuu_kernels.size(); i++) {
+    int size = Kuu_kernels[i].rows();
+    mean_efs(0) += kernels[i]->envs_struc_energy_gradient(
+        sparse_descriptors[i], test_structure.descriptors[i],
+        alpha.segment(count, size), kernels[i]->kernel_hyperparameters,
+        gradients);
+    test_structure.descriptor_calculators[i]->backpropagate(
+        test_structure, test_structure.descriptors[i], gradients, mean_efs);
+    count += size;
+  }
+
+  test_structure.mean_efs = mean_efs;
+}
+
+void SparseGP ::predict_SOR(Structure &test_structure, int block_size) {
+  check_force_derivatives(test_structure, "predict_SOR");
 
   int n_atoms = test_structure.noa;
   int n_out = 1 + 3 * n_atoms + 6;
@@ -664,12 +1091,16 @@ void SparseGP ::predict_SOR(Structure &test_structure) {
   }
 
   test_structure.mean_efs = kernel_mat.transpose() * alpha;
-  Eigen::MatrixXd variance_sqrt = kernel_mat.transpose() * R_inv;
-  test_structure.variance_efs =
-      (variance_sqrt * variance_sqrt.transpose()).diagonal();
+
+  // Sigma = R^-1 R^-T, so the SOR variances are the squared norms of the
+  // columns of R^-T kernel_mat.
+  test_structure.variance_efs = squared_column_norms(
+      R_factor.transpose().triangularView<Eigen::Lower>(), kernel_mat,
+      block_size);
 }
 
-void SparseGP ::predict_DTC(Structure &test_structure) {
+void SparseGP ::predict_DTC(Structure &test_structure, int block_size) {
+  check_force_derivatives(test_structure, "predict_DTC");
 
   int n_atoms = test_structure.noa;
   int n_out = 1 + 3 * n_atoms + 6;
@@ -694,13 +1125,19 @@ void SparseGP ::predict_DTC(Structure &test_structure) {
                                             kernels[i]->kernel_hyperparameters);
   }
 
-  Q_self = (kernel_mat.transpose() * Kuu_inverse * kernel_mat).diagonal();
-  V_SOR = (kernel_mat.transpose() * Sigma * kernel_mat).diagonal();
+  // Kuu_inverse = L^-T L^-1 and Sigma = R^-1 R^-T.
+  Q_self = squared_column_norms(L_factor.triangularView<Eigen::Lower>(),
+                                kernel_mat, block_size);
+  V_SOR = squared_column_norms(
+      R_factor.transpose().triangularView<Eigen::Lower>(), kernel_mat,
+      block_size);
 
   test_structure.variance_efs = K_self - Q_self + V_SOR;
 }
 
 void SparseGP ::predict_local_uncertainties(Structure &test_structure) {
+  check_force_derivatives(test_structure, "predict_local_uncertainties");
+
   int n_atoms = test_structure.noa;
   int n_out = 1 + 3 * n_atoms + 6;
 
@@ -722,12 +1159,45 @@ void SparseGP ::predict_local_uncertainties(Structure &test_structure) {
 
 }
 
+void SparseGP ::update_kernel_bases() {
+  if (Kuu_bases.size() == n_kernels && base_sparse == n_sparse &&
+      base_labels == n_labels)
+    return;
+
+  Kuu_bases.clear();
+  Kuf_bases.clear();
+  for (int i = 0; i < n_kernels; i++) {
+    Kuu_bases.push_back(
+        kernels[i]->Kuu_base(sparse_descriptors[i], Kuu_kernels[i]));
+    Kuf_bases.push_back(kernels[i]->Kuf_base(
+        sparse_descriptors[i], training_structures, training_atom_indices, i,
+        Kuf_kernels[i]));
+  }
+  base_sparse = n_sparse;
+  base_labels = n_labels;
+}
+
+std::vector<Eigen::MatrixXd>
+SparseGP ::compute_Kuu_grad(int i, const Eigen::VectorXd &hyps) {
+  update_kernel_bases();
+  if (Kuu_bases[i].size() != 0)
+    return kernels[i]->base_kernel_grad(Kuu_bases[i], hyps);
+  return kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu_kernels[i], hyps);
+}
+
+std::vector<Eigen::MatrixXd>
+SparseGP ::compute_Kuf_grad(int i, const Eigen::VectorXd &hyps) {
+  update_kernel_bases();
+  if (Kuf_bases[i].size() != 0)
+    return kernels[i]->base_kernel_grad(Kuf_bases[i], hyps);
+  return kernels[i]->Kuf_grad(sparse_descriptors[i], training_structures, i,
+                              Kuf_kernels[i], hyps);
+}
+
 void SparseGP ::compute_likelihood_stable() {
   // Compute inverse of Qff from Sigma.
-  Eigen::MatrixXd noise_diag = noise_vector.asDiagonal();
-
-  data_fit =
-      -(1. / 2.) * y.transpose() * noise_diag * (y - Kuf.transpose() * alpha);
+  data_fit = -(1. / 2.) * y.transpose() *
+             noise_vector.cwiseProduct(y - Kuf.transpose() * alpha);
   constant_term = -(1. / 2.) * n_labels * log(2 * M_PI);
 
   // Compute complexity penalty.
@@ -781,15 +1251,30 @@ double SparseGP ::compute_likelihood_gradient_stable(bool precomputed_KnK) {
 
   // Compute Kuu and Kuf matrices and gradients.
   int n_hyps_total = hyperparameters.size();
+  std::vector<Eigen::MatrixXd> Kuu_grad, Kuf_grad;
 
-  //Eigen::MatrixXd Kuu_mat = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
-  //Eigen::MatrixXd Kuf_mat = Eigen::MatrixXd::Zero(n_sparse, n_labels);
-
-  std::vector<Eigen::MatrixXd> Kuu_grad, Kuf_grad, Kuu_grads, Kuf_grads;
-
-  int n_hyps, hyp_index = 0, grad_index = 0;
+  int n_hyps, hyp_index = 0;
   Eigen::VectorXd hyps_curr;
 
+  // The trace terms are evaluated as elementwise sums, tr(A B) = sum(A o B^T),
+  // so that no n_sparse x n_sparse products are formed per hyperparameter.
+  // Sigma Kuf gives tr(dKuf Lambda Kfu Sigma) for each hyperparameter. It is
+  // found as R^-1 R^-T Kuf with triangular solves, since the explicit Sigma
+  // loses accuracy for large training sets, and the traces of the noise
+  // terms are the squared column norms of R^-T Kuf.
+  const Eigen::MatrixXd &Sigma_mat = Sigma();
+  Eigen::MatrixXd Sigma_Kuf_noise;
+  Eigen::VectorXd label_traces;
+  if (!precomputed_KnK) {
+    Eigen::MatrixXd R_inv_T_Kuf =
+        R_factor.transpose().triangularView<Eigen::Lower>().solve(Kuf);
+    label_traces = R_inv_T_Kuf.colwise().squaredNorm().transpose();
+    Sigma_Kuf_noise =
+        R_factor.triangularView<Eigen::Upper>().solve(R_inv_T_Kuf) *
+        noise_vector.asDiagonal();
+  }
+  Eigen::VectorXd noise_residual = noise_vector.cwiseProduct(y_K_alpha);
+
   int count = 0;
   Eigen::VectorXd complexity_grad = Eigen::VectorXd::Zero(n_hyps_total);
   Eigen::VectorXd datafit_grad = Eigen::VectorXd::Zero(n_hyps_total);
@@ -799,53 +1284,50 @@ double SparseGP ::compute_likelihood_gradient_stable(bool precomputed_KnK) {
     hyps_curr = hyperparameters.segment(hyp_index, n_hyps);
     int size = Kuu_kernels[i].rows();
 
-    Kuu_grad = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu_kernels[i], hyps_curr);
+    Kuu_grad = compute_Kuu_grad(i, hyps_curr);
     if (!precomputed_KnK) { 
-      Kuf_grad = kernels[i]->Kuf_grad(sparse_descriptors[i], training_structures,
-                                      i, Kuf_kernels[i], hyps_curr);
+      Kuf_grad = compute_Kuf_grad(i, hyps_curr);
     }
 
-    //Kuu_mat.block(count, count, size, size) = Kuu_grad[0];
-    //Kuf_mat.block(count, 0, size, n_labels) = Kuf_grad[0];
-    Eigen::MatrixXd Kuu_i = Kuu_grad[0];
+    // Kuu is block diagonal, so the block of Kuu_inverse of this kernel is
+    // given by the diagonal block of the Cholesky factor.
+    Eigen::MatrixXd L_block_inv =
+        L_factor.block(count, count, size, size)
+            .triangularView<Eigen::Lower>()
+            .solve(Eigen::MatrixXd::Identity(size, size));
+    Eigen::MatrixXd Kuu_i_inverse = L_block_inv.transpose() * L_block_inv;
+    Eigen::MatrixXd Sigma_i = Sigma_mat.block(count, count, size, size);
+    Eigen::VectorXd alpha_i = alpha.segment(count, size);
 
     for (int j = 0; j < n_hyps; j++) {
-      Kuu_grads.push_back(Eigen::MatrixXd::Zero(n_sparse, n_sparse));
-      Kuu_grads[hyp_index + j].block(count, count, size, size) =
-          Kuu_grad[j + 1];
-
-      if (!precomputed_KnK) { 
-        Kuf_grads.push_back(Eigen::MatrixXd::Zero(n_sparse, n_labels));
-        Kuf_grads[hyp_index + j].block(count, 0, size, n_labels) =
-            Kuf_grad[j + 1];
-      }
+      const Eigen::MatrixXd &dKuu = Kuu_grad[j + 1];
 
-      // Compute Pi matrix and save as an intermediate variable for derivative of complexity
-      Eigen::MatrixXd dK_noise_K;
+      // tr(dKuf Lambda Kfu Sigma), which enters the complexity twice, and
+      // dKfu alpha.
+      double dKnK_trace;
+      Eigen::VectorXd dK_alpha;
       if (precomputed_KnK) {
-        dK_noise_K = compute_dKnK(i);
+        dKnK_trace = compute_dKnK(i)
+                         .cwiseProduct(Sigma_mat.middleRows(count, size))
+                         .sum();
+        dK_alpha = (2. / hyps_curr(j)) *
+                   Kuf.block(count, 0, size, n_labels).transpose() * alpha_i;
       } else {
-        Eigen::MatrixXd noise_diag = noise_vector.asDiagonal();
-        dK_noise_K = Kuf_grads[hyp_index + j] * noise_diag * Kuf.transpose();
+        dKnK_trace =
+            Kuf_grad[j + 1]
+                .cwiseProduct(Sigma_Kuf_noise.middleRows(count, size))
+                .sum();
+        dK_alpha = Kuf_grad[j + 1].transpose() * alpha_i;
       }
-      Eigen::MatrixXd Pi_mat = dK_noise_K + dK_noise_K.transpose() + Kuu_grads[hyp_index + j]; 
 
       // Derivative of complexity over sigma
-      // TODO: the 2nd term is not very stable numerically, because dK_noise_K is very large, and Kuu_grads is small
-      complexity_grad(hyp_index + j) += 1./2. * (Kuu_i.inverse() * Kuu_grad[j + 1]).trace() - 1./2. * (Pi_mat * Sigma).trace(); 
+      complexity_grad(hyp_index + j) =
+          1./2. * Kuu_i_inverse.cwiseProduct(dKuu).sum() -
+          1./2. * (2 * dKnK_trace + Sigma_i.cwiseProduct(dKuu).sum());
 
       // Derivative of data_fit over sigma
-      Eigen::VectorXd dK_alpha;
-      if (precomputed_KnK) {
-        Eigen::MatrixXd dKuf = Eigen::MatrixXd::Zero(n_sparse, n_labels);
-        dKuf.block(count, 0, size, n_labels) = Kuf.block(count, 0, size, n_labels);
-        dK_alpha = (2. / hyps_curr(j)) * dKuf.transpose() * alpha;
-      } else {
-        dK_alpha = Kuf_grads[hyp_index + j].transpose() * alpha;
-      }
-
-      datafit_grad(hyp_index + j) += dK_alpha.transpose() * noise_vector.cwiseProduct(y_K_alpha);
-      datafit_grad(hyp_index + j) += - 1./2. * alpha.transpose() * Kuu_grads[hyp_index + j] * alpha;
+      datafit_grad(hyp_index + j) = dK_alpha.dot(noise_residual) -
+                                    1./2. * alpha_i.dot(dKuu * alpha_i);
 
       likelihood_gradient(hyp_index + j) += complexity_grad(hyp_index + j) + datafit_grad(hyp_index + j); 
     }
@@ -858,14 +1340,24 @@ double SparseGP ::compute_likelihood_gradient_stable(bool precomputed_KnK) {
   double en3 = energy_noise * energy_noise * energy_noise;
   double fn3 = force_noise * force_noise * force_noise;
   double sn3 = stress_noise * stress_noise * stress_noise;
-  
-  compute_KnK(precomputed_KnK);
+
+  double e_trace, f_trace, s_trace;
+  if (precomputed_KnK) {
+    compute_KnK(true);
+    e_trace = KnK_e.cwiseProduct(Sigma_mat).sum();
+    f_trace = KnK_f.cwiseProduct(Sigma_mat).sum();
+    s_trace = KnK_s.cwiseProduct(Sigma_mat).sum();
+  } else {
+    e_trace = e_noise_one.dot(label_traces);
+    f_trace = f_noise_one.dot(label_traces);
+    s_trace = s_noise_one.dot(label_traces);
+  }
   complexity_grad(hyp_index + 0) = - n_energy_labels / energy_noise 
-      + (KnK_e * Sigma).trace() / en3;
+      + e_trace / en3;
   complexity_grad(hyp_index + 1) = - n_force_labels / force_noise 
-      + (KnK_f * Sigma).trace() / fn3;
+      + f_trace / fn3;
   complexity_grad(hyp_index + 2) = - n_stress_labels / stress_noise 
-      + (KnK_s * Sigma).trace() / sn3;
+      + s_trace / sn3;
 
   // Derivative of data_fit over noise  
   datafit_grad(hyp_index + 0) = y_K_alpha.transpose() * e_noise_one.cwiseProduct(y_K_alpha);
@@ -945,18 +1437,14 @@ void SparseGP ::compute_KnK(bool precomputed) {
 
 Eigen::MatrixXd SparseGP ::compute_dKnK(int i) {
   // Compute Kuf_gra * noise_vector * Kfu sperately for energy, force and stress noises
-  Eigen::MatrixXd dKnK = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
+  // Only the rows of kernel i are nonzero, and only those are returned.
+  int size_i = Kuu_kernels[i].rows();
+  Eigen::MatrixXd dKnK = Eigen::MatrixXd::Zero(size_i, n_sparse);
 
   int count_ij = i * n_kernels;
   Eigen::VectorXd hyps_i = kernels[i]->kernel_hyperparameters;
   assert(hyps_i.size() == 1);
 
-  int count_i = 0;
-  for (int r = 0; r < i; r++) {
-    count_i += Kuu_kernels[r].rows();
-  }
-  int size_i = Kuu_kernels[i].rows();
-
   int count_j = 0; 
   for (int j = 0; j < n_kernels; j++) {
     Eigen::VectorXd hyps_j = kernels[j]->kernel_hyperparameters;
@@ -968,9 +1456,9 @@ Eigen::MatrixXd SparseGP ::compute_dKnK(int i) {
     double sig3f = sig3 / (force_noise * force_noise);
     double sig3s = sig3 / (stress_noise * stress_noise);
   
-    dKnK.block(count_i, count_j, size_i, size_j) += Kuf_e_noise_Kfu[count_ij] * sig3e;
-    dKnK.block(count_i, count_j, size_i, size_j) += Kuf_f_noise_Kfu[count_ij] * sig3f;
-    dKnK.block(count_i, count_j, size_i, size_j) += Kuf_s_noise_Kfu[count_ij] * sig3s;
+    dKnK.middleCols(count_j, size_j) += Kuf_e_noise_Kfu[count_ij] * sig3e;
+    dKnK.middleCols(count_j, size_j) += Kuf_f_noise_Kfu[count_ij] * sig3f;
+    dKnK.middleCols(count_j, size_j) += Kuf_s_noise_Kfu[count_ij] * sig3s;
 
     count_ij += 1;
     count_j += size_j;
@@ -986,27 +1474,37 @@ void SparseGP ::compute_likelihood() {
     return;
   }
 
-  // Construct noise vector.
-  Eigen::VectorXd noise = 1 / noise_vector.array();
-
-  Eigen::MatrixXd Qff_plus_lambda =
-      Kuf.transpose() * Kuu_inverse * Kuf +
-      noise.asDiagonal() * Eigen::MatrixXd::Identity(n_labels, n_labels);
+  // Use the Woodbury identity to avoid forming Qff + Lambda^-1, which has
+  // n_labels x n_labels entries. With A = Kuu + Kuf Lambda Kfu,
+  // (Qff + Lambda^-1)^-1 = Lambda - Lambda Kfu A^-1 Kuf Lambda and
+  // log|Qff + Lambda^-1| = log|A| - log|Kuu| - log|Lambda|.
+  //
+  // A is not formed: as in compute_matrices_QR, A = R^T R, where R is the
+  // triangular factor of [Lambda^1/2 Kfu; L^T]. Forming A would square the
+  // condition number of Kuf, which loses accuracy for large training sets.
+  Eigen::MatrixXd Kuu_jitter_mat = Kuu;
+  Kuu_jitter_mat.diagonal().array() += Kuu_jitter;
+  Eigen::LLT<Eigen::MatrixXd> Kuu_chol(Kuu_jitter_mat);
+  Eigen::MatrixXd stacked(n_labels + n_sparse, n_sparse);
+  stacked.topRows(n_labels) =
+      noise_vector.cwiseSqrt().asDiagonal() * Kuf.transpose();
+  stacked.bottomRows(n_sparse) = Kuu_chol.matrixU();
+  Eigen::HouseholderQR<Eigen::MatrixXd> qr(stacked);
+  Eigen::MatrixXd R =
+      qr.matrixQR().topRows(n_sparse).triangularView<Eigen::Upper>();
 
-  // Decompose the matrix. Use QR decomposition instead of LLT/LDLT becaues Qff
-  // becomes nonpositive when the training set is large.
-  Eigen::ColPivHouseholderQR<Eigen::MatrixXd> qr(Qff_plus_lambda);
-  Eigen::VectorXd Q_inv_y = qr.solve(y);
-  Eigen::MatrixXd qr_mat = qr.matrixQR();
   // Compute the complexity penalty.
-  complexity_penalty = 0;
-  for (int i = 0; i < qr_mat.rows(); i++) {
-    complexity_penalty += -log(abs(qr_mat(i, i)));
-  }
-  complexity_penalty /= 2;
-
+  double noise_det = noise_vector.array().log().sum();
+  double Kuu_det = 2 * Kuu_chol.matrixLLT().diagonal().array().log().sum();
+  double A_det = 2 * R.diagonal().array().abs().log().sum();
+  complexity_penalty = (noise_det + Kuu_det - A_det) / 2;
+
+  Eigen::VectorXd noise_y = noise_vector.cwiseProduct(y);
+  Eigen::VectorXd R_inv_T_Kuf_noise_y =
+      R.transpose().triangularView<Eigen::Lower>().solve(Kuf * noise_y);
   double half = 1.0 / 2.0;
-  data_fit = -half * y.transpose() * Q_inv_y;
+  data_fit =
+      -half * (y.dot(noise_y) - R_inv_T_Kuf_noise_y.squaredNorm());
   constant_term = -half * n_labels * log(2 * M_PI);
   log_marginal_likelihood = complexity_penalty + data_fit + constant_term;
 }
@@ -1020,9 +1518,11 @@ SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
   Eigen::MatrixXd Kuu_mat = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
   Eigen::MatrixXd Kuf_mat = Eigen::MatrixXd::Zero(n_sparse, n_labels);
 
-  std::vector<Eigen::MatrixXd> Kuu_grad, Kuf_grad, Kuu_grads, Kuf_grads;
+  // The gradients of each kernel are nonzero only in its rows of Kuu and
+  // Kuf, and are kept as those row blocks.
+  std::vector<std::vector<Eigen::MatrixXd>> Kuu_grads, Kuf_grads;
 
-  int n_hyps, hyp_index = 0, grad_index = 0;
+  int n_hyps, hyp_index = 0;
   Eigen::VectorXd hyps_curr;
 
   int count = 0;
@@ -1031,30 +1531,17 @@ SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
     hyps_curr = hyperparameters.segment(hyp_index, n_hyps);
     int size = Kuu_kernels[i].rows();
 
-    Kuu_grad = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu_kernels[i], hyps_curr);
-    Kuf_grad = kernels[i]->Kuf_grad(sparse_descriptors[i], training_structures,
-                                    i, Kuf_kernels[i], hyps_curr);
-
-    Kuu_mat.block(count, count, size, size) = Kuu_grad[0];
-    Kuf_mat.block(count, 0, size, n_labels) = Kuf_grad[0];
-
-    for (int j = 0; j < n_hyps; j++) {
-      Kuu_grads.push_back(Eigen::MatrixXd::Zero(n_sparse, n_sparse));
-      Kuf_grads.push_back(Eigen::MatrixXd::Zero(n_sparse, n_labels));
+    Kuu_grads.push_back(compute_Kuu_grad(i, hyps_curr));
+    Kuf_grads.push_back(compute_Kuf_grad(i, hyps_curr));
 
-      Kuu_grads[hyp_index + j].block(count, count, size, size) =
-          Kuu_grad[j + 1];
-      Kuf_grads[hyp_index + j].block(count, 0, size, n_labels) =
-          Kuf_grad[j + 1];
-    }
+    Kuu_mat.block(count, count, size, size) = Kuu_grads[i][0];
+    Kuf_mat.block(count, 0, size, n_labels) = Kuf_grads[i][0];
 
     count += size;
     hyp_index += n_hyps;
   }
 
-  Eigen::MatrixXd Kuu_inverse =
-      (Kuu_mat + Kuu_jitter * Eigen::MatrixXd::Identity(Kuu.rows(), Kuu.cols()))
-          .inverse();
+  Kuu_mat.diagonal().array() += Kuu_jitter;
 
   // Construct updated noise vector and gradients.
   double sigma_e = hyperparameters(hyp_index);
@@ -1068,59 +1555,82 @@ SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
   Eigen::VectorXd f_noise_grad = 2 * sigma_f * inv_f_noise_one;
   Eigen::VectorXd s_noise_grad = 2 * sigma_s * inv_s_noise_one;
 
-  // Compute Qff and Qff grads.
-  Eigen::MatrixXd Qff_plus_lambda =
-      Kuf_mat.transpose() * Kuu_inverse * Kuf_mat +
-      noise_vec.asDiagonal() * Eigen::MatrixXd::Identity(n_labels, n_labels);
-
-  std::vector<Eigen::MatrixXd> Qff_grads;
-  grad_index = 0;
-  for (int i = 0; i < n_kernels; i++) {
-    n_hyps = kernels[i]->kernel_hyperparameters.size();
-    for (int j = 0; j < n_hyps; j++) {
-      Qff_grads.push_back(
-          Kuf_grads[grad_index].transpose() * Kuu_inverse * Kuf_mat -
-          Kuf_mat.transpose() * Kuu_inverse * Kuu_grads[grad_index] *
-              Kuu_inverse * Kuf_mat +
-          Kuf_mat.transpose() * Kuu_inverse * Kuf_grads[grad_index]);
-
-      grad_index++;
-    }
-  }
-
-  Qff_grads.push_back(e_noise_grad.asDiagonal() *
-                      Eigen::MatrixXd::Identity(n_labels, n_labels));
-  Qff_grads.push_back(f_noise_grad.asDiagonal() *
-                      Eigen::MatrixXd::Identity(n_labels, n_labels));
-  Qff_grads.push_back(s_noise_grad.asDiagonal() *
-                      Eigen::MatrixXd::Identity(n_labels, n_labels));
-
-  // Perform LU decomposition inplace and compute the inverse.
-  Eigen::PartialPivLU<Eigen::Ref<Eigen::MatrixXd>> lu(Qff_plus_lambda);
-  Eigen::MatrixXd Qff_inverse = lu.inverse();
-
-  // Compute log determinant from the diagonal of U.
-  complexity_penalty = 0;
-#pragma omp parallel for reduction(+:complexity_penalty)
-  for (int i = 0; i < Qff_plus_lambda.rows(); i++) {
-    complexity_penalty += -log(abs(Qff_plus_lambda(i, i)));
-  }
-  complexity_penalty /= 2;
+  // Use the Woodbury identity, as in compute_likelihood, so that no
+  // n_labels x n_labels matrix is formed. With A = Kuu + Kuf Lambda Kfu and
+  // P = A^-1 Kuf Lambda, Kuu^-1 Kuf Q^-1 = P, where Q = Qff + Lambda^-1.
+  // A is not formed either: as in compute_matrices_QR, A = R^T R, where R is
+  // the triangular factor of [Lambda^1/2 Kfu; L^T], which keeps the
+  // condition number of Kuf rather than squaring it.
+  Eigen::VectorXd inv_noise = noise_vec.cwiseInverse();
+  Eigen::LLT<Eigen::MatrixXd> Kuu_chol(Kuu_mat);
+  Eigen::MatrixXd stacked(n_labels + n_sparse, n_sparse);
+  stacked.topRows(n_labels) =
+      inv_noise.cwiseSqrt().asDiagonal() * Kuf_mat.transpose();
+  stacked.bottomRows(n_sparse) = Kuu_chol.matrixU();
+  Eigen::HouseholderQR<Eigen::MatrixXd> qr(stacked);
+  Eigen::MatrixXd R =
+      qr.matrixQR().topRows(n_sparse).triangularView<Eigen::Upper>();
+  auto A_solve = [&R](const Eigen::MatrixXd &B) -> Eigen::MatrixXd {
+    return R.triangularView<Eigen::Upper>().solve(
+        R.transpose().triangularView<Eigen::Lower>().solve(B));
+  };
+  Eigen::MatrixXd P = A_solve(Kuf_mat * inv_noise.asDiagonal());
+
+  // Compute log determinant.
+  double noise_det = inv_noise.array().log().sum();
+  double Kuu_det = 2 * Kuu_chol.matrixLLT().diagonal().array().log().sum();
+  double A_det = 2 * R.diagonal().array().abs().log().sum();
+  complexity_penalty = (noise_det + Kuu_det - A_det) / 2;
 
   // Compute log marginal likelihood.
-  Eigen::VectorXd Q_inv_y = Qff_inverse * y;
+  Eigen::VectorXd P_y = P * y;
+  Eigen::VectorXd Q_inv_y =
+      inv_noise.cwiseProduct(y - Kuf_mat.transpose() * P_y);
   data_fit = -(1. / 2.) * y.transpose() * Q_inv_y;
   constant_term = -n_labels * log(2 * M_PI) / 2;
   log_marginal_likelihood = complexity_penalty + data_fit + constant_term;
 
-  // Compute likelihood gradient.
+  // Compute likelihood gradient. For the kernel hyperparameters,
+  // dQ = dKfu Kuu^-1 Kuf - Kfu Kuu^-1 dKuu Kuu^-1 Kuf + Kfu Kuu^-1 dKuf, and
+  // Kuu^-1 Kuf Q^-1 Kfu Kuu^-1 = Kuu^-1 - A^-1. Only the diagonal block of
+  // Kuu^-1 - A^-1 belonging to each kernel is needed.
   likelihood_gradient = Eigen::VectorXd::Zero(n_hyps_total);
-  Eigen::MatrixXd Qff_inv_grad;
-  for (int i = 0; i < n_hyps_total; i++) {
-    Qff_inv_grad = Qff_inverse * Qff_grads[i];
-    double complexity_grad = - Qff_inv_grad.trace();
-    double datafit_grad = y.transpose() * Qff_inv_grad * Q_inv_y;
-    likelihood_gradient(i) = (complexity_grad + datafit_grad) / 2.;
+  count = 0;
+  int grad_index = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    int size = Kuu_kernels[i].rows();
+    Eigen::MatrixXd columns = Eigen::MatrixXd::Zero(n_sparse, size);
+    columns.middleRows(count, size) = Eigen::MatrixXd::Identity(size, size);
+    Eigen::MatrixXd M_i = (Kuu_chol.solve(columns) - A_solve(columns))
+                              .middleRows(count, size);
+    const auto P_i = P.middleRows(count, size);
+    Eigen::VectorXd P_y_i = P_y.segment(count, size);
+
+    for (int j = 1; j < Kuu_grads[i].size(); j++) {
+      const Eigen::MatrixXd &dKuu = Kuu_grads[i][j];
+      const Eigen::MatrixXd &dKuf = Kuf_grads[i][j];
+      double trace = 2 * P_i.cwiseProduct(dKuf).sum() -
+                     dKuu.cwiseProduct(M_i.transpose()).sum();
+      double complexity_grad = -trace;
+      double datafit_grad =
+          2 * P_y_i.dot(dKuf * Q_inv_y) - P_y_i.dot(dKuu * P_y_i);
+      likelihood_gradient(grad_index) = (complexity_grad + datafit_grad) / 2.;
+      grad_index++;
+    }
+    count += size;
+  }
+
+  // The noise gradients only need the diagonal of Q^-1.
+  Eigen::VectorXd Q_inv_diag = inv_noise.cwiseProduct(
+      Eigen::VectorXd::Ones(n_labels) -
+      Kuf_mat.cwiseProduct(P).colwise().sum().transpose());
+  Eigen::VectorXd Q_inv_y_sq = Q_inv_y.cwiseProduct(Q_inv_y);
+  std::vector<Eigen::VectorXd> noise_grads{e_noise_grad, f_noise_grad,
+                                           s_noise_grad};
+  for (int i = 0; i < 3; i++) {
+    double complexity_grad = -noise_grads[i].dot(Q_inv_diag);
+    double datafit_grad = noise_grads[i].dot(Q_inv_y_sq);
+    likelihood_gradient(hyp_index + i) = (complexity_grad + datafit_grad) / 2.;
   }
 
   return log_marginal_likelihood;
@@ -1131,17 +1641,21 @@ void SparseGP ::set_hyperparameters(Eigen::VectorXd hyps) {
   int n_hyps, hyp_index = 0;
   Eigen::VectorXd new_hyps;
 
-  std::vector<Eigen::MatrixXd> Kuu_grad, Kuf_grad;
+  // The bases are computed before the kernels are changed.
+  update_kernel_bases();
   for (int i = 0; i < n_kernels; i++) {
     n_hyps = kernels[i]->kernel_hyperparameters.size();
     new_hyps = hyps.segment(hyp_index, n_hyps);
 
-    Kuu_grad = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu_kernels[i], new_hyps);
-    Kuf_grad = kernels[i]->Kuf_grad(sparse_descriptors[i], training_structures,
-                                    i, Kuf_kernels[i], new_hyps);
+    if (Kuu_bases[i].size() != 0)
+      Kuu_kernels[i] = kernels[i]->base_kernel(Kuu_bases[i], new_hyps);
+    else
+      Kuu_kernels[i] = compute_Kuu_grad(i, new_hyps)[0];
 
-    Kuu_kernels[i] = Kuu_grad[0];
-    Kuf_kernels[i] = Kuf_grad[0];
+    if (Kuf_bases[i].size() != 0)
+      Kuf_kernels[i] = kernels[i]->base_kernel(Kuf_bases[i], new_hyps);
+    else
+      Kuf_kernels[i] = compute_Kuf_grad(i, new_hyps)[0];
 
     kernels[i]->set_hyperparameters(new_hyps);
     hyp_index += n_hyps;
@@ -1159,78 +1673,275 @@ void SparseGP ::set_hyperparameters(Eigen::VectorXd hyps) {
                + 1 / (force_noise * force_noise) * f_noise_one 
                + 1 / (stress_noise * stress_noise) * s_noise_one; 
 
-  // Update remaining matrices.
-  update_matrices_QR();
+  // Update remaining matrices. Kuu and Kuf have been recomputed, so the
+  // stored factorization cannot be extended.
+  compute_matrices_QR();
 }
 
-void SparseGP::write_mapping_coefficients(std::string file_name,
-                                          std::string contributor,
-                                          int kernel_index) {
+double SparseGP ::optimize_hyperparameters(const std::string &method,
+                                           int max_iterations,
+                                           const Eigen::MatrixXd &bounds,
+                                           double gradient_tolerance) {
+  bool log_scale;
+  if (method == "L-BFGS-B")
+    log_scale = false;
+  else if (method == "L-BFGS-B-log")
+    log_scale = true;
+  else
+    throw std::invalid_argument("Unknown optimization method " + method +
+                                ".");
+
+  int n_hyps = hyperparameters.size();
+  double inf = std::numeric_limits<double>::infinity();
+  Eigen::VectorXd lower = Eigen::VectorXd::Constant(n_hyps, -inf);
+  Eigen::VectorXd upper = Eigen::VectorXd::Constant(n_hyps, inf);
+  if (bounds.size() != 0) {
+    if (bounds.rows() != n_hyps || bounds.cols() != 2)
+      throw std::invalid_argument(
+          "Bounds must have one (lower, upper) row per hyperparameter.");
+    lower = bounds.col(0);
+    upper = bounds.col(1);
+  }
 
-  // Compute mapping coefficients.
-  Eigen::MatrixXd mapping_coeffs =
-      kernels[kernel_index]->compute_mapping_coefficients(*this, kernel_index);
+  Eigen::VectorXd x0 = hyperparameters;
+  if (log_scale) {
+    if ((hyperparameters.array() <= 0).any() || (upper.array() <= 0).any())
+      throw std::invalid_argument(
+          "The log parameterization requires positive hyperparameters.");
+    x0 = hyperparameters.array().log();
+    lower = lower.cwiseMax(0).array().log();
+    upper = upper.array().log();
+  }
 
-  // Make beta file.
-  std::ofstream coeff_file;
-  coeff_file.open(file_name);
+  // The signal variances of dot product kernels only scale Kuf, so that
+  // Kuf Lambda Kfu can be computed once for all iterations.
+  bool precomputed = true;
+  for (int i = 0; i < n_kernels; i++) {
+    if (kernels[i]->kernel_name != "NormalizedDotProduct" &&
+        kernels[i]->kernel_name != "DotProduct")
+      precomputed = false;
+  }
+  if (precomputed)
+    precompute_KnK();
+
+  // Each evaluation factorizes the system once. The factorization is
+  // skipped if it is already current, which is the case for the initial
+  // point after update_matrices_QR.
+  Eigen::VectorXd evaluated;
+  auto objective = [&](const Eigen::VectorXd &x, Eigen::VectorXd &grad) {
+    Eigen::VectorXd hyps = x;
+    if (log_scale)
+      hyps = x.array().exp();
+
+    bool factored = R_factor.rows() == n_sparse &&
+                    factored_labels == n_labels &&
+                    factored_jitter == Kuu_jitter &&
+                    factored_hyperparameters.size() == hyps.size() &&
+                    factored_hyperparameters == hyps &&
+                    hyperparameters == hyps;
+    if (!factored)
+      set_hyperparameters(hyps);
+    evaluated = x;
+
+    double likelihood = compute_likelihood_gradient_stable(precomputed);
+    grad = -likelihood_gradient;
+    if (log_scale)
+      grad = grad.cwiseProduct(hyps);
+    return -likelihood;
+  };
+
+  LBFGSResult result =
+      lbfgs_minimize(objective, x0, lower, upper, max_iterations,
+                     gradient_tolerance);
+
+  // The last evaluation is usually the accepted point, whose factorization
+  // is kept. Otherwise the optimum is evaluated again.
+  if (evaluated != result.x) {
+    Eigen::VectorXd grad;
+    objective(result.x, grad);
+  }
 
-  // Record the date.
+  return log_marginal_likelihood;
+}
+
+// Record the date and the contributor.
+static void write_coeff_header(std::ostream &coeff_file,
+                               const std::string &contributor) {
   time_t now = std::time(0);
   std::string t(ctime(&now));
   coeff_file << "DATE: ";
   coeff_file << t.substr(0, t.length() - 1) << " ";
 
-  // Record the contributor.
   coeff_file << "CONTRIBUTOR: ";
   coeff_file << contributor << "\n";
+}
+
+void SparseGP::write_mapping_coefficients(std::string file_name,
+                                          std::string contributor,
+                                          int kernel_index, bool binary) {
+
+  // Compute mapping coefficients.
+  Eigen::MatrixXd mapping_coeffs =
+      kernels[kernel_index]->compute_mapping_coefficients(*this, kernel_index);
+
+  // Make beta file.
+  CoeffFileWriter coeff_file(file_name, binary);
+  write_coeff_header(coeff_file.text, contributor);
 
   // Write the kernel power
-  kernels[kernel_index]->write_info(coeff_file);
+  kernels[kernel_index]->write_info(coeff_file.text);
 
   // Write descriptor information to file.
   int coeff_size = mapping_coeffs.row(0).size();
   training_structures[0].descriptor_calculators[kernel_index]->write_to_file(
-      coeff_file, coeff_size);
+      coeff_file.text, coeff_size);
 
-  // Write beta vectors to file.
-  coeff_file << std::scientific << std::setprecision(16);
+  // Write beta vectors to file, one row per species.
+  coeff_file.write_values(mapping_coeffs);
 
-  int count = 0;
-  for (int i = 0; i < mapping_coeffs.rows(); i++) {
-    Eigen::VectorXd coeff_vals = mapping_coeffs.row(i);
+  coeff_file.close();
+}
+
+MappingCompression SparseGP::write_compressed_mapping_coefficients(
+    std::string file_name, std::string contributor, int kernel_index,
+    double tolerance, bool binary) {
 
-    // Start a new line for each beta.
-    if (count != 0) {
-      coeff_file << "\n";
+  const std::string &kernel_name = kernels[kernel_index]->kernel_name;
+  Eigen::MatrixXd mapping_coeffs =
+      kernels[kernel_index]->compute_mapping_coefficients(*this, kernel_index);
+  int n_descriptors = sparse_descriptors[kernel_index].n_descriptors;
+  if ((kernel_name != "NormalizedDotProduct" && kernel_name != "DotProduct") ||
+      mapping_coeffs.cols() != n_descriptors * (n_descriptors + 1) / 2)
+    throw std::invalid_argument(
+        "Compression requires a power 2 dot product kernel.");
+  bool normalized = kernel_name == "NormalizedDotProduct";
+
+  // Eigendecomposition of each beta matrix, with the off-diagonal
+  // coefficients halved as in pair_style flare.
+  MappingCompression compression;
+  int n_species = mapping_coeffs.rows();
+  std::vector<Eigen::VectorXd> eigenvalues(n_species);
+  std::vector<Eigen::MatrixXd> eigenvectors(n_species);
+  for (int s = 0; s < n_species; s++) {
+    Eigen::MatrixXd beta(n_descriptors, n_descriptors);
+    int beta_count = 0;
+    for (int i = 0; i < n_descriptors; i++) {
+      for (int j = i; j < n_descriptors; j++) {
+        double beta_val = mapping_coeffs(s, beta_count);
+        if (i != j)
+          beta_val /= 2;
+        beta(i, j) = beta_val;
+        beta(j, i) = beta_val;
+        beta_count++;
+      }
     }
 
-    for (int j = 0; j < coeff_vals.size(); j++) {
-      double coeff_val = coeff_vals[j];
+    // Order the eigenpairs by decreasing magnitude.
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(beta);
+    std::vector<int> order(n_descriptors);
+    std::iota(order.begin(), order.end(), 0);
+    const Eigen::VectorXd &values = solver.eigenvalues();
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      return std::abs(values(a)) > std::abs(values(b));
+    });
+    eigenvalues[s].resize(n_descriptors);
+    eigenvectors[s].resize(n_descriptors, n_descriptors);
+    for (int k = 0; k < n_descriptors; k++) {
+      eigenvalues[s](k) = values(order[k]);
+      eigenvectors[s].col(k) = solver.eigenvectors().col(order[k]);
+    }
 
-      // Pad with 2 spaces if positive, 1 if negative.
-      if (coeff_val > 0) {
-        coeff_file << "  ";
-      } else {
-        coeff_file << " ";
-      }
+    int rank = 0;
+    while (rank < n_descriptors && std::abs(eigenvalues[s](rank)) > tolerance)
+      rank++;
+    compression.rank = std::max(compression.rank, rank);
+  }
+  int rank = std::max(compression.rank, 1);
+  compression.rank = rank;
+
+  // Each species stores its eigenvalues followed by its eigenvectors.
+  Eigen::MatrixXd compressed_coeffs(n_species, rank * (n_descriptors + 1));
+  for (int s = 0; s < n_species; s++) {
+    compressed_coeffs.row(s).head(rank) =
+        eigenvalues[s].head(rank).transpose();
+    for (int k = 0; k < rank; k++)
+      compressed_coeffs.row(s).segment(rank + k * n_descriptors,
+                                       n_descriptors) =
+          eigenvectors[s].col(k).transpose();
+  }
+
+  CoeffFileWriter coeff_file(file_name, binary);
+  write_coeff_header(coeff_file.text, contributor);
+  coeff_file.text << "2 " << kernel_name << " " << rank << "\n";
+  training_structures[0].descriptor_calculators[kernel_index]->write_to_file(
+      coeff_file.text, compressed_coeffs.cols());
+  coeff_file.write_values(compressed_coeffs);
+  coeff_file.close();
 
-      coeff_file << coeff_vals[j];
-      count++;
+  // The dropped part of each beta matrix.
+  std::vector<Eigen::MatrixXd> beta_errors(n_species);
+  int n_dropped = n_descriptors - rank;
+  for (int s = 0; s < n_species; s++) {
+    Eigen::MatrixXd V = eigenvectors[s].rightCols(n_dropped);
+    beta_errors[s] =
+        V * eigenvalues[s].tail(n_dropped).asDiagonal() * V.transpose();
+  }
 
-      // New line if 5 numbers have been added.
-      if (count == 5) {
-        count = 0;
-        coeff_file << "\n";
+  // Energies and forces of the dropped part on the training structures.
+  double empty_thresh = 1e-8;
+  int n_force_labels = 0;
+  for (int t = 0; t < training_structures.size(); t++) {
+    const DescriptorValues &values =
+        training_structures[t].descriptors[kernel_index];
+    int n_atoms = values.n_atoms;
+    Eigen::VectorXd efs = Eigen::VectorXd::Zero(1 + 3 * n_atoms + 6);
+    std::vector<Eigen::MatrixXd> gradients(values.n_types);
+
+    for (int s = 0; s < values.n_types; s++) {
+      gradients[s] =
+          Eigen::MatrixXd::Zero(values.n_clusters_by_type[s], n_descriptors);
+      for (int j = 0; j < values.n_clusters_by_type[s]; j++) {
+        double norm = values.descriptor_norms[s](j);
+        if (norm < empty_thresh)
+          continue;
+
+        Eigen::VectorXd B2_vals = values.descriptors[s].row(j);
+        Eigen::VectorXd beta_p = beta_errors[s] * B2_vals;
+        if (normalized) {
+          double norm_squared = norm * norm;
+          double energy = B2_vals.dot(beta_p) / norm_squared;
+          efs(0) += energy;
+          gradients[s].row(j) =
+              2 * (beta_p - energy * B2_vals).transpose() / norm_squared;
+        } else {
+          efs(0) += B2_vals.dot(beta_p);
+          gradients[s].row(j) = 2 * beta_p.transpose();
+        }
       }
     }
+    backpropagate_force_dervs(values, gradients, efs);
+
+    double energy_error = std::abs(efs(0)) / n_atoms;
+    compression.energy_rmse += energy_error * energy_error;
+    compression.energy_max = std::max(compression.energy_max, energy_error);
+    Eigen::VectorXd force_errors = efs.segment(1, 3 * n_atoms);
+    compression.force_rmse += force_errors.squaredNorm();
+    compression.force_max = std::max(compression.force_max,
+                                     force_errors.cwiseAbs().maxCoeff());
+    n_force_labels += 3 * n_atoms;
+  }
+  if (training_structures.size() > 0) {
+    compression.energy_rmse =
+        sqrt(compression.energy_rmse / training_structures.size());
+    compression.force_rmse = sqrt(compression.force_rmse / n_force_labels);
   }
 
-  coeff_file.close();
+  return compression;
 }
 
 void SparseGP::write_varmap_coefficients(
-  std::string file_name, std::string contributor, int kernel_index) {
+  std::string file_name, std::string contributor, int kernel_index,
+  bool binary) {
 
   // TODO: merge this function with write_mapping_coeff, 
   // add an option in the function above for mapping "mean" or "var"
@@ -1241,189 +1952,118 @@ void SparseGP::write_varmap_coefficients(
     kernels[kernel_index]->compute_varmap_coefficients(*this, kernel_index);
 
   // Make beta file.
-  std::ofstream coeff_file;
-  coeff_file.open(file_name);
-
-  // Record the date.
-  time_t now = std::time(0);
-  std::string t(ctime(&now));
-  coeff_file << "DATE: ";
-  coeff_file << t.substr(0, t.length() - 1) << " ";
-
-  // Record the contributor.
-  coeff_file << "CONTRIBUTOR: ";
-  coeff_file << contributor << "\n";
+  CoeffFileWriter coeff_file(file_name, binary);
+  write_coeff_header(coeff_file.text, contributor);
 
   // Record the hyps
-  coeff_file << hyperparameters.size() << "\n";
-  coeff_file << std::scientific << std::setprecision(16);
+  coeff_file.text << hyperparameters.size() << "\n";
+  coeff_file.text << std::scientific << std::setprecision(16);
   for (int i = 0; i < hyperparameters.size(); i++) {      
-    coeff_file << hyperparameters(i) << " ";
+    coeff_file.text << hyperparameters(i) << " ";
   }
-  coeff_file << "\n" << kernels[kernel_index]->kernel_name << "\n";
+  coeff_file.text << "\n" << kernels[kernel_index]->kernel_name << "\n";
 
   // Write descriptor information to file.
   int coeff_size = varmap_coeffs.row(0).size();
   training_structures[0].descriptor_calculators[kernel_index]->
-    write_to_file(coeff_file, coeff_size);
+    write_to_file(coeff_file.text, coeff_size);
 
-  // Write beta vectors to file.
-  coeff_file << std::scientific << std::setprecision(16);
-
-  int count = 0;
-  for (int i = 0; i < varmap_coeffs.rows(); i++) {
-    Eigen::VectorXd coeff_vals = varmap_coeffs.row(i);
-
-    // Start a new line for each beta.
-    if (count != 0) {
-      coeff_file << "\n";
-      count = 0;
-    }
-
-    for (int j = 0; j < coeff_vals.size(); j++) {
-      double coeff_val = coeff_vals[j];
-
-      // Pad with 2 spaces if positive, 1 if negative.
-      if (coeff_val > 0) {
-        coeff_file << "  ";
-      } else {
-        coeff_file << " ";
-      }
-
-      coeff_file << coeff_vals[j];
-      count++;
-
-      // New line if 5 numbers have been added.
-      if (count == 5) {
-        count = 0;
-        coeff_file << "\n";
-      }
-    }
-  }
+  // Write beta vectors to file, one row per species.
+  coeff_file.write_values(varmap_coeffs);
 
   coeff_file.close();
 }
 
 void SparseGP::write_L_inverse(
-  std::string file_name, std::string contributor) {
+  std::string file_name, std::string contributor, bool binary) {
   // Make beta file.
-  std::ofstream coeff_file;
-  coeff_file.open(file_name);
+  CoeffFileWriter coeff_file(file_name, binary);
 
   // Record file name
-  coeff_file << "L_inverse_block file ";
-
-  // Record the date.
-  time_t now = std::time(0);
-  std::string t(ctime(&now));
-  coeff_file << "DATE: ";
-  coeff_file << t.substr(0, t.length() - 1) << " ";
-
-  // Record the contributor.
-  coeff_file << "CONTRIBUTOR: ";
-  coeff_file << contributor << "\n";
+  coeff_file.text << "L_inverse_block file ";
+  write_coeff_header(coeff_file.text, contributor);
 
   // Write the kernel power
   // TODO: support multiple kernels
-  kernels[0]->write_info(coeff_file);
+  kernels[0]->write_info(coeff_file.text);
 
   // Record the hyps
-  coeff_file << hyperparameters.size() << "\n";
-  coeff_file << std::scientific << std::setprecision(16);
+  coeff_file.text << hyperparameters.size() << "\n";
+  coeff_file.text << std::scientific << std::setprecision(16);
   for (int i = 0; i < hyperparameters.size(); i++) {      
-    coeff_file << hyperparameters(i) << " ";
+    coeff_file.text << hyperparameters(i) << " ";
   }
-  coeff_file << "\n";
+  coeff_file.text << "\n";
 
   int sparse_count = 0;
   for (int i = 0; i < n_kernels; i++) {
     //  sparse_descriptors[i].descriptors[s];
     training_structures[0].descriptor_calculators[i]->
-      write_to_file(coeff_file, n_kernels);
-
-    coeff_file << std::scientific << std::setprecision(16);
+      write_to_file(coeff_file.text, n_kernels);
 
-    // write the lower triangular part of L_inv_block 
+    // write the lower triangular part of L_inv_block, the inverse of the
+    // diagonal block of the block diagonal Cholesky factor
     int n_clusters = sparse_descriptors[i].n_clusters;
     Eigen::MatrixXd L_inverse_block =
-        L_inv.block(sparse_count, sparse_count, n_clusters, n_clusters);
+        L_factor.block(sparse_count, sparse_count, n_clusters, n_clusters)
+            .triangularView<Eigen::Lower>()
+            .solve(Eigen::MatrixXd::Identity(n_clusters, n_clusters));
     sparse_count += n_clusters;
 
-    coeff_file << n_clusters << "\n";
-    int count = 1;
+    coeff_file.text << n_clusters << "\n";
+    std::vector<double> L_inverse_vals;
     for (int j = 0; j < n_clusters; j++) {
       for (int k = 0; k <= j; k++) {
-        coeff_file << L_inverse_block(j, k) << " ";
-
-        // Change line after writing 5 numbers
-        if (count % 5 == 0) coeff_file << "\n";
-        count++;
+        L_inverse_vals.push_back(L_inverse_block(j, k));
       }
     }
-    if (count % 5 != 0) coeff_file << "\n";
-
+    coeff_file.write_values(L_inverse_vals.data(), L_inverse_vals.size());
   }
 
   coeff_file.close();
 }
 
 void SparseGP::write_sparse_descriptors(
-  std::string file_name, std::string contributor) {
+  std::string file_name, std::string contributor, bool binary) {
   double empty_thresh = 1e-8;
 
   // Make beta file.
-  std::ofstream coeff_file;
-  coeff_file.open(file_name);
+  CoeffFileWriter coeff_file(file_name, binary);
 
   // Record file name
-  coeff_file << "sparse_descriptors file ";
-
-  // Record the date.
-  time_t now = std::time(0);
-  std::string t(ctime(&now));
-  coeff_file << "DATE: ";
-  coeff_file << t.substr(0, t.length() - 1) << " ";
-
-  // Record the contributor.
-  coeff_file << "CONTRIBUTOR: ";
-  coeff_file << contributor << "\n";
-
-  coeff_file << std::scientific << std::setprecision(16);
+  coeff_file.text << "sparse_descriptors file ";
+  write_coeff_header(coeff_file.text, contributor);
 
   // Record the number of kernels
-  coeff_file << n_kernels << "\n";
+  coeff_file.text << n_kernels << "\n";
 
   for (int i = 0; i < n_kernels; i++) {
 
     int n_types = sparse_descriptors[i].n_types;
     int n_clusters = sparse_descriptors[i].n_clusters;
+    bool normalized = kernels[i]->kernel_name.find("NormalizedDotProduct") !=
+                      std::string::npos;
 
-    coeff_file << i << " " << n_clusters << " " << n_types << "\n";
+    coeff_file.text << i << " " << n_clusters << " " << n_types << "\n";
 
-    int count = 1;
     for (int s = 0; s < n_types; s++) {
       int n_clusters_by_type = sparse_descriptors[i].n_clusters_by_type[s];
       int n_descriptors = sparse_descriptors[i].n_descriptors;
 
-      coeff_file << n_clusters_by_type << "\n";
+      // Empty environments are written as zeros.
+      Eigen::MatrixXd descriptor_vals =
+          Eigen::MatrixXd::Zero(n_clusters_by_type, n_descriptors);
       for (int j = 0; j < n_clusters_by_type; j++) {
-        for (int k = 0; k < n_descriptors; k++) {
-          if (sparse_descriptors[i].descriptor_norms[s](j) < empty_thresh) {
-            coeff_file << 0.0 << " ";
-          } else {
-            if (kernels[i]->kernel_name.find("NormalizedDotProduct") != std::string::npos) {
-              coeff_file << sparse_descriptors[i].descriptors[s](j, k) / sparse_descriptors[i].descriptor_norms[s](j) << " ";
-            } else {
-              coeff_file << sparse_descriptors[i].descriptors[s](j, k) << " ";
-            }
-          }
-
-          // Change line after writing 5 numbers
-          if (count % 5 == 0) coeff_file << "\n";
-          count++;
-        }
+        double norm = sparse_descriptors[i].descriptor_norms[s](j);
+        if (norm < empty_thresh)
+          continue;
+        descriptor_vals.row(j) = sparse_descriptors[i].descriptors[s].row(j);
+        if (normalized)
+          descriptor_vals.row(j) /= norm;
       }
-      if (count % 5 != 1) coeff_file << "\n";
+
+      coeff_file.text << n_clusters_by_type << "\n";
+      coeff_file.write_values(descriptor_vals);
     }
 
   }
@@ -1441,5 +2081,15 @@ SparseGP SparseGP ::from_json(std::string file_name){
   std::ifstream sgp_file(file_name);
   nlohmann::json j;
   sgp_file >> j;
-  return j;
+
+  // Files written before the factors were stored are refactorized.
+  bool factored = j.contains("R_factor");
+  if (!factored) {
+    j["L_factor"] = nlohmann::json::array();
+    j["R_factor"] = nlohmann::json::array();
+  }
+  SparseGP sgp = j;
+  if (!factored && sgp.n_sparse > 0)
+    sgp.compute_matrices_QR();
+  return sgp;
 }
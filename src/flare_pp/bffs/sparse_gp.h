@@ -1,7 +1,9 @@
 #ifndef SPARSE_GP_H
 #define SPARSE_GP_H
 
+#include "coeff_file.h"
 #include "descriptor.h"
+#include "growable_matrix.h"
 #include "kernel.h"
 #include "structure.h"
 #include <Eigen/Dense>
@@ -9,23 +11,60 @@
 #include <nlohmann/json.hpp>
 #include "json.h"
 
+// Rank of compressed mapping coefficients and the errors they induce on the
+// training structures. Energy errors are per atom.
+struct MappingCompression {
+  int rank = 0;
+  double energy_rmse = 0, energy_max = 0, force_rmse = 0, force_max = 0;
+};
+
 class SparseGP {
 public:
   Eigen::VectorXd hyperparameters;
 
   // Kernel attributes.
   std::vector<Kernel *> kernels;
-  std::vector<Eigen::MatrixXd> Kuu_kernels, Kuf_kernels;
-  Eigen::MatrixXd Kuu, Kuf;
+  // Kuu and Kuf grow in place as sparse points and labels are added.
+  std::vector<GrowableMatrix> Kuu_kernels, Kuf_kernels;
+  GrowableMatrix Kuu, Kuf;
   std::vector<Eigen::MatrixXd> Kuf_e_noise_Kfu, Kuf_f_noise_Kfu, Kuf_s_noise_Kfu;
   Eigen::MatrixXd KnK_e, KnK_f, KnK_s;
   int n_kernels = 0;
   double Kuu_jitter;
 
-  // Solution attributes.
-  Eigen::MatrixXd Sigma, Kuu_inverse, R_inv, L_inv;
+  // Hyperparameter-independent components of Kuu_kernels and Kuf_kernels
+  // (see Kernel::Kuu_base), computed for base_sparse sparse points and
+  // base_labels labels. They are empty for kernels without bases.
+  std::vector<std::vector<Eigen::MatrixXd>> Kuu_bases, Kuf_bases;
+  int base_sparse = -1, base_labels = -1;
+
+  // Solution attributes. The system is stored as triangular factors: the
+  // lower Cholesky factor L_factor of Kuu + jitter and R_factor below. The
+  // explicit inverses are formed on request (see Sigma()).
+  Eigen::MatrixXd L_factor;
   Eigen::VectorXd alpha, R_inv_diag, L_diag;
 
+  // Upper triangular factor R of the QR system, with R^T R = Kuu + jitter +
+  // Kuf Lambda Kfu, stored row major so that rows can be rotated in place.
+  // The sizes and hyperparameters it was computed for are kept, so that new
+  // labels and sparse points can be added without refactorizing.
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic,
+                        Eigen::RowMajor>
+      FactorMatrix;
+  FactorMatrix R_factor;
+  Eigen::VectorXd factored_hyperparameters;
+  std::vector<std::vector<int>> factored_clusters_by_type;
+  int factored_labels = 0;
+  double factored_jitter = 0;
+
+  // Caches of the explicit inverses, cleared when the system is factorized.
+  mutable Eigen::MatrixXd Sigma_cache, Kuu_inverse_cache, R_inv_cache,
+      L_inv_cache;
+
+  // Relative tolerance of the check R^T R v = (Kuu + jitter + Kuf Lambda Kfu) v
+  // applied after each incremental update.
+  double refactorization_tolerance = 1e-8;
+
   // Training and sparse points.
   std::vector<ClusterDescriptor> sparse_descriptors;
   std::vector<Structure> training_structures;
@@ -54,6 +93,14 @@ public:
 
   void add_specific_environments(const Structure &structure,
                                  const std::vector<int> atoms);
+
+  /**
+   * Add the environments of the given atoms of several structures as sparse
+   * points, with Kuu and Kuf updated in a single pass. atoms holds one list
+   * of atom indices per structure.
+   */
+  void add_specific_environments(const std::vector<Structure> &structures,
+                                 const std::vector<std::vector<int>> &atoms);
   void add_random_environments(const Structure &structure,
                                const std::vector<int> &n_added);
   void add_uncertain_environments(const Structure &structure,
@@ -64,22 +111,104 @@ public:
   sort_clusters_by_uncertainty(const Structure &structure);
 
   void add_training_structure(const Structure &structure, const std::vector<int> atom_indices = {-1}, double rel_e_noise = 1, double rel_f_noise = 1, double rel_s_noise = 1);
+
+  /**
+   * Add several training structures at once. The label and noise arrays are
+   * resized once and the kernels of the new structures are evaluated in
+   * parallel. atom_indices and the relative noises hold one entry per
+   * structure, or are empty to use all atoms and unit relative noise.
+   */
+  void add_training_structures(
+      const std::vector<Structure> &structures,
+      const std::vector<std::vector<int>> &atom_indices = {},
+      const std::vector<double> &rel_e_noise = {},
+      const std::vector<double> &rel_f_noise = {},
+      const std::vector<double> &rel_s_noise = {});
   void update_Kuu(const std::vector<ClusterDescriptor> &cluster_descriptors);
   void update_Kuf(const std::vector<ClusterDescriptor> &cluster_descriptors);
   void stack_Kuu();
   void stack_Kuf();
 
+  /**
+   * Update the solution attributes after training labels or sparse points
+   * have been added. The stored factorization is extended when possible (see
+   * update_matrices_incremental), and recomputed from scratch otherwise.
+   */
   void update_matrices_QR();
 
+  /** Factorize the full system from scratch. */
+  void compute_matrices_QR();
+
+  /**
+   * Extend the stored factorization with the sparse points and labels added
+   * since it was computed. New sparse points are inserted with bordered
+   * column updates and new labels are rotated in as rows, so the cost grows
+   * with the number of new rows rather than with n_labels. Returns false if
+   * the factorization cannot be extended (no stored factor, changed
+   * hyperparameters, a failed downdate, or a failed drift check), in which
+   * case the solution attributes, including the stored factor, are
+   * unchanged.
+   */
+  bool update_matrices_incremental();
+
+  /**
+   * Explicit inverses of the factored system: L_inv = L^-1, R_inv = R^-1,
+   * Kuu_inverse = (Kuu + jitter)^-1 = L_inv^T L_inv and
+   * Sigma = (Kuu + jitter + Kuf Lambda Kfu)^-1 = R_inv R_inv^T. They are
+   * computed from the factors on first use and cached until the next
+   * factorization.
+   */
+  const Eigen::MatrixXd &Sigma() const;
+  const Eigen::MatrixXd &Kuu_inverse() const;
+  const Eigen::MatrixXd &R_inv() const;
+  const Eigen::MatrixXd &L_inv() const;
+  void clear_inverses();
+
+  // Like the other predictions and add_training_structure, throws
+  // std::invalid_argument for structures built with prediction_only.
   void predict_mean(Structure &structure);
-  void predict_SOR(Structure &structure);
-  void predict_DTC(Structure &structure);
+
+  /**
+   * Predict the mean energy, forces and stress without forming the kernel
+   * matrix. The energy gradients are back-propagated through the
+   * descriptors, so that structures built with prediction_only (which
+   * store no descriptor force derivatives) are supported.
+   */
+  void predict_mean_fast(Structure &structure);
+
+  /**
+   * Predict the mean and variance of the energy, forces and stress. Only the
+   * diagonal of the predictive covariance is computed. If block_size is
+   * positive, the variances are computed for block_size outputs at a time,
+   * which bounds the temporary memory for large structures.
+   */
+  void predict_SOR(Structure &structure, int block_size = 0);
+  void predict_DTC(Structure &structure, int block_size = 0);
   void predict_local_uncertainties(Structure &structure);
 
+  /**
+   * Recompute the kernel bases if sparse points or labels have been added
+   * since they were computed.
+   */
+  void update_kernel_bases();
+
+  /**
+   * Kuu and Kuf of kernel i and their gradients with respect to its
+   * hyperparameters hyps. The kernel bases are used when available, and the
+   * kernel is evaluated against the sparse points and training structures
+   * otherwise.
+   */
+  std::vector<Eigen::MatrixXd> compute_Kuu_grad(int i,
+                                                const Eigen::VectorXd &hyps);
+  std::vector<Eigen::MatrixXd> compute_Kuf_grad(int i,
+                                                const Eigen::VectorXd &hyps);
+
   void compute_likelihood_stable();
   double compute_likelihood_gradient_stable(bool precomputed_KnK = false);
   void precompute_KnK();
   void compute_KnK(bool precomputed = false);
+  // Rows of kernel i of the gradient of Kuf Lambda Kfu with respect to its
+  // signal variance, the only nonzero rows.
   Eigen::MatrixXd compute_dKnK(int i);
 
   void compute_likelihood();
@@ -87,21 +216,56 @@ public:
   double compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters);
   void set_hyperparameters(Eigen::VectorXd hyps);
 
+  /**
+   * Maximize the log marginal likelihood with respect to the
+   * hyperparameters with a bounded L-BFGS method (see lbfgs_minimize).
+   * method is "L-BFGS-B", or "L-BFGS-B-log" to optimize the logarithms of
+   * the hyperparameters, which must then be positive. bounds has one
+   * (lower, upper) row per hyperparameter, and may be empty; infinite
+   * bounds are allowed. On return the model is set to the optimal
+   * hyperparameters, with likelihood_gradient evaluated there, and the
+   * log marginal likelihood is returned.
+   */
+  double optimize_hyperparameters(const std::string &method = "L-BFGS-B",
+                                  int max_iterations = 10,
+                                  const Eigen::MatrixXd &bounds =
+                                      Eigen::MatrixXd(),
+                                  double gradient_tolerance = 1e-4);
+
+  /**
+   * Coefficient files are written in the ASCII format, or in the binary
+   * format of coeff_file.h if binary is true. pair_style flare and compute
+   * flare/std/atom read both.
+   */
   void write_mapping_coefficients(std::string file_name,
                                   std::string contributor,
-                                  int kernel_index);
+                                  int kernel_index, bool binary = false);
+
+  /**
+   * Write the mapping coefficients of a power 2 dot product kernel with each
+   * beta matrix replaced by its eigenpairs of magnitude above tolerance,
+   * largest first. Every species keeps the rank of the species that needs
+   * the most. For the normalized kernel, the dropped eigenvalues bound the
+   * error of every local energy by tolerance. The energy and force errors
+   * of the compressed model on the training structures are returned.
+   */
+  MappingCompression write_compressed_mapping_coefficients(
+      std::string file_name, std::string contributor, int kernel_index,
+      double tolerance, bool binary = false);
 
   Eigen::MatrixXd varmap_coeffs; // for debugging. TODO: remove this line 
   void write_varmap_coefficients(std::string file_name,
                                   std::string contributor,
-                                  int kernel_index);
-  void write_sparse_descriptors(std::string file_name, std::string contributor);
-  void write_L_inverse(std::string file_name, std::string contributor);
+                                  int kernel_index, bool binary = false);
+  void write_sparse_descriptors(std::string file_name, std::string contributor,
+                                bool binary = false);
+  void write_L_inverse(std::string file_name, std::string contributor,
+                       bool binary = false);
 
   // TODO: Make kernels jsonable.
   NLOHMANN_DEFINE_TYPE_INTRUSIVE(SparseGP, hyperparameters, kernels,    
-    Kuu_kernels, Kuf_kernels, Kuu, Kuf, n_kernels, Kuu_jitter, Sigma,
-    Kuu_inverse, R_inv, L_inv, alpha, R_inv_diag, L_diag, sparse_descriptors,
+    Kuu_kernels, Kuf_kernels, Kuu, Kuf, n_kernels, Kuu_jitter, L_factor,
+    R_factor, alpha, R_inv_diag, L_diag, sparse_descriptors,
     training_structures, sparse_indices, noise_vector, y, label_count,
     n_energy_labels, n_force_labels, n_stress_labels, n_sparse, n_labels,
     n_strucs, energy_noise, force_noise, stress_noise, log_marginal_likelihood,
@@ -0,0 +1,300 @@
+#include "coeff_file.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAXLINE 1024
+
+// Little-endian integers and values, independent of the host byte order.
+static void store_u64(unsigned char *p, uint64_t val) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (val >> (8 * i)) & 0xff;
+}
+
+static void store_u32(unsigned char *p, uint32_t val) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (val >> (8 * i)) & 0xff;
+}
+
+static uint64_t load_u64(const unsigned char *p) {
+  uint64_t val = 0;
+  for (int i = 0; i < 8; i++)
+    val |= (uint64_t)p[i] << (8 * i);
+  return val;
+}
+
+static uint32_t load_u32(const unsigned char *p) {
+  uint32_t val = 0;
+  for (int i = 0; i < 4; i++)
+    val |= (uint32_t)p[i] << (8 * i);
+  return val;
+}
+
+static double load_double(const unsigned char *p) {
+  uint64_t bits = load_u64(p);
+  double val;
+  memcpy(&val, &bits, 8);
+  return val;
+}
+
+uint64_t coeff_file_checksum(const unsigned char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+CoeffFileWriter::CoeffFileWriter(const std::string &file_name, bool binary)
+    : file_name(file_name), binary(binary) {
+  if (binary) {
+    file.open(file_name, std::ios::binary);
+    check("open");
+    unsigned char header[16] = {0};
+    memcpy(header, coeff_file_magic, 8);
+    store_u32(header + 8, coeff_file_version);
+    file.write(reinterpret_cast<const char *>(header), 16);
+    check("write");
+  } else {
+    file.open(file_name);
+    check("open");
+  }
+}
+
+// Errors are only reported by an explicit close, since a destructor cannot
+// throw.
+CoeffFileWriter::~CoeffFileWriter() {
+  try {
+    close();
+  } catch (const std::runtime_error &) {
+  }
+}
+
+void CoeffFileWriter::close() {
+  if (!file.is_open())
+    return;
+  flush_text();
+  file.close();
+  check("close");
+}
+
+void CoeffFileWriter::check(const std::string &action) {
+  if (!file)
+    throw std::runtime_error("Cannot " + action + " the coefficient file " +
+                             file_name + ".");
+}
+
+void CoeffFileWriter::flush_text() {
+  std::string pending = text.str();
+  if (pending.empty())
+    return;
+  text.str("");
+
+  if (binary) {
+    write_record(1, reinterpret_cast<const unsigned char *>(pending.data()),
+                 pending.size(), pending.size());
+  } else {
+    file << pending;
+    check("write");
+  }
+}
+
+void CoeffFileWriter::write_record(uint32_t kind, const unsigned char *payload,
+                                   size_t size, uint64_t length) {
+  unsigned char header[16] = {0};
+  store_u32(header, kind);
+  store_u64(header + 8, length);
+  file.write(reinterpret_cast<const char *>(header), 16);
+  file.write(reinterpret_cast<const char *>(payload), size);
+
+  unsigned char padding[8] = {0};
+  file.write(reinterpret_cast<const char *>(padding), (8 - size % 8) % 8);
+
+  unsigned char checksum[8];
+  store_u64(checksum, coeff_file_checksum(payload, size));
+  file.write(reinterpret_cast<const char *>(checksum), 8);
+  check("write");
+}
+
+void CoeffFileWriter::write_values(const double *values, size_t n) {
+  flush_text();
+  if (n == 0)
+    return;
+
+  if (binary) {
+    std::vector<unsigned char> payload(8 * n);
+    for (size_t i = 0; i < n; i++) {
+      uint64_t bits;
+      memcpy(&bits, &values[i], 8);
+      store_u64(&payload[8 * i], bits);
+    }
+    write_record(2, payload.data(), payload.size(), n);
+    return;
+  }
+
+  file << std::scientific << std::setprecision(16);
+  for (size_t i = 0; i < n; i++) {
+    // Pad with 2 spaces if positive, 1 if negative.
+    if (values[i] > 0) {
+      file << "  ";
+    } else {
+      file << " ";
+    }
+    file << values[i];
+
+    // New line if 5 numbers have been added.
+    if ((i + 1) % 5 == 0 || i == n - 1)
+      file << "\n";
+  }
+  check("write");
+}
+
+void CoeffFileWriter::write_values(const Eigen::MatrixXd &values) {
+  Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      rows = values;
+  if (binary) {
+    write_values(rows.data(), rows.size());
+  } else {
+    for (int i = 0; i < rows.rows(); i++)
+      write_values(rows.data() + i * rows.cols(), rows.cols());
+  }
+}
+
+CoeffFileReader::CoeffFileReader(
+    FILE *fptr, std::function<void(const std::string &)> error)
+    : fptr(fptr), error(error) {
+
+  // Read ahead to detect the format. Text files keep what was read.
+  char magic[8];
+  size_t n_read = fread(magic, 1, 8, fptr);
+  if (n_read < 8 || memcmp(magic, coeff_file_magic, 8) != 0) {
+    pending.assign(magic, n_read);
+    return;
+  }
+
+  struct stat file_stat;
+  if (fstat(fileno(fptr), &file_stat) != 0 || file_stat.st_size < 16)
+    fail("Cannot map the binary coefficient file.");
+  size = file_stat.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+  if (mapped == MAP_FAILED)
+    fail("Cannot map the binary coefficient file.");
+  data = static_cast<unsigned char *>(mapped);
+
+  uint32_t version = load_u32(data + 8);
+  if (version != coeff_file_version)
+    fail("Unsupported binary coefficient file version " +
+         std::to_string(version) + ".");
+}
+
+CoeffFileReader::~CoeffFileReader() {
+  if (data != nullptr)
+    munmap(data, size);
+  if (fptr != nullptr)
+    fclose(fptr);
+}
+
+void CoeffFileReader::fail(const std::string &message) {
+  if (error)
+    error(message);
+  throw std::runtime_error(message);
+}
+
+bool CoeffFileReader::advance() {
+  if (next_record >= size)
+    return false;
+  if (size - next_record < 16)
+    fail("Truncated binary coefficient file.");
+
+  const unsigned char *header = data + next_record;
+  uint32_t record_kind = load_u32(header);
+  uint64_t record_length = load_u64(header + 8);
+  if (record_kind != 1 && record_kind != 2)
+    fail("Unknown record in the binary coefficient file.");
+
+  size_t available = size - next_record - 16;
+  if (record_length > available)
+    fail("Truncated binary coefficient file.");
+  size_t bytes = record_kind == 2 ? 8 * record_length : record_length;
+  size_t padded = (bytes + 7) / 8 * 8;
+  if (padded + 8 > available)
+    fail("Truncated binary coefficient file.");
+
+  payload = header + 16;
+  if (coeff_file_checksum(payload, bytes) != load_u64(payload + padded))
+    fail("Checksum mismatch in the binary coefficient file.");
+
+  kind = record_kind;
+  length = record_length;
+  position = 0;
+  next_record += 16 + padded + 8;
+  return true;
+}
+
+char *CoeffFileReader::gets(char *line, int n) {
+  if (!binary()) {
+    if (pending.empty())
+      return fgets(line, n, fptr);
+
+    // Complete the line that was read ahead.
+    char buffer[MAXLINE];
+    while (pending.find('\n') == std::string::npos &&
+           fgets(buffer, MAXLINE, fptr) != nullptr)
+      pending += buffer;
+    size_t eol = pending.find('\n');
+    size_t count = eol == std::string::npos ? pending.size() : eol + 1;
+    count = std::min(count, (size_t)n - 1);
+    memcpy(line, pending.data(), count);
+    line[count] = '\0';
+    pending.erase(0, count);
+    return line;
+  }
+
+  while (kind != 1 || position >= length) {
+    if (kind == 2 && position < length)
+      fail("Expected text but found values in the coefficient file.");
+    if (!advance())
+      return nullptr;
+  }
+
+  int count = 0;
+  while (position < length && count < n - 1) {
+    char c = payload[position++];
+    line[count++] = c;
+    if (c == '\n')
+      break;
+  }
+  line[count] = '\0';
+  return line;
+}
+
+void CoeffFileReader::grab(int n, double *list) {
+  char line[MAXLINE];
+  int i = 0;
+  while (i < n) {
+    if (binary() && kind == 2 && position < length) {
+      while (i < n && position < length)
+        list[i++] = load_double(payload + 8 * position++);
+    } else if (!binary() || (kind == 1 && position < length)) {
+      // Numbers written as text, several to a line.
+      if (gets(line, MAXLINE) == nullptr)
+        fail("Unexpected end of the coefficient file.");
+      char *ptr = strtok(line, " \t\n\r\f");
+      while (ptr != nullptr) {
+        if (i == n)
+          fail("More numbers on a line than expected in the coefficient "
+               "file.");
+        list[i++] = atof(ptr);
+        ptr = strtok(nullptr, " \t\n\r\f");
+      }
+    } else if (!advance()) {
+      fail("Unexpected end of the coefficient file.");
+    }
+  }
+}
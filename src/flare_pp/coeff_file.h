@@ -0,0 +1,98 @@
+#ifndef COEFF_FILE_H
+#define COEFF_FILE_H
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Coefficient files of pair_style flare and compute flare/std/atom are a
+// sequence of text lines and arrays of numbers. In the ASCII format the
+// numbers are written five per line with 16 significant digits.
+//
+// The binary format starts with the magic "FLAREBIN", a uint32 version and
+// four zero bytes, followed by records. A record is a uint32 kind (1 for
+// text, 2 for float64 values), four zero bytes, a uint64 length (in bytes
+// for text, in values otherwise), the payload padded with zeros to a
+// multiple of 8 bytes, and the 64-bit FNV-1a checksum of the unpadded
+// payload. Everything is little-endian and the values are 8-byte aligned,
+// so that a mapped file can be read in place.
+
+const char coeff_file_magic[] = "FLAREBIN";
+const uint32_t coeff_file_version = 1;
+
+uint64_t coeff_file_checksum(const unsigned char *data, size_t size);
+
+/**
+ * Writes a coefficient file in either format. Text written to the text
+ * stream is buffered and goes to the file before the next values, or when
+ * the file is closed. Errors opening or writing the file are thrown as
+ * std::runtime_error, so close should be called to see those of the last
+ * writes.
+ */
+class CoeffFileWriter {
+public:
+  std::ostringstream text;
+
+  CoeffFileWriter(const std::string &file_name, bool binary = false);
+  ~CoeffFileWriter();
+
+  void write_values(const double *values, size_t n);
+
+  // The rows of the matrix, each starting on a new line in the ASCII format.
+  void write_values(const Eigen::MatrixXd &values);
+
+  void close();
+
+private:
+  std::ofstream file;
+  std::string file_name;
+  bool binary;
+
+  void check(const std::string &action);
+  void flush_text();
+  void write_record(uint32_t kind, const unsigned char *payload,
+                    size_t size, uint64_t length);
+};
+
+/**
+ * Reads a coefficient file in either format from an open file, which it
+ * closes when destroyed. Binary files are mapped into memory. Errors are
+ * passed to the error function if there is one, and otherwise thrown as
+ * std::runtime_error.
+ */
+class CoeffFileReader {
+public:
+  CoeffFileReader(FILE *fptr,
+                  std::function<void(const std::string &)> error = nullptr);
+  ~CoeffFileReader();
+
+  bool binary() const { return data != nullptr; }
+
+  // Next line of text, like fgets. Returns nullptr at the end of the file.
+  char *gets(char *line, int n);
+
+  // Next n numbers, which may span several lines or value records.
+  void grab(int n, double *list);
+
+private:
+  FILE *fptr;
+  std::function<void(const std::string &)> error;
+  std::string pending; // text read ahead while detecting the format
+
+  // Mapped binary file, and the current record.
+  unsigned char *data = nullptr;
+  size_t size = 0, next_record = 16;
+  uint32_t kind = 0;
+  const unsigned char *payload = nullptr;
+  size_t length = 0, position = 0;
+
+  void fail(const std::string &message);
+  bool advance();
+};
+
+#endif
@@ -7,19 +7,19 @@
 
 // Radial cutoff functions.
 void polynomial_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                       std::vector<double> cutoff_hyps);
+                       const std::vector<double> &cutoff_hyps);
 
 void power_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                  std::vector<double> cutoff_hyps);
+                  const std::vector<double> &cutoff_hyps);
 
 void quadratic_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                      std::vector<double> cutoff_hyps);
+                      const std::vector<double> &cutoff_hyps);
 
 void cos_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                std::vector<double> cutoff_hyps);
+                const std::vector<double> &cutoff_hyps);
 
 void hard_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                 std::vector<double> cutoff_hyps);
+                 const std::vector<double> &cutoff_hyps);
     
 void set_cutoff(const std::string &cutoff_function,
                 std::function<void(std::vector<double> &, double, double,
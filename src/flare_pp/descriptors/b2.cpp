@@ -23,6 +23,10 @@ B2 ::B2(const std::string &radial_basis, const std::string &cutoff_function,
 
   set_radial_basis(radial_basis, this->radial_pointer);
   set_cutoff(cutoff_function, this->cutoff_pointer);
+  single_bond_pointer =
+      set_single_bond<StructureSingleBond>(radial_basis, cutoff_function);
+  atom_single_bond_pointer =
+      set_single_bond<AtomSingleBond>(radial_basis, cutoff_function);
 
   // Create cutoff matrix.
   int n_species = descriptor_settings[0];
@@ -44,12 +48,16 @@ B2 ::B2(const std::string &radial_basis, const std::string &cutoff_function,
 
   set_radial_basis(radial_basis, this->radial_pointer);
   set_cutoff(cutoff_function, this->cutoff_pointer);
+  single_bond_pointer =
+      set_single_bond<StructureSingleBond>(radial_basis, cutoff_function);
+  atom_single_bond_pointer =
+      set_single_bond<AtomSingleBond>(radial_basis, cutoff_function);
 
   // Assign cutoff matrix.
   this->cutoffs = cutoffs;
 }
 
-void B2 ::write_to_file(std::ofstream &coeff_file, int coeff_size) {
+void B2 ::write_to_file(std::ostream &coeff_file, int coeff_size) {
   // Report radial basis set.
   coeff_file << radial_basis << "\n";
 
@@ -87,19 +95,33 @@ DescriptorValues B2 ::compute_struc(Structure &structure) {
   int N = descriptor_settings[1];
   int lmax = descriptor_settings[2];
 
-  single_bond_multiple_cutoffs(
-    single_bond_vals, force_dervs, neighbor_coords, unique_neighbor_count,
-    cumulative_neighbor_count, descriptor_indices, radial_pointer,
-    cutoff_pointer, nos, N, lmax, radial_hyps, cutoff_hyps, structure,
-    cutoffs);
+  if (single_bond_pointer != nullptr) {
+    single_bond_pointer(single_bond_vals, force_dervs, neighbor_coords,
+                        unique_neighbor_count, cumulative_neighbor_count,
+                        descriptor_indices, nos, N, lmax, radial_hyps,
+                        cutoff_hyps, structure, cutoffs);
+  } else {
+    single_bond_multiple_cutoffs(
+      single_bond_vals, force_dervs, neighbor_coords, unique_neighbor_count,
+      cumulative_neighbor_count, descriptor_indices, radial_pointer,
+      cutoff_pointer, nos, N, lmax, radial_hyps, cutoff_hyps, structure,
+      cutoffs);
+  }
 
   // Compute descriptor values.
   Eigen::MatrixXd B2_vals, B2_force_dervs;
   Eigen::VectorXd B2_norms, B2_force_dots;
 
-  compute_b2(B2_vals, B2_force_dervs, B2_norms, B2_force_dots, single_bond_vals,
-             force_dervs, unique_neighbor_count, cumulative_neighbor_count,
-             descriptor_indices, nos, N, lmax);
+  if (b2_gemm) {
+    compute_b2_gemm(B2_vals, B2_force_dervs, B2_norms, B2_force_dots,
+                    single_bond_vals, force_dervs, unique_neighbor_count,
+                    cumulative_neighbor_count, descriptor_indices, nos, N,
+                    lmax);
+  } else {
+    compute_b2(B2_vals, B2_force_dervs, B2_norms, B2_force_dots,
+               single_bond_vals, force_dervs, unique_neighbor_count,
+               cumulative_neighbor_count, descriptor_indices, nos, N, lmax);
+  }
 
   // Gather species information.
   int noa = structure.noa;
@@ -178,6 +200,226 @@ DescriptorValues B2 ::compute_struc(Structure &structure) {
   return desc;
 }
 
+// Gather the single bond values of degree l of one atom, with S(n, m) the
+// value of radial channel n and harmonic (l, m).
+static void gather_degree(Eigen::MatrixXd &S,
+                          const Eigen::VectorXd &single_bond_vals,
+                          int n_radial, int lmax, int l) {
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  int n_m = 2 * l + 1;
+  for (int n = 0; n < n_radial; n++) {
+    S.block(n, 0, 1, n_m) =
+        single_bond_vals.segment(n * n_harmonics + l * l, n_m).transpose();
+  }
+}
+
+// B2 values of one atom, ordered as in compute_b2.
+static void atom_b2_values(Eigen::MatrixXd &B2_vals, int atom,
+                           const Eigen::VectorXd &single_bond_vals,
+                           int n_radial, int lmax, Eigen::MatrixXd &S,
+                           Eigen::MatrixXd &products) {
+  for (int l = 0; l < (lmax + 1); l++) {
+    gather_degree(S, single_bond_vals, n_radial, lmax, l);
+    const auto S_l = S.leftCols(2 * l + 1);
+    products.noalias() = S_l * S_l.transpose();
+
+    int pair = 0;
+    for (int n1 = 0; n1 < n_radial; n1++) {
+      for (int n2 = n1; n2 < n_radial; n2++) {
+        B2_vals(atom, pair * (lmax + 1) + l) = products(n1, n2);
+        pair++;
+      }
+    }
+  }
+}
+
+// Gradient of the energy with respect to the single bond values of one atom,
+// given the gradient with respect to its B2 values (row j of gradient). For
+// each l this is G_l S_l, where G_l is the symmetric matrix of B2 gradients
+// with the diagonal doubled.
+static void atom_b2_gradient(Eigen::VectorXd &bond_gradient,
+                             const Eigen::VectorXd &single_bond_vals,
+                             const Eigen::MatrixXd &gradient, int j,
+                             int n_radial, int lmax, Eigen::MatrixXd &S,
+                             Eigen::MatrixXd &G, Eigen::MatrixXd &U) {
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  bond_gradient.resize(n_radial * n_harmonics);
+
+  for (int l = 0; l < (lmax + 1); l++) {
+    int n_m = 2 * l + 1;
+    gather_degree(S, single_bond_vals, n_radial, lmax, l);
+
+    int pair = 0;
+    for (int n1 = 0; n1 < n_radial; n1++) {
+      for (int n2 = n1; n2 < n_radial; n2++) {
+        double g = gradient(j, pair * (lmax + 1) + l);
+        G(n1, n2) = g;
+        G(n2, n1) = g;
+        pair++;
+      }
+      G(n1, n1) *= 2;
+    }
+
+    U.leftCols(n_m).noalias() = G * S.leftCols(n_m);
+    for (int n = 0; n < n_radial; n++) {
+      bond_gradient.segment(n * n_harmonics + l * l, n_m) =
+          U.block(n, 0, 1, n_m).transpose();
+    }
+  }
+}
+
+DescriptorValues B2 ::compute_struc_values(Structure &structure) {
+
+  int nos = descriptor_settings[0];
+  int N = descriptor_settings[1];
+  int lmax = descriptor_settings[2];
+  int n_radial = nos * N;
+  int n_d = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+  int noa = structure.noa;
+
+  Eigen::MatrixXd B2_vals(noa, n_d);
+  Eigen::VectorXd B2_norms(noa);
+
+#pragma omp parallel
+  {
+    Eigen::VectorXd single_bond_vals;
+    Eigen::MatrixXd force_dervs, neighbor_coordinates,
+        S(n_radial, 2 * lmax + 1), products(n_radial, n_radial);
+    std::vector<int> neighbor_indices;
+
+#pragma omp for
+    for (int i = 0; i < noa; i++) {
+      compute_atom_single_bond(single_bond_vals, force_dervs,
+                               neighbor_coordinates, neighbor_indices, i,
+                               structure);
+      atom_b2_values(B2_vals, i, single_bond_vals, n_radial, lmax, S,
+                     products);
+      B2_norms(i) = sqrt(B2_vals.row(i).dot(B2_vals.row(i)));
+    }
+  }
+
+  // Gather species information.
+  Eigen::VectorXi species_count = Eigen::VectorXi::Zero(nos);
+  for (int i = 0; i < noa; i++) {
+    species_count(structure.species[i])++;
+  }
+
+  // Initialize arrays. No neighbors are recorded.
+  DescriptorValues desc = DescriptorValues();
+  desc.n_descriptors = n_d;
+  desc.n_types = nos;
+  desc.n_atoms = noa;
+  desc.volume = structure.volume;
+  desc.cumulative_type_count.push_back(0);
+  for (int s = 0; s < nos; s++) {
+    int n_s = species_count(s);
+
+    desc.n_clusters_by_type.push_back(n_s);
+    desc.cumulative_type_count.push_back(desc.cumulative_type_count[s] + n_s);
+    desc.n_clusters += n_s;
+    desc.n_neighbors_by_type.push_back(0);
+
+    desc.descriptors.push_back(Eigen::MatrixXd::Zero(n_s, n_d));
+    desc.descriptor_force_dervs.push_back(Eigen::MatrixXd::Zero(0, n_d));
+    desc.neighbor_coordinates.push_back(Eigen::MatrixXd::Zero(0, 3));
+
+    desc.cutoff_values.push_back(Eigen::VectorXd::Ones(n_s));
+    desc.cutoff_dervs.push_back(Eigen::VectorXd::Zero(0));
+    desc.descriptor_norms.push_back(Eigen::VectorXd::Zero(n_s));
+    desc.descriptor_force_dots.push_back(Eigen::VectorXd::Zero(0));
+
+    desc.neighbor_counts.push_back(Eigen::VectorXi::Zero(n_s));
+    desc.cumulative_neighbor_counts.push_back(Eigen::VectorXi::Zero(n_s));
+    desc.atom_indices.push_back(Eigen::VectorXi::Zero(n_s));
+    desc.neighbor_indices.push_back(Eigen::VectorXi::Zero(0));
+  }
+
+  // Assign to structure.
+  Eigen::VectorXi species_counter = Eigen::VectorXi::Zero(nos);
+  for (int i = 0; i < noa; i++) {
+    int s = structure.species[i];
+    int s_count = species_counter(s);
+    desc.descriptors[s].row(s_count) = B2_vals.row(i);
+    desc.descriptor_norms[s](s_count) = B2_norms(i);
+    desc.atom_indices[s](s_count) = i;
+    species_counter(s)++;
+  }
+
+  return desc;
+}
+
+void B2 ::backpropagate(Structure &structure, const DescriptorValues &values,
+                        const std::vector<Eigen::MatrixXd> &gradients,
+                        Eigen::VectorXd &efs) {
+
+  int nos = descriptor_settings[0];
+  int N = descriptor_settings[1];
+  int lmax = descriptor_settings[2];
+  int n_radial = nos * N;
+  int noa = structure.noa;
+  double vol_inv = 1 / structure.volume;
+
+  // Row of each atom in the gradient of its type.
+  std::vector<int> type_index(noa);
+  for (int s = 0; s < values.n_types; s++) {
+    for (int j = 0; j < values.n_clusters_by_type[s]; j++) {
+      type_index[values.atom_indices[s](j)] = j;
+    }
+  }
+
+#pragma omp parallel
+  {
+    Eigen::VectorXd local_efs = Eigen::VectorXd::Zero(efs.size());
+    Eigen::VectorXd single_bond_vals, bond_gradient, force_dot;
+    Eigen::MatrixXd force_dervs, neighbor_coordinates,
+        S(n_radial, 2 * lmax + 1), G(n_radial, n_radial),
+        U(n_radial, 2 * lmax + 1);
+    std::vector<int> neighbor_indices;
+
+#pragma omp for
+    for (int i = 0; i < noa; i++) {
+      int s = structure.species[i];
+      int j = type_index[i];
+      if (gradients[s].row(j).isZero(0))
+        continue;
+
+      compute_atom_single_bond(single_bond_vals, force_dervs,
+                               neighbor_coordinates, neighbor_indices, i,
+                               structure);
+      int n_neigh = neighbor_indices.size();
+      if (n_neigh == 0)
+        continue;
+
+      atom_b2_gradient(bond_gradient, single_bond_vals, gradients[s], j,
+                       n_radial, lmax, S, G, U);
+      force_dot.noalias() = force_dervs * bond_gradient;
+
+      for (int k = 0; k < n_neigh; k++) {
+        int neighbor_index = neighbor_indices[k];
+        double coords[3] = {neighbor_coordinates(k, 0),
+                            neighbor_coordinates(k, 1),
+                            neighbor_coordinates(k, 2)};
+        int stress_counter = 0;
+
+        for (int comp = 0; comp < 3; comp++) {
+          double force_val = force_dot(3 * k + comp);
+          local_efs(1 + 3 * neighbor_index + comp) -= force_val;
+          local_efs(1 + 3 * i + comp) += force_val;
+
+          for (int comp2 = comp; comp2 < 3; comp2++) {
+            local_efs(1 + 3 * noa + stress_counter) -=
+                force_val * coords[comp2] * vol_inv;
+            stress_counter++;
+          }
+        }
+      }
+    }
+
+#pragma omp critical
+    efs += local_efs;
+  }
+}
+
 void compute_b2(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
                 Eigen::VectorXd &B2_norms, Eigen::VectorXd &B2_force_dots,
                 const Eigen::MatrixXd &single_bond_vals,
@@ -241,18 +483,95 @@ void compute_b2(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
   }
 }
 
-void single_bond_multiple_cutoffs(
+void compute_b2_gemm(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
+                     Eigen::VectorXd &B2_norms, Eigen::VectorXd &B2_force_dots,
+                     const Eigen::MatrixXd &single_bond_vals,
+                     const Eigen::MatrixXd &single_bond_force_dervs,
+                     const Eigen::VectorXi &unique_neighbor_count,
+                     const Eigen::VectorXi &cumulative_neighbor_count,
+                     const Eigen::VectorXi &descriptor_indices, int nos,
+                     int N, int lmax) {
+
+  int n_atoms = single_bond_vals.rows();
+  int n_neighbors = cumulative_neighbor_count(n_atoms);
+  int n_radial = nos * N;
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  int n_d = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+
+  // Initialize arrays.
+  B2_vals = Eigen::MatrixXd::Zero(n_atoms, n_d);
+  B2_force_dervs = Eigen::MatrixXd::Zero(n_neighbors * 3, n_d);
+  B2_norms = Eigen::VectorXd::Zero(n_atoms);
+  B2_force_dots = Eigen::VectorXd::Zero(n_neighbors * 3);
+
+#pragma omp parallel for
+  for (int atom = 0; atom < n_atoms; atom++) {
+    int n_atom_neighbors = unique_neighbor_count(atom);
+    int force_start = cumulative_neighbor_count(atom) * 3;
+    int n_rows = n_atom_neighbors * 3;
+
+    Eigen::MatrixXd S(n_radial, 2 * lmax + 1), products(n_radial, n_radial);
+    Eigen::MatrixXd dervs(n_rows, n_radial * n_radial);
+
+    for (int l = 0; l < (lmax + 1); l++) {
+      int n_m = 2 * l + 1;
+
+      // Gather the single bond values of degree l, with S(n, m) the value of
+      // radial channel n and harmonic (l, m).
+      for (int n = 0; n < n_radial; n++) {
+        S.block(n, 0, 1, n_m) =
+            single_bond_vals.block(atom, n * n_harmonics + l * l, 1, n_m);
+      }
+      const auto S_l = S.leftCols(n_m);
+      products.noalias() = S_l * S_l.transpose();
+
+      // Column n2 * n_radial + n1 of dervs holds the sum over m of the force
+      // derivatives of channel n2 times the values of channel n1.
+      if (n_rows > 0) {
+        for (int n2 = 0; n2 < n_radial; n2++) {
+          dervs.middleCols(n2 * n_radial, n_radial).noalias() =
+              single_bond_force_dervs.block(
+                  force_start, n2 * n_harmonics + l * l, n_rows, n_m) *
+              S_l.transpose();
+        }
+      }
+
+      // Scatter the (n1, n2, l) descriptors, ordered as in compute_b2.
+      int pair = 0;
+      for (int n1 = 0; n1 < n_radial; n1++) {
+        for (int n2 = n1; n2 < n_radial; n2++) {
+          int counter = pair * (lmax + 1) + l;
+          B2_vals(atom, counter) = products(n1, n2);
+          if (n_rows > 0) {
+            B2_force_dervs.block(force_start, counter, n_rows, 1) =
+                dervs.col(n2 * n_radial + n1) + dervs.col(n1 * n_radial + n2);
+          }
+          pair++;
+        }
+      }
+    }
+
+    // Compute descriptor norm and force dot products.
+    B2_norms(atom) = sqrt(B2_vals.row(atom).dot(B2_vals.row(atom)));
+    if (n_atom_neighbors > 0) {
+      B2_force_dots.segment(force_start, n_atom_neighbors * 3) =
+          B2_force_dervs.block(force_start, 0, n_atom_neighbors * 3, n_d) *
+          B2_vals.row(atom).transpose();
+    }
+  }
+}
+
+// Single bond values with species-dependent cutoffs. Radial and Cutoff are
+// either std::function objects or the StaticRadial/StaticCutoff wrappers of
+// the single bond engine.
+template <typename Radial, typename Cutoff>
+static void single_bond_multiple_cutoffs_engine(
     Eigen::MatrixXd &single_bond_vals, Eigen::MatrixXd &force_dervs,
     Eigen::MatrixXd &neighbor_coordinates, Eigen::VectorXi &neighbor_count,
     Eigen::VectorXi &cumulative_neighbor_count,
-    Eigen::VectorXi &neighbor_indices,
-    std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
-        radial_function,
-    std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
-        cutoff_function,
-    int nos, int N, int lmax, const std::vector<double> &radial_hyps,
+    Eigen::VectorXi &neighbor_indices, const Radial &radial_function,
+    const Cutoff &cutoff_function, int nos, int N, int lmax,
+    const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, const Structure &structure,
     const Eigen::MatrixXd &cutoffs) {
 
@@ -318,86 +637,171 @@ void single_bond_multiple_cutoffs(
     int rel_index = structure.cumulative_neighbor_count(i);
     int neighbor_index = cumulative_neighbor_count(i);
     int central_species = structure.species[i];
+    SingleBondScratch &scratch = single_bond_scratch(N);
+    scratch.clear_bonds();
 
     // Initialize radial hyperparameters.
     std::vector<double> new_radial_hyps = radial_hyps;
 
-    // Initialize radial and spherical harmonic vectors.
-    std::vector<double> g = std::vector<double>(N, 0);
-    std::vector<double> gx = std::vector<double>(N, 0);
-    std::vector<double> gy = std::vector<double>(N, 0);
-    std::vector<double> gz = std::vector<double>(N, 0);
-
-    std::vector<double> h = std::vector<double>(number_of_harmonics, 0);
-    std::vector<double> hx = std::vector<double>(number_of_harmonics, 0);
-    std::vector<double> hy = std::vector<double>(number_of_harmonics, 0);
-    std::vector<double> hz = std::vector<double>(number_of_harmonics, 0);
-
-    double x, y, z, r, bond, bond_x, bond_y, bond_z, g_val, gx_val, gy_val,
-        gz_val, h_val;
-    int s, neigh_index, descriptor_counter, unique_ind;
     for (int j = 0; j < i_neighbors; j++) {
-      neigh_index = rel_index + j;
-      int neighbor_species = structure.neighbor_species(neigh_index);
-      double rcut = cutoffs(central_species, neighbor_species);
-      r = structure.relative_positions(neigh_index, 0);
+      int neigh_index = rel_index + j;
+      int s = structure.neighbor_species(neigh_index);
+      double rcut = cutoffs(central_species, s);
+      double r = structure.relative_positions(neigh_index, 0);
       if (r > rcut)
         continue; // Skip if outside cutoff.
-      x = structure.relative_positions(neigh_index, 1);
-      y = structure.relative_positions(neigh_index, 2);
-      z = structure.relative_positions(neigh_index, 3);
-      s = structure.neighbor_species(neigh_index);
-
-      // Reset the endpoint of the radial basis set.
-      new_radial_hyps[1] = rcut;
+      double x = structure.relative_positions(neigh_index, 1);
+      double y = structure.relative_positions(neigh_index, 2);
+      double z = structure.relative_positions(neigh_index, 3);
 
       // Store neighbor coordinates.
       neighbor_coordinates(neighbor_index, 0) = x;
       neighbor_coordinates(neighbor_index, 1) = y;
       neighbor_coordinates(neighbor_index, 2) = z;
 
-      // Compute radial basis values and spherical harmonics.
-      calculate_radial(g, gx, gy, gz, radial_function, cutoff_function, x, y, z,
-                       r, rcut, N, new_radial_hyps, cutoff_hyps);
-      get_Y(h, hx, hy, hz, x, y, z, lmax);
+      scratch.add_bond(x, y, z, r, rcut, s);
+      neighbor_index++;
+    }
 
-      // Store the products and their derivatives.
-      descriptor_counter = s * no_bond_vals;
+    // Compute the single bond values and their derivatives.
+    add_single_bonds(single_bond_vals.row(i), force_dervs,
+                     cumulative_neighbor_count(i) * 3, scratch,
+                     radial_function, cutoff_function, N, lmax,
+                     new_radial_hyps, cutoff_hyps);
+  }
+}
 
-      for (int radial_counter = 0; radial_counter < N; radial_counter++) {
-        // Retrieve radial values.
-        g_val = g[radial_counter];
-        gx_val = gx[radial_counter];
-        gy_val = gy[radial_counter];
-        gz_val = gz[radial_counter];
+template <RadialFunction radial, CutoffFunction cutoff>
+void StructureSingleBond::compute(
+    Eigen::MatrixXd &single_bond_vals, Eigen::MatrixXd &force_dervs,
+    Eigen::MatrixXd &neighbor_coordinates, Eigen::VectorXi &neighbor_count,
+    Eigen::VectorXi &cumulative_neighbor_count,
+    Eigen::VectorXi &neighbor_indices, int nos, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, const Structure &structure,
+    const Eigen::MatrixXd &cutoffs) {
 
-        for (int angular_counter = 0; angular_counter < number_of_harmonics;
-             angular_counter++) {
+  single_bond_multiple_cutoffs_engine(
+      single_bond_vals, force_dervs, neighbor_coordinates, neighbor_count,
+      cumulative_neighbor_count, neighbor_indices, StaticRadial<radial>(),
+      StaticCutoff<cutoff>(), nos, N, lmax, radial_hyps, cutoff_hyps,
+      structure, cutoffs);
+}
 
-          // Compute single bond value.
-          h_val = h[angular_counter];
-          bond = g_val * h_val;
+// Single bond values of one atom, with the displacement of each bond.
+template <typename Radial, typename Cutoff>
+static void atom_single_bond_engine(
+    Eigen::VectorXd &single_bond_vals, Eigen::MatrixXd &force_dervs,
+    Eigen::MatrixXd &neighbor_coordinates, std::vector<int> &neighbor_indices, const Radial &radial_function,
+    const Cutoff &cutoff_function, int atom, int nos, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, const Structure &structure,
+    const Eigen::MatrixXd &cutoffs) {
 
-          // Calculate derivatives with the product rule.
-          bond_x = gx_val * h_val + g_val * hx[angular_counter];
-          bond_y = gy_val * h_val + g_val * hy[angular_counter];
-          bond_z = gz_val * h_val + g_val * hz[angular_counter];
+  int i_neighbors = structure.neighbor_count(atom);
+  int rel_index = structure.cumulative_neighbor_count(atom);
+  int central_species = structure.species[atom];
+  SingleBondScratch &scratch = single_bond_scratch(N);
+  scratch.clear_bonds();
+  neighbor_indices.clear();
+
+  for (int j = 0; j < i_neighbors; j++) {
+    int neigh_index = rel_index + j;
+    int s = structure.neighbor_species(neigh_index);
+    double rcut = cutoffs(central_species, s);
+    double r = structure.relative_positions(neigh_index, 0);
+    if (r > rcut)
+      continue; // Skip if outside cutoff.
+    double x = structure.relative_positions(neigh_index, 1);
+    double y = structure.relative_positions(neigh_index, 2);
+    double z = structure.relative_positions(neigh_index, 3);
+
+    scratch.add_bond(x, y, z, r, rcut, s);
+    neighbor_indices.push_back(structure.structure_indices(neigh_index));
+  }
 
-          // Update single bond arrays.
-          single_bond_vals(i, descriptor_counter) += bond;
+  int n_bonds = neighbor_indices.size();
+  neighbor_coordinates.resize(n_bonds, 3);
+  for (int k = 0; k < n_bonds; k++) {
+    neighbor_coordinates(k, 0) = scratch.bond_x[k];
+    neighbor_coordinates(k, 1) = scratch.bond_y[k];
+    neighbor_coordinates(k, 2) = scratch.bond_z[k];
+  }
 
-          force_dervs(neighbor_index * 3, descriptor_counter) += bond_x;
-          force_dervs(neighbor_index * 3 + 1, descriptor_counter) += bond_y;
-          force_dervs(neighbor_index * 3 + 2, descriptor_counter) += bond_z;
+  int single_bond_size = nos * N * (lmax + 1) * (lmax + 1);
+  single_bond_vals.setZero(single_bond_size);
+  force_dervs.setZero(n_bonds * 3, single_bond_size);
 
-          descriptor_counter++;
-        }
-      }
-      neighbor_index++;
-    }
+  std::vector<double> new_radial_hyps = radial_hyps;
+  add_single_bonds(single_bond_vals, force_dervs, 0, scratch,
+                   radial_function, cutoff_function, N, lmax,
+                   new_radial_hyps, cutoff_hyps);
+}
+
+template <RadialFunction radial, CutoffFunction cutoff>
+void AtomSingleBond::compute(Eigen::VectorXd &single_bond_vals,
+                             Eigen::MatrixXd &force_dervs,
+                             Eigen::MatrixXd &neighbor_coordinates,
+                             std::vector<int> &neighbor_indices, int atom,
+                             int nos, int N, int lmax,
+                             const std::vector<double> &radial_hyps,
+                             const std::vector<double> &cutoff_hyps,
+                             const Structure &structure,
+                             const Eigen::MatrixXd &cutoffs) {
+
+  atom_single_bond_engine(single_bond_vals, force_dervs,
+                          neighbor_coordinates, neighbor_indices,
+                          StaticRadial<radial>(), StaticCutoff<cutoff>(),
+                          atom, nos, N, lmax, radial_hyps, cutoff_hyps,
+                          structure, cutoffs);
+}
+
+void B2 ::compute_atom_single_bond(Eigen::VectorXd &single_bond_vals,
+                                   Eigen::MatrixXd &force_dervs,
+                                   Eigen::MatrixXd &neighbor_coordinates,
+                                   std::vector<int> &neighbor_indices,
+                                   int atom, const Structure &structure) {
+
+  int nos = descriptor_settings[0];
+  int N = descriptor_settings[1];
+  int lmax = descriptor_settings[2];
+
+  if (atom_single_bond_pointer != nullptr) {
+    atom_single_bond_pointer(single_bond_vals, force_dervs,
+                             neighbor_coordinates, neighbor_indices, atom,
+                             nos, N, lmax, radial_hyps, cutoff_hyps,
+                             structure, cutoffs);
+  } else {
+    atom_single_bond_engine(single_bond_vals, force_dervs,
+                            neighbor_coordinates, neighbor_indices,
+                            radial_pointer, cutoff_pointer, atom, nos, N,
+                            lmax, radial_hyps, cutoff_hyps, structure,
+                            cutoffs);
   }
 }
 
+void single_bond_multiple_cutoffs(
+    Eigen::MatrixXd &single_bond_vals, Eigen::MatrixXd &force_dervs,
+    Eigen::MatrixXd &neighbor_coordinates, Eigen::VectorXi &neighbor_count,
+    Eigen::VectorXi &cumulative_neighbor_count,
+    Eigen::VectorXi &neighbor_indices,
+    std::function<void(std::vector<double> &, std::vector<double> &, double,
+                       int, std::vector<double>)>
+        radial_function,
+    std::function<void(std::vector<double> &, double, double,
+                       std::vector<double>)>
+        cutoff_function,
+    int nos, int N, int lmax, const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, const Structure &structure,
+    const Eigen::MatrixXd &cutoffs) {
+
+  single_bond_multiple_cutoffs_engine(
+      single_bond_vals, force_dervs, neighbor_coordinates, neighbor_count,
+      cumulative_neighbor_count, neighbor_indices, radial_function,
+      cutoff_function, nos, N, lmax, radial_hyps, cutoff_hyps, structure,
+      cutoffs);
+}
+
 void compute_single_bond(
     Eigen::MatrixXd &single_bond_vals, Eigen::MatrixXd &force_dervs,
     Eigen::MatrixXd &neighbor_coordinates, Eigen::VectorXi &neighbor_count,
@@ -553,7 +957,8 @@ void to_json(nlohmann::json& j, const B2 & p){
     {"cutoff_hyps", p.cutoff_hyps},
     {"descriptor_settings", p.descriptor_settings},
     {"cutoffs", p.cutoffs},
-    {"descriptor_name", p.descriptor_name}
+    {"descriptor_name", p.descriptor_name},
+    {"b2_gemm", p.b2_gemm}
   };
 }
 
@@ -566,6 +971,7 @@ void from_json(const nlohmann::json& j, B2 & p){
     j.at("descriptor_settings"),
     j.at("cutoffs")
   );
+  p.b2_gemm = j.value("b2_gemm", true);
 }
 
 nlohmann::json B2 ::return_json(){
@@ -2,6 +2,7 @@
 #define B2_H
 
 #include "descriptor.h"
+#include "single_bond.h"
 #include <string>
 #include <vector>
 #include <nlohmann/json.hpp>
@@ -9,6 +10,62 @@
 
 class Structure;
 
+/**
+ * Single bond engine for structures, specialized on the radial basis and
+ * cutoff function. Specializations are selected by name with
+ * set_single_bond<StructureSingleBond>.
+ */
+struct StructureSingleBond {
+  typedef void (*Function)(Eigen::MatrixXd &single_bond_vals,
+                           Eigen::MatrixXd &force_dervs,
+                           Eigen::MatrixXd &neighbor_coordinates,
+                           Eigen::VectorXi &neighbor_count,
+                           Eigen::VectorXi &cumulative_neighbor_count,
+                           Eigen::VectorXi &neighbor_indices, int nos, int N,
+                           int lmax, const std::vector<double> &radial_hyps,
+                           const std::vector<double> &cutoff_hyps,
+                           const Structure &structure,
+                           const Eigen::MatrixXd &cutoffs);
+
+  template <RadialFunction radial, CutoffFunction cutoff>
+  static void compute(Eigen::MatrixXd &single_bond_vals,
+                      Eigen::MatrixXd &force_dervs,
+                      Eigen::MatrixXd &neighbor_coordinates,
+                      Eigen::VectorXi &neighbor_count,
+                      Eigen::VectorXi &cumulative_neighbor_count,
+                      Eigen::VectorXi &neighbor_indices, int nos, int N,
+                      int lmax, const std::vector<double> &radial_hyps,
+                      const std::vector<double> &cutoff_hyps,
+                      const Structure &structure,
+                      const Eigen::MatrixXd &cutoffs);
+};
+
+/**
+ * Single bond engine for one atom. Row k of neighbor_coordinates holds the
+ * displacement of bond k, and neighbor_indices its structure index.
+ */
+struct AtomSingleBond {
+  typedef void (*Function)(Eigen::VectorXd &single_bond_vals,
+                           Eigen::MatrixXd &force_dervs,
+                           Eigen::MatrixXd &neighbor_coordinates,
+                           std::vector<int> &neighbor_indices, int atom,
+                           int nos, int N, int lmax,
+                           const std::vector<double> &radial_hyps,
+                           const std::vector<double> &cutoff_hyps,
+                           const Structure &structure,
+                           const Eigen::MatrixXd &cutoffs);
+
+  template <RadialFunction radial, CutoffFunction cutoff>
+  static void compute(Eigen::VectorXd &single_bond_vals,
+                      Eigen::MatrixXd &force_dervs,
+                      Eigen::MatrixXd &neighbor_coordinates,
+                      std::vector<int> &neighbor_indices, int atom, int nos,
+                      int N, int lmax, const std::vector<double> &radial_hyps,
+                      const std::vector<double> &cutoff_hyps,
+                      const Structure &structure,
+                      const Eigen::MatrixXd &cutoffs);
+};
+
 class B2 : public Descriptor {
 public:
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
@@ -21,6 +78,17 @@ public:
   std::vector<double> radial_hyps, cutoff_hyps;
   std::vector<int> descriptor_settings;
 
+  /** Single bond engine specialized on the radial basis and cutoff function.
+   */
+  StructureSingleBond::Function single_bond_pointer = nullptr;
+  AtomSingleBond::Function atom_single_bond_pointer = nullptr;
+
+  /** If true (the default), the B2 values and force derivatives are
+   * contracted with compute_b2_gemm, otherwise with the reference loops of
+   * compute_b2. Saved in the JSON; files without it load the default.
+   */
+  bool b2_gemm = true;
+
   std::string descriptor_name = "B2";
 
   /** Matrix of cutoff values, with element (i, j) corresponding to the cutoff
@@ -47,7 +115,33 @@ public:
 
   DescriptorValues compute_struc(Structure &structure);
 
-  void write_to_file(std::ofstream &coeff_file, int coeff_size);
+  /**
+   * Compute the B2 values and norms of a structure. The force derivatives,
+   * neighbor coordinates and neighbor indices are left empty, so that memory
+   * scales with the number of atoms rather than the number of neighbors.
+   */
+  DescriptorValues compute_struc_values(Structure &structure);
+
+  /**
+   * Back-propagate the energy gradients through the single bond derivatives
+   * of each atom, which are recomputed one atom at a time.
+   */
+  void backpropagate(Structure &structure, const DescriptorValues &values,
+                     const std::vector<Eigen::MatrixXd> &gradients,
+                     Eigen::VectorXd &efs);
+
+  /**
+   * Compute the single bond values of one atom and their derivatives with
+   * respect to the positions of its neighbors. Row k of
+   * neighbor_coordinates is the displacement of neighbor k.
+   */
+  void compute_atom_single_bond(Eigen::VectorXd &single_bond_vals,
+                                Eigen::MatrixXd &force_dervs,
+                                Eigen::MatrixXd &neighbor_coordinates,
+                                std::vector<int> &neighbor_indices, int atom,
+                                const Structure &structure);
+
+  void write_to_file(std::ostream &coeff_file, int coeff_size);
 
   nlohmann::json return_json();
 };
@@ -61,6 +155,20 @@ void compute_b2(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
                 const Eigen::VectorXi &descriptor_indices, int nos, int N,
                 int lmax);
 
+/**
+ * Equivalent to compute_b2, with the sum over m of each degree l evaluated as
+ * dense matrix products of the single bond values and the force derivatives
+ * of each atom.
+ */
+void compute_b2_gemm(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
+                     Eigen::VectorXd &B2_norms, Eigen::VectorXd &B2_force_dots,
+                     const Eigen::MatrixXd &single_bond_vals,
+                     const Eigen::MatrixXd &single_bond_force_dervs,
+                     const Eigen::VectorXi &unique_neighbor_count,
+                     const Eigen::VectorXi &cumulative_neighbor_count,
+                     const Eigen::VectorXi &descriptor_indices, int nos,
+                     int N, int lmax);
+
 /**
  * Compute single bond vector with different cutoffs assigned to different
  * pairs of elements.
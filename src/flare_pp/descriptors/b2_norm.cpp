@@ -18,6 +18,17 @@ B2_Norm ::B2_Norm(const std::string &radial_basis,
     : B2(radial_basis, cutoff_function, radial_hyps, cutoff_hyps,
          descriptor_settings) {}
 
+DescriptorValues B2_Norm ::compute_struc_values(Structure &structure) {
+  return Descriptor::compute_struc_values(structure);
+}
+
+void B2_Norm ::backpropagate(Structure &structure,
+                             const DescriptorValues &values,
+                             const std::vector<Eigen::MatrixXd> &gradients,
+                             Eigen::VectorXd &efs) {
+  Descriptor::backpropagate(structure, values, gradients, efs);
+}
+
 DescriptorValues B2_Norm ::compute_struc(Structure &structure) {
 
   // Initialize descriptor values.
@@ -43,7 +54,8 @@ DescriptorValues B2_Norm ::compute_struc(Structure &structure) {
 
   compute_b2_norm(B2_vals, B2_force_dervs, B2_norms, B2_force_dots,
                   single_bond_vals, force_dervs, unique_neighbor_count,
-                  cumulative_neighbor_count, descriptor_indices, nos, N, lmax);
+                  cumulative_neighbor_count, descriptor_indices, nos, N, lmax,
+                  b2_gemm);
 
   // Gather species information.
   int noa = structure.noa;
@@ -129,7 +141,8 @@ void compute_b2_norm(
   const Eigen::MatrixXd &single_bond_force_dervs,
   const Eigen::VectorXi &unique_neighbor_count,
   const Eigen::VectorXi &cumulative_neighbor_count,
-  const Eigen::VectorXi &descriptor_indices, int nos, int N, int lmax) {
+  const Eigen::VectorXi &descriptor_indices, int nos, int N, int lmax,
+  bool gemm) {
 
   int n_atoms = single_bond_vals.rows();
   int n_neighbors = cumulative_neighbor_count(n_atoms);
@@ -143,9 +156,16 @@ void compute_b2_norm(
   // Compute unnormalized B2 values.
   Eigen::MatrixXd B2_vals_1, B2_force_dervs_1;
   Eigen::VectorXd B2_norms_1, B2_force_dots_1;
-  compute_b2(B2_vals_1, B2_force_dervs_1, B2_norms_1, B2_force_dots_1,
-             single_bond_vals, single_bond_force_dervs, unique_neighbor_count,
-             cumulative_neighbor_count, descriptor_indices, nos, N, lmax);
+  if (gemm) {
+    compute_b2_gemm(B2_vals_1, B2_force_dervs_1, B2_norms_1, B2_force_dots_1,
+                    single_bond_vals, single_bond_force_dervs,
+                    unique_neighbor_count, cumulative_neighbor_count,
+                    descriptor_indices, nos, N, lmax);
+  } else {
+    compute_b2(B2_vals_1, B2_force_dervs_1, B2_norms_1, B2_force_dots_1,
+               single_bond_vals, single_bond_force_dervs, unique_neighbor_count,
+               cumulative_neighbor_count, descriptor_indices, nos, N, lmax);
+  }
 
   // Normalize the descriptor values.
   B2_vals = Eigen::MatrixXd::Zero(n_atoms, n_d);
@@ -19,6 +19,14 @@ public:
 
   DescriptorValues compute_struc(Structure &structure);
 
+  /** The normalized values are not back-propagated atom by atom, so these
+   * use the Descriptor defaults rather than the B2 versions.
+   */
+  DescriptorValues compute_struc_values(Structure &structure);
+  void backpropagate(Structure &structure, const DescriptorValues &values,
+                     const std::vector<Eigen::MatrixXd> &gradients,
+                     Eigen::VectorXd &efs);
+
   nlohmann::json return_json();
 };
 
@@ -29,6 +37,6 @@ void compute_b2_norm(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
                      const Eigen::VectorXi &unique_neighbor_count,
                      const Eigen::VectorXi &cumulative_neighbor_count,
                      const Eigen::VectorXi &descriptor_indices, int nos, int N,
-                     int lmax);
+                     int lmax, bool gemm = true);
 
 #endif
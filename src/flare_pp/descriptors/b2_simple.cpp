@@ -27,7 +27,7 @@ B2_Simple ::B2_Simple(const std::string &radial_basis,
   set_cutoff(cutoff_function, this->cutoff_pointer);
 }
 
-void B2_Simple ::write_to_file(std::ofstream &coeff_file, int coeff_size) {
+void B2_Simple ::write_to_file(std::ostream &coeff_file, int coeff_size) {
   // Report radial basis set.
   coeff_file << radial_basis << "\n";
 
@@ -29,7 +29,7 @@ public:
 
   DescriptorValues compute_struc(Structure &structure);
 
-  void write_to_file(std::ofstream &coeff_file, int coeff_size);
+  void write_to_file(std::ostream &coeff_file, int coeff_size);
 
   nlohmann::json return_json();
 };
@@ -5,10 +5,82 @@
 #include "b2.h"
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
 
 Descriptor::Descriptor() {}
 
-void Descriptor::write_to_file(std::ofstream &coeff_file, int coeff_size) {
+DescriptorValues Descriptor::compute_struc_values(Structure &structure) {
+  return compute_struc(structure);
+}
+
+void Descriptor::backpropagate(Structure &structure,
+                               const DescriptorValues &values,
+                               const std::vector<Eigen::MatrixXd> &gradients,
+                               Eigen::VectorXd &efs) {
+  backpropagate_force_dervs(values, gradients, efs);
+}
+
+void backpropagate_force_dervs(const DescriptorValues &values,
+                               const std::vector<Eigen::MatrixXd> &gradients,
+                               Eigen::VectorXd &efs) {
+
+  int n_atoms = values.n_atoms;
+  double vol_inv = 1 / values.volume;
+
+  for (int s = 0; s < values.n_types; s++) {
+    if (values.descriptor_force_dervs[s].rows() !=
+        3 * values.n_neighbors_by_type[s]) {
+      throw std::invalid_argument(
+          "The force derivatives of the descriptors were not computed.");
+    }
+  }
+
+#pragma omp parallel
+  {
+    Eigen::VectorXd local_efs = Eigen::VectorXd::Zero(efs.size());
+    Eigen::VectorXd force_dot;
+
+    for (int s = 0; s < values.n_types; s++) {
+#pragma omp for
+      for (int j = 0; j < values.n_clusters_by_type[s]; j++) {
+        int n_neigh = values.neighbor_counts[s](j);
+        int c_neigh = values.cumulative_neighbor_counts[s](j);
+        int atom_index = values.atom_indices[s](j);
+
+        // Derivatives of the energy of atom j with respect to the positions
+        // of its neighbors.
+        force_dot.noalias() =
+            values.descriptor_force_dervs[s].middleRows(3 * c_neigh,
+                                                        3 * n_neigh) *
+            gradients[s].row(j).transpose();
+
+        for (int k = 0; k < n_neigh; k++) {
+          int ind = c_neigh + k;
+          int neighbor_index = values.neighbor_indices[s](ind);
+          int stress_counter = 0;
+
+          for (int comp = 0; comp < 3; comp++) {
+            double force_val = force_dot(3 * k + comp);
+            local_efs(1 + 3 * neighbor_index + comp) -= force_val;
+            local_efs(1 + 3 * atom_index + comp) += force_val;
+
+            for (int comp2 = comp; comp2 < 3; comp2++) {
+              double coord = values.neighbor_coordinates[s](ind, comp2);
+              local_efs(1 + 3 * n_atoms + stress_counter) -=
+                  force_val * coord * vol_inv;
+              stress_counter++;
+            }
+          }
+        }
+      }
+    }
+
+#pragma omp critical
+    efs += local_efs;
+  }
+}
+
+void Descriptor::write_to_file(std::ostream &coeff_file, int coeff_size) {
   std::cout << "Mapping this descriptor is not implemented yet." << std::endl;
   return;
 }
@@ -60,7 +132,8 @@ ClusterDescriptor::ClusterDescriptor(const DescriptorValues &structure,
 }
 
 void ClusterDescriptor ::initialize_cluster(int n_types, int n_descriptors) {
-  if (n_clusters != 0)
+  // Types are set up once, even if no clusters have been added yet.
+  if (n_clusters_by_type.size() != 0)
     return;
 
   this->n_types = n_types;
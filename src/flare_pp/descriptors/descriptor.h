@@ -17,9 +17,27 @@ public:
 
   virtual DescriptorValues compute_struc(Structure &structure) = 0;
 
+  /**
+   * Compute the descriptor values and norms of a structure, without the
+   * force derivatives. The default computes everything with compute_struc.
+   */
+  virtual DescriptorValues compute_struc_values(Structure &structure);
+
+  /**
+   * Add the forces and stress due to an energy gradient to efs, which is
+   * ordered as Structure::mean_efs. gradients[s](j, d) is the derivative of
+   * the energy with respect to descriptor d of atom j of type s. The default
+   * is backpropagate_force_dervs, so it requires values computed with
+   * compute_struc.
+   */
+  virtual void backpropagate(Structure &structure,
+                             const DescriptorValues &values,
+                             const std::vector<Eigen::MatrixXd> &gradients,
+                             Eigen::VectorXd &efs);
+
   virtual ~Descriptor() = default;
 
-  virtual void write_to_file(std::ofstream &coeff_file, int coeff_size);
+  virtual void write_to_file(std::ostream &coeff_file, int coeff_size);
 
   virtual nlohmann::json return_json() = 0;
 };
@@ -56,6 +74,15 @@ public:
     n_neighbors_by_type)
 };
 
+/**
+ * Add the forces and stress due to the energy gradients of each atom to efs
+ * by contracting them with the stored descriptor force derivatives (see
+ * Descriptor::backpropagate).
+ */
+void backpropagate_force_dervs(const DescriptorValues &values,
+                               const std::vector<Eigen::MatrixXd> &gradients,
+                               Eigen::VectorXd &efs);
+
 // ClusterDescriptor holds the descriptor values for a collection of clusters
 // (excluding partial force derivatives).
 class ClusterDescriptor {
@@ -73,6 +73,22 @@ namespace nlohmann {
       }
     }
   };
+
+  template <>
+  struct adl_serializer<
+      Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> {
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic,
+                          Eigen::RowMajor>
+        RowMajorMatrix;
+
+    static void to_json(json &j, const RowMajorMatrix &matrix) {
+      j = Eigen::MatrixXd(matrix);
+    }
+
+    static void from_json(const json &j, RowMajorMatrix &matrix) {
+      matrix = j.get<Eigen::MatrixXd>();
+    }
+  };
 }
 
 #endif
@@ -87,6 +87,29 @@ Eigen::MatrixXd DotProduct ::envs_envs(const ClusterDescriptor &envs1,
   return kern_mat;
 }
 
+Eigen::VectorXd DotProduct ::envs_self_diagonal(const ClusterDescriptor &envs,
+                                                const Eigen::VectorXd &hyps) {
+
+  double sig_sq = hyps(0) * hyps(0);
+  Eigen::VectorXd kern_vec = Eigen::VectorXd::Zero(envs.n_clusters);
+  double empty_thresh = 1e-8;
+
+  for (int s = 0; s < envs.n_types; s++) {
+    int n_sparse = envs.n_clusters_by_type[s];
+    int c_sparse = envs.cumulative_type_count[s];
+
+#pragma omp parallel for
+    for (int i = 0; i < n_sparse; i++) {
+      if (envs.descriptor_norms[s](i) < empty_thresh)
+        continue;
+
+      double norm_dot = envs.descriptors[s].row(i).squaredNorm();
+      kern_vec(c_sparse + i) = sig_sq * pow(norm_dot, power);
+    }
+  }
+  return kern_vec;
+}
+
 std::vector<Eigen::MatrixXd>
 DotProduct ::envs_envs_grad(const ClusterDescriptor &envs1,
                                       const ClusterDescriptor &envs2,
@@ -210,6 +233,60 @@ Eigen::MatrixXd DotProduct ::envs_struc(const ClusterDescriptor &envs,
   return kern_mat;
 }
 
+Eigen::VectorXd DotProduct ::envs_struc_contracted(
+    const ClusterDescriptor &envs, const DescriptorValues &struc,
+    const Eigen::VectorXd &alpha, const Eigen::VectorXd &hyps) {
+
+  Eigen::VectorXd efs = Eigen::VectorXd::Zero(1 + struc.n_atoms * 3 + 6);
+  std::vector<Eigen::MatrixXd> gradients;
+  efs(0) = envs_struc_energy_gradient(envs, struc, alpha, hyps, gradients);
+  backpropagate_force_dervs(struc, gradients, efs);
+  return efs;
+}
+
+double DotProduct ::envs_struc_energy_gradient(
+    const ClusterDescriptor &envs, const DescriptorValues &struc,
+    const Eigen::VectorXd &alpha, const Eigen::VectorXd &hyps,
+    std::vector<Eigen::MatrixXd> &gradients) {
+
+  double sig_sq = hyps(0) * hyps(0);
+  double empty_thresh = 1e-8;
+  double energy = 0;
+  gradients.clear();
+
+  for (int s = 0; s < envs.n_types; s++) {
+    int n_sparse = envs.n_clusters_by_type[s];
+    int n_struc = struc.n_clusters_by_type[s];
+    int c_sparse = envs.cumulative_type_count[s];
+
+    Eigen::MatrixXd dot_vals =
+        struc.descriptors[s] * envs.descriptors[s].transpose();
+
+    // W(j, i) is the derivative of the energy with respect to the dot
+    // product of atom j and sparse environment i.
+    Eigen::MatrixXd W = Eigen::MatrixXd::Zero(n_struc, n_sparse);
+
+#pragma omp parallel for reduction(+ : energy)
+    for (int j = 0; j < n_struc; j++) {
+      if (struc.descriptor_norms[s](j) < empty_thresh)
+        continue;
+
+      for (int i = 0; i < n_sparse; i++) {
+        if (envs.descriptor_norms[s](i) < empty_thresh)
+          continue;
+
+        double weight = sig_sq * alpha(c_sparse + i);
+        energy += weight * pow(dot_vals(j, i), power);
+        W(j, i) = weight * power * pow(dot_vals(j, i), power - 1);
+      }
+    }
+
+    gradients.push_back(W * envs.descriptors[s]);
+  }
+
+  return energy;
+}
+
 Eigen::MatrixXd
 DotProduct ::struc_struc(const DescriptorValues &struc1,
                                    const DescriptorValues &struc2,
@@ -780,6 +857,7 @@ Eigen::MatrixXd DotProduct ::compute_varmap_coefficients(
   }
 
   double empty_thresh = 1e-8;
+  const Eigen::MatrixXd &Kuu_inverse = gp_model.Kuu_inverse();
 
   // Initialize beta vector.
   int p_size = gp_model.sparse_descriptors[kernel_index].n_descriptors;
@@ -826,7 +904,7 @@ Eigen::MatrixXd DotProduct ::compute_varmap_coefficients(
         if (pj_norm < empty_thresh)
           continue;
 
-        double Kuu_inv_ij = gp_model.Kuu_inverse(K_ind + i, K_ind + j);
+        double Kuu_inv_ij = Kuu_inverse(K_ind + i, K_ind + j);
         double Kuu_inv_ij_normed = Kuu_inv_ij; // / pi_norm / pj_norm;
 //        double Sigma_ij = gp_model.Sigma(K_ind + i, K_ind + j);
 //        double Sigma_ij_normed = Sigma_ij / pi_norm / pj_norm;
@@ -858,7 +936,7 @@ Eigen::MatrixXd DotProduct ::compute_varmap_coefficients(
   return mapping_coeffs;
 }
 
-void DotProduct ::write_info(std::ofstream &coeff_file) {
+void DotProduct ::write_info(std::ostream &coeff_file) {
   coeff_file << std::fixed << std::setprecision(0);
   coeff_file << power << " DotProduct\n";
 }
@@ -2,6 +2,7 @@
 #include "cutoffs.h"
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
 #include "normalized_dot_product.h"
 #include "norm_dot_icm.h"
 #include "squared_exponential.h"
@@ -21,6 +22,27 @@ std::vector<Eigen::MatrixXd> Kernel ::Kuu_grad(const ClusterDescriptor &envs,
   return Kuu_grad;
 }
 
+Eigen::VectorXd Kernel ::envs_self_diagonal(const ClusterDescriptor &envs,
+                                            const Eigen::VectorXd &hyps) {
+  return envs_envs(envs, envs, hyps).diagonal();
+}
+
+Eigen::VectorXd Kernel ::envs_struc_contracted(const ClusterDescriptor &envs,
+                                               const DescriptorValues &struc,
+                                               const Eigen::VectorXd &alpha,
+                                               const Eigen::VectorXd &hyps) {
+  return envs_struc(envs, struc, hyps).transpose() * alpha;
+}
+
+double Kernel ::envs_struc_energy_gradient(
+    const ClusterDescriptor &envs, const DescriptorValues &struc,
+    const Eigen::VectorXd &alpha, const Eigen::VectorXd &hyps,
+    std::vector<Eigen::MatrixXd> &gradients) {
+
+  throw std::invalid_argument(kernel_name +
+                              " does not support fast mean predictions.");
+}
+
 std::vector<Eigen::MatrixXd>
 Kernel ::Kuf_grad(const ClusterDescriptor &envs,
                   const std::vector<Structure> &strucs, int kernel_index,
@@ -89,6 +111,101 @@ Kernel ::Kuf_grad(const ClusterDescriptor &envs,
   return Kuf_grad;
 }
 
+std::vector<Eigen::MatrixXd> Kernel ::Kuu_base(const ClusterDescriptor &envs,
+                                               const Eigen::MatrixXd &Kuu) {
+  return envs_envs_base(envs, envs);
+}
+
+std::vector<Eigen::MatrixXd>
+Kernel ::Kuf_base(const ClusterDescriptor &envs,
+                  const std::vector<Structure> &strucs,
+                  const std::vector<std::vector<int>> &atom_indices,
+                  int kernel_index, const Eigen::MatrixXd &Kuf) {
+
+  std::vector<Eigen::MatrixXd> base;
+  int n_strucs = strucs.size();
+  if (n_strucs == 0)
+    return base;
+
+  // Check that the kernel has components.
+  std::vector<Eigen::MatrixXd> first_base =
+      envs_struc_base(envs, strucs[0].descriptors[kernel_index]);
+  if (first_base.size() == 0)
+    return base;
+
+  // Count labels. Only the forces on atom_indices are labels.
+  std::vector<int> label_count(n_strucs + 1, 0);
+  for (int i = 0; i < n_strucs; i++) {
+    int n_force =
+        strucs[i].forces.size() == 0 ? 0 : 3 * atom_indices[i].size();
+    label_count[i + 1] = label_count[i] + strucs[i].energy.size() + n_force +
+                         strucs[i].stresses.size();
+  }
+
+  int n_sparse = envs.n_clusters;
+  int n_components = first_base.size();
+  for (int i = 0; i < n_components; i++) {
+    base.push_back(Eigen::MatrixXd::Zero(n_sparse, label_count[n_strucs]));
+  }
+
+#pragma omp parallel for
+  for (int i = 0; i < n_strucs; i++) {
+    std::vector<Eigen::MatrixXd> envs_struc =
+        i == 0 ? first_base
+               : envs_struc_base(envs, strucs[i].descriptors[kernel_index]);
+    int n_atoms = strucs[i].noa;
+
+    for (int j = 0; j < n_components; j++) {
+      int current_count = label_count[i];
+
+      if (strucs[i].energy.size() != 0) {
+        base[j].col(current_count) = envs_struc[j].col(0);
+        current_count += 1;
+      }
+
+      if (strucs[i].forces.size() != 0) {
+        for (int a = 0; a < atom_indices[i].size(); a++) {
+          base[j].block(0, current_count, n_sparse, 3) =
+              envs_struc[j].block(0, 1 + atom_indices[i][a] * 3, n_sparse, 3);
+          current_count += 3;
+        }
+      }
+
+      if (strucs[i].stresses.size() != 0) {
+        base[j].block(0, current_count, n_sparse, 6) =
+            envs_struc[j].block(0, 1 + n_atoms * 3, n_sparse, 6);
+      }
+    }
+  }
+
+  return base;
+}
+
+std::vector<Eigen::MatrixXd>
+Kernel ::envs_envs_base(const ClusterDescriptor &envs1,
+                        const ClusterDescriptor &envs2) {
+  return std::vector<Eigen::MatrixXd>();
+}
+
+std::vector<Eigen::MatrixXd>
+Kernel ::envs_struc_base(const ClusterDescriptor &envs,
+                         const DescriptorValues &struc) {
+  return std::vector<Eigen::MatrixXd>();
+}
+
+Eigen::MatrixXd Kernel ::base_kernel(const std::vector<Eigen::MatrixXd> &base,
+                                     const Eigen::VectorXd &hyps) {
+  return base_kernel_grad(base, hyps)[0];
+}
+
+std::vector<Eigen::MatrixXd>
+Kernel ::base_kernel_grad(const std::vector<Eigen::MatrixXd> &base,
+                          const Eigen::VectorXd &hyps) {
+
+  throw std::invalid_argument(kernel_name +
+                              " does not support kernel bases.");
+}
+
 void to_json(nlohmann::json& j, const std::vector<Kernel*> & kernels){
   int n_kernels = kernels.size();
   for (int i = 0; i < n_kernels; i++){
@@ -25,6 +25,13 @@ public:
                                     const ClusterDescriptor &envs2,
                                     const Eigen::VectorXd &hyps) = 0;
 
+  /**
+   * Diagonal of envs_envs(envs, envs, hyps), i.e. the self-kernel of each
+   * cluster. The default evaluates the full matrix.
+   */
+  virtual Eigen::VectorXd envs_self_diagonal(const ClusterDescriptor &envs,
+                                             const Eigen::VectorXd &hyps);
+
   virtual std::vector<Eigen::MatrixXd>
   envs_envs_grad(const ClusterDescriptor &envs1, const ClusterDescriptor &envs2,
                  const Eigen::VectorXd &hyps) = 0;
@@ -37,6 +44,27 @@ public:
   envs_struc_grad(const ClusterDescriptor &envs, const DescriptorValues &struc,
                   const Eigen::VectorXd &hyps) = 0;
 
+  /**
+   * Energy, forces and stress predicted from the sparse environments with
+   * weights alpha, i.e. envs_struc(envs, struc, hyps)^T alpha. The default
+   * forms the kernel matrix.
+   */
+  virtual Eigen::VectorXd envs_struc_contracted(const ClusterDescriptor &envs,
+                                                const DescriptorValues &struc,
+                                                const Eigen::VectorXd &alpha,
+                                                const Eigen::VectorXd &hyps);
+
+  /**
+   * Energy of a structure predicted from the sparse environments with
+   * weights alpha. The gradient of the energy with respect to the descriptors
+   * of each atom is stored in gradients, with one matrix per type, so that
+   * forces and stresses can be obtained with Descriptor::backpropagate.
+   */
+  virtual double envs_struc_energy_gradient(
+      const ClusterDescriptor &envs, const DescriptorValues &struc,
+      const Eigen::VectorXd &alpha, const Eigen::VectorXd &hyps,
+      std::vector<Eigen::MatrixXd> &gradients);
+
   virtual Eigen::VectorXd self_kernel_struc(const DescriptorValues &struc,
                                             const Eigen::VectorXd &hyps) = 0;
 
@@ -48,7 +76,7 @@ public:
                                                        int kernel_index) = 0;
   virtual Eigen::MatrixXd compute_varmap_coefficients(const SparseGP &gp_model,
                                                        int kernel_index) = 0;
-  virtual void write_info(std::ofstream &coeff_file) = 0;
+  virtual void write_info(std::ostream &coeff_file) = 0;
 
   virtual std::vector<Eigen::MatrixXd> Kuu_grad(const ClusterDescriptor &envs,
                                                 const Eigen::MatrixXd &Kuu,
@@ -60,6 +88,37 @@ public:
                                                 const Eigen::MatrixXd &Kuf,
                                                 const Eigen::VectorXd &hyps);
 
+  /**
+   * Hyperparameter-independent components of Kuu and Kuf. The kernel
+   * matrices and their gradients are elementwise functions of the components,
+   * evaluated by base_kernel and base_kernel_grad, so that they can be
+   * rebuilt for new hyperparameters without the descriptors. Kernels that
+   * cannot be written this way return no components, and Kuu_grad and
+   * Kuf_grad are used instead. So do the dot product kernels, whose
+   * Kuu_grad and Kuf_grad rescale the stored matrices without another copy.
+   */
+  virtual std::vector<Eigen::MatrixXd> Kuu_base(const ClusterDescriptor &envs,
+                                                const Eigen::MatrixXd &Kuu);
+
+  virtual std::vector<Eigen::MatrixXd>
+  Kuf_base(const ClusterDescriptor &envs, const std::vector<Structure> &strucs,
+           const std::vector<std::vector<int>> &atom_indices, int kernel_index,
+           const Eigen::MatrixXd &Kuf);
+
+  virtual std::vector<Eigen::MatrixXd>
+  envs_envs_base(const ClusterDescriptor &envs1,
+                 const ClusterDescriptor &envs2);
+
+  virtual std::vector<Eigen::MatrixXd>
+  envs_struc_base(const ClusterDescriptor &envs, const DescriptorValues &struc);
+
+  virtual Eigen::MatrixXd base_kernel(const std::vector<Eigen::MatrixXd> &base,
+                                      const Eigen::VectorXd &hyps);
+
+  virtual std::vector<Eigen::MatrixXd>
+  base_kernel_grad(const std::vector<Eigen::MatrixXd> &base,
+                   const Eigen::VectorXd &hyps);
+
   virtual void set_hyperparameters(Eigen::VectorXd hyps) = 0;
 
   virtual ~Kernel() = default;
@@ -101,6 +101,35 @@ NormalizedDotProduct_ICM ::envs_envs(const ClusterDescriptor &envs1,
   return kern_mat;
 }
 
+Eigen::VectorXd
+NormalizedDotProduct_ICM ::envs_self_diagonal(const ClusterDescriptor &envs,
+                                              const Eigen::VectorXd &hyps) {
+
+  double sig_sq = hyps(0) * hyps(0);
+  Eigen::VectorXd kern_vec = Eigen::VectorXd::Zero(envs.n_clusters);
+  int n_types = envs.n_types;
+  double empty_thresh = 1e-8;
+
+  for (int s = 0; s < n_types; s++) {
+    // Only clusters of the same type contribute to the diagonal.
+    double icm_val = hyps(1 + get_icm_index(s, s, n_types));
+    int n_sparse = envs.n_clusters_by_type[s];
+    int c_sparse = envs.cumulative_type_count[s];
+
+#pragma omp parallel for
+    for (int i = 0; i < n_sparse; i++) {
+      double norm_i = envs.descriptor_norms[s](i);
+      if (norm_i < empty_thresh)
+        continue;
+
+      double norm_dot =
+          envs.descriptors[s].row(i).squaredNorm() / (norm_i * norm_i);
+      kern_vec(c_sparse + i) = sig_sq * icm_val * pow(norm_dot, power);
+    }
+  }
+  return kern_vec;
+}
+
 std::vector<Eigen::MatrixXd>
 NormalizedDotProduct_ICM ::envs_envs_grad(const ClusterDescriptor &envs1,
                                           const ClusterDescriptor &envs2,
@@ -637,6 +666,57 @@ NormalizedDotProduct_ICM ::self_kernel_struc(const DescriptorValues &struc,
   return kernel_vector;
 }
 
+std::vector<Eigen::MatrixXd>
+NormalizedDotProduct_ICM ::envs_envs_base(const ClusterDescriptor &envs1,
+                                          const ClusterDescriptor &envs2) {
+
+  // With unit hyperparameters, the ICM gradients are the bases.
+  Eigen::VectorXd unit_hyps = Eigen::VectorXd::Ones(1 + n_icm_coeffs);
+  std::vector<Eigen::MatrixXd> grads =
+      envs_envs_grad(envs1, envs2, unit_hyps);
+  return std::vector<Eigen::MatrixXd>(grads.begin() + 2, grads.end());
+}
+
+std::vector<Eigen::MatrixXd>
+NormalizedDotProduct_ICM ::envs_struc_base(const ClusterDescriptor &envs,
+                                           const DescriptorValues &struc) {
+
+  Eigen::VectorXd unit_hyps = Eigen::VectorXd::Ones(1 + n_icm_coeffs);
+  std::vector<Eigen::MatrixXd> grads = envs_struc_grad(envs, struc, unit_hyps);
+  return std::vector<Eigen::MatrixXd>(grads.begin() + 2, grads.end());
+}
+
+Eigen::MatrixXd
+NormalizedDotProduct_ICM ::base_kernel(const std::vector<Eigen::MatrixXd> &base,
+                                       const Eigen::VectorXd &hyps) {
+
+  Eigen::MatrixXd kern_mat = Eigen::MatrixXd::Zero(base[0].rows(),
+                                                   base[0].cols());
+  for (int i = 0; i < n_icm_coeffs; i++) {
+    kern_mat += hyps(1 + i) * base[i];
+  }
+  return kern_mat * (hyps(0) * hyps(0));
+}
+
+std::vector<Eigen::MatrixXd> NormalizedDotProduct_ICM ::base_kernel_grad(
+    const std::vector<Eigen::MatrixXd> &base, const Eigen::VectorXd &hyps) {
+
+  double sig_sq = hyps(0) * hyps(0);
+  Eigen::MatrixXd icm_sum = Eigen::MatrixXd::Zero(base[0].rows(),
+                                                  base[0].cols());
+  for (int i = 0; i < n_icm_coeffs; i++) {
+    icm_sum += hyps(1 + i) * base[i];
+  }
+
+  std::vector<Eigen::MatrixXd> kernel_gradients;
+  kernel_gradients.push_back(sig_sq * icm_sum);
+  kernel_gradients.push_back(2 * hyps(0) * icm_sum);
+  for (int i = 0; i < n_icm_coeffs; i++) {
+    kernel_gradients.push_back(sig_sq * base[i]);
+  }
+  return kernel_gradients;
+}
+
 void NormalizedDotProduct_ICM ::set_hyperparameters(Eigen::VectorXd new_hyps) {
   sigma = new_hyps(0);
   sig2 = sigma * sigma;
@@ -678,7 +758,7 @@ NormalizedDotProduct_ICM ::compute_varmap_coefficients(const SparseGP &gp_model,
   return empty_mat;
 }
 
-void NormalizedDotProduct_ICM ::write_info(std::ofstream &coeff_file) {
+void NormalizedDotProduct_ICM ::write_info(std::ostream &coeff_file) {
   std::cout << "Not implemented." << std::endl;
 }
 
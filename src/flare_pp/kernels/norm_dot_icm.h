@@ -23,6 +23,9 @@ public:
                             const ClusterDescriptor &envs2,
                             const Eigen::VectorXd &hyps);
 
+  Eigen::VectorXd envs_self_diagonal(const ClusterDescriptor &envs,
+                                     const Eigen::VectorXd &hyps);
+
   std::vector<Eigen::MatrixXd> envs_envs_grad(const ClusterDescriptor &envs1,
                                               const ClusterDescriptor &envs2,
                                               const Eigen::VectorXd &hyps);
@@ -42,13 +45,29 @@ public:
                               const DescriptorValues &struc2,
                               const Eigen::VectorXd &hyps);
 
+  // Each base component is the kernel between one pair of types, with unit
+  // signal variance and ICM coefficient.
+  std::vector<Eigen::MatrixXd>
+  envs_envs_base(const ClusterDescriptor &envs1,
+                 const ClusterDescriptor &envs2);
+
+  std::vector<Eigen::MatrixXd>
+  envs_struc_base(const ClusterDescriptor &envs, const DescriptorValues &struc);
+
+  Eigen::MatrixXd base_kernel(const std::vector<Eigen::MatrixXd> &base,
+                              const Eigen::VectorXd &hyps);
+
+  std::vector<Eigen::MatrixXd>
+  base_kernel_grad(const std::vector<Eigen::MatrixXd> &base,
+                   const Eigen::VectorXd &hyps);
+
   void set_hyperparameters(Eigen::VectorXd new_hyps);
 
   Eigen::MatrixXd compute_mapping_coefficients(const SparseGP &gp_model,
                                                int kernel_index);
   Eigen::MatrixXd compute_varmap_coefficients(const SparseGP &gp_model,
                                                int kernel_index);
-  void write_info(std::ofstream &coeff_file);
+  void write_info(std::ostream &coeff_file);
 
   NLOHMANN_DEFINE_TYPE_INTRUSIVE(NormalizedDotProduct_ICM,
     sigma, sig2, power, no_types, n_icm_coeffs, icm_coeffs, kernel_name)
@@ -20,6 +20,9 @@ public:
                             const ClusterDescriptor &envs2,
                             const Eigen::VectorXd &hyps);
 
+  Eigen::VectorXd envs_self_diagonal(const ClusterDescriptor &envs,
+                                     const Eigen::VectorXd &hyps);
+
   std::vector<Eigen::MatrixXd> envs_envs_grad(const ClusterDescriptor &envs1,
                                               const ClusterDescriptor &envs2,
                                               const Eigen::VectorXd &hyps);
@@ -32,6 +35,20 @@ public:
                                                const DescriptorValues &struc,
                                                const Eigen::VectorXd &hyps);
 
+  // The weights are contracted with the descriptors of the sparse
+  // environments first, so that the force derivatives of the structure are
+  // visited once, independently of the number of sparse environments.
+  Eigen::VectorXd envs_struc_contracted(const ClusterDescriptor &envs,
+                                        const DescriptorValues &struc,
+                                        const Eigen::VectorXd &alpha,
+                                        const Eigen::VectorXd &hyps);
+
+  double envs_struc_energy_gradient(const ClusterDescriptor &envs,
+                                    const DescriptorValues &struc,
+                                    const Eigen::VectorXd &alpha,
+                                    const Eigen::VectorXd &hyps,
+                                    std::vector<Eigen::MatrixXd> &gradients);
+
   Eigen::VectorXd self_kernel_struc(const DescriptorValues &struc,
                                     const Eigen::VectorXd &hyps);
 
@@ -63,7 +80,7 @@ public:
                                                int kernel_index);
   Eigen::MatrixXd compute_varmap_coefficients(const SparseGP &gp_model,
                                               int kernel_index);
-  void write_info(std::ofstream &coeff_file);
+  void write_info(std::ostream &coeff_file);
 
   NLOHMANN_DEFINE_TYPE_INTRUSIVE(NormalizedDotProduct,
     sigma, sig2, power, kernel_name, kernel_hyperparameters)
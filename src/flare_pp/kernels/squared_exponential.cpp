@@ -78,6 +78,32 @@ Eigen::MatrixXd SquaredExponential ::envs_envs(const ClusterDescriptor &envs1,
   return kern_mat;
 }
 
+Eigen::VectorXd
+SquaredExponential ::envs_self_diagonal(const ClusterDescriptor &envs,
+                                        const Eigen::VectorXd &hyps) {
+
+  double sig2 = hyps(0) * hyps(0);
+  double ls2 = hyps(1) * hyps(1);
+  Eigen::VectorXd kern_vec = Eigen::VectorXd::Zero(envs.n_clusters);
+
+  for (int s = 0; s < envs.n_types; s++) {
+    int n_sparse = envs.n_clusters_by_type[s];
+    int c_sparse = envs.cumulative_type_count[s];
+
+#pragma omp parallel for
+    for (int i = 0; i < n_sparse; i++) {
+      double norm_i = envs.descriptor_norms[s](i);
+      double cut_i = envs.cutoff_values[s](i);
+
+      // The exponent vanishes up to rounding.
+      double dot_val = envs.descriptors[s].row(i).squaredNorm();
+      double exp_arg = (2 * norm_i * norm_i - 2 * dot_val) / (2 * ls2);
+      kern_vec(c_sparse + i) = sig2 * cut_i * cut_i * exp(-exp_arg);
+    }
+  }
+  return kern_vec;
+}
+
 std::vector<Eigen::MatrixXd>
 SquaredExponential ::envs_envs_grad(const ClusterDescriptor &envs1,
                                     const ClusterDescriptor &envs2,
@@ -613,6 +639,80 @@ SquaredExponential ::self_kernel_struc(const DescriptorValues &struc,
   return kernel_vector;
 }
 
+std::vector<Eigen::MatrixXd>
+SquaredExponential ::envs_envs_base(const ClusterDescriptor &envs1,
+                                    const ClusterDescriptor &envs2) {
+
+  Eigen::MatrixXd cut_mat =
+      Eigen::MatrixXd::Zero(envs1.n_clusters, envs2.n_clusters);
+  Eigen::MatrixXd dist_mat =
+      Eigen::MatrixXd::Zero(envs1.n_clusters, envs2.n_clusters);
+  int n_types = envs1.n_types;
+
+  for (int s = 0; s < n_types; s++) {
+    // Compute dot products.
+    Eigen::MatrixXd dot_vals =
+        envs1.descriptors[s] * envs2.descriptors[s].transpose();
+
+    int n_sparse_1 = envs1.n_clusters_by_type[s];
+    int c_sparse_1 = envs1.cumulative_type_count[s];
+    int n_sparse_2 = envs2.n_clusters_by_type[s];
+    int c_sparse_2 = envs2.cumulative_type_count[s];
+
+#pragma omp parallel for
+    for (int i = 0; i < n_sparse_1; i++) {
+      double norm_i = envs1.descriptor_norms[s](i);
+      double cut_i = envs1.cutoff_values[s](i);
+      int ind1 = c_sparse_1 + i;
+
+      for (int j = 0; j < n_sparse_2; j++) {
+        double norm_j = envs2.descriptor_norms[s](j);
+        double cut_j = envs2.cutoff_values[s](j);
+        int ind2 = c_sparse_2 + j;
+
+        cut_mat(ind1, ind2) = cut_i * cut_j;
+        dist_mat(ind1, ind2) =
+            norm_i * norm_i + norm_j * norm_j - 2 * dot_vals(i, j);
+      }
+    }
+  }
+
+  std::vector<Eigen::MatrixXd> base;
+  base.push_back(cut_mat);
+  base.push_back(dist_mat);
+  return base;
+}
+
+Eigen::MatrixXd
+SquaredExponential ::base_kernel(const std::vector<Eigen::MatrixXd> &base,
+                                 const Eigen::VectorXd &hyps) {
+
+  double sig2 = hyps(0) * hyps(0);
+  double ls2 = hyps(1) * hyps(1);
+  Eigen::MatrixXd exp_mat = (-base[1] / (2 * ls2)).array().exp().matrix();
+  return sig2 * base[0].cwiseProduct(exp_mat);
+}
+
+std::vector<Eigen::MatrixXd>
+SquaredExponential ::base_kernel_grad(const std::vector<Eigen::MatrixXd> &base,
+                                      const Eigen::VectorXd &hyps) {
+
+  double sig_new = hyps(0);
+  double ls_new = hyps(1);
+  double ls2_new = ls_new * ls_new;
+
+  Eigen::MatrixXd val2 =
+      base[0].cwiseProduct((-base[1] / (2 * ls2_new)).array().exp().matrix());
+  Eigen::MatrixXd kern_mat = sig_new * sig_new * val2;
+
+  std::vector<Eigen::MatrixXd> kernel_gradients;
+  kernel_gradients.push_back(kern_mat);
+  kernel_gradients.push_back(2 * sig_new * val2);
+  kernel_gradients.push_back(kern_mat.cwiseProduct(base[1]) /
+                             (ls2_new * ls_new));
+  return kernel_gradients;
+}
+
 void SquaredExponential ::set_hyperparameters(Eigen::VectorXd hyps) {
   sigma = hyps(0);
   ls = hyps(1);
@@ -647,7 +747,7 @@ SquaredExponential ::compute_varmap_coefficients(const SparseGP &gp_model,
   return empty_mat;
 }
 
-void SquaredExponential ::write_info(std::ofstream &coeff_file) {
+void SquaredExponential ::write_info(std::ostream &coeff_file) {
   std::cout << "Not implemented." << std::endl;
 }
 
@@ -20,6 +20,9 @@ public:
                             const ClusterDescriptor &envs2,
                             const Eigen::VectorXd &hyps);
 
+  Eigen::VectorXd envs_self_diagonal(const ClusterDescriptor &envs,
+                                     const Eigen::VectorXd &hyps);
+
   std::vector<Eigen::MatrixXd> envs_envs_grad(const ClusterDescriptor &envs1,
                                               const ClusterDescriptor &envs2,
                                               const Eigen::VectorXd &hyps);
@@ -39,13 +42,27 @@ public:
                               const DescriptorValues &struc2,
                               const Eigen::VectorXd &hyps);
 
+  // The bases of Kuu are the products of the cutoff values and the squared
+  // distances between the descriptors. The force and stress kernels sum
+  // length scale dependent terms over neighbors, so Kuf has no bases.
+  std::vector<Eigen::MatrixXd>
+  envs_envs_base(const ClusterDescriptor &envs1,
+                 const ClusterDescriptor &envs2);
+
+  Eigen::MatrixXd base_kernel(const std::vector<Eigen::MatrixXd> &base,
+                              const Eigen::VectorXd &hyps);
+
+  std::vector<Eigen::MatrixXd>
+  base_kernel_grad(const std::vector<Eigen::MatrixXd> &base,
+                   const Eigen::VectorXd &hyps);
+
   void set_hyperparameters(Eigen::VectorXd hyps);
 
   Eigen::MatrixXd compute_mapping_coefficients(const SparseGP &gp_model,
                                                int kernel_index);
   Eigen::MatrixXd compute_varmap_coefficients(const SparseGP &gp_model,
                                                int kernel_index);
-  void write_info(std::ofstream &coeff_file);
+  void write_info(std::ostream &coeff_file);
 
   NLOHMANN_DEFINE_TYPE_INTRUSIVE(SquaredExponential, sigma, ls, sig2, ls2,
     kernel_name)
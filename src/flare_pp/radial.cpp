@@ -5,7 +5,7 @@
 
 void fourier(std::vector<double> &basis_vals,
              std::vector<double> &basis_derivs, double r, int N,
-             std::vector<double> radial_hyps){
+             const std::vector<double> &radial_hyps){
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -42,7 +42,7 @@ void fourier(std::vector<double> &basis_vals,
 
 void fourier_quarter(std::vector<double> &basis_vals,
                      std::vector<double> &basis_derivs, double r, int N,
-                     std::vector<double> radial_hyps){
+                     const std::vector<double> &radial_hyps){
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -78,7 +78,7 @@ void fourier_quarter(std::vector<double> &basis_vals,
 
 void fourier_half(std::vector<double> &basis_vals,
                   std::vector<double> &basis_derivs, double r, int N,
-                  std::vector<double> radial_hyps){
+                  const std::vector<double> &radial_hyps){
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -113,7 +113,7 @@ void fourier_half(std::vector<double> &basis_vals,
 }
 
 void bessel(std::vector<double> &basis_vals, std::vector<double> &basis_derivs,
-            double r, int N, std::vector<double> radial_hyps) {
+            double r, int N, const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -137,7 +137,7 @@ void bessel(std::vector<double> &basis_vals, std::vector<double> &basis_derivs,
 
 void chebyshev(std::vector<double> &basis_vals,
                std::vector<double> &basis_derivs, double r, int N,
-               std::vector<double> radial_hyps) {
+               const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -170,7 +170,7 @@ void chebyshev(std::vector<double> &basis_vals,
 
 void positive_chebyshev(std::vector<double> &basis_vals,
                         std::vector<double> &basis_derivs, double r, int N,
-                        std::vector<double> radial_hyps) {
+                        const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -180,40 +180,32 @@ void positive_chebyshev(std::vector<double> &basis_vals,
     return;
   }
 
-  std::vector<double> cheby_vals = std::vector<double>(N, 0);
-  std::vector<double> cheby_derivs = std::vector<double>(N, 0);
-
   double c = 1 / (r2 - r1);
   double x = (r - r1) * c;
   double half = 1. / 2.;
+  double cheby_val, cheby_derv;
 
   for (int n = 0; n < N; n++) {
     if (n == 0) {
-      cheby_vals[n] = 1;
-      cheby_derivs[n] = 0;
-
       basis_vals[n] = 1;
       basis_derivs[n] = 0;
     } else if (n == 1) {
-      cheby_vals[n] = x;
-      cheby_derivs[n] = c;
-
       basis_vals[n] = half * (1 - x);
       basis_derivs[n] = -half * c;
     } else {
-      cheby_vals[n] = 2 * x * basis_vals[n - 1] - basis_vals[n - 2];
-      cheby_derivs[n] = 2 * basis_vals[n - 1] * c +
-                        2 * x * basis_derivs[n - 1] - basis_derivs[n - 2];
+      cheby_val = 2 * x * basis_vals[n - 1] - basis_vals[n - 2];
+      cheby_derv = 2 * basis_vals[n - 1] * c + 2 * x * basis_derivs[n - 1] -
+                   basis_derivs[n - 2];
 
-      basis_vals[n] = half * (1 - cheby_vals[n]);
-      basis_derivs[n] = -half * cheby_derivs[n];
+      basis_vals[n] = half * (1 - cheby_val);
+      basis_derivs[n] = -half * cheby_derv;
     }
   }
 }
 
 void weighted_chebyshev(std::vector<double> &basis_vals,
                         std::vector<double> &basis_derivs, double r, int N,
-                        std::vector<double> radial_hyps) {
+                        const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -232,37 +224,41 @@ void weighted_chebyshev(std::vector<double> &basis_vals,
   double dx_dr = 2 * c * lambda * exp_const / lambda_const;
   double half = 1. / 2.;
 
-  std::vector<double> cheby_vals = std::vector<double>(N, 0);
-  std::vector<double> cheby_derivs = std::vector<double>(N, 0);
+  // Chebyshev values and derivatives of the previous two orders.
+  double cheby_vals[2] = {0, 0}, cheby_derivs[2] = {0, 0};
+  double cheby_val, cheby_derv;
 
   for (int n = 0; n < N; n++) {
     if (n == 0) {
-      cheby_vals[n] = 1;
-      cheby_derivs[n] = 0;
+      cheby_val = 1;
+      cheby_derv = 0;
 
       basis_vals[n] = 1;
       basis_derivs[n] = 0;
     } else if (n == 1) {
-      cheby_vals[n] = x_weighted;
-      cheby_derivs[n] = 1;
+      cheby_val = x_weighted;
+      cheby_derv = 1;
 
-      basis_vals[n] = cheby_vals[n];
-      basis_derivs[n] = cheby_derivs[n] * dx_dr;
+      basis_vals[n] = cheby_val;
+      basis_derivs[n] = cheby_derv * dx_dr;
     } else {
-      cheby_vals[n] = 2 * x_weighted * cheby_vals[n - 1] - cheby_vals[n - 2];
-      cheby_derivs[n] = 2 * cheby_vals[n - 1] +
-                        2 * x_weighted * cheby_derivs[n - 1] -
-                        cheby_derivs[n - 2];
+      cheby_val = 2 * x_weighted * cheby_vals[1] - cheby_vals[0];
+      cheby_derv =
+          2 * cheby_vals[1] + 2 * x_weighted * cheby_derivs[1] - cheby_derivs[0];
 
-      basis_vals[n] = cheby_vals[n];
-      basis_derivs[n] = cheby_derivs[n] * dx_dr;
+      basis_vals[n] = cheby_val;
+      basis_derivs[n] = cheby_derv * dx_dr;
     }
+    cheby_vals[0] = cheby_vals[1];
+    cheby_vals[1] = cheby_val;
+    cheby_derivs[0] = cheby_derivs[1];
+    cheby_derivs[1] = cheby_derv;
   }
 }
 
 void weighted_positive_chebyshev(std::vector<double> &basis_vals,
                                  std::vector<double> &basis_derivs, double r,
-                                 int N, std::vector<double> radial_hyps) {
+                                 int N, const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -281,37 +277,41 @@ void weighted_positive_chebyshev(std::vector<double> &basis_vals,
   double dx_dr = 2 * c * lambda * exp_const / lambda_const;
   double half = 1. / 2.;
 
-  std::vector<double> cheby_vals = std::vector<double>(N, 0);
-  std::vector<double> cheby_derivs = std::vector<double>(N, 0);
+  // Chebyshev values and derivatives of the previous two orders.
+  double cheby_vals[2] = {0, 0}, cheby_derivs[2] = {0, 0};
+  double cheby_val, cheby_derv;
 
   for (int n = 0; n < N; n++) {
     if (n == 0) {
-      cheby_vals[n] = 1;
-      cheby_derivs[n] = 0;
+      cheby_val = 1;
+      cheby_derv = 0;
 
       basis_vals[n] = 1;
       basis_derivs[n] = 0;
     } else if (n == 1) {
-      cheby_vals[n] = x_weighted;
-      cheby_derivs[n] = 1;
+      cheby_val = x_weighted;
+      cheby_derv = 1;
 
       basis_vals[n] = half * (1 - x_weighted);
       basis_derivs[n] = -half * dx_dr;
     } else {
-      cheby_vals[n] = 2 * x_weighted * cheby_vals[n - 1] - cheby_vals[n - 2];
-      cheby_derivs[n] = 2 * cheby_vals[n - 1] +
-                        2 * x_weighted * cheby_derivs[n - 1] -
-                        cheby_derivs[n - 2];
+      cheby_val = 2 * x_weighted * cheby_vals[1] - cheby_vals[0];
+      cheby_derv =
+          2 * cheby_vals[1] + 2 * x_weighted * cheby_derivs[1] - cheby_derivs[0];
 
-      basis_vals[n] = half * (1 - cheby_vals[n]);
-      basis_derivs[n] = -half * cheby_derivs[n] * dx_dr;
+      basis_vals[n] = half * (1 - cheby_val);
+      basis_derivs[n] = -half * cheby_derv * dx_dr;
     }
+    cheby_vals[0] = cheby_vals[1];
+    cheby_vals[1] = cheby_val;
+    cheby_derivs[0] = cheby_derivs[1];
+    cheby_derivs[1] = cheby_derv;
   }
 }
 
 void equispaced_gaussians(std::vector<double> &basis_vals,
                           std::vector<double> &basis_derivs, double r, int N,
-                          std::vector<double> radial_hyps) {
+                          const std::vector<double> &radial_hyps) {
 
   // Define Gaussian hyperparameters (width and locations of first and final
   // gaussians)
@@ -344,22 +344,25 @@ void equispaced_gaussians(std::vector<double> &basis_vals,
 void calculate_radial(
     std::vector<double> &comb_vals, std::vector<double> &comb_x,
     std::vector<double> &comb_y, std::vector<double> &comb_z,
-    std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
-        basis_function,
-    std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
-        cutoff_function,
+    const std::function<void(std::vector<double> &, std::vector<double> &,
+                             double, int, std::vector<double>)>
+        &basis_function,
+    const std::function<void(std::vector<double> &, double, double,
+                             std::vector<double>)> &cutoff_function,
     double x, double y, double z, double r, double rcut, int N,
-    std::vector<double> radial_hyps, std::vector<double> cutoff_hyps) {
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps) {
 
-  // Calculate cutoff values.
-  std::vector<double> rcut_vals(2, 0);
+  // Calculate cutoff values. The buffers are kept between calls so that
+  // no memory is allocated per neighbor.
+  static thread_local std::vector<double> rcut_vals(2, 0);
   cutoff_function(rcut_vals, r, rcut, cutoff_hyps);
 
-  // Calculate radial basis values.
-  std::vector<double> basis_vals = std::vector<double>(N, 0);
-  std::vector<double> basis_derivs = std::vector<double>(N, 0);
+  // Calculate radial basis values. Basis functions return early outside
+  // their support, so the buffers are zeroed first.
+  static thread_local std::vector<double> basis_vals, basis_derivs;
+  basis_vals.assign(N, 0);
+  basis_derivs.assign(N, 0);
   basis_function(basis_vals, basis_derivs, r, N, radial_hyps);
 
   // Store the product.
@@ -0,0 +1,167 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+
+// Portable packed double type used by the batched kernels. The instruction
+// set is chosen at compile time (AVX-512, AVX/AVX2 or SSE2), with a scalar
+// fallback of width 1. Define FLARE_NO_SIMD to force the fallback.
+
+#if !defined(FLARE_NO_SIMD) && defined(__AVX512F__)
+#define FLARE_SIMD_AVX512
+#include <immintrin.h>
+#elif !defined(FLARE_NO_SIMD) && defined(__AVX__)
+#define FLARE_SIMD_AVX
+#include <immintrin.h>
+#elif !defined(FLARE_NO_SIMD) && defined(__SSE2__)
+#define FLARE_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+struct SimdDouble {
+#if defined(FLARE_SIMD_AVX512)
+  typedef __m512d native_type;
+  enum { width = 8 };
+#elif defined(FLARE_SIMD_AVX)
+  typedef __m256d native_type;
+  enum { width = 4 };
+#elif defined(FLARE_SIMD_SSE2)
+  typedef __m128d native_type;
+  enum { width = 2 };
+#else
+  typedef double native_type;
+  enum { width = 1 };
+#endif
+
+  native_type v;
+
+  SimdDouble() {}
+
+  // Broadcast a scalar to every lane. Implicit, so that the scalar constants
+  // of templated kernels can be mixed with packs.
+#if defined(FLARE_SIMD_AVX512)
+  SimdDouble(native_type v) : v(v) {}
+  SimdDouble(double a) : v(_mm512_set1_pd(a)) {}
+#elif defined(FLARE_SIMD_AVX)
+  SimdDouble(native_type v) : v(v) {}
+  SimdDouble(double a) : v(_mm256_set1_pd(a)) {}
+#elif defined(FLARE_SIMD_SSE2)
+  SimdDouble(native_type v) : v(v) {}
+  SimdDouble(double a) : v(_mm_set1_pd(a)) {}
+#else
+  SimdDouble(double a) : v(a) {}
+#endif
+
+  static SimdDouble load(const double *p) {
+#if defined(FLARE_SIMD_AVX512)
+    return _mm512_loadu_pd(p);
+#elif defined(FLARE_SIMD_AVX)
+    return _mm256_loadu_pd(p);
+#elif defined(FLARE_SIMD_SSE2)
+    return _mm_loadu_pd(p);
+#else
+    return *p;
+#endif
+  }
+
+  void store(double *p) const {
+#if defined(FLARE_SIMD_AVX512)
+    _mm512_storeu_pd(p, v);
+#elif defined(FLARE_SIMD_AVX)
+    _mm256_storeu_pd(p, v);
+#elif defined(FLARE_SIMD_SSE2)
+    _mm_storeu_pd(p, v);
+#else
+    *p = v;
+#endif
+  }
+
+  // Load the first n lanes from p, and set the remaining lanes to fill.
+  static SimdDouble load_partial(const double *p, int n, double fill) {
+    double buffer[width];
+    for (int i = 0; i < width; i++)
+      buffer[i] = (i < n) ? p[i] : fill;
+    return load(buffer);
+  }
+
+  // Store the first n lanes to p.
+  void store_partial(double *p, int n) const {
+    double buffer[width];
+    store(buffer);
+    for (int i = 0; i < n; i++)
+      p[i] = buffer[i];
+  }
+};
+
+#if defined(FLARE_SIMD_AVX512)
+#define FLARE_SIMD_PREFIX(op) _mm512_##op##_pd
+#elif defined(FLARE_SIMD_AVX)
+#define FLARE_SIMD_PREFIX(op) _mm256_##op##_pd
+#elif defined(FLARE_SIMD_SSE2)
+#define FLARE_SIMD_PREFIX(op) _mm_##op##_pd
+#endif
+
+#ifdef FLARE_SIMD_PREFIX
+inline SimdDouble operator+(const SimdDouble &a, const SimdDouble &b) {
+  return FLARE_SIMD_PREFIX(add)(a.v, b.v);
+}
+inline SimdDouble operator-(const SimdDouble &a, const SimdDouble &b) {
+  return FLARE_SIMD_PREFIX(sub)(a.v, b.v);
+}
+inline SimdDouble operator*(const SimdDouble &a, const SimdDouble &b) {
+  return FLARE_SIMD_PREFIX(mul)(a.v, b.v);
+}
+inline SimdDouble operator/(const SimdDouble &a, const SimdDouble &b) {
+  return FLARE_SIMD_PREFIX(div)(a.v, b.v);
+}
+inline SimdDouble sqrt(const SimdDouble &a) {
+  return FLARE_SIMD_PREFIX(sqrt)(a.v);
+}
+#undef FLARE_SIMD_PREFIX
+#else
+inline SimdDouble operator+(const SimdDouble &a, const SimdDouble &b) {
+  return a.v + b.v;
+}
+inline SimdDouble operator-(const SimdDouble &a, const SimdDouble &b) {
+  return a.v - b.v;
+}
+inline SimdDouble operator*(const SimdDouble &a, const SimdDouble &b) {
+  return a.v * b.v;
+}
+inline SimdDouble operator/(const SimdDouble &a, const SimdDouble &b) {
+  return a.v / b.v;
+}
+inline SimdDouble sqrt(const SimdDouble &a) { return std::sqrt(a.v); }
+#endif
+
+inline SimdDouble operator-(const SimdDouble &a) { return SimdDouble(0.) - a; }
+
+// Integer powers by repeated squaring.
+inline SimdDouble pow(const SimdDouble &a, int n) {
+  SimdDouble result(1.), base = a;
+  while (n > 0) {
+    if (n & 1)
+      result = result * base;
+    base = base * base;
+    n >>= 1;
+  }
+  return result;
+}
+
+// Half-integer powers use the square root. Other powers are evaluated lane
+// by lane.
+inline SimdDouble pow(const SimdDouble &a, double p) {
+  double twice = 2 * p;
+  if (twice >= 0 && twice == std::floor(twice)) {
+    int n = (int)p;
+    return (n == p) ? pow(a, n) : pow(a, n) * sqrt(a);
+  }
+
+  double buffer[SimdDouble::width];
+  a.store(buffer);
+  for (int i = 0; i < SimdDouble::width; i++)
+    buffer[i] = std::pow(buffer[i], p);
+  return SimdDouble::load(buffer);
+}
+
+#endif
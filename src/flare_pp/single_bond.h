@@ -0,0 +1,252 @@
+#ifndef SINGLE_BOND_H
+#define SINGLE_BOND_H
+
+#include "cutoffs.h"
+#include "radial.h"
+#include "y_grad.h"
+#include <Eigen/Dense>
+#include <string>
+#include <vector>
+
+// Single bond engine shared by the flare++ descriptors and the LAMMPS pair
+// styles. The radial basis and cutoff function are template parameters, so
+// that the per-neighbor calls are resolved at compile time, and the
+// intermediate values are stored in preallocated per-thread buffers.
+
+typedef void (*RadialFunction)(std::vector<double> &, std::vector<double> &,
+                               double, int, const std::vector<double> &);
+typedef void (*CutoffFunction)(std::vector<double> &, double, double,
+                               const std::vector<double> &);
+
+/** Wraps a radial basis function in a type, so that it can be called
+ * directly (and inlined) by the single bond templates.
+ */
+template <RadialFunction radial> struct StaticRadial {
+  void operator()(std::vector<double> &basis_vals,
+                  std::vector<double> &basis_derivs, double r, int N,
+                  const std::vector<double> &radial_hyps) const {
+    radial(basis_vals, basis_derivs, r, N, radial_hyps);
+  }
+};
+
+/** Wraps a cutoff function in a type. */
+template <CutoffFunction cutoff> struct StaticCutoff {
+  void operator()(std::vector<double> &rcut_vals, double r, double rcut,
+                  const std::vector<double> &cutoff_hyps) const {
+    cutoff(rcut_vals, r, rcut, cutoff_hyps);
+  }
+};
+
+/** Buffers for the bonds of one atom and their radial basis, cutoff and
+ * spherical harmonic values. The buffers only grow, so once they are large
+ * enough no memory is allocated.
+ */
+struct SingleBondScratch {
+  std::vector<double> rcut_vals, basis_vals, basis_derivs;
+  std::vector<double> g, gx, gy, gz;
+
+  // Bonds in structure-of-arrays form, and their spherical harmonics stored
+  // harmonic-major (see get_Y_batch). The harmonic buffers are sized in
+  // add_single_bonds, once the number of bonds is known.
+  std::vector<double> bond_x, bond_y, bond_z, bond_r, bond_rcut;
+  std::vector<int> bond_species;
+  std::vector<double> h, hx, hy, hz;
+
+  void resize(int N) {
+    rcut_vals.resize(2);
+    basis_vals.resize(N);
+    basis_derivs.resize(N);
+    g.resize(N);
+    gx.resize(N);
+    gy.resize(N);
+    gz.resize(N);
+  }
+
+  void clear_bonds() {
+    bond_x.clear();
+    bond_y.clear();
+    bond_z.clear();
+    bond_r.clear();
+    bond_rcut.clear();
+    bond_species.clear();
+  }
+
+  void add_bond(double x, double y, double z, double r, double rcut, int s) {
+    bond_x.push_back(x);
+    bond_y.push_back(y);
+    bond_z.push_back(z);
+    bond_r.push_back(r);
+    bond_rcut.push_back(rcut);
+    bond_species.push_back(s);
+  }
+};
+
+/** Scratch buffers owned by the calling thread. */
+inline SingleBondScratch &single_bond_scratch(int N) {
+  static thread_local SingleBondScratch scratch;
+  scratch.resize(N);
+  return scratch;
+}
+
+/**
+ * Compute the radial basis values of a bond, multiplied by the cutoff
+ * function, and their Cartesian derivatives. Results are stored in
+ * scratch.g, scratch.gx, scratch.gy and scratch.gz.
+ */
+template <typename Radial, typename Cutoff>
+inline void bond_radial(SingleBondScratch &scratch,
+                        const Radial &radial_function,
+                        const Cutoff &cutoff_function, double x, double y,
+                        double z, double r, double rcut, int N,
+                        const std::vector<double> &radial_hyps,
+                        const std::vector<double> &cutoff_hyps) {
+
+  cutoff_function(scratch.rcut_vals, r, rcut, cutoff_hyps);
+
+  // Basis functions return early outside their support.
+  for (int n = 0; n < N; n++) {
+    scratch.basis_vals[n] = 0;
+    scratch.basis_derivs[n] = 0;
+  }
+  radial_function(scratch.basis_vals, scratch.basis_derivs, r, N,
+                  radial_hyps);
+
+  double xrel = x / r;
+  double yrel = y / r;
+  double zrel = z / r;
+  double rcut_val = scratch.rcut_vals[0];
+  double rcut_derv = scratch.rcut_vals[1];
+
+  for (int n = 0; n < N; n++) {
+    double basis_val = scratch.basis_vals[n];
+    double basis_derv = scratch.basis_derivs[n];
+    scratch.g[n] = basis_val * rcut_val;
+    scratch.gx[n] =
+        basis_derv * xrel * rcut_val + basis_val * xrel * rcut_derv;
+    scratch.gy[n] =
+        basis_derv * yrel * rcut_val + basis_val * yrel * rcut_derv;
+    scratch.gz[n] =
+        basis_derv * zrel * rcut_val + basis_val * zrel * rcut_derv;
+  }
+}
+
+/**
+ * Add the single bond values of the bonds stored in the scratch to
+ * bond_vals, and the derivatives with respect to the position of bond b to
+ * rows derv_row + 3 * b, derv_row + 3 * b + 1 and derv_row + 3 * b + 2 of
+ * bond_dervs. The values of neighbor species s start at column
+ * s * N * (lmax + 1)^2. The spherical harmonics of all bonds are computed
+ * together with get_Y_batch. radial_hyps[1] is set to the cutoff of each
+ * bond.
+ */
+template <typename Radial, typename Cutoff, typename Values>
+inline void add_single_bonds(Values &&bond_vals, Eigen::MatrixXd &bond_dervs,
+                             int derv_row, SingleBondScratch &scratch,
+                             const Radial &radial_function,
+                             const Cutoff &cutoff_function, int N, int lmax,
+                             std::vector<double> &radial_hyps,
+                             const std::vector<double> &cutoff_hyps) {
+
+  int n_bonds = scratch.bond_x.size();
+  if (n_bonds == 0)
+    return;
+
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  scratch.h.resize(n_harmonics * n_bonds);
+  scratch.hx.resize(n_harmonics * n_bonds);
+  scratch.hy.resize(n_harmonics * n_bonds);
+  scratch.hz.resize(n_harmonics * n_bonds);
+  get_Y_batch(scratch.h.data(), scratch.hx.data(), scratch.hy.data(),
+              scratch.hz.data(), scratch.bond_x.data(), scratch.bond_y.data(),
+              scratch.bond_z.data(), n_bonds, n_bonds, lmax);
+
+  for (int b = 0; b < n_bonds; b++) {
+    double rcut = scratch.bond_rcut[b];
+    radial_hyps[1] = rcut;
+    bond_radial(scratch, radial_function, cutoff_function, scratch.bond_x[b],
+                scratch.bond_y[b], scratch.bond_z[b], scratch.bond_r[b], rcut,
+                N, radial_hyps, cutoff_hyps);
+
+    const double *h = scratch.h.data() + b;
+    const double *hx = scratch.hx.data() + b;
+    const double *hy = scratch.hy.data() + b;
+    const double *hz = scratch.hz.data() + b;
+    int row = derv_row + 3 * b;
+    int descriptor_counter = scratch.bond_species[b] * N * n_harmonics;
+    for (int radial_counter = 0; radial_counter < N; radial_counter++) {
+      double g_val = scratch.g[radial_counter];
+      double gx_val = scratch.gx[radial_counter];
+      double gy_val = scratch.gy[radial_counter];
+      double gz_val = scratch.gz[radial_counter];
+
+      for (int angular_counter = 0; angular_counter < n_harmonics;
+           angular_counter++) {
+        int m = angular_counter * n_bonds;
+        double h_val = h[m];
+
+        // Calculate derivatives with the product rule.
+        bond_vals(descriptor_counter) += g_val * h_val;
+        bond_dervs(row, descriptor_counter) += gx_val * h_val + g_val * hx[m];
+        bond_dervs(row + 1, descriptor_counter) +=
+            gy_val * h_val + g_val * hy[m];
+        bond_dervs(row + 2, descriptor_counter) +=
+            gz_val * h_val + g_val * hz[m];
+
+        descriptor_counter++;
+      }
+    }
+  }
+}
+
+/**
+ * Select the specialization of a single bond engine for a radial basis and
+ * cutoff function given by name, mirroring set_radial_basis and set_cutoff.
+ * An engine is a class with a Function pointer type and a static template
+ * compute<RadialFunction, CutoffFunction>. Returns nullptr if either name is
+ * not recognized.
+ */
+template <typename Engine, RadialFunction radial>
+typename Engine::Function set_single_bond_cutoff(
+    const std::string &cutoff_function) {
+  if (cutoff_function == "quadratic") {
+    return Engine::template compute<radial, quadratic_cutoff>;
+  } else if (cutoff_function == "hard") {
+    return Engine::template compute<radial, hard_cutoff>;
+  } else if (cutoff_function == "cosine") {
+    return Engine::template compute<radial, cos_cutoff>;
+  } else if (cutoff_function == "polynomial") {
+    return Engine::template compute<radial, polynomial_cutoff>;
+  } else if (cutoff_function == "power") {
+    return Engine::template compute<radial, power_cutoff>;
+  }
+  return nullptr;
+}
+
+template <typename Engine>
+typename Engine::Function set_single_bond(const std::string &radial_basis,
+                                          const std::string &cutoff_function) {
+  if (radial_basis == "chebyshev") {
+    return set_single_bond_cutoff<Engine, chebyshev>(cutoff_function);
+  } else if (radial_basis == "weighted_chebyshev") {
+    return set_single_bond_cutoff<Engine, weighted_chebyshev>(cutoff_function);
+  } else if (radial_basis == "equispaced_gaussians") {
+    return set_single_bond_cutoff<Engine, equispaced_gaussians>(
+        cutoff_function);
+  } else if (radial_basis == "weighted_positive_chebyshev") {
+    return set_single_bond_cutoff<Engine, weighted_positive_chebyshev>(
+        cutoff_function);
+  } else if (radial_basis == "positive_chebyshev") {
+    return set_single_bond_cutoff<Engine, positive_chebyshev>(cutoff_function);
+  } else if (radial_basis == "bessel") {
+    return set_single_bond_cutoff<Engine, bessel>(cutoff_function);
+  } else if (radial_basis == "fourier_quarter") {
+    return set_single_bond_cutoff<Engine, fourier_quarter>(cutoff_function);
+  } else if (radial_basis == "fourier_half") {
+    return set_single_bond_cutoff<Engine, fourier_half>(cutoff_function);
+  } else if (radial_basis == "fourier") {
+    return set_single_bond_cutoff<Engine, fourier>(cutoff_function);
+  }
+  return nullptr;
+}
+
+#endif
@@ -1,6 +1,12 @@
 #include "structure.h"
+#include <algorithm>
+#include <exception>
 #include <fstream> // File operations
 #include <iostream>
+#include <stdexcept>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 Structure ::Structure() {}
 
@@ -27,17 +33,18 @@ Structure ::Structure(const Eigen::MatrixXd &cell,
 Structure ::Structure(const Eigen::MatrixXd &cell,
                       const std::vector<int> &species,
                       const Eigen::MatrixXd &positions, double cutoff,
-                      std::vector<Descriptor *> descriptor_calculators)
+                      std::vector<Descriptor *> descriptor_calculators,
+                      const std::string &neighbor_method, double skin,
+                      bool prediction_only)
     : Structure(cell, species, positions) {
 
   this->cutoff = cutoff;
+  this->neighbor_method = neighbor_method;
+  this->skin = skin;
+  this->prediction_only = prediction_only;
   this->descriptor_calculators = descriptor_calculators;
   sweep = ceil(cutoff / single_sweep_cutoff);
 
-  // Initialize neighbor count.
-  neighbor_count = Eigen::VectorXi::Zero(noa);
-  cumulative_neighbor_count = Eigen::VectorXi::Zero(noa + 1);
-
   compute_neighbors();
   compute_descriptors();
 }
@@ -45,78 +52,299 @@ Structure ::Structure(const Eigen::MatrixXd &cell,
 void Structure ::compute_descriptors(){
   descriptors.clear();
   for (int i = 0; i < descriptor_calculators.size(); i++){
-    descriptors.push_back(descriptor_calculators[i]->compute_struc(*this));
+    if (prediction_only) {
+      descriptors.push_back(
+          descriptor_calculators[i]->compute_struc_values(*this));
+    } else {
+      descriptors.push_back(descriptor_calculators[i]->compute_struc(*this));
+    }
   }
 }
 
 void Structure ::compute_neighbors() {
-  // Count the neighbors of each atom and compute the relative positions
-  // of all candidate neighbors.
-  int sweep_unit = 2 * sweep + 1;
-  int sweep_no = sweep_unit * sweep_unit * sweep_unit;
-  Eigen::MatrixXd all_positions =
-      Eigen::MatrixXd::Zero(noa * noa * sweep_no, 4);
-  Eigen::VectorXi all_indices = Eigen::VectorXi::Zero(noa * noa * sweep_no);
-
-// Compute neighbor lists and relative positions.
+  if ((neighbor_method != "brute_force") && (neighbor_method != "cell_list")) {
+    throw std::invalid_argument("Unknown neighbor method: " +
+                                neighbor_method);
+  }
+
+  if (skin > 0) {
+    // Search for candidates within cutoff + skin, then filter them.
+    if (neighbor_method == "brute_force") {
+      build_verlet_list(BruteForceSearch(*this, cutoff + skin));
+    } else {
+      build_verlet_list(CellListSearch(*this, cutoff + skin));
+    }
+    build_neighbor_lists(VerletSearch(*this));
+  } else if (neighbor_method == "brute_force") {
+    compute_neighbors_brute_force();
+  } else {
+    compute_neighbors_cell_list();
+  }
+}
+
+void Structure ::compute_neighbors_brute_force() {
+  build_neighbor_lists(BruteForceSearch(*this, cutoff));
+}
+
+void Structure ::compute_neighbors_cell_list() {
+  build_neighbor_lists(CellListSearch(*this, cutoff));
+}
+
+void Structure ::update_positions(const Eigen::MatrixXd &new_positions) {
+  positions = new_positions;
+  wrapped_positions = wrap_positions();
+
+  // Only search the structure again if an atom may have crossed the skin.
+  bool rebuild = (skin <= 0) || (verlet_positions.rows() != noa);
+  if (!rebuild && noa > 0) {
+    double max_displacement =
+        (positions - verlet_positions).rowwise().norm().maxCoeff();
+    rebuild = max_displacement > skin / 2;
+  }
+
+  if (rebuild) {
+    compute_neighbors();
+  } else {
+    build_neighbor_lists(VerletSearch(*this));
+  }
+  compute_descriptors();
+}
+
+template <typename Search>
+void Structure ::build_neighbor_lists(const Search &search) {
+  // First pass: count the neighbors of each atom. Arrays that already have
+  // the right size (e.g. after a position update) are reused.
+  neighbor_count.resize(noa);
+  cumulative_neighbor_count.resize(noa + 1);
 #pragma omp parallel for
   for (int i = 0; i < noa; i++) {
-    Eigen::MatrixXd pos_atom = wrapped_positions.row(i);
-    int i_index = i * noa * sweep_no;
-    int counter = 0;
-    for (int j = 0; j < noa; j++) {
-      Eigen::MatrixXd diff_curr = wrapped_positions.row(j) - pos_atom;
-      for (int s1 = -sweep; s1 < sweep + 1; s1++) {
-        for (int s2 = -sweep; s2 < sweep + 1; s2++) {
-          for (int s3 = -sweep; s3 < sweep + 1; s3++) {
-            Eigen::MatrixXd im = diff_curr + s1 * cell.row(0) +
-                                 s2 * cell.row(1) + s3 * cell.row(2);
-            double dist = sqrt(im(0) * im(0) + im(1) * im(1) + im(2) * im(2));
-
-            // Store coordinates and distance.
-            if ((dist < cutoff) && (dist != 0)) {
-              neighbor_count(i)++;
-              int row_index = i_index + counter;
-              all_positions(row_index, 0) = dist;
-              all_positions(row_index, 1) = im(0);
-              all_positions(row_index, 2) = im(1);
-              all_positions(row_index, 3) = im(2);
-              all_indices(row_index) = j;
-              counter++;
-            }
-          }
-        }
-      }
-    }
+    NeighborCounter counter;
+    search(i, counter);
+    neighbor_count(i) = counter.count;
   }
 
   // Store cumulative neighbor counts.
+  cumulative_neighbor_count(0) = 0;
   for (int i = 1; i < noa + 1; i++) {
-    cumulative_neighbor_count(i) +=
+    cumulative_neighbor_count(i) =
         cumulative_neighbor_count(i - 1) + neighbor_count(i - 1);
   }
 
-  // Store relative positions.
+  // Second pass: write the relative positions of each neighbor directly into
+  // the exactly sized neighbor arrays.
   n_neighbors = cumulative_neighbor_count(noa);
-  relative_positions = Eigen::MatrixXd::Zero(n_neighbors, 4);
-  structure_indices = Eigen::VectorXi::Zero(n_neighbors);
-  neighbor_species = Eigen::VectorXi::Zero(n_neighbors);
+  relative_positions.resize(n_neighbors, 4);
+  structure_indices.resize(n_neighbors);
+  neighbor_species.resize(n_neighbors);
 #pragma omp parallel for
   for (int i = 0; i < noa; i++) {
-    int n_neighbors = neighbor_count(i);
-    int rel_index = cumulative_neighbor_count(i);
-    int all_index = i * noa * sweep_no;
-    for (int j = 0; j < n_neighbors; j++) {
-      int current_index = all_indices(all_index + j);
-      structure_indices(rel_index + j) = current_index;
-      neighbor_species(rel_index + j) = species[current_index];
-      for (int k = 0; k < 4; k++) {
-        relative_positions(rel_index + j, k) = all_positions(all_index + j, k);
+    NeighborWriter writer(*this, cumulative_neighbor_count(i));
+    search(i, writer);
+  }
+}
+
+template <typename Search>
+void Structure ::build_verlet_list(const Search &search) {
+  verlet_count.resize(noa);
+  cumulative_verlet_count.resize(noa + 1);
+#pragma omp parallel for
+  for (int i = 0; i < noa; i++) {
+    NeighborCounter counter;
+    search(i, counter);
+    verlet_count(i) = counter.count;
+  }
+
+  cumulative_verlet_count(0) = 0;
+  for (int i = 1; i < noa + 1; i++) {
+    cumulative_verlet_count(i) =
+        cumulative_verlet_count(i - 1) + verlet_count(i - 1);
+  }
+
+  int n_candidates = cumulative_verlet_count(noa);
+  verlet_indices.resize(n_candidates);
+  verlet_shifts.resize(n_candidates, 3);
+#pragma omp parallel for
+  for (int i = 0; i < noa; i++) {
+    VerletWriter writer(*this, i, cumulative_verlet_count(i));
+    search(i, writer);
+  }
+  verlet_positions = positions;
+}
+
+void Structure ::NeighborCounter ::operator()(int j, const Eigen::Vector3d &im,
+                                              double dist) {
+  count++;
+}
+
+Structure ::NeighborWriter ::NeighborWriter(Structure &structure, int index)
+    : structure(structure), index(index) {}
+
+void Structure ::NeighborWriter ::operator()(int j, const Eigen::Vector3d &im,
+                                             double dist) {
+  structure.structure_indices(index) = j;
+  structure.neighbor_species(index) = structure.species[j];
+  structure.relative_positions(index, 0) = dist;
+  structure.relative_positions(index, 1) = im(0);
+  structure.relative_positions(index, 2) = im(1);
+  structure.relative_positions(index, 3) = im(2);
+  index++;
+}
+
+Structure ::VerletWriter ::VerletWriter(Structure &structure, int i,
+                                        int index)
+    : structure(structure), i(i), index(index) {}
+
+void Structure ::VerletWriter ::operator()(int j, const Eigen::Vector3d &im,
+                                           double dist) {
+  structure.verlet_indices(index) = j;
+  structure.verlet_shifts.row(index) = im.transpose() -
+                                       structure.positions.row(j) +
+                                       structure.positions.row(i);
+  index++;
+}
+
+Structure ::BruteForceSearch ::BruteForceSearch(const Structure &structure,
+                                                double radius)
+    : structure(structure), radius(radius) {
+  sweep = ceil(radius / structure.single_sweep_cutoff);
+}
+
+template <typename Visitor>
+void Structure ::BruteForceSearch ::operator()(int i, Visitor &visit) const {
+  // Loop over every atom in every periodic image within the sweep.
+  const Eigen::MatrixXd &cell = structure.cell;
+  Eigen::Vector3d pos_atom = structure.wrapped_positions.row(i);
+  for (int j = 0; j < structure.noa; j++) {
+    Eigen::Vector3d diff_curr =
+        structure.wrapped_positions.row(j).transpose() - pos_atom;
+    for (int s1 = -sweep; s1 < sweep + 1; s1++) {
+      for (int s2 = -sweep; s2 < sweep + 1; s2++) {
+        for (int s3 = -sweep; s3 < sweep + 1; s3++) {
+          Eigen::Vector3d im = diff_curr + s1 * cell.row(0).transpose() +
+                               s2 * cell.row(1).transpose() +
+                               s3 * cell.row(2).transpose();
+          double dist = sqrt(im(0) * im(0) + im(1) * im(1) + im(2) * im(2));
+
+          if ((dist < radius) && (dist != 0)) {
+            visit(j, im, dist);
+          }
+        }
       }
     }
   }
 }
 
+Structure ::CellListSearch ::CellListSearch(const Structure &structure,
+                                            double radius)
+    : structure(structure), radius(radius) {
+  // Perpendicular width of the cell along each lattice direction.
+  const Eigen::MatrixXd &cell = structure.cell;
+  int noa = structure.noa;
+  Eigen::Vector3d a = cell.row(0), b = cell.row(1), c = cell.row(2);
+  double volume = structure.volume;
+  double widths[3] = {volume / b.cross(c).norm(), volume / c.cross(a).norm(),
+                      volume / a.cross(b).norm()};
+
+  // Divide the cell into bins that are at least one search radius wide,
+  // capping the number of bins at roughly one per atom. A bin narrower than
+  // the radius (e.g. when the radius exceeds the cell) is handled by sweeping
+  // over more than one neighboring bin.
+  int max_bins = std::max(1, (int)ceil(cbrt((double)noa)));
+  for (int k = 0; k < 3; k++) {
+    n_bins[k] = std::min(max_bins, std::max(1, (int)floor(widths[k] / radius)));
+    bin_sweep[k] = ceil(radius * n_bins[k] / widths[k]);
+  }
+  int n_total_bins = n_bins[0] * n_bins[1] * n_bins[2];
+
+  // Assign each atom to a bin using its fractional coordinates.
+  Eigen::MatrixXd fractional =
+      (structure.wrapped_positions * structure.cell_transpose) *
+      structure.cell_dot_inverse;
+  atom_bins = std::vector<int>(noa);
+  std::vector<int> bin_count(n_total_bins, 0);
+  for (int i = 0; i < noa; i++) {
+    int bin_index[3];
+    for (int k = 0; k < 3; k++) {
+      bin_index[k] = floor(fractional(i, k) * n_bins[k]);
+      bin_index[k] = std::min(std::max(bin_index[k], 0), n_bins[k] - 1);
+    }
+    atom_bins[i] =
+        (bin_index[0] * n_bins[1] + bin_index[1]) * n_bins[2] + bin_index[2];
+    bin_count[atom_bins[i]]++;
+  }
+
+  // Sort atoms by bin.
+  bin_start = std::vector<int>(n_total_bins + 1, 0);
+  for (int i = 0; i < n_total_bins; i++) {
+    bin_start[i + 1] = bin_start[i] + bin_count[i];
+  }
+  bin_atoms = std::vector<int>(noa);
+  std::vector<int> bin_fill(bin_start.begin(), bin_start.end() - 1);
+  for (int i = 0; i < noa; i++) {
+    bin_atoms[bin_fill[atom_bins[i]]++] = i;
+  }
+}
+
+template <typename Visitor>
+void Structure ::CellListSearch ::operator()(int i, Visitor &visit) const {
+  // Search the surrounding bins of the atom, keeping track of the periodic
+  // image each bin belongs to.
+  const Eigen::MatrixXd &cell = structure.cell;
+  Eigen::Vector3d a = cell.row(0), b = cell.row(1), c = cell.row(2);
+  Eigen::Vector3d pos_atom = structure.wrapped_positions.row(i);
+  int b0 = atom_bins[i] / (n_bins[1] * n_bins[2]);
+  int b1 = (atom_bins[i] / n_bins[2]) % n_bins[1];
+  int b2 = atom_bins[i] % n_bins[2];
+
+  for (int s1 = b0 - bin_sweep[0]; s1 < b0 + bin_sweep[0] + 1; s1++) {
+    int im1 = floor((double)s1 / n_bins[0]);
+    int c1 = s1 - im1 * n_bins[0];
+    for (int s2 = b1 - bin_sweep[1]; s2 < b1 + bin_sweep[1] + 1; s2++) {
+      int im2 = floor((double)s2 / n_bins[1]);
+      int c2 = s2 - im2 * n_bins[1];
+      for (int s3 = b2 - bin_sweep[2]; s3 < b2 + bin_sweep[2] + 1; s3++) {
+        int im3 = floor((double)s3 / n_bins[2]);
+        int c3 = s3 - im3 * n_bins[2];
+
+        Eigen::Vector3d shift = im1 * a + im2 * b + im3 * c - pos_atom;
+        int bin = (c1 * n_bins[1] + c2) * n_bins[2] + c3;
+        for (int n = bin_start[bin]; n < bin_start[bin + 1]; n++) {
+          int j = bin_atoms[n];
+          Eigen::Vector3d im =
+              structure.wrapped_positions.row(j).transpose() + shift;
+          double dist = im.norm();
+
+          if ((dist < radius) && (dist != 0)) {
+            visit(j, im, dist);
+          }
+        }
+      }
+    }
+  }
+}
+
+Structure ::VerletSearch ::VerletSearch(const Structure &structure)
+    : structure(structure) {}
+
+template <typename Visitor>
+void Structure ::VerletSearch ::operator()(int i, Visitor &visit) const {
+  // Refilter the cached candidates of the atom at the current positions.
+  double cutoff = structure.cutoff;
+  int start = structure.cumulative_verlet_count(i);
+  int end = structure.cumulative_verlet_count(i + 1);
+  for (int n = start; n < end; n++) {
+    int j = structure.verlet_indices(n);
+    Eigen::Vector3d im = (structure.positions.row(j) -
+                          structure.positions.row(i) +
+                          structure.verlet_shifts.row(n)).transpose();
+    double dist = im.norm();
+
+    if ((dist < cutoff) && (dist != 0)) {
+      visit(j, im, dist);
+    }
+  }
+}
+
 Eigen::MatrixXd Structure ::wrap_positions() {
   // Convert Cartesian coordinates to relative coordinates.
   Eigen::MatrixXd relative_positions =
@@ -177,3 +405,117 @@ Structure Structure ::from_json(std::string file_name){
   struc_file >> j;
   return j;
 }
+
+void to_json(nlohmann::json &j, const Structure &struc) {
+  j = nlohmann::json{
+      {"neighbor_count", struc.neighbor_count},
+      {"cutoff", struc.cutoff},
+      {"cumulative_neighbor_count", struc.cumulative_neighbor_count},
+      {"structure_indices", struc.structure_indices},
+      {"neighbor_species", struc.neighbor_species},
+      {"cell", struc.cell},
+      {"cell_transpose", struc.cell_transpose},
+      {"cell_transpose_inverse", struc.cell_transpose_inverse},
+      {"cell_dot", struc.cell_dot},
+      {"cell_dot_inverse", struc.cell_dot_inverse},
+      {"positions", struc.positions},
+      {"wrapped_positions", struc.wrapped_positions},
+      {"relative_positions", struc.relative_positions},
+      {"single_sweep_cutoff", struc.single_sweep_cutoff},
+      {"volume", struc.volume},
+      {"sweep", struc.sweep},
+      {"n_neighbors", struc.n_neighbors},
+      {"neighbor_method", struc.neighbor_method},
+      {"skin", struc.skin},
+      {"prediction_only", struc.prediction_only},
+      {"species", struc.species},
+      {"noa", struc.noa},
+      {"energy", struc.energy},
+      {"forces", struc.forces},
+      {"stresses", struc.stresses},
+      {"mean_efs", struc.mean_efs},
+      {"variance_efs", struc.variance_efs},
+      {"mean_contributions", struc.mean_contributions},
+      {"local_uncertainties", struc.local_uncertainties},
+      {"descriptor_calculators", struc.descriptor_calculators},
+      {"descriptors", struc.descriptors}};
+}
+
+void from_json(const nlohmann::json &j, Structure &struc) {
+  j.at("neighbor_count").get_to(struc.neighbor_count);
+  j.at("cutoff").get_to(struc.cutoff);
+  j.at("cumulative_neighbor_count").get_to(struc.cumulative_neighbor_count);
+  j.at("structure_indices").get_to(struc.structure_indices);
+  j.at("neighbor_species").get_to(struc.neighbor_species);
+  j.at("cell").get_to(struc.cell);
+  j.at("cell_transpose").get_to(struc.cell_transpose);
+  j.at("cell_transpose_inverse").get_to(struc.cell_transpose_inverse);
+  j.at("cell_dot").get_to(struc.cell_dot);
+  j.at("cell_dot_inverse").get_to(struc.cell_dot_inverse);
+  j.at("positions").get_to(struc.positions);
+  j.at("wrapped_positions").get_to(struc.wrapped_positions);
+  j.at("relative_positions").get_to(struc.relative_positions);
+  j.at("single_sweep_cutoff").get_to(struc.single_sweep_cutoff);
+  j.at("volume").get_to(struc.volume);
+  j.at("sweep").get_to(struc.sweep);
+  j.at("n_neighbors").get_to(struc.n_neighbors);
+  struc.neighbor_method =
+      j.value("neighbor_method", std::string("brute_force"));
+  struc.skin = j.value("skin", 0.0);
+  struc.prediction_only = j.value("prediction_only", false);
+  j.at("species").get_to(struc.species);
+  j.at("noa").get_to(struc.noa);
+  j.at("energy").get_to(struc.energy);
+  j.at("forces").get_to(struc.forces);
+  j.at("stresses").get_to(struc.stresses);
+  j.at("mean_efs").get_to(struc.mean_efs);
+  j.at("variance_efs").get_to(struc.variance_efs);
+  j.at("mean_contributions").get_to(struc.mean_contributions);
+  j.at("local_uncertainties").get_to(struc.local_uncertainties);
+  j.at("descriptor_calculators").get_to(struc.descriptor_calculators);
+  j.at("descriptors").get_to(struc.descriptors);
+}
+
+std::vector<Structure> Structure ::compute_structures(
+    const std::vector<Eigen::MatrixXd> &cells,
+    const std::vector<std::vector<int>> &species,
+    const std::vector<Eigen::MatrixXd> &positions, double cutoff,
+    std::vector<Descriptor *> descriptor_calculators, int n_threads,
+    bool prediction_only, const std::string &neighbor_method, double skin) {
+
+  int n_frames = cells.size();
+  if (species.size() != n_frames || positions.size() != n_frames)
+    throw std::invalid_argument(
+        "Cells, species and positions must be given for every frame.");
+
+#ifdef _OPENMP
+  if (n_threads <= 0)
+    n_threads = omp_get_max_threads();
+#else
+  n_threads = 1;
+#endif
+
+  // Frames are built one per thread. A single frame is built outside a
+  // parallel region, so that the loops inside the constructor are not nested
+  // and keep all threads. Exceptions cannot leave the parallel region and
+  // are rethrown after it.
+  n_threads = std::max(1, std::min(n_threads, n_frames));
+  std::vector<Structure> structures(n_frames);
+  std::exception_ptr error;
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads) if(n_frames > 1)
+  for (int i = 0; i < n_frames; i++) {
+    try {
+      structures[i] =
+          Structure(cells[i], species[i], positions[i], cutoff,
+                    descriptor_calculators, neighbor_method, skin,
+                    prediction_only);
+    } catch (...) {
+#pragma omp critical
+      error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+
+  return structures;
+}
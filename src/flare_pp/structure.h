@@ -2,6 +2,7 @@
 #define STRUCTURE_H
 
 #include "descriptor.h"
+#include <string>
 #include <vector>
 #include <nlohmann/json.hpp>
 #include "json.h"
@@ -46,6 +47,41 @@ public:
   double cutoff, single_sweep_cutoff, volume;
   int sweep, n_neighbors;
 
+  /**
+   * Algorithm used to build the neighbor lists. "brute_force" compares every
+   * pair of atoms in every periodic image, and "cell_list" bins the atoms
+   * into cells at least one cutoff wide so that the search scales linearly
+   * with the number of atoms.
+   */
+  std::string neighbor_method = "brute_force";
+
+  /** @name Verlet list
+   * When the skin is positive, candidate neighbors within cutoff + skin are
+   * cached so that update_positions can refilter them instead of searching
+   * the whole structure again. The list is rebuilt once an atom has moved
+   * more than half the skin since the list was built.
+   */
+  ///@{
+  double skin = 0;
+  Eigen::VectorXi verlet_count, cumulative_verlet_count, verlet_indices;
+
+  /** Lattice translation of each candidate, i.e. the candidate's relative
+   * position minus the difference of the unwrapped atomic positions.
+   */
+  Eigen::MatrixXd verlet_shifts;
+
+  /** Positions of the atoms when the Verlet list was last built.
+   */
+  Eigen::MatrixXd verlet_positions;
+  ///@}
+
+  /**
+   * If true, the descriptors are computed with compute_struc_values, which
+   * skips their force derivatives. Such structures can only be passed to
+   * SparseGP::predict_mean_fast.
+   */
+  bool prediction_only = false;
+
   /**
    * Species of each atom.
    */
@@ -92,25 +128,120 @@ public:
   Structure(const Eigen::MatrixXd &cell, const std::vector<int> &species,
             const Eigen::MatrixXd &positions);
 
+  /**
+   Structure constructor that computes the neighbor lists and descriptors.
+
+   @param cutoff Neighbor cutoff.
+   @param descriptor_calculators Descriptors computed for the structure.
+   @param neighbor_method Either "brute_force" or "cell_list".
+   @param skin Distance beyond the cutoff within which candidate neighbors
+        are cached in a Verlet list. A skin of zero disables the list.
+   @param prediction_only If true, the force derivatives of the descriptors
+        are not stored (see predict_mean_fast).
+   */
   Structure(const Eigen::MatrixXd &cell, const std::vector<int> &species,
             const Eigen::MatrixXd &positions, double cutoff,
-            std::vector<Descriptor *> descriptor_calculators);
+            std::vector<Descriptor *> descriptor_calculators,
+            const std::string &neighbor_method = "brute_force",
+            double skin = 0, bool prediction_only = false);
 
   Eigen::MatrixXd wrap_positions();
   double get_single_sweep_cutoff();
   void compute_neighbors();
+  void compute_neighbors_brute_force();
+  void compute_neighbors_cell_list();
+
+  /**
+   Move the atoms to new positions in the same cell and recompute neighbors
+   and descriptors, reusing the Verlet list when possible.
+
+   @param new_positions Nx3 array of atomic coordinates.
+   */
+  void update_positions(const Eigen::MatrixXd &new_positions);
   void compute_descriptors();
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(Structure, neighbor_count,
-    cutoff, cumulative_neighbor_count, structure_indices, neighbor_species,
-    cell, cell_transpose, cell_transpose_inverse, cell_dot, cell_dot_inverse,
-    positions, wrapped_positions, relative_positions, cutoff,
-    single_sweep_cutoff, volume, sweep, n_neighbors, species, noa,
-    energy, forces, stresses, mean_efs, variance_efs, mean_contributions, 
-    local_uncertainties, descriptor_calculators, descriptors)
+  /**
+   JSON conversion. The neighbor method, skin and prediction_only fall back
+   to their defaults for structures saved before they were stored.
+   */
+  friend void to_json(nlohmann::json &j, const Structure &struc);
+  friend void from_json(const nlohmann::json &j, Structure &struc);
 
   static void to_json(std::string file_name, const Structure & struc);
   static Structure from_json(std::string file_name);
+
+  /**
+   Construct the structures of many frames concurrently, one frame per
+   thread. Frame i has cell cells[i], species species[i] and positions
+   positions[i]. The other arguments are shared by all frames.
+
+   @param n_threads Number of threads. Zero uses the OpenMP default.
+   @param prediction_only, neighbor_method, skin As in the constructor.
+   */
+  static std::vector<Structure>
+  compute_structures(const std::vector<Eigen::MatrixXd> &cells,
+                     const std::vector<std::vector<int>> &species,
+                     const std::vector<Eigen::MatrixXd> &positions,
+                     double cutoff,
+                     std::vector<Descriptor *> descriptor_calculators,
+                     int n_threads = 0, bool prediction_only = false,
+                     const std::string &neighbor_method = "brute_force",
+                     double skin = 0);
+
+private:
+  /** @name Neighbor list construction
+   * Neighbor lists are built in two passes over a search algorithm: the
+   * first pass counts the neighbors of each atom and the second writes them
+   * into exactly sized CSR arrays, so that no scratch memory proportional to
+   * the number of candidate pairs is needed. A search is a callable that
+   * visits every neighbor of atom i as visit(j, relative_position, distance).
+   */
+  ///@{
+  template <typename Search> void build_neighbor_lists(const Search &search);
+  template <typename Search> void build_verlet_list(const Search &search);
+
+  struct NeighborCounter {
+    int count = 0;
+    void operator()(int j, const Eigen::Vector3d &im, double dist);
+  };
+
+  struct NeighborWriter {
+    Structure &structure;
+    int index;
+    NeighborWriter(Structure &structure, int index);
+    void operator()(int j, const Eigen::Vector3d &im, double dist);
+  };
+
+  struct VerletWriter {
+    Structure &structure;
+    int i, index;
+    VerletWriter(Structure &structure, int i, int index);
+    void operator()(int j, const Eigen::Vector3d &im, double dist);
+  };
+
+  struct BruteForceSearch {
+    const Structure &structure;
+    double radius;
+    int sweep;
+    BruteForceSearch(const Structure &structure, double radius);
+    template <typename Visitor> void operator()(int i, Visitor &visit) const;
+  };
+
+  struct CellListSearch {
+    const Structure &structure;
+    double radius;
+    int n_bins[3], bin_sweep[3];
+    std::vector<int> atom_bins, bin_start, bin_atoms;
+    CellListSearch(const Structure &structure, double radius);
+    template <typename Visitor> void operator()(int i, Visitor &visit) const;
+  };
+
+  struct VerletSearch {
+    const Structure &structure;
+    VerletSearch(const Structure &structure);
+    template <typename Visitor> void operator()(int i, Visitor &visit) const;
+  };
+  ///@}
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include "y_grad.h"
+#include "simd.h"
 #include <cmath>
 #include <complex>
 using namespace std;
@@ -664,46 +665,48 @@ void get_complex_Y(Eigen::VectorXcd &Y, Eigen::VectorXcd &Yx,
   counter++;
 }
 
-void get_Y(vector<double> &Y, vector<double> &Yx, vector<double> &Yy,
-           vector<double> &Yz, const double x, const double y, const double z,
-           const int l) {
+// The body is shared by the scalar and batched versions. Real is double or
+// SimdDouble, and Out is indexed by harmonic and assigned values of type Real.
+template <typename Real, typename Out>
+static void compute_Y(Out &Y, Out &Yx, Out &Yy, Out &Yz, const Real x,
+                      const Real y, const Real z, const int l) {
 
   unsigned int counter = 0;
 
-  const double r2 = x * x + y * y + z * z;
-  const double r2s = sqrt(r2);
-  const double r3 = pow(r2, 1.5);
-  const double r4 = r2 * r2;
-  const double r5 = pow(r2, 2.5);
-  const double r6 = r3 * r3;
-  const double r7 = pow(r2, 3.5);
-  const double r8 = r4 * r4;
-  const double r9 = r4 * r5;
-  const double r10 = r5 * r5;
-  const double r11 = r5 * r6;
-  const double r12 = r6 * r6;
-  const double x2 = x * x;
-  const double y2 = y * y;
-  const double z2 = z * z;
-  const double x3 = x * x * x;
-  const double y3 = y * y * y;
-  const double x4 = x2 * x2;
-  const double y4 = y2 * y2;
-  const double z4 = z2 * z2;
-  const double x5 = x4 * x;
-  const double y5 = y4 * y;
-  const double x6 = x3 * x3;
-  const double y6 = y3 * y3;
-  const double z6 = z2 * z2 * z2;
-  const double x8 = pow(x, 8);
-  const double y8 = pow(y, 8);
-  const double z8 = pow(z, 8);
-  const double x2py21 = x2 + y2;
-  const double x2py2 = pow(x2 + y2, 2);
-  const double x2py3 = pow(x2 + y2, 3);
-  const double x2py4 = x2py2 * x2py2;
-  const double xy = x * y;
-  const double xy2 = x * y2;
+  const Real r2 = x * x + y * y + z * z;
+  const Real r2s = sqrt(r2);
+  const Real r3 = pow(r2, 1.5);
+  const Real r4 = r2 * r2;
+  const Real r5 = pow(r2, 2.5);
+  const Real r6 = r3 * r3;
+  const Real r7 = pow(r2, 3.5);
+  const Real r8 = r4 * r4;
+  const Real r9 = r4 * r5;
+  const Real r10 = r5 * r5;
+  const Real r11 = r5 * r6;
+  const Real r12 = r6 * r6;
+  const Real x2 = x * x;
+  const Real y2 = y * y;
+  const Real z2 = z * z;
+  const Real x3 = x * x * x;
+  const Real y3 = y * y * y;
+  const Real x4 = x2 * x2;
+  const Real y4 = y2 * y2;
+  const Real z4 = z2 * z2;
+  const Real x5 = x4 * x;
+  const Real y5 = y4 * y;
+  const Real x6 = x3 * x3;
+  const Real y6 = y3 * y3;
+  const Real z6 = z2 * z2 * z2;
+  const Real x8 = pow(x, 8);
+  const Real y8 = pow(y, 8);
+  const Real z8 = pow(z, 8);
+  const Real x2py21 = x2 + y2;
+  const Real x2py2 = pow(x2 + y2, 2);
+  const Real x2py3 = pow(x2 + y2, 3);
+  const Real x2py4 = x2py2 * x2py2;
+  const Real xy = x * y;
+  const Real xy2 = x * y2;
 
   { // l_counter == 0
     Y[counter] = 1 / (2. * sqrt(Pi));
@@ -2752,3 +2755,100 @@ void get_Y(vector<double> &Y, vector<double> &Yx, vector<double> &Yy,
     counter++;
   }
 }
+
+void get_Y(vector<double> &Y, vector<double> &Yx, vector<double> &Yy,
+           vector<double> &Yz, const double x, const double y, const double z,
+           const int l) {
+  compute_Y<double>(Y, Yx, Yy, Yz, x, y, z, l);
+}
+
+// Writes packs of harmonic values to rows of a harmonic-major array. Only the
+// first n_valid lanes are stored, so that the array doesn't need padding.
+struct BatchStore {
+  double *ptr;
+  int n_valid;
+
+  void operator=(const SimdDouble &value) {
+    if (n_valid == SimdDouble::width)
+      value.store(ptr);
+    else
+      value.store_partial(ptr, n_valid);
+  }
+};
+
+struct BatchColumns {
+  double *data;
+  int ld, offset, n_valid;
+
+  BatchStore operator[](unsigned int counter) {
+    BatchStore store = {data + counter * ld + offset, n_valid};
+    return store;
+  }
+};
+
+struct ScalarColumns {
+  double *data;
+  int ld, offset;
+
+  double &operator[](unsigned int counter) {
+    return data[counter * ld + offset];
+  }
+};
+
+void get_Y_batch(double *Y, double *Yx, double *Yy, double *Yz,
+                 const double *x, const double *y, const double *z,
+                 const int n, const int ld, const int l) {
+
+  const int width = SimdDouble::width;
+
+  // Without SIMD support, evaluate the scalar kernel directly.
+  if (width == 1) {
+    for (int i = 0; i < n; i++) {
+      ScalarColumns Y_cols = {Y, ld, i};
+      ScalarColumns Yx_cols = {Yx, ld, i};
+      ScalarColumns Yy_cols = {Yy, ld, i};
+      ScalarColumns Yz_cols = {Yz, ld, i};
+      compute_Y<double>(Y_cols, Yx_cols, Yy_cols, Yz_cols, x[i], y[i], z[i],
+                        l);
+    }
+    return;
+  }
+
+  for (int i = 0; i < n; i += width) {
+    int n_valid = (n - i < width) ? n - i : width;
+
+    // Unused lanes are set to a nonzero vector to avoid dividing by zero.
+    SimdDouble xs, ys, zs;
+    if (n_valid == width) {
+      xs = SimdDouble::load(x + i);
+      ys = SimdDouble::load(y + i);
+      zs = SimdDouble::load(z + i);
+    } else {
+      xs = SimdDouble::load_partial(x + i, n_valid, 1);
+      ys = SimdDouble::load_partial(y + i, n_valid, 1);
+      zs = SimdDouble::load_partial(z + i, n_valid, 1);
+    }
+
+    BatchColumns Y_cols = {Y, ld, i, n_valid};
+    BatchColumns Yx_cols = {Yx, ld, i, n_valid};
+    BatchColumns Yy_cols = {Yy, ld, i, n_valid};
+    BatchColumns Yz_cols = {Yz, ld, i, n_valid};
+    compute_Y<SimdDouble>(Y_cols, Yx_cols, Yy_cols, Yz_cols, xs, ys, zs, l);
+  }
+}
+
+void get_Y_batch(Eigen::MatrixXd &Y, Eigen::MatrixXd &Yx, Eigen::MatrixXd &Yy,
+                 Eigen::MatrixXd &Yz, const Eigen::VectorXd &x,
+                 const Eigen::VectorXd &y, const Eigen::VectorXd &z,
+                 const int l) {
+
+  int n = x.size();
+  int n_harmonics = (l + 1) * (l + 1);
+  Y.resize(n, n_harmonics);
+  Yx.resize(n, n_harmonics);
+  Yy.resize(n, n_harmonics);
+  Yz.resize(n, n_harmonics);
+
+  get_Y_batch(Y.data(), Yx.data(), Yy.data(), Yz.data(), x.data(), y.data(),
+              z.data(), n, n, l);
+}
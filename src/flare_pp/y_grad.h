@@ -9,6 +9,20 @@ void get_Y(std::vector<double> &Y, std::vector<double> &Yx,
            std::vector<double> &Yy, std::vector<double> &Yz, const double x,
            const double y, const double z, const int l);
 
+// Spherical harmonics of n vectors given in structure-of-arrays form,
+// vectorized over the vectors. Harmonic m of vector i is stored at
+// Y[m * ld + i], with ld >= n.
+void get_Y_batch(double *Y, double *Yx, double *Yy, double *Yz,
+                 const double *x, const double *y, const double *z,
+                 const int n, const int ld, const int l);
+
+// Batched spherical harmonics with Eigen storage. The outputs are resized to
+// n x (l + 1)^2, so that column m holds harmonic m of every vector.
+void get_Y_batch(Eigen::MatrixXd &Y, Eigen::MatrixXd &Yx, Eigen::MatrixXd &Yy,
+                 Eigen::MatrixXd &Yz, const Eigen::VectorXd &x,
+                 const Eigen::VectorXd &y, const Eigen::VectorXd &z,
+                 const int l);
+
 void get_complex_Y(Eigen::VectorXcd &Y, Eigen::VectorXcd &Yx,
                    Eigen::VectorXcd &Yy, Eigen::VectorXcd &Yz, const double x,
                    const double y, const double z, const int l);